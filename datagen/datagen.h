@@ -0,0 +1,99 @@
+// SPDX-FileCopyrightText: 2022 Brian Calhoun <brian@bemorehuman.org>
+//
+// SPDX-License-Identifier: MIT
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is furnished to do
+// so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// This file is part of bemorehuman. See https://bemorehuman.org
+#ifndef DATAGEN_H
+#define DATAGEN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/time.h>
+#include <math.h>
+#include <string.h>
+#include <syslog.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "bmh-config.h"
+
+// defines
+
+// Defaults for the shape of the dataset.
+#define DATAGEN_DEFAULT_PEOPLE 10000
+#define DATAGEN_DEFAULT_ELTS 1000
+#define DATAGEN_DEFAULT_ACTIVITY 50.0    // mean ratings per person
+#define DATAGEN_DEFAULT_ZIPF 1.0         // exponent of the element popularity power law
+#define DATAGEN_DEFAULT_FACTORS 8        // latent factors per person and element
+#define DATAGEN_DEFAULT_NOISE 0.4        // standard deviation of the per-rating noise
+#define DATAGEN_DEFAULT_SCALE 5
+#define DATAGEN_DEFAULT_SEED 1
+
+#define DATAGEN_MAX_FACTORS 64
+#define DATAGEN_MAX_THREADS 256
+
+// Person activity is lognormal with this sigma, which gives the long tail of heavy raters real data has.
+#define DATAGEN_ACTIVITY_SIGMA 1.0
+
+// How the latent model turns into a rating. The taste score is
+//   DATAGEN_TASTE_WEIGHT * (person . element) / sqrt(factors) + person bias + element bias + noise
+// and the rating is scale * (DATAGEN_RATING_CENTER + DATAGEN_RATING_SPREAD * score), rounded and clamped to 1..scale.
+#define DATAGEN_TASTE_WEIGHT 0.6
+#define DATAGEN_PERSON_BIAS_SD 0.3
+#define DATAGEN_ELT_BIAS_SD 0.4
+#define DATAGEN_RATING_CENTER 0.6
+#define DATAGEN_RATING_SPREAD 0.3
+
+// People are generated in chunks of this many. Each round, every thread fills one chunk and then they're written in
+// order, so the output doesn't depend on the number of threads.
+#define DATAGEN_CHUNK_PEOPLE 4096
+
+// The longest ratings line is "4294967295,4294967295,32\n". That's longer than any binary record or events line, too.
+#define DATAGEN_MAX_LINE 25
+
+enum { OUTPUT_RATINGS, OUTPUT_RATINGS_BIN, OUTPUT_EVENTS };
+
+// typedefs
+
+// One element a person rated.
+typedef struct
+{
+    uint32_t eltid;
+    uint8_t rating;
+} gen_rating_t;
+
+// One thread's chunk of people and the output it produced for them. The scratch space lives as long as the thread slot.
+typedef struct
+{
+    uint32_t lo;             // first personid in this chunk
+    uint32_t hi;             // upper exclusive bound of personids in this chunk
+    char *buf;               // output bytes for this chunk
+    size_t len;              // bytes used in buf
+    size_t cap;              // bytes allocated for buf
+    uint64_t num_ratings;    // ratings generated for this chunk
+    uint32_t *stamp;         // stamp[eltid] == personid when that person already rated eltid
+    gen_rating_t *rated;     // the current person's ratings
+    double *taste;           // the current person's latent factors
+} gen_part_t;
+
+#endif // DATAGEN_H
@@ -0,0 +1,572 @@
+// SPDX-FileCopyrightText: 2022 Brian Calhoun <brian@bemorehuman.org>
+//
+// SPDX-License-Identifier: MIT
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is furnished to do
+// so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// This file is part of bemorehuman. See https://bemorehuman.org
+// This is datagen, the synthetic dataset generator. It writes a ratings file (or an events file for ratgen) of any
+// size without needing the MovieLens download, so we can test at scale on machines that can't reach the internet.
+//
+// The data has the shape of real ratings:
+//  - element popularity follows a power law (Zipf), so a few elements get most of the ratings
+//  - person activity is lognormal, so most people rate a little and a few rate a lot
+//  - ratings come from latent factors plus person & element biases plus noise, so there's real structure for
+//    valgen to find and test-accuracy's numbers mean something
+//
+// Every person has their own random stream, so the output is the same no matter how many threads make it.
+
+#include "datagen.h"
+
+// globals
+static uint32_t g_num_people = DATAGEN_DEFAULT_PEOPLE;
+static uint32_t g_num_elts = DATAGEN_DEFAULT_ELTS;
+static double g_activity = DATAGEN_DEFAULT_ACTIVITY;
+static double g_zipf = DATAGEN_DEFAULT_ZIPF;
+static int g_factors = DATAGEN_DEFAULT_FACTORS;
+static double g_noise = DATAGEN_DEFAULT_NOISE;
+static int g_scale = DATAGEN_DEFAULT_SCALE;
+static uint64_t g_seed = DATAGEN_DEFAULT_SEED;
+static int g_output = OUTPUT_RATINGS;
+static int g_nthreads = 0;
+
+static double *g_cdf = NULL;            // g_cdf[r] is the chance of picking an element of popularity rank r or better
+static uint32_t *g_rank_elt = NULL;     // the eltid of popularity rank r, so popular elements aren't all low ids
+static float *g_elt_factors = NULL;     // g_factors latent factors per eltid
+static float *g_elt_bias = NULL;        // how much everyone likes each eltid
+static uint32_t g_max_per_person = 0;   // cap on the ratings we sample for one person
+
+
+// splitmix64, plenty random and it can start anywhere
+static uint64_t gen_rand(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+} // end gen_rand()
+
+
+// uniform in [0, 1)
+static double gen_uniform(uint64_t *state)
+{
+    return (double) (gen_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+} // end gen_uniform()
+
+
+// standard normal via Box-Muller
+static double gen_normal(uint64_t *state)
+{
+    const double u1 = 1.0 - gen_uniform(state);   // (0, 1] so the log is finite
+    const double u2 = gen_uniform(state);
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+} // end gen_normal()
+
+
+// Pick an element by popularity.
+static uint32_t pick_elt(uint64_t *state)
+{
+    const double u = gen_uniform(state);
+    uint32_t lo = 0, hi = g_num_elts - 1;
+
+    // find the first rank whose cdf is more than u
+    while (lo < hi)
+    {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (g_cdf[mid] > u)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return g_rank_elt[lo];
+} // end pick_elt()
+
+
+static int gen_rating_cmp(const void *a, const void *b)
+{
+    const gen_rating_t *x = (const gen_rating_t *) a;
+    const gen_rating_t *y = (const gen_rating_t *) b;
+    return (x->eltid > y->eltid) - (x->eltid < y->eltid);
+} // end gen_rating_cmp()
+
+
+static char *put_u32(char *p, uint32_t v)
+{
+    char digits[10];
+    int n = 0;
+
+    do
+    {
+        digits[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v);
+
+    while (n)
+        *p++ = digits[--n];
+
+    return p;
+} // end put_u32()
+
+
+// Build the popularity distribution and the latent element model. This is small next to the output so one thread
+// does it.
+static void build_elements(void)
+{
+    uint64_t state = g_seed ^ 0x5bd1e9955bd1e995ULL;
+    uint32_t i;
+
+    g_cdf = (double *) malloc(g_num_elts * sizeof(double));
+    g_rank_elt = (uint32_t *) malloc(g_num_elts * sizeof(uint32_t));
+    g_elt_factors = (float *) malloc(((size_t) g_num_elts + 1) * (size_t) g_factors * sizeof(float));
+    g_elt_bias = (float *) malloc(((size_t) g_num_elts + 1) * sizeof(float));
+    if (NULL == g_cdf || NULL == g_rank_elt || NULL == g_elt_factors || NULL == g_elt_bias)
+    {
+        syslog(LOG_CRIT, "Out of memory building the element model. Exiting.");
+        exit(-1);
+    }
+
+    // Zipf weights by rank.
+    double total = 0.0;
+    for (i = 0; i < g_num_elts; i++)
+    {
+        total += 1.0 / pow((double) (i + 1), g_zipf);
+        g_cdf[i] = total;
+    }
+    for (i = 0; i < g_num_elts; i++)
+        g_cdf[i] /= total;
+    g_cdf[g_num_elts - 1] = 1.0;
+
+    // Shuffle which eltid gets which rank (Fisher-Yates).
+    for (i = 0; i < g_num_elts; i++)
+        g_rank_elt[i] = i + 1;
+    for (i = g_num_elts - 1; i > 0; i--)
+    {
+        const uint32_t j = (uint32_t) (gen_rand(&state) % (i + 1));
+        const uint32_t tmp = g_rank_elt[i];
+        g_rank_elt[i] = g_rank_elt[j];
+        g_rank_elt[j] = tmp;
+    }
+
+    for (i = 1; i <= g_num_elts; i++)
+    {
+        for (int f = 0; f < g_factors; f++)
+            g_elt_factors[(size_t) i * g_factors + f] = (float) gen_normal(&state);
+        g_elt_bias[i] = (float) (DATAGEN_ELT_BIAS_SD * gen_normal(&state));
+    }
+} // end build_elements()
+
+
+// Make the ratings for people [part->lo, part->hi) and format them into part->buf.
+static void *gen_people(void *arg)
+{
+    gen_part_t *part = (gen_part_t *) arg;
+    const double mu = log(g_activity) - DATAGEN_ACTIVITY_SIGMA * DATAGEN_ACTIVITY_SIGMA / 2.0;
+    const double taste_scale = DATAGEN_TASTE_WEIGHT / sqrt((double) g_factors);
+
+    part->len = 0;
+    part->num_ratings = 0;
+
+    for (uint32_t personid = part->lo; personid < part->hi; personid++)
+    {
+        uint64_t state = g_seed * 0xd1342543de82ef95ULL + personid;
+        uint32_t n = 0;
+
+        // How much does this person rate? At least 1.
+        double wanted = exp(mu + DATAGEN_ACTIVITY_SIGMA * gen_normal(&state));
+        if (wanted < 1.0) wanted = 1.0;
+        if (wanted > g_max_per_person) wanted = g_max_per_person;
+        const uint32_t num_wanted = (uint32_t) wanted;
+
+        // Elements nobody rated wouldn't be in a real ratings file, so person p also rates every element e with
+        // (e - 1) % num_people == p - 1. That puts every element in the output at least once.
+        for (uint32_t e = personid; e <= g_num_elts; e += g_num_people)
+        {
+            part->stamp[e] = personid;
+            part->rated[n++].eltid = e;
+        }
+
+        // Now the popularity-driven picks. Give up on the stragglers if the power law is too steep to find them.
+        uint64_t tries = 20 * (uint64_t) num_wanted + 1000;
+        while (n < num_wanted && tries-- > 0)
+        {
+            const uint32_t e = pick_elt(&state);
+            if (part->stamp[e] == personid) continue;
+            part->stamp[e] = personid;
+            part->rated[n++].eltid = e;
+        }
+
+        // Rate them.
+        for (int f = 0; f < g_factors; f++)
+            part->taste[f] = gen_normal(&state);
+        const double person_bias = DATAGEN_PERSON_BIAS_SD * gen_normal(&state);
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            const float *ef = &g_elt_factors[(size_t) part->rated[i].eltid * g_factors];
+            double dot = 0.0;
+            for (int f = 0; f < g_factors; f++)
+                dot += part->taste[f] * ef[f];
+
+            const double score = taste_scale * dot + person_bias + g_elt_bias[part->rated[i].eltid]
+                                 + g_noise * gen_normal(&state);
+            long r = bmh_round(g_scale * (DATAGEN_RATING_CENTER + DATAGEN_RATING_SPREAD * score));
+            if (r < 1) r = 1;
+            if (r > g_scale) r = g_scale;
+            part->rated[i].rating = (uint8_t) r;
+        }
+
+        qsort(part->rated, n, sizeof(gen_rating_t), gen_rating_cmp);
+
+        // Make sure there's room for this person's output.
+        size_t need = (size_t) n * DATAGEN_MAX_LINE * (g_output == OUTPUT_EVENTS ? (size_t) g_scale : 1);
+        if (part->len + need > part->cap)
+        {
+            size_t cap = part->cap ? part->cap : 1 << 20;
+            while (part->len + need > cap)
+                cap *= 2;
+            char *tmp = (char *) realloc(part->buf, cap);
+            if (NULL == tmp)
+            {
+                syslog(LOG_CRIT, "Out of memory for generator output. Exiting.");
+                exit(-1);
+            }
+            part->buf = tmp;
+            part->cap = cap;
+        }
+
+        char *p = part->buf + part->len;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            const uint32_t eltid = part->rated[i].eltid;
+            const uint8_t rating = part->rated[i].rating;
+
+            switch (g_output)
+            {
+                case OUTPUT_RATINGS:
+                    p = put_u32(p, personid);
+                    *p++ = ',';
+                    p = put_u32(p, eltid);
+                    *p++ = ',';
+                    p = put_u32(p, rating);
+                    *p++ = '\n';
+                    break;
+                case OUTPUT_RATINGS_BIN:
+                {
+                    // Every person before this one has ratings, so the person delta is 1 on their first rating.
+                    const uint32_t prev_eltid = i ? part->rated[i - 1].eltid : 0;
+                    p = (char *) put_varint((uint8_t *) p, zigzag_encode(i ? 0 : 1));
+                    p = (char *) put_varint((uint8_t *) p, zigzag_encode((int64_t) eltid - prev_eltid));
+                    *p++ = (char) rating;
+                    break;
+                }
+                case OUTPUT_EVENTS:
+                    // ratgen rates by how often a person touches an element, so touch it rating times.
+                    for (uint8_t c = 0; c < rating; c++)
+                    {
+                        p = put_u32(p, personid);
+                        *p++ = '\t';
+                        p = put_u32(p, eltid);
+                        *p++ = '\n';
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+        part->len = (size_t) (p - part->buf);
+        part->num_ratings += n;
+    } // end for across people in this part
+
+    return NULL;
+} // end gen_people()
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-p people] [-e elements] [-a mean_ratings_per_person] [-z zipf_exponent]\n"
+                    "       [-f latent_factors] [-n noise] [-r rating_scale] [-t threads] [-s seed]\n"
+                    "       [-o ratings|bin|events] [-d output_dir]\n", name);
+    exit(EXIT_FAILURE);
+} // end usage()
+
+
+int main(int argc, char **argv)
+{
+    char dir[PATH_SIZE] = "";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "a:d:e:f:n:o:p:r:s:t:z:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': // for "activity"
+                g_activity = strtod(optarg, NULL);
+                if (g_activity < 1.0)
+                {
+                    printf("Error: the argument for -a should be >= 1 instead of %s. Exiting.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'd': // for "directory"
+                strlcpy(dir, optarg, sizeof(dir));
+                break;
+            case 'e': // for "elements"
+                g_num_elts = (uint32_t) strtoul(optarg, NULL, 10);
+                if (g_num_elts < 1)
+                {
+                    printf("Error: the argument for -e should be > 0 instead of %s. Exiting.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f': // for "factors"
+                g_factors = (int) strtol(optarg, NULL, 10);
+                if (g_factors < 1 || g_factors > DATAGEN_MAX_FACTORS)
+                {
+                    printf("Error: the argument for -f should be between 1 and %d instead of %s. Exiting.\n",
+                           DATAGEN_MAX_FACTORS, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n': // for "noise"
+                g_noise = strtod(optarg, NULL);
+                if (g_noise < 0.0)
+                {
+                    printf("Error: the argument for -n should be >= 0 instead of %s. Exiting.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'o': // for "output"
+                if (!strcmp(optarg, "ratings"))
+                    g_output = OUTPUT_RATINGS;
+                else if (!strcmp(optarg, "bin"))
+                    g_output = OUTPUT_RATINGS_BIN;
+                else if (!strcmp(optarg, "events"))
+                    g_output = OUTPUT_EVENTS;
+                else
+                {
+                    printf("Error: the argument for -o should be ratings, bin or events instead of %s. Exiting.\n",
+                           optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p': // for "people"
+                g_num_people = (uint32_t) strtoul(optarg, NULL, 10);
+                if (g_num_people < 1)
+                {
+                    printf("Error: the argument for -p should be > 0 instead of %s. Exiting.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r': // for "rating scale"
+                g_scale = (int) strtol(optarg, NULL, 10);
+                if (g_scale < 2 || g_scale > 32)
+                {
+                    printf("Error: the argument for -r should be > 1 and < 33 instead of %s. Exiting.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's': // for "seed"
+                g_seed = strtoull(optarg, NULL, 10);
+                break;
+            case 't': // for "threads"
+                g_nthreads = (int) strtol(optarg, NULL, 10);
+                if (g_nthreads < 1 || g_nthreads > DATAGEN_MAX_THREADS)
+                {
+                    printf("Error: the argument for -t should be between 1 and %d instead of %s. Exiting.\n",
+                           DATAGEN_MAX_THREADS, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'z': // for "zipf"
+                g_zipf = strtod(optarg, NULL);
+                if (g_zipf < 0.0)
+                {
+                    printf("Error: the argument for -z should be >= 0 instead of %s. Exiting.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        } // end switch
+    } // end while
+
+    // Without -d, write where the config says the rest of bemorehuman will look.
+    char fname[PATH_SIZE + 32];
+    if (dir[0] == '\0')
+    {
+        load_config_file();
+        strlcpy(dir, BE.working_dir, sizeof(dir));
+    }
+    else
+    {
+        openlog("datagen", LOG_PID | LOG_NDELAY, LOG_LOCAL0);
+        strlcpy(BE.working_dir, dir, sizeof(BE.working_dir));
+    }
+
+    switch (g_output)
+    {
+        case OUTPUT_RATINGS_BIN:
+            snprintf(fname, sizeof(fname), "%s/%s", dir, RATINGS_BIN);
+            break;
+        case OUTPUT_EVENTS:
+            if (BE.events_file[0] != '\0')
+                strlcpy(fname, BE.events_file, sizeof(fname));
+            else
+                snprintf(fname, sizeof(fname), "%s/%s", dir, "events.txt");
+            break;
+        default:
+            snprintf(fname, sizeof(fname), "%s/%s", dir, "ratings.out");
+            break;
+    }
+
+    if (0 == g_nthreads)
+    {
+        const long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        g_nthreads = ncpu < 1 ? 1 : ncpu > DATAGEN_MAX_THREADS ? DATAGEN_MAX_THREADS : (int) ncpu;
+    }
+
+    // Cap how many ratings we sample per person. Past half the catalog, finding unrated elements gets slow.
+    g_max_per_person = g_num_elts / 2 > 0 ? g_num_elts / 2 : 1;
+    if (g_max_per_person > 50 * g_activity)
+        g_max_per_person = (uint32_t) (50 * g_activity);
+    if (g_max_per_person < 1)
+        g_max_per_person = 1;
+
+    printf("*** Generating %u people x %u elements, %.1f ratings per person on average, zipf %.2f, %d factors, "
+           "scale %d, %d threads ***\n", g_num_people, g_num_elts, g_activity, g_zipf, g_factors, g_scale, g_nthreads);
+    printf("*** Writing to %s ***\n", fname);
+
+    long long start = current_time_millis();
+    build_elements();
+
+    FILE *fp = fopen(fname, "wb");
+    if (NULL == fp)
+    {
+        syslog(LOG_CRIT, "Can't open %s for writing. Exiting.", fname);
+        printf("Can't open %s for writing. Exiting.\n", fname);
+        exit(-1);
+    }
+
+    // The binary header goes first. We fill in the count of ratings at the end.
+    ratings_bin_header_t header;
+    memset(&header, 0, sizeof(header));
+    strlcpy(header.magic, RATINGS_BIN_MAGIC, sizeof(header.magic));
+    header.version = RATINGS_BIN_VERSION;
+    header.num_people = g_num_people;
+    header.num_elts = g_num_elts;
+    if (OUTPUT_RATINGS_BIN == g_output)
+        fwrite(&header, sizeof(header), 1, fp);
+
+    // Each person's extra ratings that make sure every element shows up.
+    const uint32_t coverage = (g_num_elts + g_num_people - 1) / g_num_people;
+
+    gen_part_t parts[g_nthreads];
+    pthread_t tids[g_nthreads];
+    for (int t = 0; t < g_nthreads; t++)
+    {
+        memset(&parts[t], 0, sizeof(gen_part_t));
+        parts[t].stamp = (uint32_t *) calloc((size_t) g_num_elts + 1, sizeof(uint32_t));
+        parts[t].rated = (gen_rating_t *) malloc(((size_t) g_max_per_person + coverage + 1) * sizeof(gen_rating_t));
+        parts[t].taste = (double *) malloc((size_t) g_factors * sizeof(double));
+        if (NULL == parts[t].stamp || NULL == parts[t].rated || NULL == parts[t].taste)
+        {
+            syslog(LOG_CRIT, "Out of memory for generator threads. Exiting.");
+            exit(-1);
+        }
+    }
+
+    uint64_t num_ratings = 0;
+    uint64_t next_person = 1;
+
+    while (next_person <= g_num_people)
+    {
+        int used = 0;
+
+        for (int t = 0; t < g_nthreads && next_person <= g_num_people; t++, used++)
+        {
+            parts[t].lo = (uint32_t) next_person;
+            next_person += DATAGEN_CHUNK_PEOPLE;
+            if (next_person > (uint64_t) g_num_people + 1)
+                next_person = (uint64_t) g_num_people + 1;
+            parts[t].hi = (uint32_t) next_person;
+
+            if (pthread_create(&tids[t], NULL, gen_people, &parts[t]) != 0)
+            {
+                syslog(LOG_CRIT, "Can't create generator thread. Exiting.");
+                exit(-1);
+            }
+        }
+
+        // Write the chunks in person order.
+        for (int t = 0; t < used; t++)
+        {
+            pthread_join(tids[t], NULL);
+
+            if (parts[t].len && fwrite(parts[t].buf, parts[t].len, 1, fp) != 1)
+            {
+                syslog(LOG_CRIT, "Error writing %s. Exiting.", fname);
+                printf("Error writing %s. Exiting.\n", fname);
+                exit(-1);
+            }
+            num_ratings += parts[t].num_ratings;
+        }
+
+        printf("people generated: %" PRIu64 ", ratings so far: %" PRIu64 "\n", next_person - 1, num_ratings);
+    } // end while there are people to generate
+
+    if (OUTPUT_RATINGS_BIN == g_output)
+    {
+        header.num_ratings = num_ratings;
+        fseek(fp, 0, SEEK_SET);
+        fwrite(&header, sizeof(header), 1, fp);
+    }
+
+    if (fclose(fp) != 0)
+    {
+        syslog(LOG_CRIT, "Error closing %s. Exiting.", fname);
+        exit(-1);
+    }
+
+    // A ratings file with a manifest saves valgen from rescanning it. The valences made from an older ratings file
+    // don't go with these ratings, so clear those out the way a rescan would. That's only if we wrote the ratings in
+    // the format the config says is in use; otherwise the valences still go with the ratings that are.
+    if (OUTPUT_EVENTS != g_output && (OUTPUT_RATINGS_BIN == g_output) == BE.binary_ratings)
+    {
+        remove_stale_valences();
+        write_dataset_manifest(fname, g_num_people, g_num_elts, num_ratings);
+    }
+
+    printf("*** Done. Wrote %" PRIu64 " ratings for %u people and %u elements in %lld ms. ***\n", num_ratings,
+           g_num_people, g_num_elts, current_time_millis() - start);
+
+    for (int t = 0; t < g_nthreads; t++)
+    {
+        free(parts[t].buf);
+        free(parts[t].stamp);
+        free(parts[t].rated);
+        free(parts[t].taste);
+    }
+    free(g_cdf);
+    free(g_rank_elt);
+    free(g_elt_factors);
+    free(g_elt_bias);
+
+    exit(EXIT_SUCCESS);
+} // end main()
@@ -35,6 +35,50 @@
 #define VALUE_SIZE 64
 #define PATH_SIZE 256
 
+// The dataset manifest is a small binary file valgen writes next to the ratings it ingested. As long as the ratings
+// file load_config_file() is about to count is the one recorded here, and it still has the size and mtime recorded
+// here, load_config_file() takes the counts from the manifest instead of scanning the ratings file.
+#define DATASET_MANIFEST "dataset_manifest.bin"
+#define DATASET_MANIFEST_MAGIC "BMHMANI"
+#define DATASET_MANIFEST_VERSION 2
+
+// 64-bit FNV-1a, for the hashes that say which inputs a cache file was made from
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+typedef struct
+{
+    char magic[8];           // DATASET_MANIFEST_MAGIC
+    uint32_t version;        // DATASET_MANIFEST_VERSION
+    uint32_t padding;
+    uint64_t num_people;     // number of distinct people in the ratings
+    uint64_t num_elts;       // number of distinct elements in the ratings
+    uint64_t num_ratings;    // number of ratings
+    uint64_t ratings_size;   // size of the ratings file in bytes
+    int64_t ratings_mtime;   // last modified time of the ratings file, in seconds since the epoch
+    char ratings_path[PATH_SIZE + 32];   // the ratings file the counts came from
+} dataset_manifest_t;
+
+// The binary ratings file is an optional alternative to the text ratings file. With "ratings_format = binary" in the
+// config file, ratgen writes it, valgen reads it and load_config_file() takes the counts from it, and the text ratings
+// file isn't used at all. After the header, each rating is
+//   varint(zigzag(personid - previous personid)), varint(zigzag(eltid - previous eltid)), uint8 rating
+// where the previous eltid is 0 whenever the personid changes. Sorted ratings mostly take 3 bytes each this way.
+#define RATINGS_BIN "ratings.bin"
+#define RATINGS_BIN_MAGIC "BMHRATS"
+#define RATINGS_BIN_VERSION 1
+#define RATINGS_BIN_MAX_RECORD 21   // two 10-byte varints and the rating
+
+typedef struct
+{
+    char magic[8];           // RATINGS_BIN_MAGIC
+    uint32_t version;        // RATINGS_BIN_VERSION
+    uint32_t padding;
+    uint64_t num_people;     // number of distinct people in the ratings
+    uint64_t num_elts;       // number of distinct elements in the ratings
+    uint64_t num_ratings;    // number of ratings that follow the header
+} ratings_bin_header_t;
+
 typedef struct bemorehumanConfig
 {
     uint64_t num_elts;     // number of elements we can possibly recommend
@@ -46,15 +90,23 @@ typedef struct bemorehumanConfig
     char working_dir[PATH_SIZE];
     char valence_cache_dir[PATH_SIZE];
     char recgen_socket_location[PATH_SIZE];
+    bool binary_ratings;   // are the ratings in working_dir/RATINGS_BIN instead of ratings_file?
 } bemorehumanConfig_t;
 
 extern void load_config_file(void);
+extern void write_dataset_manifest(const char *, uint64_t, uint64_t, uint64_t);
+extern void remove_stale_valences(void);
 extern bemorehumanConfig_t BE;
 extern long long current_time_millis(void);
 extern long long current_time_micros(void);
 extern bool check_make_dir(char *);
 extern void itoa(int, char[]);
 extern long bmh_round(double);
+extern uint8_t *put_varint(uint8_t *, uint64_t);
+extern const uint8_t *get_varint(const uint8_t *, const uint8_t *, uint64_t *);
+extern uint64_t zigzag_encode(int64_t);
+extern int64_t zigzag_decode(uint64_t);
+extern bool read_ratings_bin_header(const char *, ratings_bin_header_t *);
 
 #ifndef HAVE_STRLCAT
 #ifdef strlcat
@@ -96,6 +148,24 @@ typedef struct
     uint8_t padding[3];
 } rating_t;
 
+//
+// Ratings are stored as a compressed sparse row (by person) and compressed sparse column (by element) pair. Each
+// side is a row pointer array plus packed entries. The ratings of person p are row entries [index[p], index[p + 1])
+// sorted by elementid, and the ratings of element e are column entries [index[e], index[e + 1]) sorted by userid.
+// Packed means 5 bytes per entry instead of the 12 of a rating_t.
+//
+typedef struct __attribute__((packed))
+{
+    uint32_t elementid;
+    uint8_t rating;
+} elt_rating_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t userid;
+    uint8_t rating;
+} user_rating_t;
+
 typedef struct
 {
     uint32_t elementid;
@@ -96,6 +96,166 @@ int parse_integers(const char* line, int* first_integer, int* second_integer, in
 // end rmetacache creation helpers
 
 
+// Read the dataset manifest and use it if it was written for rat_fname and still describes it.
+//
+// returns true if BE's counts were set from the manifest, and sets *changed if the manifest was written for rat_fname
+// but the file has changed since
+static bool read_dataset_manifest(const char *rat_fname, bool *changed)
+{
+    *changed = false;
+
+    char man_fname[PATH_SIZE + 32];
+    snprintf(man_fname, sizeof(man_fname), "%s/%s", BE.working_dir, DATASET_MANIFEST);
+
+    FILE *fp = fopen(man_fname, "rb");
+    if (NULL == fp)
+        return false;
+
+    dataset_manifest_t man;
+    size_t num_read = fread(&man, sizeof(man), 1, fp);
+    fclose(fp);
+
+    if (num_read != 1 || strncmp(man.magic, DATASET_MANIFEST_MAGIC, sizeof(man.magic)) != 0
+        || man.version != DATASET_MANIFEST_VERSION)
+    {
+        syslog(LOG_INFO, "Ignoring dataset manifest %s because it's not one we understand.", man_fname);
+        return false;
+    }
+
+    // Is it the ratings file we're about to count?
+    if (strncmp(man.ratings_path, rat_fname, sizeof(man.ratings_path)) != 0)
+    {
+        syslog(LOG_INFO, "Dataset manifest %s is for %.*s, not %s.", man_fname, (int) sizeof(man.ratings_path),
+               man.ratings_path, rat_fname);
+        return false;
+    }
+
+    // Is it still the same ratings file?
+    struct stat file_stat;
+    if (stat(rat_fname, &file_stat) != 0 || (uint64_t) file_stat.st_size != man.ratings_size
+        || (int64_t) file_stat.st_mtime != man.ratings_mtime)
+    {
+        syslog(LOG_INFO, "Dataset manifest %s is out of date.", man_fname);
+        *changed = true;
+        return false;
+    }
+
+    BE.num_people = man.num_people;
+    BE.num_elts = man.num_elts;
+    BE.num_ratings = man.num_ratings;
+
+    printf("number of people: %" PRIu64 "\n", BE.num_people);
+    printf("number of elements: %" PRIu64 "\n", BE.num_elts);
+    printf("number of ratings: %" PRIu64 "\n", BE.num_ratings);
+    syslog(LOG_INFO, "BE.num_people is %" PRIu64 ", BE.num_elts is %" PRIu64 ", BE.num_ratings is %" PRIu64
+           " from the dataset manifest for %s", BE.num_people, BE.num_elts, BE.num_ratings, rat_fname);
+
+    return true;
+} // end read_dataset_manifest()
+
+
+// The ratings changed, so the valences made from the old ones are no good. Remove them.
+void remove_stale_valences(void)
+{
+    FILE *fp;
+    char shell_cmds[4096];
+    char bfr[BUFSIZ];
+    int counter;
+
+    // cd valences_dir; rm valences.out valence_cache/* num_confident_valences.out; rmdir valence_cache
+    strlcpy(shell_cmds, "cd ", sizeof(shell_cmds));
+    strlcat(shell_cmds, BE.working_dir, sizeof(shell_cmds));
+    strlcat(shell_cmds, "; rm valences.out valence_cache/* num_confident_valences.out; rmdir valence_cache", sizeof(shell_cmds));
+
+    printf("Because there's a new ratings file, we need to invalidate (remove) the various valence files.\n");
+    printf("Now removing old valences.out, num_confident_valences.out, and valence_cache dir.\n");
+    syslog(LOG_INFO, "Because there's a new ratings file, we're removing the old valences.out, num_confident_valences.out, and valence cache dir.");
+
+    if ((fp = popen(shell_cmds, "r")) == NULL)
+    {
+        // There was an error on popen.
+        perror("Some problem opening popen stream 3. Bailing in bmh-config");
+        exit(1);
+    }
+
+    // Read hopefully 0 lines of results
+    counter = 0;
+    int len;
+    while (fgets(bfr,BUFSIZ,fp) != NULL)
+    {
+        switch (counter)
+        {
+            case 0:
+                // bfr should have hopefully nothing if the rm's went ok
+                len = strlen(bfr);
+                if (len > 0)
+                {
+                    printf("output from valence files removal is: ---%s---\n", bfr);
+                    syslog(LOG_INFO, "BE.num_people is %" PRIu64, BE.num_people);
+                }
+            break;
+
+            default:
+            break;
+        } // end switch
+        counter++;
+    } // end while
+
+    fclose(fp);
+} // end remove_stale_valences()
+
+
+//
+// Write the dataset manifest for a ratings file we just ingested.
+//
+// IN
+// ratings_fname is the ratings file the counts came from. Its path, size and mtime get recorded.
+// num_people, num_elts, num_ratings are the counts
+//
+void write_dataset_manifest(const char *ratings_fname, uint64_t num_people, uint64_t num_elts, uint64_t num_ratings)
+{
+    struct stat file_stat;
+    if (stat(ratings_fname, &file_stat) != 0)
+    {
+        syslog(LOG_ERR, "Can't stat %s so not writing a dataset manifest.", ratings_fname);
+        return;
+    }
+
+    dataset_manifest_t man;
+    memset(&man, 0, sizeof(man));
+    strlcpy(man.magic, DATASET_MANIFEST_MAGIC, sizeof(man.magic));
+    man.version = DATASET_MANIFEST_VERSION;
+    man.num_people = num_people;
+    man.num_elts = num_elts;
+    man.num_ratings = num_ratings;
+    man.ratings_size = (uint64_t) file_stat.st_size;
+    man.ratings_mtime = (int64_t) file_stat.st_mtime;
+    strlcpy(man.ratings_path, ratings_fname, sizeof(man.ratings_path));
+
+    // Write to a temp file and rename it so readers never see half a manifest.
+    char man_fname[PATH_SIZE + 32], tmp_fname[PATH_SIZE + 40];
+    snprintf(man_fname, sizeof(man_fname), "%s/%s", BE.working_dir, DATASET_MANIFEST);
+    snprintf(tmp_fname, sizeof(tmp_fname), "%s.tmp", man_fname);
+
+    FILE *fp = fopen(tmp_fname, "wb");
+    if (NULL == fp)
+    {
+        syslog(LOG_ERR, "Can't open %s for writing the dataset manifest.", tmp_fname);
+        return;
+    }
+
+    if (fwrite(&man, sizeof(man), 1, fp) != 1 || fclose(fp) != 0 || rename(tmp_fname, man_fname) != 0)
+    {
+        syslog(LOG_ERR, "Error writing the dataset manifest %s.", man_fname);
+        unlink(tmp_fname);
+        return;
+    }
+
+    syslog(LOG_INFO, "Wrote dataset manifest %s: %" PRIu64 " people, %" PRIu64 " elts, %" PRIu64 " ratings",
+           man_fname, num_people, num_elts, num_ratings);
+} // end write_dataset_manifest()
+
+
 void load_config_file()
 {
     FILE *fp;
@@ -195,6 +355,19 @@ void load_config_file()
                     }
                     strlcpy(BE.recgen_socket_location, value, sizeof(BE.recgen_socket_location));
                 }
+                if (!strcmp(item, "ratings_format"))
+                {
+                    // "text" (the default) or "binary". Every tool goes by this, never by which file is newer.
+                    if (!strcmp(value, "binary"))
+                        BE.binary_ratings = true;
+                    else if (!strcmp(value, "text"))
+                        BE.binary_ratings = false;
+                    else
+                    {
+                        perror("ratings_format field needs to be text or binary. Exiting bmh-config");
+                        exit(1);
+                    }
+                }
             } // end if it's a token
         } // while more lines in config file
     } // end if we can open the config file
@@ -211,40 +384,58 @@ void load_config_file()
     sprintf(rm_fname, "%s/%s", BE.working_dir, "rmetacache.txt");
     sprintf(rat_fname, "%s/%s", BE.working_dir, "ratings.out");
 
-    char shell_cmds[4096], cached_tstamp[1024], cur_tstamp[1024];
     char bfr[BUFSIZ];
     bool use_cache = false;
+    int counter;
+    struct stat file_stat;
 
-    // Does the metafile exist at all?
-    bool rmeta_exists = false;
-    strlcpy(shell_cmds, "test -f ", sizeof(shell_cmds));
-    strlcat(shell_cmds, BE.working_dir, sizeof(shell_cmds));
-    strlcat(shell_cmds, "/rmetacache.txt; echo $?", sizeof(shell_cmds));
-    if ((fp = popen(shell_cmds, "r")) == NULL)
-    {
-        // There was an error on popen.
-        perror("Some problem opening popen stream 0. Bailing in bmh-config");
-        exit(1);
-    }
-    // Read 1 line of results.
-    int counter = 0;
-    while (fgets(bfr,BUFSIZ,fp) != NULL)
+    // With binary ratings, the header has the counts so there's never a rescan.
+    bool ratings_changed;
+    if (BE.binary_ratings)
     {
-        switch (counter)
+        char bin_fname[PATH_SIZE + 32];
+        snprintf(bin_fname, sizeof(bin_fname), "%s/%s", BE.working_dir, RATINGS_BIN);
+
+        if (read_dataset_manifest(bin_fname, &ratings_changed))
+            return;
+
+        if (stat(bin_fname, &file_stat) != 0)
         {
-            case 0:
-            // bfr should have a 1 if no cache file, and 0 if one exists
-            rmeta_exists = 1 - atoi(bfr);
-            syslog(LOG_INFO, "rmeta_exists is %d", rmeta_exists);
-            break;
+            // at this point, ratgen called us and we need to generate the ratings file.
+            syslog(LOG_INFO, "no binary ratings file. done in bmh lib.");
+            return;
+        }
 
-            default:
-            break;
-        } // end switch
-        counter++;
-    } // end while
+        ratings_bin_header_t header;
+        if (!read_ratings_bin_header(bin_fname, &header))
+        {
+            perror("Error reading the header of the binary ratings file. Exiting.");
+            exit(1);
+        }
 
-    fclose(fp);
+        BE.num_people = header.num_people;
+        BE.num_elts = header.num_elts;
+        BE.num_ratings = header.num_ratings;
+        printf("number of people from %s: %" PRIu64 "\n", RATINGS_BIN, BE.num_people);
+        printf("number of elements from %s: %" PRIu64 "\n", RATINGS_BIN, BE.num_elts);
+        printf("number of ratings from %s: %" PRIu64 "\n", RATINGS_BIN, BE.num_ratings);
+        syslog(LOG_INFO, "BE.num_people is %" PRIu64 ", BE.num_elts is %" PRIu64 ", BE.num_ratings is %" PRIu64
+               " from %s", BE.num_people, BE.num_elts, BE.num_ratings, bin_fname);
+
+        // Only if valgen ingested an earlier version of this same file are its valences stale. A missing manifest,
+        // or one for the text ratings, says nothing about them.
+        if (ratings_changed)
+            remove_stale_valences();
+        return;
+    }
+
+    // Trust the dataset manifest if it still matches the ratings file valgen reads. That's just a few stat() calls.
+    if (read_dataset_manifest(BE.ratings_file, &ratings_changed))
+        return;
+
+    // Does the metafile exist at all?
+    bool rmeta_exists = (stat(rm_fname, &file_stat) == 0);
+    syslog(LOG_INFO, "rmeta_exists is %d", rmeta_exists);
 
     // Ok, now we have bool rmeta_exists to tell us if the rmetacache.txt exists.
     // If there's no cache, we should skip the next popen and set use_cache to false
@@ -276,8 +467,6 @@ void load_config_file()
     fclose(fptr);
 
     // Get last modified time from ratings.out
-    struct stat file_stat;
-
     if (stat(rat_fname, &file_stat) == 0)
     {
         // Compare the two strings
@@ -486,46 +675,7 @@ cache_check:
         fclose(fp);
 
         // Ok, now delete a bunch of stuff
-        // cd valences_dir; rm valences.out valence_cache/* num_confident_valences.out; rmdir valence_cache
-        strlcpy(shell_cmds, "cd ", sizeof(shell_cmds));
-        strlcat(shell_cmds, BE.working_dir, sizeof(shell_cmds));
-        strlcat(shell_cmds, "; rm valences.out valence_cache/* num_confident_valences.out; rmdir valence_cache", sizeof(shell_cmds));
-
-        printf("Because there's a new ratings file, we need to invalidate (remove) the various valence files.\n");
-        printf("Now removing old valences.out, num_confident_valences.out, and valence_cache dir.\n");
-        syslog(LOG_INFO, "Because there's a new ratings file, we're removing the old valences.out, num_confident_valences.out, and valence cache dir.");
-
-        if ((fp = popen(shell_cmds, "r")) == NULL)
-        {
-            // There was an error on popen.
-            perror("Some problem opening popen stream 3. Bailing in bmh-config");
-            exit(1);
-        }
-
-        // Read hopefully 0 lines of results
-        counter = 0;
-        int len;
-        while (fgets(bfr,BUFSIZ,fp) != NULL)
-        {
-            switch (counter)
-            {
-                case 0:
-                    // bfr should have hopefully nothing if the rm's went ok
-                    len = strlen(bfr);
-                    if (len > 0)
-                    {
-                        printf("output from valence files removal is: ---%s---\n", bfr);
-                        syslog(LOG_INFO, "BE.num_people is %" PRIu64, BE.num_people);
-                    }
-                break;
-
-                default:
-                break;
-            } // end switch
-            counter++;
-        } // end while
-
-        fclose(fp);
+        remove_stale_valences();
     } // end else we can't use the cache
 
     // Try printing it out to verify that it loaded ok.
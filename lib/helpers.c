@@ -215,8 +215,78 @@ bool check_make_dir(char *dirname)
     return (true);
 } // end check_make_dir()
 
+// Read and check the header of a binary ratings file. Returns false if it's missing or not one we understand.
+bool read_ratings_bin_header(const char *fname, ratings_bin_header_t *header)
+{
+    FILE *fp = fopen(fname, "rb");
+    if (NULL == fp)
+        return false;
+
+    size_t num_read = fread(header, sizeof(ratings_bin_header_t), 1, fp);
+    fclose(fp);
+
+    if (num_read != 1 || strncmp(header->magic, RATINGS_BIN_MAGIC, sizeof(header->magic)) != 0
+        || header->version != RATINGS_BIN_VERSION)
+    {
+        syslog(LOG_ERR, "%s is not a binary ratings file we understand.", fname);
+        return false;
+    }
+
+    return true;
+} // end read_ratings_bin_header()
+
 //  END file helpers
 
+//  BEGIN varint helpers
+
+// Write v as a little-endian base-128 varint at p and return the spot after it.
+uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t) v;
+
+    return p;
+} // end put_varint()
+
+
+// Read a varint at p into *v without going past end. Returns the spot after it, or NULL if it's truncated or too long.
+const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+    uint64_t result = 0;
+
+    for (int shift = 0; shift < 64 && p < end; shift += 7)
+    {
+        uint8_t byte = *p++;
+        result |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            *v = result;
+            return p;
+        }
+    }
+
+    return NULL;
+} // end get_varint()
+
+
+// Map signed to unsigned so small negative deltas stay small: 0, -1, 1, -2, ... become 0, 1, 2, 3, ...
+uint64_t zigzag_encode(int64_t v)
+{
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+} // end zigzag_encode()
+
+
+int64_t zigzag_decode(uint64_t v)
+{
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+} // end zigzag_decode()
+
+//  END varint helpers
+
 //  BEGIN math helpers
 
 // Round isn't really included anywhere convenient. input: double, output long
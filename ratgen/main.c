@@ -56,7 +56,10 @@
 //   ...
 //
 // General plan:
-// - Begin reading events file.
+// - Stream the events file once, counting events per (person, elt) in an open-addressing hash. Memory is bounded by the
+//   number of distinct (person, elt) pairs, not the number of events.
+// - Bucket the distinct pairs by person with a counting pass.
+// - For each person:
 // -- Find the (max number of events of any particular elt for each person: max_event_count).
 // -- iterate over all distinct elts evented by this person.
 // --- find the (event_count / max_event_count) for each plu
@@ -75,36 +78,267 @@ static double g_ratio_thresh[32] = {0.03125, 0.0625, 0.09375, 0.125, 0.15625, 0.
                                    0.96875, 1.01};
 
 //
-// Compare any two events for use as a callback function by qsort.
-// We're sorting by personid, then eltid
+// Globals for the (person, elt) event count aggregation.
 //
-// Returns -1 if the first personid is less than the second || same person but first elt is less than second
-//          0 if the two personids are the same AND eltids are equal
-//          1 if the first personid is greater than the second || same person but first elt is greater than second
+static uint64_t *g_agg_keys;        // (personid << 32) | eltid
+static uint32_t *g_agg_counts;      // event count for the key, 0 means the slot is empty
+static uint64_t g_agg_capacity;     // always a power of 2
+static uint64_t g_agg_used;         // how many slots are in use
+static uint32_t g_max_personid;     // highest personid we've seen
+static uint32_t g_max_eltid;        // highest eltid we've seen
+
+// Globals for rating the people once the pairs are bucketed by person.
+static freq_t *g_freqs;             // person p's distinct elts and event counts are g_freqs[g_person_index[p]..[p + 1])
+static uint64_t *g_person_index;
+
+//
+// Forward declarations
 //
-int eventcmp(const void* p1, const void* p2)
+static uint64_t agg_hash(uint64_t);
+static void agg_alloc(uint64_t);
+static void agg_grow(void);
+static void agg_add(uint32_t, uint32_t);
+static int freqcmp(const void *, const void *);
+static uint64_t person_upper_bound(uint64_t, uint64_t, uint64_t);
+static char *put_u32(char *, uint32_t);
+static void *rate_people(void *);
+
+
+// Mix the bits of a key so (person, elt) pairs spread out over the table. This is the splitmix64 finalizer.
+static uint64_t agg_hash(uint64_t key)
+{
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+} // end agg_hash()
+
+
+// Allocate an empty aggregation table with room for capacity slots.
+static void agg_alloc(uint64_t capacity)
 {
-    event_t x = *(const event_t *) p1, y = *(const event_t *) p2;
+    g_agg_capacity = capacity;
+    g_agg_used = 0;
+    g_agg_keys = (uint64_t *) malloc(capacity * sizeof(uint64_t));
+    g_agg_counts = (uint32_t *) calloc(capacity, sizeof(uint32_t));
 
-    // This test is to see if p1 < p2.
-    if ((x.personid < y.personid) || ((x.personid == y.personid) && (x.eltid < y.eltid)))
+    if (NULL == g_agg_keys || NULL == g_agg_counts)
     {
-        return (-1);
+        syslog(LOG_ERR, "Ran out of RAM when allocating the event aggregation table with %" PRIu64 " slots.", capacity);
+        exit(-1);
     }
-    else
+} // end agg_alloc()
+
+
+// Double the table and rehash everything into it.
+static void agg_grow(void)
+{
+    uint64_t *old_keys = g_agg_keys;
+    uint32_t *old_counts = g_agg_counts;
+    uint64_t old_capacity = g_agg_capacity;
+
+    agg_alloc(old_capacity * 2);
+
+    const uint64_t mask = g_agg_capacity - 1;
+    for (uint64_t i = 0; i < old_capacity; i++)
+    {
+        if (0 == old_counts[i])
+            continue;
+
+        uint64_t slot = agg_hash(old_keys[i]) & mask;
+        while (g_agg_counts[slot] != 0)
+            slot = (slot + 1) & mask;
+
+        g_agg_keys[slot] = old_keys[i];
+        g_agg_counts[slot] = old_counts[i];
+        g_agg_used++;
+    }
+
+    free(old_keys);
+    free(old_counts);
+} // end agg_grow()
+
+
+// Count one event for (personid, eltid).
+static void agg_add(uint32_t personid, uint32_t eltid)
+{
+    // Keep the load factor at or below AGG_MAX_LOAD_PCT so probe runs stay short.
+    if ((g_agg_used + 1) * 100 > g_agg_capacity * AGG_MAX_LOAD_PCT)
+        agg_grow();
+
+    const uint64_t key = ((uint64_t) personid << 32) | eltid;
+    const uint64_t mask = g_agg_capacity - 1;
+    uint64_t slot = agg_hash(key) & mask;
+
+    // Linear probe until we find the key or an empty slot.
+    while (g_agg_counts[slot] != 0)
     {
-        // This test is to see if p1 > p2.
-        if ((x.personid > y.personid) || ((x.personid == y.personid) && (x.eltid > y.eltid)))
+        if (g_agg_keys[slot] == key)
         {
-            return (1);
+            g_agg_counts[slot]++;
+            return;
         }
+        slot = (slot + 1) & mask;
+    }
+
+    g_agg_keys[slot] = key;
+    g_agg_counts[slot] = 1;
+    g_agg_used++;
+
+    if (personid > g_max_personid)
+        g_max_personid = personid;
+    if (eltid > g_max_eltid)
+        g_max_eltid = eltid;
+} // end agg_add()
+
+
+// Compare two freq_t's by eltid for use as a callback function by qsort.
+static int freqcmp(const void *p1, const void *p2)
+{
+    const freq_t *x = (const freq_t *) p1, *y = (const freq_t *) p2;
+
+    return (x->eltid > y->eltid) - (x->eltid < y->eltid);
+} // end freqcmp()
+
+
+// Find the first person p in [lo, hi) whose pairs start at or after target, or hi if there isn't one.
+static uint64_t person_upper_bound(uint64_t lo, uint64_t hi, uint64_t target)
+{
+    while (lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (g_person_index[mid] < target)
+            lo = mid + 1;
         else
+            hi = mid;
+    }
+    return lo;
+} // end person_upper_bound()
+
+
+// Write v in decimal at p and return the spot after it. This is what sprintf("%u") does, without the format parsing.
+static char *put_u32(char *p, uint32_t v)
+{
+    char digits[10];
+    int n = 0;
+
+    do
+    {
+        digits[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v);
+
+    while (n)
+        *p++ = digits[--n];
+
+    return p;
+} // end put_u32()
+
+
+// Each thread rates the people in its part and formats their ratings into its own buffer.
+static void *rate_people(void *args)
+{
+    ratgen_part_t *part = (ratgen_part_t *) args;
+    int rating = 0;
+    double event_ratio;
+    uint32_t event_count;
+    uint64_t j;
+
+    // Make sure the buffer can hold the longest possible line for every pair in this part.
+    const size_t needed = (size_t) (g_person_index[part->hi] - g_person_index[part->lo]) * RATGEN_MAX_LINE;
+    if (needed > part->cap)
+    {
+        free(part->buf);
+        part->buf = (char *) malloc(needed);
+        part->cap = needed;
+        if (NULL == part->buf)
+        {
+            syslog(LOG_ERR, "Ran out of RAM when allocating a %zu byte ratings output buffer.", needed);
+            exit(-1);
+        }
+    }
+
+    char *out = part->buf;
+
+    // Binary records are deltas from the record before, which for our first one is the last person before this part.
+    uint32_t prev_personid = 0;
+    for (uint64_t q = part->lo; q > 0; q--)
+    {
+        if (g_person_index[q] > g_person_index[q - 1])
         {
-            // They're the same (x.user = y.user AND x.element = y.element).
-            return (0);
+            prev_personid = (uint32_t) (q - 1);
+            break;
         }
     }
-} // end eventcmp()
+
+    for (uint64_t p = part->lo; p < part->hi; p++)
+    {
+        const uint32_t personid = (uint32_t) p;
+        freq_t *person_freqs = &g_freqs[g_person_index[p]];
+        const uint64_t num_freqs = g_person_index[p + 1] - g_person_index[p];
+
+        if (0 == num_freqs)
+            continue;
+
+        // The ratings come out sorted by eltid within each person.
+        qsort(person_freqs, num_freqs, sizeof(freq_t), freqcmp);
+
+        uint32_t max_event_count = 0;
+
+        // 1b. Iterate over all distinct eltids evented by this person to get the max_event_count.
+        for (j = 0; j < num_freqs; j++)
+        {
+            if (person_freqs[j].freq > max_event_count)
+                max_event_count = person_freqs[j].freq;
+        }
+
+        // 1b. Iterate over all distinct eltids evented by this person again.
+        for (j = 0; j < num_freqs; j++)
+        {
+            event_count = person_freqs[j].freq;
+
+            // 1.b.1 find the (event_count / max_event_count) for each plu
+            event_ratio = (float) event_count / (float) max_event_count;
+
+            // 1.b.2 put that ratio into lookup table for the 32 ratings bands
+            for (int k = 0; k < 32; k++)
+            {
+                if (event_ratio < g_ratio_thresh[k])
+                {
+                    rating = k + 1;
+                    break;
+                }
+            }
+
+            // 1.b.3 We now have a rating for that person / element
+
+            // 1.b.4 Persist the rating info.
+            if (BE.binary_ratings)
+            {
+                // Export to this thread's buffer: personid delta, eltid delta, rating
+                uint32_t prev_eltid = j ? person_freqs[j - 1].eltid : 0;
+                out = (char *) put_varint((uint8_t *) out, zigzag_encode((int64_t) personid - prev_personid));
+                out = (char *) put_varint((uint8_t *) out,
+                                          zigzag_encode((int64_t) person_freqs[j].eltid - prev_eltid));
+                *out++ = (char) rating;
+                prev_personid = personid;
+                continue;
+            }
+
+            // Export to this thread's buffer: comma-delimited personid, productid, rating
+            out = put_u32(out, personid);
+            *out++ = ',';
+            out = put_u32(out, person_freqs[j].eltid);
+            *out++ = ',';
+            out = put_u32(out, (uint32_t) rating);
+            *out++ = '\n';
+        } // end for loop across distinct elements for this person
+    } // end for loop across the people in this part
+
+    part->len = (size_t) (out - part->buf);
+
+    return (void *) NULL;
+} // end rate_people()
+
 
 int main()
 {
@@ -122,43 +356,11 @@ int main()
         
     load_config_file();
 
-    int i, j, rating = 0;
-    double event_ratio;
-    uint32_t personid, event_count;
-        
-    FILE *fp;
-    char fname[255];
-    char bfr[BUFSIZ];
-    uint32_t num_lines = 0;
-    uint32_t num_found = 0;
-    
-    strlcpy(bfr, BE.working_dir, sizeof(bfr));
-    strlcat(bfr, "/events.txt", sizeof(bfr));
-    syslog(LOG_INFO, "bfr is ---%s---", bfr);
-    
-    fp = fopen(bfr, "r");
-    if (fp == NULL) {
-        perror("Error opening events file directly");
-        return 1;
-    }
-
-    char ch;
-
-    // Read through the file character by character to count newlines
-    while ((ch = fgetc(fp)) != EOF) {
-        if (ch == '\n') {
-            num_lines++;
-        }
-    }
-
-    fclose(fp);
+    uint64_t i;
 
-    syslog(LOG_INFO, "num_lines is %d", num_lines);
-    if (0 == num_lines)
-    {
-        syslog(LOG_ERR, "Couldn't get the num_lines of input file events.txt. Exiting.");
-        exit (-1);
-    }
+    FILE *fp;
+    char fname[PATH_SIZE + 32];
+    uint64_t num_found = 0;
 
     // Set up events input file.
     strlcpy(fname, BE.events_file, sizeof(fname));
@@ -170,14 +372,7 @@ int main()
         exit(1);
     }
 
-    // Malloc num_lines event_t's
-    event_t *events;
-    events = (event_t *) malloc(num_lines * sizeof(event_t));
-    if (events == NULL)
-    {
-        syslog(LOG_ERR, "Ran out of RAM when allocating events structure with %d elts.", num_lines);
-        exit(-1);
-    }
+    agg_alloc(AGG_INITIAL_CAPACITY);
 
     char *line = NULL;
     size_t line_capacity = 0;
@@ -185,7 +380,7 @@ int main()
     const char delimiter[2] = "\t";
     char *token;
 
-    // Read the input file and populate the event_t's.
+    // Stream the input file and count the events for each (person, elt).
     while ((line_length = getline(&line, &line_capacity, fp)) != -1)
     {
         // Is the file coming from linux/unix?
@@ -196,6 +391,7 @@ int main()
             line[--line_length] = '\0';
 
         int token_number = 0;
+        uint32_t personid = 0, eltid = 0;
 
         // Get the first token.
         token = strtok(line, delimiter);
@@ -206,10 +402,10 @@ int main()
             switch (token_number)
             {
                 case 0:   // personid
-                    events[num_found].personid = strtol(token, NULL, 10);
+                    personid = strtol(token, NULL, 10);
                     break;
                 case 1:   // eltid
-                    events[num_found].eltid = strtol(token, NULL, 10);
+                    eltid = strtol(token, NULL, 10);
                     break;
                 default:
                     syslog(LOG_ERR, "ERROR: hit the default case situation when parsing tokens in a line in %s. Why?", fname);
@@ -218,15 +414,21 @@ int main()
             token_number++;
         } // end while() parsing tokens
 
-        num_found++;
-        if (num_found > num_lines)
+        if (token_number < 2)
         {
-            syslog(LOG_ERR, "Found more events than we allocated. %d > %d. Exiting.", num_found, num_lines);
-            exit(-1);
+            syslog(LOG_ERR, "Skipping event line %" PRIu64 " in %s because it doesn't have a personid and eltid.",
+                   num_found + 1, fname);
+            continue;
         }
+
+        agg_add(personid, eltid);
+        num_found++;
     } // end while more lines to get
 
-    syslog(LOG_INFO, "We loaded %u events and were expecting %u", num_found, num_lines);
+    free(line);
+
+    syslog(LOG_INFO, "We streamed %" PRIu64 " events into %" PRIu64 " distinct (person, elt) pairs", num_found,
+           g_agg_used);
 
     if (fclose(fp) != 0)
     {
@@ -234,11 +436,50 @@ int main()
         exit(-1);
     }
 
-    // Sort events by personid, then productid
-    qsort(events, num_found, sizeof(event_t), eventcmp);
+    if (0 == num_found)
+    {
+        syslog(LOG_ERR, "Couldn't find any events in input file %s. Exiting.", fname);
+        exit (-1);
+    }
+
+    // Bucket the distinct pairs by person. person_index[p]..person_index[p + 1] are person p's pairs in freqs.
+    uint64_t *person_index = (uint64_t *) calloc((size_t) g_max_personid + 2, sizeof(uint64_t));
+    freq_t *freqs = (freq_t *) malloc(g_agg_used * sizeof(freq_t));
+    if (NULL == person_index || NULL == freqs)
+    {
+        syslog(LOG_ERR, "Ran out of RAM when allocating the per-person structures for %" PRIu64 " pairs.", g_agg_used);
+        exit(-1);
+    }
+
+    for (i = 0; i < g_agg_capacity; i++)
+        if (g_agg_counts[i] != 0)
+            person_index[(g_agg_keys[i] >> 32) + 1]++;
+
+    for (i = 1; i <= (uint64_t) g_max_personid + 1; i++)
+        person_index[i] += person_index[i - 1];
+
+    // Scatter using the next free spot for each person, then put the index back the way it was.
+    for (i = 0; i < g_agg_capacity; i++)
+    {
+        if (0 == g_agg_counts[i])
+            continue;
+        const uint32_t personid = (uint32_t) (g_agg_keys[i] >> 32);
+        freqs[person_index[personid]].eltid = (uint32_t) g_agg_keys[i];
+        freqs[person_index[personid]].freq = g_agg_counts[i];
+        person_index[personid]++;
+    }
+    for (i = (uint64_t) g_max_personid + 1; i > 0; i--)
+        person_index[i] = person_index[i - 1];
+    person_index[0] = 0;
+
+    free(g_agg_keys);
+    free(g_agg_counts);
 
     // Set up ratings output file.
-    strlcpy(fname, BE.ratings_file, sizeof(fname));
+    if (BE.binary_ratings)
+        snprintf(fname, sizeof(fname), "%s/%s", BE.working_dir, RATINGS_BIN);
+    else
+        strlcpy(fname, BE.ratings_file, sizeof(fname));
     fp = fopen(fname,"w");
 
     if (NULL == fp)
@@ -247,85 +488,88 @@ int main()
         exit(1);
     }
 
-    // Walk the events and count the quantities of items for each person.
-    i = 0;
-    while ((uint32_t) i < num_found)
+    // The binary file starts with the counts so nobody has to scan it to learn them.
+    if (BE.binary_ratings)
     {
-        // Find out how many freq_t guys to allocate for this person.
-        // NOTE: This allocation will be larger that what's necessary in every case except when all eltids are unique for this person
-        personid = events[i].personid;
-        int walker = i;
-        int num_to_allocate = 0;
-        while (events[walker++].personid == personid)
-            num_to_allocate++;
-
-        // Set up the frequency structure for this person.
-        freq_t *freqs;
-        freqs = (freq_t *) calloc(num_to_allocate, sizeof(freq_t));
-
-        // Populate freqs for this person. eltids are sorted.
-        int freq_ind = -1;
-        uint32_t curr_elt = 0;
-        for (j = 0; j < num_to_allocate; j++)
+        ratings_bin_header_t header;
+        memset(&header, 0, sizeof(header));
+        strlcpy(header.magic, RATINGS_BIN_MAGIC, sizeof(header.magic));
+        header.version = RATINGS_BIN_VERSION;
+        header.num_ratings = g_agg_used;
+
+        for (i = 0; i <= g_max_personid; i++)
+            if (person_index[i + 1] > person_index[i])
+                header.num_people++;
+
+        uint8_t *elt_seen = (uint8_t *) calloc((size_t) g_max_eltid + 1, sizeof(uint8_t));
+        if (NULL == elt_seen)
         {
-            // Do we have a new elt?
-            if (curr_elt != events[i + j].eltid)
-            {
-                freq_ind++;
-                curr_elt = events[i + j].eltid;
+            syslog(LOG_ERR, "Ran out of RAM when counting distinct elts.");
+            exit(-1);
+        }
+        for (i = 0; i < g_agg_used; i++)
+            elt_seen[freqs[i].eltid] = 1;
+        for (i = 0; i <= g_max_eltid; i++)
+            header.num_elts += elt_seen[i];
+        free(elt_seen);
 
-                // New elt, so set the eltid at the new freq location
-                freqs[freq_ind].eltid = events[i + j].eltid;
-            }
-            // Bump the freq count
-            freqs[freq_ind].freq++;
-        } // end for loop across events for this person
+        if (fwrite(&header, sizeof(header), 1, fp) != 1)
+        {
+            syslog(LOG_ERR, "Error writing ratings output file header.");
+            exit(1);
+        }
+    }
 
-        i += j;
-        uint32_t max_event_count = 0;
+    g_freqs = freqs;
+    g_person_index = person_index;
 
-        // 1b. Iterate over all distinct eltids evented by this person to get the max_event_count.
-        for (j = 0; j < freq_ind + 1; j++)
+    // Work through the people a chunk at a time so the output buffers stay bounded. Each chunk is split across the
+    // threads by number of pairs, and the thread buffers are written in personid order.
+    pthread_t thread_id[RATGEN_NTHREADS];
+    ratgen_part_t parts[RATGEN_NTHREADS];
+    memset(parts, 0, sizeof(parts));
+
+    const uint64_t num_people_slots = (uint64_t) g_max_personid + 1;
+    uint64_t chunk_lo = 0;
+    while (chunk_lo < num_people_slots)
+    {
+        uint64_t chunk_hi = person_upper_bound(chunk_lo, num_people_slots,
+                                               person_index[chunk_lo] + RATGEN_CHUNK_PAIRS);
+        if (chunk_hi == chunk_lo)
+            chunk_hi = chunk_lo + 1;
+
+        const uint64_t base = person_index[chunk_lo];
+        const uint64_t span = person_index[chunk_hi] - base;
+        uint64_t lo = chunk_lo;
+        int t;
+        for (t = 0; t < RATGEN_NTHREADS; t++)
         {
-            if (freqs[j].freq > max_event_count)
-                max_event_count = freqs[j].freq;
+            uint64_t hi = (t == RATGEN_NTHREADS - 1) ? chunk_hi
+                          : person_upper_bound(lo, chunk_hi, base + span * (uint64_t) (t + 1) / RATGEN_NTHREADS);
+            parts[t].lo = lo;
+            parts[t].hi = hi;
+            pthread_create(&thread_id[t], NULL, rate_people, &parts[t]);
+            lo = hi;
         }
 
-        // 1b. Iterate over all distinct eltids evented by this person again.
-        for (j = 0; j < freq_ind + 1; j++)
+        for (t = 0; t < RATGEN_NTHREADS; t++)
         {
-            event_count = freqs[j].freq;
-
-            // 1.b.1 find the (event_count / max_event_count) for each plu
-            event_ratio = (float) event_count / (float) max_event_count;
-
-            // 1.b.2 put that ratio into lookup table for the 32 ratings bands
-            for (int k = 0; k < 32; k++)
+            pthread_join(thread_id[t], NULL);
+            if (parts[t].len && fwrite(parts[t].buf, parts[t].len, 1, fp) != 1)
             {
-                if (event_ratio < g_ratio_thresh[k])
-                {
-                    rating = k + 1;
-                    break;
-                }
+                syslog(LOG_ERR, "Error writing ratings output file.");
+                exit(1);
             }
+        }
 
-            // 1.b.3 We now have a rating for that person / element
-
-            // 1.b.4 Persist the rating info.
-            // Export to flat file: comma-delimited personid, productid, rating
-            char out_buffer[256];
-            sprintf(out_buffer, "%u,%u,%d\n", personid, freqs[j].eltid, rating);
-            fwrite(out_buffer, strlen(out_buffer), 1, fp);
-
-        } // end for loop across distinct elements for this person
-
-        if (NULL != freqs)
-            free(freqs);
+        chunk_lo = chunk_hi;
+    } // end while more people to rate
 
-    } // end for loop across distinct people
+    for (int t = 0; t < RATGEN_NTHREADS; t++)
+        free(parts[t].buf);
 
-    if (NULL != events)
-        free(events);
+    free(freqs);
+    free(person_index);
 
     if (fclose(fp) != 0)
     {
@@ -341,4 +585,3 @@ int main()
 
     return (0);
 } // end ratgen main()
-
@@ -34,8 +34,25 @@
 #include <string.h>
 #include <assert.h>
 #include <syslog.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "bmh-config.h"
 
+// defines
+
+// The (person, elt) event count table starts with this many slots and doubles when it's more than
+// AGG_MAX_LOAD_PCT percent full.
+#define AGG_INITIAL_CAPACITY (1 << 16)
+#define AGG_MAX_LOAD_PCT 70
+
+// How many threads rate people, and how many (person, elt) pairs they share per round.
+#define RATGEN_NTHREADS 16
+#define RATGEN_CHUNK_PAIRS (1 << 22)
+
+// The longest ratings line is "4294967295,4294967295,32\n". That's longer than any binary record, too.
+#define RATGEN_MAX_LINE 25
+
 // typedefs
 
 // This holds the elt count for one person's different elts.
@@ -45,4 +62,14 @@ typedef struct
     uint32_t eltid;
 } freq_t;
 
+// One thread's share of the people to rate, and the ratings text it produced for them.
+typedef struct
+{
+    uint64_t lo;     // first personid in this part
+    uint64_t hi;     // upper exclusive bound of personids in this part
+    char *buf;       // ratings text for this part
+    size_t len;      // bytes used in buf
+    size_t cap;      // bytes allocated for buf
+} ratgen_part_t;
+
 #endif // RATGEN_H
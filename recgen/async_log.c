@@ -0,0 +1,226 @@
+// SPDX-FileCopyrightText: 2022 Brian Calhoun <brian@bemorehuman.org>
+//
+// SPDX-License-Identifier: MIT
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is furnished to do
+// so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// This file is part of bemorehuman. See https://bemorehuman.org
+
+#include "recgen.h"
+#include <stdarg.h>
+#include <time.h>
+
+//
+// This is the request-path logger for recgen. BMH_LOG() formats the message into a ring owned by the calling thread
+// and returns; a background thread drains the rings into syslog. A full ring drops the message instead of waiting,
+// so a worker never blocks on logging. Each BMH_LOG() call site also has its own rate limit of LOG_SITE_RATE
+// messages per second, and the next message that gets through says how many were suppressed.
+//
+// Until async_log_start() runs, BMH_LOG() calls syslog() directly. That keeps cache generation and the benchmark,
+// which never start the drain thread, logging as before.
+//
+
+typedef struct
+{
+    int level;
+    char msg[LOG_MSG_SIZE];
+} log_entry_t;
+
+// Single producer (the owning thread), single consumer (the drain thread).
+typedef struct
+{
+    uint64_t head __attribute__((aligned(64)));  // next entry the owner writes; only the owner stores it
+    uint64_t dropped;                            // messages lost to a full ring; only the owner stores it
+    uint64_t tail __attribute__((aligned(64)));  // next entry the drain thread reads; only the drain thread stores it
+    uint64_t dropped_reported;                   // drain thread's copy of dropped as of its last report
+    log_entry_t entries[LOG_RING_SIZE];
+} log_ring_t;
+
+static log_ring_t *g_rings[LOG_MAX_THREADS];
+static uint32_t g_num_rings = 0;
+static uint64_t g_unringed_dropped = 0;         // messages from threads beyond LOG_MAX_THREADS
+static bool g_log_running = false;
+
+static __thread log_ring_t *t_ring = NULL;
+static __thread bool t_ring_failed = false;
+
+
+// Get this thread's ring, making it the first time through. Returns NULL if there's no ring to be had.
+static log_ring_t *ring_for_thread(void)
+{
+    if (t_ring || t_ring_failed)
+        return t_ring;
+
+    const uint32_t slot = __atomic_fetch_add(&g_num_rings, 1, __ATOMIC_RELAXED);
+    log_ring_t *ring = (slot < LOG_MAX_THREADS) ? calloc(1, sizeof(log_ring_t)) : NULL;
+    if (NULL == ring)
+    {
+        t_ring_failed = true;
+        return NULL;
+    }
+
+    // Publish the ring. The drain thread skips slots that are still NULL.
+    __atomic_store_n(&g_rings[slot], ring, __ATOMIC_RELEASE);
+    t_ring = ring;
+    return ring;
+} // end ring_for_thread()
+
+
+// Let this message through the site's rate limit? If so, *suppressed is how many were held back before it.
+static bool site_allows(log_site_t *site, uint32_t *suppressed)
+{
+    const uint32_t now = (uint32_t) time(NULL);
+    uint32_t window = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+
+    // First message this second? Start a new window. Only the thread that wins the swap resets the count.
+    if (window != now && __atomic_compare_exchange_n(&site->window, &window, now, false,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+
+    if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) >= LOG_SITE_RATE)
+    {
+        __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    return true;
+} // end site_allows()
+
+
+// Use BMH_LOG() instead of calling this directly.
+void async_log_write(log_site_t *site, int level, const char *fmt, ...)
+{
+    uint32_t suppressed = 0;
+    if (!site_allows(site, &suppressed))
+        return;
+
+    va_list ap;
+    va_start(ap, fmt);
+
+    if (!__atomic_load_n(&g_log_running, __ATOMIC_ACQUIRE))
+    {
+        vsyslog(level, fmt, ap);
+        va_end(ap);
+        if (suppressed)
+            syslog(level, "(%u more like the last message suppressed)", suppressed);
+        return;
+    }
+
+    log_ring_t *ring = ring_for_thread();
+    if (NULL == ring)
+    {
+        va_end(ap);
+        __atomic_fetch_add(&g_unringed_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    const uint64_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE)
+    {
+        va_end(ap);
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    log_entry_t *entry = &ring->entries[head & (LOG_RING_SIZE - 1)];
+    entry->level = level;
+    int len = vsnprintf(entry->msg, sizeof(entry->msg), fmt, ap);
+    va_end(ap);
+
+    if (suppressed && len >= 0 && (size_t) len < sizeof(entry->msg))
+        snprintf(entry->msg + len, sizeof(entry->msg) - (size_t) len, " (%u more like this suppressed)", suppressed);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+} // end async_log_write()
+
+
+// Empty every ring into syslog. Returns how many messages it wrote.
+static uint64_t drain_rings(void)
+{
+    uint64_t drained = 0;
+    const uint32_t num_rings = __atomic_load_n(&g_num_rings, __ATOMIC_RELAXED);
+
+    for (uint32_t r = 0; r < num_rings && r < LOG_MAX_THREADS; r++)
+    {
+        log_ring_t *ring = __atomic_load_n(&g_rings[r], __ATOMIC_ACQUIRE);
+        if (NULL == ring)
+            continue;
+
+        uint64_t tail = ring->tail;
+        const uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head)
+        {
+            const log_entry_t *entry = &ring->entries[tail & (LOG_RING_SIZE - 1)];
+            syslog(entry->level, "%s", entry->msg);
+            tail++;
+            drained++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        const uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->dropped_reported)
+        {
+            syslog(LOG_WARNING, "Log ring %u was full and dropped %" PRIu64 " messages.", r,
+                   dropped - ring->dropped_reported);
+            ring->dropped_reported = dropped;
+        }
+    }
+    return drained;
+} // end drain_rings()
+
+
+// NOTE: clang understands the GCC pragma, but not vice-versa! So do it this way.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wreturn-type"
+static void *drain_thread(void *arg)
+{
+    (void) arg;
+    uint64_t unringed_reported = 0;
+    const struct timespec idle = { 0, LOG_DRAIN_INTERVAL_MS * 1000000L };
+
+    while (1)
+    {
+        if (0 == drain_rings())
+            nanosleep(&idle, NULL);
+
+        const uint64_t unringed = __atomic_load_n(&g_unringed_dropped, __ATOMIC_RELAXED);
+        if (unringed != unringed_reported)
+        {
+            syslog(LOG_WARNING, "More than %d threads are logging. Dropped %" PRIu64 " of their messages.",
+                   LOG_MAX_THREADS, unringed - unringed_reported);
+            unringed_reported = unringed;
+        }
+    }
+} // end drain_thread()
+#pragma GCC diagnostic pop
+
+
+// Start the drain thread. From here on, BMH_LOG() doesn't call syslog() itself. Call this once, after any fork().
+void async_log_start(void)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, drain_thread, NULL) != 0)
+    {
+        syslog(LOG_ERR, "Can't start the log drain thread. Logging stays synchronous.");
+        return;
+    }
+    pthread_detach(thread);
+    __atomic_store_n(&g_log_running, true, __ATOMIC_RELEASE);
+} // end async_log_start()
@@ -0,0 +1,885 @@
+// SPDX-FileCopyrightText: 2022 Brian Calhoun <brian@bemorehuman.org>
+//
+// SPDX-License-Identifier: MIT
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is furnished to do
+// so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// This file is part of bemorehuman. See https://bemorehuman.org
+#include "recgen.h"
+#include <math.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+//
+// This is the recgen kernel benchmark. It drives create_pcrs(), init_workingset(), tally(), composite() and
+// top_recs() directly, without the server in front, over either a synthetic valence model or a real valence cache.
+// Use it to compare kernel changes on their own instead of through end-to-end HTTP timing.
+//
+
+enum { STAGE_INIT, STAGE_TALLY, STAGE_COMPOSITE, STAGE_TOPK, NUM_STAGES };
+
+static const char *stage_names[NUM_STAGES] = { "init_workingset", "tally", "composite", "top-K sort" };
+static const char *bucket_names[BENCH_NUM_RATING_BUCKETS] = { "1-10", "11-50", "51-200", "201-1000", ">1000" };
+
+// This is everything the kernels read.
+typedef struct
+{
+    valence_t *bb;
+    seg_ptr_t *bind_seg;
+    valence_t *bb_ds;
+    seg_ptr_t *bind_seg_ds;
+    valence_t *bb_uni;          // NULL unless we're timing the unified adjacency
+    seg_ptr_t *bind_seg_uni;
+    packed_adjacency_t packed;  // key_bytes is 0 unless we're timing the packed adjacency
+    popularity_t *pop;
+    const pop_split_t *split;   // NULL unless the rows are partitioned by popularity
+    const pop_split_t *split_ds;
+    int8_t *tiny_slopes;
+    double *tiny_slopes_inv;
+    int8_t *tiny_offsets;
+    uint64_t num_valences;
+} bench_model_t;
+
+// One timed request.
+typedef struct
+{
+    int num_ratings;
+    uint64_t visited;           // valences tally() walked for this request
+    uint64_t lines;             // workingset cache lines tally() wrote to for this request
+    uint64_t tlb_misses;        // dTLB load misses for the whole request, if the CPU counts them
+    uint64_t node_misses;       // loads that went to another NUMA node's memory, if the CPU counts them
+    uint64_t ratings_hash;      // the request's result cache key, with -q
+    uint64_t ns[NUM_STAGES];
+} bench_sample_t;
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+} // end now_ns()
+
+
+// splitmix64
+static uint64_t bench_rand(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+} // end bench_rand()
+
+
+static int u32cmp(const void *p1, const void *p2)
+{
+    const uint32_t a = *(const uint32_t *) p1;
+    const uint32_t b = *(const uint32_t *) p2;
+    return (a > b) - (a < b);
+} // end u32cmp()
+
+
+static int u64cmp(const void *p1, const void *p2)
+{
+    const uint64_t a = *(const uint64_t *) p1;
+    const uint64_t b = *(const uint64_t *) p2;
+    return (a > b) - (a < b);
+} // end u64cmp()
+
+
+static void *bench_calloc(size_t num, size_t size, const char *what)
+{
+    void *p = calloc(num, size);
+    if (NULL == p)
+    {
+        printf("FATAL ERROR: Out of memory when creating %s.\n", what);
+        exit(EXIT_MEMLOAD);
+    }
+    return p;
+} // end bench_calloc()
+
+
+// The arrays the kernels read and write go on huge pages the way recgen puts them there. See huge_mem.c.
+static void *model_calloc(size_t num, size_t size, const char *what)
+{
+    void *p = huge_calloc(num, size, what);
+    if (NULL == p)
+    {
+        printf("FATAL ERROR: Out of memory when creating %s.\n", what);
+        exit(EXIT_MEMLOAD);
+    }
+    return p;
+} // end model_calloc()
+
+
+// Open a counter of this thread's load misses in user space for a PERF_COUNT_HW_CACHE_ cache: the dTLB, or the local
+// NUMA node for loads from another node's memory. Returns -1 if the kernel or CPU won't count them.
+static int open_miss_counter(uint64_t cache)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    (void) cache;
+    errno = ENOSYS;
+    return -1;
+#endif
+} // end open_miss_counter()
+
+
+static uint64_t read_counter(int fd)
+{
+    uint64_t value = 0;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+        return 0;
+    return value;
+} // end read_counter()
+
+
+// The last element in x's group, or in the catalog if there are no groups.
+static exp_elt_t synth_last(exp_elt_t x, uint64_t group)
+{
+    if (0 == group)
+        return (exp_elt_t) BE.num_elts;
+    const uint64_t last = ((x - 1) / group + 1) * group;
+    return (exp_elt_t) (last < BE.num_elts ? last : BE.num_elts);
+} // end synth_last()
+
+
+// Build a synthetic valence model laid out exactly like the valence cache: for each x, its y's sorted ascending in bb,
+// and for each y, its x's sorted ascending in bb_ds. Each x gets 0..2*density valences with y > x. With a group size,
+// the y's come from x's own group of that many elements instead of the whole catalog, and then the ids get shuffled
+// the way normalize.sh hands them out, so the groups are there but not in the ids.
+static void synth_model(bench_model_t *m, uint32_t density, uint64_t group, uint64_t *rng)
+{
+    const uint64_t num_elts = BE.num_elts;
+    const uint32_t max_per_x = 2 * density + 1;
+    uint32_t *ys = bench_calloc(max_per_x, sizeof(uint32_t), "the synthetic y list");
+    uint32_t *counts = bench_calloc(num_elts + 1, sizeof(uint32_t), "the synthetic counts");
+    uint64_t total = 0;
+    exp_elt_t x, y;
+
+    // Decide how many valences each x gets so we know how much to allocate.
+    for (x = 1; x <= num_elts; x++)
+    {
+        uint64_t c = bench_rand(rng) % max_per_x;
+        if (c > synth_last(x, group) - x) c = synth_last(x, group) - x;
+        counts[x] = (uint32_t) c;
+        total += c;
+    }
+
+    const uint64_t rows = SEG_ROWS(num_elts);
+    m->bb = model_calloc(total > 0 ? total : 1, sizeof(valence_t), "bb");
+    m->bind_seg = model_calloc(SEG_ENTRIES(num_elts), sizeof(seg_ptr_t), "bind_seg");
+    m->bind_seg_ds = model_calloc(SEG_ENTRIES(num_elts), sizeof(seg_ptr_t), "bind_seg_ds");
+    uint8_t *page = seg_page_array(total, "bind_seg");
+
+    // Fill bb. Duplicate y's get dropped so each x,y pair shows up once.
+    uint64_t offset = 0;
+    for (x = 1; x <= num_elts; x++)
+    {
+        const uint32_t c = counts[x];
+        uint32_t kept = 0;
+
+        for (uint32_t i = 0; i < c; i++)
+            ys[i] = x + 1 + (uint32_t) (bench_rand(rng) % (synth_last(x, group) - x));
+        qsort(ys, c, sizeof(uint32_t), u32cmp);
+
+        SET_SEG(m->bind_seg[x], offset);
+        for (uint32_t i = 0; i < c; i++)
+        {
+            if (i > 0 && ys[i] == ys[i - 1]) continue;
+            SETELT(m->bb[offset + kept].eltid, ys[i]);
+            m->bb[offset + kept].soindex = (uint8_t) bench_rand(rng);
+            if (NULL != page)
+                page[offset + kept] = (uint8_t) (ys[i] >> ELT_PAGE_BITS);
+            kept++;
+        }
+        offset += kept;
+    }
+    SET_SEG(m->bind_seg[num_elts + 1], offset);
+    m->num_valences = offset;
+    seg_add_pages(&m->bind_seg, rows, page, "bind_seg");
+    free(page);
+
+    // Count the x's in each y's row, then lay out bb_ds.
+    seg_walk_t walk;
+    uint64_t start, stop;
+    exp_elt_t base;
+    uint64_t *next = bench_calloc(rows, sizeof(uint64_t), "the bb_ds fill positions");
+    for (x = 1; x <= num_elts; x++)
+    {
+        seg_walk_start(&walk, m->bind_seg, rows, x, GET_SEG(m->bind_seg[x + 1]));
+        while (seg_walk_next(&walk, &start, &stop, &base))
+            for (uint64_t v = start; v < stop; v++)
+                next[base | GET_ELT(m->bb[v].eltid)]++;
+    }
+
+    offset = 0;
+    for (uint64_t row = 0; row < rows; row++)
+    {
+        const uint64_t c = next[row];
+        SET_SEG(m->bind_seg_ds[row], offset);
+        next[row] = offset;
+        offset += c;
+    }
+
+    // Going through the x's in order leaves each y's row sorted by x.
+    m->bb_ds = model_calloc(m->num_valences > 0 ? m->num_valences : 1, sizeof(valence_t), "bb_ds");
+    page = seg_page_array(m->num_valences, "bind_seg_ds");
+    for (x = 1; x <= num_elts; x++)
+    {
+        seg_walk_start(&walk, m->bind_seg, rows, x, GET_SEG(m->bind_seg[x + 1]));
+        while (seg_walk_next(&walk, &start, &stop, &base))
+            for (uint64_t v = start; v < stop; v++)
+            {
+                const uint64_t to = next[base | GET_ELT(m->bb[v].eltid)]++;
+                SETELT(m->bb_ds[to].eltid, x);
+                m->bb_ds[to].soindex = m->bb[v].soindex;
+                if (NULL != page)
+                    page[to] = (uint8_t) (x >> ELT_PAGE_BITS);
+            }
+    }
+    seg_add_pages(&m->bind_seg_ds, rows, page, "bind_seg_ds");
+    free(page);
+
+    // Slopes and offsets in tenths, same units as the compressed slope/offset file.
+    m->tiny_slopes = bench_calloc(NUM_SO_BUCKETS, sizeof(int8_t), "the tiny slopes");
+    m->tiny_slopes_inv = bench_calloc(NUM_SO_BUCKETS, sizeof(double), "the inverse tiny slopes");
+    m->tiny_offsets = bench_calloc(NUM_SO_BUCKETS, sizeof(int8_t), "the tiny offsets");
+    for (int i = 0; i < NUM_SO_BUCKETS; i++)
+    {
+        m->tiny_slopes[i] = (int8_t) (4 + i);
+        m->tiny_slopes_inv[i] = 1.0 / m->tiny_slopes[i];
+        m->tiny_offsets[i] = (int8_t) (-60 + 8 * i);
+    }
+
+    m->pop = bench_calloc(num_elts + 1, sizeof(popularity_t), "pop");
+    for (x = 1; x <= num_elts; x++)
+        m->pop[x] = (popularity_t) (LOWEST_POP_NUMBER + bench_rand(rng) % HIGHEST_POP_NUMBER);
+
+    free(next);
+    free(counts);
+    free(ys);
+
+    if (0 == group)
+        return;
+
+    // Shuffle the ids.
+    exp_elt_t *shuffle = bench_calloc(num_elts + 1, sizeof(exp_elt_t), "the id shuffle");
+    for (x = 1; x <= num_elts; x++)
+        shuffle[x] = x;
+    for (x = (exp_elt_t) num_elts; x > 1; x--)
+    {
+        const exp_elt_t other = 1 + (exp_elt_t) (bench_rand(rng) % x);
+        y = shuffle[x];
+        shuffle[x] = shuffle[other];
+        shuffle[other] = y;
+    }
+
+    valence_t *bb = model_calloc(m->num_valences + 1, sizeof(valence_t), "the shuffled bb");
+    valence_t *bb_ds = model_calloc(m->num_valences + 1, sizeof(valence_t), "the shuffled bb_ds");
+    seg_ptr_t *bind_seg = model_calloc(SEG_ENTRIES(num_elts), sizeof(seg_ptr_t), "the shuffled bind_seg");
+    seg_ptr_t *bind_seg_ds = model_calloc(SEG_ENTRIES(num_elts), sizeof(seg_ptr_t), "the shuffled bind_seg_ds");
+    relabel_adjacency(bb, &bind_seg, m->bb, m->bind_seg, shuffle);
+    relabel_adjacency(bb_ds, &bind_seg_ds, m->bb_ds, m->bind_seg_ds, shuffle);
+    huge_free(m->bb);
+    huge_free(m->bind_seg);
+    huge_free(m->bb_ds);
+    huge_free(m->bind_seg_ds);
+    m->bb = bb;
+    m->bind_seg = bind_seg;
+    m->bb_ds = bb_ds;
+    m->bind_seg_ds = bind_seg_ds;
+    free(shuffle);
+} // end synth_model()
+
+
+// Load the real valence cache the same way recgen does and time each loader.
+static void load_model(bench_model_t *m)
+{
+    uint64_t start;
+
+    load_config_file();
+    populate_ncv();
+    m->num_valences = g_num_confident_valences;
+
+    // load_beast() checks the popularity splits against pop.out, so pop goes first.
+    start = now_ns();
+    if (!pop_load())
+        exit(EXIT_FAILURE);
+    printf("pop_load: %.1f ms\n", (double) (now_ns() - start) / 1e6);
+
+    start = now_ns();
+    if (!load_beast(LOAD_VALENCES_FROM_BEAST_EXPORT, true))
+        exit(EXIT_MEMLOAD);
+    printf("load_beast: %.1f ms\n", (double) (now_ns() - start) / 1e6);
+
+    start = now_ns();
+    if (!big_rat_load())
+        exit(EXIT_MEMLOAD);
+    printf("big_rat_load: %.1f ms\n", (double) (now_ns() - start) / 1e6);
+
+    if (perm_load())
+        printf("The valence cache's element ids were reordered by recgen -r.\n");
+
+    m->bb = bb_leash();
+    m->bind_seg = bind_seg_leash();
+    m->bb_ds = bb_ds_leash();
+    m->bind_seg_ds = bind_seg_ds_leash();
+    m->pop = pop_leash();
+    m->split = pop_split_leash();
+    m->split_ds = pop_split_ds_leash();
+    m->tiny_slopes = tiny_slopes_leash();
+    m->tiny_slopes_inv = tiny_slopes_inv_leash();
+    m->tiny_offsets = tiny_offsets_leash();
+} // end load_model()
+
+
+// Make up the ratings for one request. For a synthetic model, the number of ratings is log-uniform between 1 and
+// MAX_RATS_PER_PERSON so every rating count bucket gets requests. For a real cache, pick a real person. Either way the
+// ratings come out in the valence cache's element ids, like predictions() hands them to tally().
+static int make_request(bool real, uint64_t *rng, uint32_t *stamp, uint32_t request_id, rating_t ur[])
+{
+    int n = 0;
+
+    if (real)
+    {
+        const elt_rating_t *big_rat = big_rat_leash();
+        const uint64_t *big_rat_index = big_rat_index_leash();
+
+        // Find someone with ratings.
+        for (int tries = 0; tries < 1000 && 0 == n; tries++)
+        {
+            const uint32_t p = 1 + (uint32_t) (bench_rand(rng) % BE.num_people);
+            const uint64_t first = big_rat_index[p];
+            uint64_t num = big_rat_index[p + 1] - first;
+            if (num > MAX_RATS_PER_PERSON) num = MAX_RATS_PER_PERSON;
+            for (uint64_t i = 0; i < num; i++, n++)
+            {
+                ur[n].userid = p;
+                ur[n].elementid = elt_internal(big_rat[first + i].elementid);
+                ur[n].rating = big_rat[first + i].rating;
+            }
+        }
+        return n;
+    }
+
+    const double u = (double) (bench_rand(rng) >> 11) / 9007199254740992.0;
+    int wanted = (int) exp(u * log((double) MAX_RATS_PER_PERSON));
+    if (wanted < 1) wanted = 1;
+    if ((uint64_t) wanted > BE.num_elts) wanted = (int) BE.num_elts;
+
+    // stamp keeps a person from rating the same element twice.
+    while (n < wanted)
+    {
+        const uint32_t e = 1 + (uint32_t) (bench_rand(rng) % BE.num_elts);
+        if (stamp[e] == request_id) continue;
+        stamp[e] = request_id;
+        ur[n].userid = request_id;
+        ur[n].elementid = elt_internal(e);
+        ur[n].rating = (uint8_t) (1 + bench_rand(rng) % 32);
+        n++;
+    }
+    return n;
+} // end make_request()
+
+
+// How many valences will tally() walk for these ratings, and how many cache lines of the workingset will it write to?
+// line_stamp has a slot per workingset cache line, and request_id marks the lines this request touched. The lines
+// are a stand-in for cache misses that doesn't need hardware counters: each one is at least one miss once the
+// workingset is bigger than the cache.
+static uint64_t count_visited(const bench_model_t *m, const rating_t ur[], int n, popularity_t target_pop,
+                              uint32_t *line_stamp, uint32_t request_id, uint64_t *lines)
+{
+    uint64_t visited = 0;
+
+    *lines = 0;
+    for (int i = 0; i < n; i++)
+    {
+        for (int side = 0; side < 2; side++)
+        {
+            const valence_t *bb = side ? m->bb_ds : m->bb;
+            const seg_ptr_t *idx = side ? m->bind_seg_ds : m->bind_seg;
+            const pop_split_t *split = side ? m->split_ds : m->split;
+            seg_walk_t walk;
+            uint64_t start, stop;
+            exp_elt_t base;
+            seg_walk_start(&walk, idx, SEG_ROWS(BE.num_elts), ur[i].elementid,
+                           SEG_END(idx, split, ur[i].elementid, target_pop));
+            while (seg_walk_next(&walk, &start, &stop, &base))
+                for (uint64_t v = start; v < stop; v++, visited++)
+                {
+                    const uint64_t y = base | GET_ELT(bb[v].eltid);
+                    const uint64_t line = (y - 1) * sizeof(prediction_t) / BENCH_CACHE_LINE;
+                    if (line_stamp[line] != request_id)
+                    {
+                        line_stamp[line] = request_id;
+                        (*lines)++;
+                    }
+                }
+        }
+    }
+    return visited;
+} // end count_visited()
+
+
+static int rating_bucket(int num_ratings)
+{
+    if (num_ratings <= 10) return 0;
+    if (num_ratings <= 50) return 1;
+    if (num_ratings <= 200) return 2;
+    if (num_ratings <= 1000) return 3;
+    return 4;
+} // end rating_bucket()
+
+
+static double gbps(double bytes, uint64_t ns)
+{
+    return ns ? bytes / (double) ns : 0.0;  // bytes per ns is GB/s
+} // end gbps()
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-c | -e num_elts -v valences_per_elt [-g group_size]] [-u num_requests] [-k num_recs] [-s seed] [-a | -z]"
+                    " [-r rcm|pop] [-o target_pop] [-m none|thp|hugetlb] [-n node] [-q entries]\n", name);
+    fprintf(stderr, "    -c    use the real valence cache and ratings from the bemorehuman config instead of a "
+                    "synthetic model\n");
+    fprintf(stderr, "    -a    time tally_unified() over the unified adjacency instead of tally()\n");
+    fprintf(stderr, "    -z    time tally_packed() over the packed adjacency instead of tally()\n");
+    fprintf(stderr, "    -g    give a synthetic model groups of elements that share valences, with shuffled ids\n");
+    fprintf(stderr, "    -r    reorder the element ids the way recgen -r does before timing\n");
+    fprintf(stderr, "    -o    ask for recs in popularity buckets 1..target_pop only, with the rows partitioned by "
+                    "popularity\n");
+    fprintf(stderr, "    -m    back the model and workingset with 4 KB pages, transparent huge pages (the default) or "
+                    "hugetlbfs pages\n");
+    fprintf(stderr, "    -n    run the requests on this NUMA node, wherever the model was built, and count remote "
+                    "loads\n");
+    fprintf(stderr, "    -q    keep the recs in a result cache of that many entries, ask again, and check that it hit. "
+                    "With at least twice as many entries as requests, any eviction is an error\n");
+    exit(EXIT_FAILURE);
+} // end usage()
+
+
+int main(int argc, char **argv)
+{
+    bool real = false;
+    bool unified = false;
+    bool packed = false;
+    int ordering = 0;
+    int run_node = -1;
+    popularity_t target_pop = HIGHEST_POP_NUMBER;
+    uint64_t num_elts = BENCH_DEFAULT_ELTS;
+    uint32_t density = BENCH_DEFAULT_DENSITY;
+    uint64_t group = 0;
+    uint32_t num_users = BENCH_DEFAULT_USERS;
+    int num_recs = RECS_BUCKET_SIZE;
+    uint64_t cache_entries = 0;
+    uint64_t rng = 42;
+    int opt;
+
+    openlog(LOG_MODULE_STRING, LOG_PID, LOG_LOCAL0);
+    setlogmask(LOG_UPTO(LOG_WARNING));
+
+    while ((opt = getopt(argc, argv, "ace:g:k:m:n:o:q:r:s:u:v:z")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': // for "adjacency"
+                unified = true;
+                break;
+            case 'c': // for "cache"
+                real = true;
+                break;
+            case 'e': // for "elements"
+                num_elts = strtoull(optarg, NULL, 10);
+                if (num_elts < 2 || num_elts > MAX_ELTS)
+                {
+                    printf("Error: the argument for -e should be between 2 and %u instead of %s. Exiting.\n",
+                           MAX_ELTS, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'g': // for "group size"
+                group = strtoull(optarg, NULL, 10);
+                break;
+            case 'k': // for "number of recs"
+                num_recs = (int) strtol(optarg, NULL, 10);
+                if (num_recs < 1 || num_recs > MAX_PREDS_PER_PERSON)
+                {
+                    printf("Error: the argument for -k should be between 1 and %d instead of %s. Exiting.\n",
+                           MAX_PREDS_PER_PERSON, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm': // for "memory pages"
+                g_huge_pages = parse_huge_pages(optarg);
+                if (g_huge_pages < 0)
+                {
+                    printf("Error: the argument for -m should be none, thp or hugetlb instead of %s. Exiting.\n",
+                           optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n': // for "NUMA node"
+                run_node = (int) strtol(optarg, NULL, 10);
+                if (run_node < 0)
+                {
+                    printf("Error: the argument for -n should be a NUMA node number instead of %s. Exiting.\n",
+                           optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'o': // for "obscurity"
+                target_pop = (popularity_t) strtoul(optarg, NULL, 10);
+                if (target_pop < LOWEST_POP_NUMBER || target_pop > HIGHEST_POP_NUMBER)
+                {
+                    printf("Error: the argument for -o should be between %d and %d instead of %s. Exiting.\n",
+                           LOWEST_POP_NUMBER, HIGHEST_POP_NUMBER, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q': // for "query cache"
+                cache_entries = strtoull(optarg, NULL, 10);
+                break;
+            case 'r': // for "reorder"
+                ordering = parse_elt_order(optarg);
+                if (0 == ordering)
+                {
+                    printf("Error: the argument for -r should be rcm or pop instead of %s. Exiting.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's': // for "seed"
+                rng = strtoull(optarg, NULL, 10);
+                break;
+            case 'u': // for "users"
+                num_users = (uint32_t) strtoul(optarg, NULL, 10);
+                if (num_users < 1)
+                {
+                    printf("Error: the argument for -u should be > 0 instead of %s. Exiting.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'v': // for "valences per element"
+                density = (uint32_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'z': // for "packed"
+                packed = true;
+                break;
+            default:
+                usage(argv[0]);
+        } // end switch
+    } // end while
+
+    bench_model_t m;
+    memset(&m, 0, sizeof(m));
+    uint64_t start = now_ns();
+
+    if (real)
+    {
+        load_model(&m);
+    }
+    else
+    {
+        BE.num_elts = num_elts;
+        synth_model(&m, density, group, &rng);
+        printf("synthetic model built in %.1f ms\n", (double) (now_ns() - start) / 1e6);
+    }
+
+    printf("Model: %" PRIu64 " elements, %" PRIu64 " valences (%.1f MB each for bb and bb_ds)\n",
+           BE.num_elts, m.num_valences, (double) (m.num_valences * sizeof(valence_t)) / 1e6);
+
+    if (ordering)
+    {
+        // Relabel the model like recgen -r would, and translate the requests through the new ids too, so the same
+        // seed asks for the same elements with and without -r.
+        start = now_ns();
+        exp_elt_t *to_internal = order_elements(ordering, m.bb, m.bind_seg, m.bb_ds, m.bind_seg_ds);
+        valence_t *bb = model_calloc(m.num_valences + 1, sizeof(valence_t), "the reordered bb");
+        valence_t *bb_ds = model_calloc(m.num_valences + 1, sizeof(valence_t), "the reordered bb_ds");
+        seg_ptr_t *bind_seg = model_calloc(SEG_ENTRIES(BE.num_elts), sizeof(seg_ptr_t), "the reordered bind_seg");
+        seg_ptr_t *bind_seg_ds = model_calloc(SEG_ENTRIES(BE.num_elts), sizeof(seg_ptr_t), "the reordered bind_seg_ds");
+        relabel_adjacency(bb, &bind_seg, m.bb, m.bind_seg, to_internal);
+        relabel_adjacency(bb_ds, &bind_seg_ds, m.bb_ds, m.bind_seg_ds, to_internal);
+        m.bb = bb;
+        m.bind_seg = bind_seg;
+        m.bb_ds = bb_ds;
+        m.bind_seg_ds = bind_seg_ds;
+
+        // A real cache may have been reordered already, so catalog ids go through that permutation and then this one.
+        exp_elt_t *composed = bench_calloc(BE.num_elts + 1, sizeof(exp_elt_t), "the element permutation");
+        for (uint64_t e = 0; e <= BE.num_elts; e++)
+            composed[e] = to_internal[elt_internal((exp_elt_t) e)];
+        free(to_internal);
+        perm_install(composed);
+        printf("Reordered element ids with %s in %.1f ms\n", ELT_ORDER_RCM == ordering ? "rcm" : "pop",
+               (double) (now_ns() - start) / 1e6);
+
+        // The relabelled rows are in eltid order, so any popularity splits loaded with the cache are stale.
+        m.split = m.split_ds = NULL;
+    }
+
+    if (target_pop < HIGHEST_POP_NUMBER && (NULL == m.split || NULL == m.split_ds))
+    {
+        // Partition the rows the way recgen -c and recgen -d do.
+        start = now_ns();
+        popularity_t *pop = pop_internal(m.pop);
+        m.split = partition_by_pop(m.bb, &m.bind_seg, pop, "the popularity splits");
+        m.split_ds = partition_by_pop(m.bb_ds, &m.bind_seg_ds, pop, "the popularity splits");
+        free(pop);
+        printf("Partitioned the rows by popularity in %.1f ms\n", (double) (now_ns() - start) / 1e6);
+    }
+    if (target_pop < HIGHEST_POP_NUMBER)
+        printf("Popularity: recs from buckets %d..%d of %d\n", LOWEST_POP_NUMBER, target_pop, HIGHEST_POP_NUMBER);
+
+    if (packed)
+    {
+        start = now_ns();
+        if (!pack_adjacency(&m.packed, m.bb, m.bind_seg, m.bb_ds, m.bind_seg_ds))
+            exit(EXIT_MEMLOAD);
+        const double packed_mb = (double) (2 * m.num_valences + m.packed.key_bytes) / 1e6;
+        printf("Layout: packed adjacency, %.1f MB instead of %.1f MB, built in %.1f ms\n", packed_mb,
+               (double) (2 * m.num_valences * sizeof(valence_t)) / 1e6, (double) (now_ns() - start) / 1e6);
+    }
+    else if (unified)
+    {
+        start = now_ns();
+        m.bb_uni = model_calloc(2 * m.num_valences + 1, sizeof(valence_t), "bb_uni");
+        m.bind_seg_uni = model_calloc(UNI_SEG_ENTRIES(BE.num_elts), sizeof(seg_ptr_t), "bind_seg_uni");
+        unify_adjacency(m.bb_uni, &m.bind_seg_uni, m.bb, m.bind_seg, m.bb_ds, m.bind_seg_ds);
+        printf("Layout: unified adjacency, built in %.1f ms\n", (double) (now_ns() - start) / 1e6);
+    }
+    else
+    {
+        printf("Layout: bb and bb_ds\n");
+    }
+
+    // create_pcrs() runs once per valence load, but time it anyway so changes to it show up.
+    start = now_ns();
+    for (int i = 0; i < BENCH_PCR_REPS; i++)
+        create_pcrs(m.tiny_slopes, m.tiny_slopes_inv, m.tiny_offsets);
+    printf("create_pcrs: %.0f ns per call\n", (double) (now_ns() - start) / BENCH_PCR_REPS);
+
+    // Move to the NUMA node -n asked for before the workingset is allocated. The model stays where it was built, so
+    // running once on its node and once on another shows what recgen -n saves.
+    const void *model_mem = packed ? (const void *) m.packed.keys : unified ? (const void *) m.bb_uni
+                                                                             : (const void *) m.bb;
+    if (run_node >= 0)
+    {
+        if (!numa_pin_to_node(run_node))
+        {
+            printf("Error: can't run on NUMA node %d; this machine has %d. Exiting.\n", run_node, numa_num_nodes());
+            exit(EXIT_FAILURE);
+        }
+        printf("NUMA: the model is on node %d and the requests run on node %d\n", numa_node_of(model_mem), run_node);
+    }
+
+    create_workingset(BE.num_elts);
+    huge_report();
+    result_cache_init(cache_entries);
+
+    const int tlb_fd = open_miss_counter(PERF_COUNT_HW_CACHE_DTLB);
+    if (tlb_fd < 0)
+        printf("dTLB misses won't be counted: perf_event_open: %s\n", strerror(errno));
+    const int node_fd = numa_num_nodes() > 1 ? open_miss_counter(PERF_COUNT_HW_CACHE_NODE) : -1;
+    if (numa_num_nodes() > 1 && node_fd < 0)
+        printf("Remote NUMA loads won't be counted: perf_event_open: %s\n", strerror(errno));
+    printf("\n");
+
+    rating_t *ur = bench_calloc(BE.num_elts > MAX_RATS_PER_PERSON ? BE.num_elts : MAX_RATS_PER_PERSON,
+                                sizeof(rating_t), "the request ratings");
+    uint32_t *stamp = bench_calloc(BE.num_elts + 1, sizeof(uint32_t), "the request stamps");
+    const uint64_t ws_lines = BE.num_elts * sizeof(prediction_t) / BENCH_CACHE_LINE + 1;
+    uint32_t *line_stamp = bench_calloc(ws_lines, sizeof(uint32_t), "the cache line stamps");
+    bench_sample_t *samples = bench_calloc(num_users, sizeof(bench_sample_t), "the samples");
+    prediction_t *recs = bench_calloc((size_t) num_recs, sizeof(prediction_t), "the recs");
+
+    for (uint32_t u = 0; u < num_users + BENCH_WARMUP_USERS; u++)
+    {
+        const int n = make_request(real, &rng, stamp, u + 1, ur);
+        if (0 == n) continue;
+
+        const uint64_t ratings_hash = result_cache_hash(ur, n);
+        const uint64_t tlb_before = read_counter(tlb_fd);
+        const uint64_t node_before = read_counter(node_fd);
+        const uint64_t t0 = now_ns();
+        init_workingset(BE.num_elts);
+        const uint64_t t1 = now_ns();
+        if (packed)
+            tally_packed(&m.packed, n, ur);
+        else if (unified)
+            tally_unified(m.bb_uni, m.bind_seg_uni, m.split, m.split_ds, target_pop, n, ur);
+        else
+            tally(m.bb, m.bind_seg, m.bb_ds, m.bind_seg_ds, m.split, m.split_ds, target_pop, n, ur);
+        const uint64_t t2 = now_ns();
+        composite(BE.num_elts);
+        const uint64_t t3 = now_ns();
+        top_recs(recs, num_recs, target_pop, m.pop);
+        const uint64_t t4 = now_ns();
+        const uint64_t tlb_after = read_counter(tlb_fd);
+        const uint64_t node_after = read_counter(node_fd);
+        if (RECS_BUCKET_SIZE == num_recs)
+            result_cache_put(u + 1, target_pop, ratings_hash, recs);
+
+        if (u < BENCH_WARMUP_USERS) continue;
+
+        bench_sample_t *s = &samples[u - BENCH_WARMUP_USERS];
+        s->num_ratings = n;
+        s->tlb_misses = tlb_after - tlb_before;
+        s->node_misses = node_after - node_before;
+        s->ratings_hash = ratings_hash;
+        s->visited = count_visited(&m, ur, n, packed ? HIGHEST_POP_NUMBER : target_pop, line_stamp, u + 1, &s->lines);
+        s->ns[STAGE_INIT] = t1 - t0;
+        s->ns[STAGE_TALLY] = t2 - t1;
+        s->ns[STAGE_COMPOSITE] = t3 - t2;
+        s->ns[STAGE_TOPK] = t4 - t3;
+    }
+
+    // Per-stage totals.
+    uint64_t stage_ns[NUM_STAGES] = { 0, 0, 0, 0 }, all_ns = 0, visited = 0, lines = 0, tlb_misses = 0, timed = 0;
+    uint64_t node_misses = 0;
+    for (uint32_t u = 0; u < num_users; u++)
+    {
+        if (0 == samples[u].num_ratings) continue;
+        timed++;
+        visited += samples[u].visited;
+        lines += samples[u].lines;
+        tlb_misses += samples[u].tlb_misses;
+        node_misses += samples[u].node_misses;
+        for (int st = 0; st < NUM_STAGES; st++)
+        {
+            stage_ns[st] += samples[u].ns[st];
+            all_ns += samples[u].ns[st];
+        }
+    }
+    if (0 == timed)
+    {
+        printf("ERROR: no requests had any ratings. Exiting.\n");
+        exit(EXIT_NULLRATS);
+    }
+
+    printf("%" PRIu64 " requests, %d recs each\n", timed, num_recs);
+    printf("%-16s %12s %8s %10s\n", "stage", "mean us", "share", "GB/s");
+    const double ws_bytes = (double) BE.num_elts * sizeof(prediction_t);
+    const double stage_bytes[NUM_STAGES] =
+    {
+        ws_bytes * (double) timed,                          // init writes the workingset
+        (double) visited * sizeof(valence_t),               // tally streams the valences
+        2.0 * ws_bytes * (double) timed,                    // composite reads & writes the workingset
+        0.0                                                 // the sort isn't bandwidth bound
+    };
+    for (int st = 0; st < NUM_STAGES; st++)
+    {
+        printf("%-16s %12.1f %7.1f%%", stage_names[st], (double) stage_ns[st] / (double) timed / 1e3,
+               100.0 * (double) stage_ns[st] / (double) all_ns);
+        if (stage_bytes[st] > 0)
+            printf(" %10.2f\n", gbps(stage_bytes[st], stage_ns[st]));
+        else
+            printf(" %10s\n", "-");
+    }
+    printf("\ntally: %" PRIu64 " valences visited, %.2f ns per valence visited\n", visited,
+           visited ? (double) stage_ns[STAGE_TALLY] / (double) visited : 0.0);
+    printf("tally: %.1f of the %" PRIu64 " workingset cache lines written per request, %.2f valences per line\n",
+           (double) lines / (double) timed, ws_lines, lines ? (double) visited / (double) lines : 0.0);
+    if (tlb_fd >= 0)
+        printf("dTLB load misses: %.1f per request, %.2f per 1000 valences visited\n",
+               (double) tlb_misses / (double) timed, visited ? 1000.0 * (double) tlb_misses / (double) visited : 0.0);
+    if (node_fd >= 0)
+        printf("Remote NUMA loads: %.1f per request, %.2f per 1000 valences visited\n",
+               (double) node_misses / (double) timed,
+               visited ? 1000.0 * (double) node_misses / (double) visited : 0.0);
+    printf("\n");
+
+    // Latency distribution of the whole request by rating count.
+    printf("%-10s %8s %14s %10s %10s %10s %10s\n", "ratings", "requests", "mean valences", "p50 us", "p90 us",
+           "p99 us", "max us");
+    uint64_t *lat = bench_calloc(num_users, sizeof(uint64_t), "the latencies");
+    for (int b = 0; b < BENCH_NUM_RATING_BUCKETS; b++)
+    {
+        uint64_t num = 0, bucket_visited = 0;
+        for (uint32_t u = 0; u < num_users; u++)
+        {
+            if (0 == samples[u].num_ratings || rating_bucket(samples[u].num_ratings) != b) continue;
+            lat[num++] = samples[u].ns[STAGE_INIT] + samples[u].ns[STAGE_TALLY] + samples[u].ns[STAGE_COMPOSITE]
+                         + samples[u].ns[STAGE_TOPK];
+            bucket_visited += samples[u].visited;
+        }
+        if (0 == num) continue;
+
+        qsort(lat, num, sizeof(uint64_t), u64cmp);
+        printf("%-10s %8" PRIu64 " %14.0f %10.1f %10.1f %10.1f %10.1f\n", bucket_names[b], num,
+               (double) bucket_visited / (double) num,
+               (double) lat[(num - 1) / 2] / 1e3, (double) lat[(uint64_t) ((double) (num - 1) * 0.9)] / 1e3,
+               (double) lat[(uint64_t) ((double) (num - 1) * 0.99)] / 1e3, (double) lat[num - 1] / 1e3);
+    }
+
+    free(lat);
+
+    // Ask for every timed request again. Each one should come from the result cache, and with it at most half full
+    // nothing should have been evicted to make room.
+    result_cache_stats_t before;
+    if (result_cache_stats(&before))
+    {
+        start = now_ns();
+        for (uint32_t u = 0; u < num_users; u++)
+            if (0 != samples[u].num_ratings)
+                result_cache_get(u + BENCH_WARMUP_USERS + 1, target_pop, samples[u].ratings_hash, recs);
+        const uint64_t get_ns = now_ns() - start;
+        result_cache_stats_t after;
+        result_cache_stats(&after);
+        printf("\nResult cache: %" PRIu64 " of %" PRIu64 " entries used, %" PRIu64 " evictions, %" PRIu64
+               " of %" PRIu64 " repeats hit, %.0f ns per lookup\n", after.used, after.capacity, after.evictions,
+               after.hits - before.hits, timed, (double) get_ns / (double) timed);
+        const uint64_t keys = (uint64_t) num_users + BENCH_WARMUP_USERS;
+        if (RECS_BUCKET_SIZE != num_recs)
+            printf("Result cache: not filled, since it only keeps %d recs per request\n", RECS_BUCKET_SIZE);
+        else if (2 * keys <= after.capacity && (after.evictions > 0 || after.hits - before.hits < timed))
+        {
+            printf("ERROR: %" PRIu64 " requests in a result cache of %" PRIu64 " entries shouldn't evict. "
+                   "Exiting.\n", keys, after.capacity);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    free(recs);
+    free(samples);
+    free(line_stamp);
+    free(stamp);
+    free(ur);
+    if (tlb_fd >= 0)
+        close(tlb_fd);
+    if (node_fd >= 0)
+        close(node_fd);
+    closelog();
+
+    return 0;
+} // end main()
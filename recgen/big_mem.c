@@ -37,16 +37,19 @@
 //
 
 size_t g_num_confident_valences; // The number of valences we're confident about.
+bool g_unified_adjacency = false; // Serve from the bb_uni instead of the bb and bb_ds. See recgen -u.
 
 // These guys are static because we want them in the bss segment. Pass around pointers as needed.
 static popularity_t *g_pop = NULL;        // this is the popularity of the things to be recommended -- used for obscurity filtering
 static valence_t *g_bb = NULL;            // this is the combined Beast & Beast index (bind), or bb
-static bb_ind_t *g_bind_seg = NULL;       // fixed x locations which are the offsets of the X's in the bb
+static seg_ptr_t *g_bind_seg = NULL;      // fixed x locations which are the offsets of the X's in the bb
 static valence_t *g_bb_ds = NULL;         // this is the combined Beast & bind, or bb for the DS (Differently Sorted)
-static bb_ind_t *g_bind_seg_ds = NULL;    // fixed y locations which are the offsets of the Y's in the bb_ds
+static seg_ptr_t *g_bind_seg_ds = NULL;   // fixed y locations which are the offsets of the Y's in the bb_ds
+static valence_t *g_bb_uni = NULL;        // the bb_ds and bb segments of each element side by side, or NULL
+static seg_ptr_t *g_bind_seg_uni = NULL;  // two offsets per element into the bb_uni
 static valence_xy_t *g_bb_ds_temp = NULL; // this is the combined Beast & bind, or bb for the DS (Differently Sorted), temp version for DS creation
-static rating_t *g_big_rat = NULL;        // this is the valgen-outputted user ratings
-static uint32_t *g_big_rat_index = NULL;  // this is a person index into g_big_rat
+static elt_rating_t *g_big_rat = NULL;    // this is the valgen-outputted user ratings, grouped by person
+static uint64_t *g_big_rat_index = NULL;  // this is a person index into g_big_rat: person p is [index[p], index[p + 1])
 
 // forward declaration
 static int pull_from_files(bool);
@@ -59,6 +62,99 @@ static int8_t g_tiny_offsets[NUM_SO_BUCKETS];
 
 static uint64_t g_valence_count = 0;
 
+
+// Turn per-row valence counts into a CSR row pointer array, where row r is [idx[r], idx[r + 1]).
+// counts and idx both have SEG_ROWS(BE.num_elts) entries.
+static void counts_to_seg_index(seg_ptr_t *idx, const uint64_t *counts)
+{
+    uint64_t offset = 0;
+    for (uint64_t r = 0; r < SEG_ROWS(BE.num_elts); r++)
+    {
+        SET_SEG(idx[r], offset);
+        offset += counts[r];
+    }
+    if (offset > SEG_MAX_OFFSET)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: %" PRIu64 " valences is more than a segment index can address.", offset);
+        exit(-1);
+    }
+} // end counts_to_seg_index()
+
+
+// Write a segment index, header first.
+static void write_seg_index(const char *filename, const seg_ptr_t *idx)
+{
+    FILE *val_out = fopen(filename,"w");
+    assert(NULL != val_out);
+
+    seg_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, VALENCES_SEG_MAGIC, sizeof(VALENCES_SEG_MAGIC));
+    header.version = VALENCES_SEG_VERSION;
+    header.elt_pages = (uint32_t) ELT_PAGES(BE.num_elts);
+    header.num_elts = BE.num_elts;
+    header.num_valences = GET_SEG(idx[SEG_ROWS(BE.num_elts) - 1]);
+    header.num_entries = seg_index_entries(idx, SEG_ROWS(BE.num_elts));
+    fwrite(&header, sizeof(header), 1, val_out);
+
+    const size_t num_written = fwrite(idx, sizeof(seg_ptr_t), header.num_entries, val_out);
+    syslog(LOG_INFO, "Number of segment offsets written to %s: %zu and we expected %" PRIu64 " to be written.",
+           filename, num_written, header.num_entries);
+    fclose(val_out);
+} // end write_seg_index()
+
+
+// Read a segment index written by write_seg_index() and check it matches the valences we have. The index is as big
+// as its page directory needs, so we allocate it here.
+static seg_ptr_t *read_seg_index(const char *filename, const char *what)
+{
+    FILE *val_out = fopen(filename,"r");
+    assert(NULL != val_out);
+
+    seg_header_t header;
+    if (fread(&header, sizeof(header), 1, val_out) != 1
+        || memcmp(header.magic, VALENCES_SEG_MAGIC, sizeof(VALENCES_SEG_MAGIC)) != 0
+        || header.version != VALENCES_SEG_VERSION
+        || header.elt_pages != ELT_PAGES(header.num_elts))
+    {
+        syslog(LOG_ERR, "FATAL ERROR: %s is from an older valence cache. Run recgen -c and recgen -d again.", filename);
+        exit(-1);
+    }
+    if (header.num_elts != BE.num_elts || header.num_valences != g_num_confident_valences)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: %s has %" PRIu64 " elements and %" PRIu64 " valences but we expected %" PRIu64
+               " and %zu. Run recgen -c and recgen -d again.", filename, header.num_elts, header.num_valences,
+               BE.num_elts, g_num_confident_valences);
+        exit(-1);
+    }
+
+    if (header.num_entries < SEG_ENTRIES(BE.num_elts))
+    {
+        syslog(LOG_ERR, "FATAL ERROR: %s is truncated. Run recgen -c and recgen -d again.", filename);
+        exit(-1);
+    }
+    seg_ptr_t *idx = (seg_ptr_t *) huge_calloc((size_t) header.num_entries, sizeof(seg_ptr_t), what);
+    if (NULL == idx)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when loading %s.", filename);
+        exit(EXIT_MEMLOAD);
+    }
+
+    const size_t num_read = fread(idx, sizeof(seg_ptr_t), header.num_entries, val_out);
+    syslog(LOG_INFO, "Number of segment offsets read from %s: %zu and we expected %" PRIu64 " to be read.",
+           filename, num_read, header.num_entries);
+    fclose(val_out);
+    const uint64_t paged = GET_SEG(idx[SEG_ROWS(BE.num_elts)]);
+    if (num_read != header.num_entries || paged > header.num_entries / 2
+        || SEG_ROWS(BE.num_elts) + 2 * paged + 2 > header.num_entries
+        || seg_index_entries(idx, SEG_ROWS(BE.num_elts)) != header.num_entries)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: %s is truncated. Run recgen -c and recgen -d again.", filename);
+        exit(-1);
+    }
+    return idx;
+} // end read_seg_index()
+
 // Begin DS sorting and population implementation.
 
 //
@@ -67,17 +163,10 @@ static uint64_t g_valence_count = 0;
 //
 static int valence_cmp(const void* p1, const void* p2)
 {
-    valence_xy_t a, b;
-
-    ASSIGN(a, (*(const valence_xy_t *) p1));
-    ASSIGN(b, (*(const valence_xy_t *) p2));
-    
-    exp_elt_t exp_a_elt1, exp_a_elt2;
-    exp_elt_t exp_b_elt1, exp_b_elt2;
-    EXPAND((a.x), exp_a_elt1);
-    EXPAND((a.eltid), exp_a_elt2);
-    EXPAND((b.x), exp_b_elt1);
-    EXPAND((b.eltid), exp_b_elt2);
+    const exp_elt_t exp_a_elt1 = ((const valence_xy_t *) p1)->x;
+    const exp_elt_t exp_a_elt2 = ((const valence_xy_t *) p1)->eltid;
+    const exp_elt_t exp_b_elt1 = ((const valence_xy_t *) p2)->x;
+    const exp_elt_t exp_b_elt2 = ((const valence_xy_t *) p2)->eltid;
 
     // Is a < b?
     if ((exp_a_elt2 < exp_b_elt2) || ((exp_a_elt2 == exp_b_elt2) && (exp_a_elt1 < exp_b_elt1)))
@@ -111,7 +200,7 @@ static void quicksort_iterative(valence_xy_t array[], uint64_t len)
         for (; left+1 < len; len++)
         {                // sort left to len-1
             if (pos == MAX_STACK) len = stack[pos = 0];  // stack overflow, reset
-            ASSIGN(pivot, array[left+seed%(len-left)]);  // pick random pivot
+            pivot = array[left+seed%(len-left)];         // pick random pivot
             seed = seed*69069+1;                         // next pseudorandom number
             stack[pos++] = len;                          // sort right part later
             for (uint64_t right = left-1; ; )
@@ -122,9 +211,9 @@ static void quicksort_iterative(valence_xy_t array[], uint64_t len)
                 while (valence_cmp(&pivot, &(array[--len])) < 0) {}    // look for smaller element
                 if (right >= len) break;                 // partition point found?
 
-                ASSIGN(temp, array[right]);
-                ASSIGN(array[right], array[len]);        // the only swap
-                ASSIGN(array[len], temp);
+                temp = array[right];
+                array[right] = array[len];               // the only swap
+                array[len] = temp;
             } // end for loop partitioned, continue left part
         } // end for
         if (pos == 0) break;                             // stack empty?
@@ -142,59 +231,47 @@ static void populate_ds()
     // We are creating the DS at this point so pass in true.
     pull_from_files(true);
 
-    // Walk the g_bind_seg_ds and initialize the whole thing.
-    for (uint64_t i = 0; i <= BE.num_elts; i++)
-    {
-        g_bind_seg_ds[i].count = 0;
-        g_bind_seg_ds[i].offset = UINT64_MAX;
-    }
-
     // Sort the DS_temp.
     quicksort_iterative(g_bb_ds_temp,  g_num_confident_valences);
 
     syslog(LOG_INFO, "Finished with quicksort_iterative()");
 
     // Create the ds which needs to be copied from the ds_temp.
-    g_bb_ds = (valence_t *) calloc(g_num_confident_valences, sizeof(valence_t));
+    g_bb_ds = (valence_t *) huge_calloc(g_num_confident_valences, sizeof(valence_t), "bb_ds");
     if (g_bb_ds == 0)
     {
         syslog(LOG_ERR, "FATAL ERROR: Out of memory when creating bb_ds prior to exporting it.");
         exit (-1);
     }
 
-    // Create the bind_seg_ds.
-    g_bind_seg_ds = (bb_ind_t *) calloc((unsigned long) BE.num_elts, sizeof(bb_ind_t));
-    if (g_bind_seg_ds == 0)
+    // How many valences does each y have? These become g_bind_seg_ds, and the page of each x its page directory.
+    uint64_t *counts = calloc((size_t) SEG_ROWS(BE.num_elts), sizeof(uint64_t));
+    uint8_t *page = seg_page_array(g_num_confident_valences, "bind_seg_ds");
+    if (counts == 0)
     {
-        syslog(LOG_ERR, "FATAL ERROR: Out of memory when creating bind_seg_ds prior to exporting it.");
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when counting valences for bind_seg_ds.");
         exit (-1);
     }
 
-    // Walk the bb_ds_temp to create the g_bb_ds and set the g_bind_seg_ds properly.
-    exp_elt_t exp_id_2, prev_exp_id_2 = 0;
+    // Walk the bb_ds_temp to create the g_bb_ds and count the y's for g_bind_seg_ds.
     for (uint64_t i = 0; i < g_num_confident_valences; i++)
     {
         // Create the g_bb_ds.
+        const exp_elt_t exp_id_1 = g_bb_ds_temp[i].x;
         g_bb_ds[i].soindex = g_bb_ds_temp[i].soindex;
-        g_bb_ds[i].eltid[0] = g_bb_ds_temp[i].x[0];
-        g_bb_ds[i].eltid[1] = g_bb_ds_temp[i].x[1];
-        g_bb_ds[i].eltid[2] = g_bb_ds_temp[i].x[2];
-
-        // Now create the g_bind_seg_ds.
-        EXPAND(g_bb_ds_temp[i].eltid, exp_id_2);
-
-        // Create an index of y-value starting positions in BeastDS.
-        if (exp_id_2 != prev_exp_id_2)
-        {
-            // Need to do the below bit (num_elts - 1) times.
-            g_bind_seg_ds[exp_id_2].offset = i;
-            prev_exp_id_2 = exp_id_2;
-        }
+        SETELT(g_bb_ds[i].eltid, exp_id_1);
 
-        // add to count
-        g_bind_seg_ds[exp_id_2].count++;
+        // bb_ds_temp is sorted by y and then x, so each y's valences are together and in page order.
+        counts[g_bb_ds_temp[i].eltid]++;
+        if (NULL != page)
+            page[i] = (uint8_t) (exp_id_1 >> ELT_PAGE_BITS);
 
     } // end for loop over valences
+
+    counts_to_seg_index(g_bind_seg_ds, counts);
+    seg_add_pages(&g_bind_seg_ds, SEG_ROWS(BE.num_elts), page, "bind_seg_ds");
+    free(counts);
+    free(page);
     
     free (g_bb_ds_temp);
     
@@ -282,14 +359,8 @@ static void pull_from_beast_export()
     strlcpy(file_to_open, BE.valence_cache_dir, sizeof(file_to_open));
     strlcat(file_to_open, "/", sizeof(file_to_open));
     strlcat(file_to_open, VALENCES_BB_SEG, sizeof(file_to_open));
-    val_out = fopen(file_to_open,"r");
-    assert(NULL != val_out);
-
-    num_valences_read = fread(g_bind_seg, sizeof(bb_ind_t), BE.num_elts, val_out);
-    syslog(LOG_INFO, "Number of valence segment starts read from bin file: %lu and we expected %" PRIu64 " to be read.",
-           num_valences_read, BE.num_elts);
-    fclose(val_out);
-    assert(num_valences_read == BE.num_elts);
+    huge_free(g_bind_seg);
+    g_bind_seg = read_seg_index(file_to_open, "bind_seg");
 
     // Read the bb_ds
     strlcpy(file_to_open, BE.valence_cache_dir, sizeof(file_to_open));
@@ -308,14 +379,8 @@ static void pull_from_beast_export()
     strlcpy(file_to_open, BE.valence_cache_dir, sizeof(file_to_open));
     strlcat(file_to_open, "/", sizeof(file_to_open));
     strlcat(file_to_open, VALENCES_BB_SEG_DS, sizeof(file_to_open));
-    val_out = fopen(file_to_open,"r");
-    assert(NULL != val_out);
-
-    num_valences_read = fread(g_bind_seg_ds, sizeof(bb_ind_t), BE.num_elts, val_out);
-    syslog(LOG_INFO, "Number of valence segment starts read from DS bin file: %lu and we expected %" PRIu64 " to be read.",
-           num_valences_read, BE.num_elts);
-    fclose(val_out);
-    assert(num_valences_read == BE.num_elts);
+    huge_free(g_bind_seg_ds);
+    g_bind_seg_ds = read_seg_index(file_to_open, "bind_seg_ds");
 
     // debugging
     /*
@@ -334,8 +399,8 @@ static void pull_from_beast_export()
         uint8_t so1, so2;
         
         // print out some bb values
-        EXPAND(g_bb[i].eltid, ee1);
-        EXPAND(g_bb_ds[i].eltid, ee2);
+        ee1 = GET_ELT(g_bb[i].eltid);
+        ee2 = GET_ELT(g_bb_ds[i].eltid);
         so1 = g_bb[i].soindex;
         so2 = g_bb_ds[i].soindex;
         
@@ -351,6 +416,15 @@ static void pull_from_beast_export()
 } // end pullFromBeastExport()
 
 
+// Read an element id from valences.out. Anything that doesn't fit in an exp_elt_t comes back as 0, which
+// pull_from_files() rejects along with the other ids that aren't in the catalog.
+static exp_elt_t parse_eltid(const char *token)
+{
+    const unsigned long long id = strtoull(token, NULL, 10);
+    return id > MAX_ELTS ? 0 : (exp_elt_t) id;
+} // end parse_eltid()
+
+
 // Load the valence file (human-readable data that can go into a db easily) to memory and returns 0 on success or 1 on error.
 // Parameter createDS: are we creating the DS structure? We need to know b/c we populate a different structure if so.
 static int pull_from_files(bool createDS)
@@ -360,13 +434,25 @@ static int pull_from_files(bool createDS)
     char filename[strlen(BE.working_dir) + 16];
     g_valence_count = 0;
 
-    // Walk the bind_seg and initialize it.
-    for (i = 0; i <= BE.num_elts; i++)
+    // Element ids have to fit in 32 bits. Past 2^24 their top bits go in the page directory of the segment index.
+    if (BE.num_elts > MAX_ELTS)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: %" PRIu64 " elements is more than the %u the valence cache can hold.",
+               BE.num_elts, MAX_ELTS);
+        exit(-1);
+    }
+    const uint64_t pages = ELT_PAGES(BE.num_elts);
+
+    // How many valences does each x have? These become g_bind_seg, and the page of each y its page directory.
+    uint64_t *counts = calloc((size_t) SEG_ROWS(BE.num_elts), sizeof(uint64_t));
+    uint8_t *page = createDS ? NULL : seg_page_array(g_num_confident_valences, "bind_seg");
+    if (counts == 0)
     {
-        g_bind_seg[i].count = 0;
-        g_bind_seg[i].offset = UINT64_MAX;
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when counting valences for bind_seg.");
+        exit(-1);
     }
-    syslog(LOG_INFO, "BE.num_elts is %" PRIu64, BE.num_elts);
+    syslog(LOG_INFO, "BE.num_elts is %" PRIu64 ", which takes %" PRIu64 " page(s) of 2^%d element ids.",
+           BE.num_elts, pages, ELT_PAGE_BITS);
 
     syslog(LOG_INFO, "BE.valence_files_dir is ---%s---", BE.working_dir);
     strlcpy(filename, BE.working_dir, sizeof(filename));
@@ -385,7 +471,8 @@ static int pull_from_files(bool createDS)
     ssize_t line_length;
     const char delimiter[4] = ",";
     char *token;
-    exp_elt_t id_1 = 0, id_2 = 0, prev_id_1 = 0;
+    exp_elt_t id_1 = 0, id_2 = 0;
+    uint64_t prev_row = 0;
     double slope = 0, offset = 0 ;
     signed char tiny_slope, tiny_offset;
     bool found = false;
@@ -440,10 +527,10 @@ static int pull_from_files(bool createDS)
             switch (token_number)
             {
                 case 0:   // elt1
-                    id_1 = (exp_elt_t ) strtol(token, NULL, 10);
+                    id_1 = parse_eltid(token);
                     break;
                 case 1:   // elt2
-                    id_2 = (exp_elt_t ) strtol(token, NULL, 10);
+                    id_2 = parse_eltid(token);
                     break;
                 case 2:   // numpairs
                     break;
@@ -900,10 +987,10 @@ static int pull_from_files(bool createDS)
             switch (token_number)
             {
                 case 0:   // elt1
-                    id_1 = (exp_elt_t ) strtol(token, NULL, 10);
+                    id_1 = parse_eltid(token);
                     break;
                 case 1:   // elt2
-                    id_2 = (exp_elt_t ) strtol(token, NULL, 10);
+                    id_2 = parse_eltid(token);
                     break;
                 case 2:   // numpairs
                     break;
@@ -924,7 +1011,7 @@ static int pull_from_files(bool createDS)
 
         // Set the y element value in the bb.
         if (createDS)
-            SETELT(g_bb_ds_temp[g_valence_count].eltid, id_2);
+            g_bb_ds_temp[g_valence_count].eltid = id_2;
         else
             SETELT(g_bb[g_valence_count].eltid, id_2);
 
@@ -990,17 +1077,28 @@ static int pull_from_files(bool createDS)
 
         // If we're filling up the g_bb_ds_temp, then set the x value.
         if (createDS)
-            COMPACT(g_bb_ds_temp[g_valence_count].x, id_1);
+            g_bb_ds_temp[g_valence_count].x = id_1;
 
-        // Create an index of x-value starting positions in Beast.
-        if (id_1 != prev_id_1)
+        // The segment index needs each x's valences together and in page order, and valgen writes them sorted by x
+        // and then y.
+        if (id_1 < 1 || id_1 > BE.num_elts || id_2 < 1 || id_2 > BE.num_elts)
+        {
+            syslog(LOG_ERR, "FATAL ERROR: valence (%u, %u) in valences.out isn't within the %" PRIu64 " elements.",
+                   id_1, id_2, BE.num_elts);
+            exit(-1);
+        }
+        const uint64_t row = ((uint64_t) id_1 << 8) | (id_2 >> ELT_PAGE_BITS);
+        if (row < prev_row)
         {
-            g_bind_seg[id_1].offset = g_valence_count;
-            prev_id_1 = id_1;
+            syslog(LOG_ERR, "FATAL ERROR: valences.out isn't sorted by x and then y at valence (%u, %u).", id_1, id_2);
+            exit(-1);
         }
+        prev_row = row;
 
         // add to count in bind_seg
-        g_bind_seg[id_1].count++;
+        counts[id_1]++;
+        if (NULL != page)
+            page[g_valence_count] = (uint8_t) (id_2 >> ELT_PAGE_BITS);
 
         g_valence_count++;
 
@@ -1012,6 +1110,11 @@ static int pull_from_files(bool createDS)
     syslog(LOG_INFO, "g_valence_count is %" PRIu64, g_valence_count);
     free(line);
     fclose(fp);
+
+    counts_to_seg_index(g_bind_seg, counts);
+    seg_add_pages(&g_bind_seg, SEG_ROWS(BE.num_elts), page, "bind_seg");
+    free(counts);
+    free(page);
     return 0;
 } // end pullFromFiles()
 
@@ -1032,6 +1135,9 @@ void export_beast()
         exit(-1);
     }
 
+    // Sort each row by popularity bucket so requests with a target popularity can stop early.
+    pop_split_export(g_bb, &g_bind_seg, POP_SPLIT_BB);
+
     FILE *val_out = fopen(filename,"w");
 
     assert(NULL != val_out);
@@ -1044,12 +1150,7 @@ void export_beast()
     strlcpy(filename, BE.valence_cache_dir, sizeof(filename));
     strlcat(filename, "/", sizeof(filename));
     strlcat(filename, VALENCES_BB_SEG, sizeof(filename));
-    val_out = fopen(filename,"w");
-    assert(NULL != val_out);
-    num_valences_written = fwrite(g_bind_seg, sizeof(bb_ind_t), BE.num_elts, val_out);
-    syslog(LOG_INFO, "Number of valence segment starts written to bin file: %lu and we expected %" PRIu64 " to be written.",
-           num_valences_written, BE.num_elts);
-    fclose(val_out);
+    write_seg_index(filename, g_bind_seg);
 } // end exportBeast()
 
 
@@ -1069,6 +1170,9 @@ void export_ds()
         exit(-1);
     }
 
+    // Sort each row by popularity bucket so requests with a target popularity can stop early.
+    pop_split_export(g_bb_ds, &g_bind_seg_ds, POP_SPLIT_BB_DS);
+
     FILE *val_out = fopen(filename,"w");
 
     assert(NULL != val_out);
@@ -1081,12 +1185,7 @@ void export_ds()
     strlcpy(filename, BE.valence_cache_dir, sizeof(filename));
     strlcat(filename, "/", sizeof(filename));
     strlcat(filename, VALENCES_BB_SEG_DS, sizeof(filename));
-    val_out = fopen(filename,"w");
-    assert(NULL != val_out);
-    num_valences_written = fwrite(g_bind_seg_ds, sizeof(bb_ind_t), BE.num_elts, val_out);
-    syslog(LOG_INFO, "Number of valence segment starts written to DS bin file: %lu and we expected %" PRIu64 " to be written.",
-           num_valences_written, BE.num_elts);
-    fclose(val_out);
+    write_seg_index(filename, g_bind_seg_ds);
 } // end exportDS()
 
 
@@ -1249,6 +1348,222 @@ static void load_so_compressed()
 } // end compressed slope/offset loading
 
 
+// Get the num_confident_valences.
+void populate_ncv()
+{
+    // Get the num_confident_valences from a flat file.
+    char filename[strlen(BE.working_dir) + strlen(NUM_CONF_OUTFILE) + 2];
+    strlcpy(filename, BE.working_dir, sizeof(filename));
+    strlcat(filename, "/", sizeof(filename));
+    strlcat(filename, NUM_CONF_OUTFILE, sizeof(filename));
+
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+    {
+        printf("Can't open file %s. Exiting.\n", filename);
+        exit(1);
+    }
+
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t line_length;
+    while ((line_length = getline(&line, &line_capacity, fp)) != -1)
+    {
+        // Is the file coming from linux/unix or pre Mac OSX?
+        if (line_length && (line[line_length - 1] == '\n' || line[line_length - 1] == '\r'))
+            line[--line_length] = '\0';
+        // Is the file coming from windows?
+        if (line_length && (line[line_length - 1] == '\r'))
+            line[--line_length] = '\0';
+
+        // Convert line to a size_t.
+        g_num_confident_valences = (size_t) strtol(line, NULL, 10);
+        syslog(LOG_INFO, "num_confident_valences is %lu", g_num_confident_valences);
+    }
+    free(line);
+    fclose(fp);
+} // end populate_ncv()
+
+
+// Lay out bb_uni from the bb and bb_ds: for each element, its bb_ds row and then its bb row. uni needs room for twice
+// the valences and *uni_seg for UNI_SEG_ENTRIES(BE.num_elts) offsets. It moves if its page directory needs more.
+void unify_adjacency(valence_t *uni, seg_ptr_t **uni_seg, const valence_t *bb, const seg_ptr_t *bind_seg,
+                     const valence_t *bb_ds, const seg_ptr_t *bind_seg_ds)
+{
+    const uint64_t num_valences = GET_SEG(bind_seg[SEG_ROWS(BE.num_elts) - 1]);
+    uint8_t *page = seg_page_array(2 * num_valences, "bind_seg_uni");
+    uint64_t offset = 0;
+    uint64_t row = 0;
+    for (uint64_t e = 0; e <= BE.num_elts; e++)
+    {
+        for (int side = 0; side < 2; side++, row++)
+        {
+            const valence_t *src = side ? bb : bb_ds;
+            const seg_ptr_t *idx = side ? bind_seg : bind_seg_ds;
+            const uint64_t start = GET_SEG(idx[e]);
+            const uint64_t count = GET_SEG(idx[e + 1]) - start;
+            SET_SEG((*uni_seg)[row], offset);
+            memcpy(&uni[offset], &src[start], count * sizeof(valence_t));
+
+            seg_walk_t walk;
+            uint64_t run_start, run_stop;
+            exp_elt_t base;
+            seg_walk_start(&walk, idx, SEG_ROWS(BE.num_elts), e, start + count);
+            while (NULL != page && seg_walk_next(&walk, &run_start, &run_stop, &base))
+                memset(&page[offset + run_start - start], (int) (base >> ELT_PAGE_BITS), run_stop - run_start);
+            offset += count;
+        }
+    }
+    SET_SEG((*uni_seg)[row], offset);
+    seg_add_pages(uni_seg, UNI_SEG_ROWS(BE.num_elts), page, "bind_seg_uni");
+    free(page);
+} // end unify_adjacency()
+
+
+typedef struct
+{
+    exp_elt_t eltid;
+    uint8_t soindex;
+} relabel_item_t;
+
+
+static int itemcmp(const void *p1, const void *p2)
+{
+    const exp_elt_t a = ((const relabel_item_t *) p1)->eltid;
+    const exp_elt_t b = ((const relabel_item_t *) p2)->eltid;
+    return (a > b) - (a < b);
+} // end itemcmp()
+
+
+// Relabel an adjacency (bb or bb_ds) with to_internal[old id] = new id. Element e's valences move to element
+// to_internal[e], each valence's eltid is relabelled too, and each row is sorted by eltid again. out needs room for
+// as many valences as bb, and *out_seg for SEG_ENTRIES(BE.num_elts) offsets. It moves if its page directory needs
+// more.
+void relabel_adjacency(valence_t *out, seg_ptr_t **out_seg, const valence_t *bb, const seg_ptr_t *bind_seg,
+                       const exp_elt_t *to_internal)
+{
+    const uint64_t rows = SEG_ROWS(BE.num_elts);
+    const uint64_t num_valences = GET_SEG(bind_seg[rows - 1]);
+    uint64_t *next = calloc((size_t) rows, sizeof(uint64_t));
+    relabel_item_t *item = calloc(num_valences + 1, sizeof(relabel_item_t));
+    uint8_t *page = seg_page_array(num_valences, "the relabelled bind_seg");
+    if (NULL == next || NULL == item)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when relabelling the valences.");
+        exit(-1);
+    }
+
+    // Count the valences in each new row, then turn the counts into the new index.
+    for (uint64_t e = 1; e <= BE.num_elts; e++)
+        next[to_internal[e]] += GET_SEG(bind_seg[e + 1]) - GET_SEG(bind_seg[e]);
+    counts_to_seg_index(*out_seg, next);
+
+    // Fill the new rows with whole ids.
+    for (uint64_t r = 0; r < rows; r++)
+        next[r] = GET_SEG((*out_seg)[r]);
+    for (uint64_t e = 1; e <= BE.num_elts; e++)
+    {
+        seg_walk_t walk;
+        uint64_t start, stop;
+        exp_elt_t base;
+        seg_walk_start(&walk, bind_seg, rows, e, GET_SEG(bind_seg[e + 1]));
+        while (seg_walk_next(&walk, &start, &stop, &base))
+            for (uint64_t v = start; v < stop; v++)
+            {
+                relabel_item_t *to = &item[next[to_internal[e]]++];
+                to->eltid = to_internal[base | GET_ELT(bb[v].eltid)];
+                to->soindex = bb[v].soindex;
+            }
+    }
+    free(next);
+
+    // The new ids within a row come out in the old order, so sort each row so tally() walks it in address order.
+    for (uint64_t r = 0; r + 1 < rows; r++)
+    {
+        const uint64_t start = GET_SEG((*out_seg)[r]);
+        const uint64_t count = GET_SEG((*out_seg)[r + 1]) - start;
+        if (count > 1)
+            qsort(&item[start], count, sizeof(relabel_item_t), itemcmp);
+    }
+    for (uint64_t v = 0; v < num_valences; v++)
+    {
+        SETELT(out[v].eltid, item[v].eltid);
+        out[v].soindex = item[v].soindex;
+        if (NULL != page)
+            page[v] = (uint8_t) (item[v].eltid >> ELT_PAGE_BITS);
+    }
+    free(item);
+    seg_add_pages(out_seg, rows, page, "the relabelled bind_seg");
+    free(page);
+} // end relabel_adjacency()
+
+
+// Relabel whichever of the bb and bb_ds are loaded with relabel_adjacency(). For a moment we hold both copies.
+void relabel_beast(const exp_elt_t *to_internal)
+{
+    valence_t **bbs[2] = { &g_bb, &g_bb_ds };
+    seg_ptr_t **segs[2] = { &g_bind_seg, &g_bind_seg_ds };
+
+    for (int side = 0; side < 2; side++)
+    {
+        if (NULL == *bbs[side])
+            continue;
+
+        valence_t *out = (valence_t *) huge_calloc(g_num_confident_valences + 1, sizeof(valence_t),
+                                                   side ? "bb_ds" : "bb");
+        seg_ptr_t *out_seg = (seg_ptr_t *) huge_calloc((size_t) SEG_ENTRIES(BE.num_elts), sizeof(seg_ptr_t),
+                                                       side ? "bind_seg_ds" : "bind_seg");
+        if (NULL == out || NULL == out_seg)
+        {
+            syslog(LOG_ERR, "FATAL ERROR: Out of memory when relabelling the valences.");
+            exit(-1);
+        }
+        relabel_adjacency(out, &out_seg, *bbs[side], *segs[side], to_internal);
+
+        huge_free(*bbs[side]);
+        huge_free(*segs[side]);
+        *bbs[side] = out;
+        *segs[side] = out_seg;
+    }
+} // end relabel_beast()
+
+
+// Replace the bb, bb_ds and their bind_segs with the bb_uni and bind_seg_uni. For a moment we hold both.
+static bool load_unified()
+{
+    g_bb_uni = (valence_t *) huge_calloc(2 * g_num_confident_valences, sizeof(valence_t), "bb_uni");
+    if (g_bb_uni == 0)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when creating bb_uni.");
+        return (false);
+    }
+
+    g_bind_seg_uni = (seg_ptr_t *) huge_calloc(UNI_SEG_ENTRIES(BE.num_elts), sizeof(seg_ptr_t), "bind_seg_uni");
+    if (g_bind_seg_uni == 0)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when creating bind_seg_uni.");
+        return (false);
+    }
+
+    unify_adjacency(g_bb_uni, &g_bind_seg_uni, g_bb, g_bind_seg, g_bb_ds, g_bind_seg_ds);
+
+    huge_free(g_bb);
+    huge_free(g_bind_seg);
+    huge_free(g_bb_ds);
+    huge_free(g_bind_seg_ds);
+    g_bb = g_bb_ds = NULL;
+    g_bind_seg = g_bind_seg_ds = NULL;
+
+#ifdef linux
+    // Seriously free the mem. Looking at you glibc.
+    malloc_trim(0);
+#endif
+
+    syslog(LOG_INFO, "Using the unified adjacency: %zu bytes for bb_uni.", 2 * sizeof(valence_t) * g_num_confident_valences);
+    return (true);
+} // end load_unified()
+
+
 // Load valences from valgen output or beast output depending on passed-in read method.
 bool  load_beast(int read_method, bool ds_load)
 {
@@ -1264,25 +1579,41 @@ bool  load_beast(int read_method, bool ds_load)
     // Elsewhere, we're already blocking the access to g_bb, so we don't need to worry about that here.
     if (NULL != g_bb)
     {
-        free(g_bb);
-        if (NULL != g_bind_seg) free(g_bind_seg);
+        huge_free(g_bb);
+        if (NULL != g_bind_seg) huge_free(g_bind_seg);
 
 #ifdef linux
         // Seriously free the mem. Looking at you glibc.
         malloc_trim(0);
 #endif
     }
+    if (NULL != g_bb_uni)
+    {
+        huge_free(g_bb_uni);
+        huge_free(g_bind_seg_uni);
+        g_bb_uni = NULL;
+        g_bind_seg_uni = NULL;
+    }
+
+    // The packed cache replaces the bb and bb_ds, so we only need the slopes and offsets alongside it.
+    if (LOAD_VALENCES_FROM_PACKED == read_method)
+    {
+        g_bb = NULL;
+        g_bind_seg = NULL;
+        load_so_compressed();
+        return packed_load();
+    }
 
     // Create the bb.
-    g_bb = (valence_t *) calloc(g_num_confident_valences, sizeof(valence_t));
+    g_bb = (valence_t *) huge_calloc(g_num_confident_valences, sizeof(valence_t), "bb");
     if (g_bb == 0)
     {
         syslog(LOG_ERR, "FATAL ERROR: Out of memory when creating bb.");
         return (false);
     }
 
-    // Create the bind_seg. +1 b/c indexing starts at 1
-    g_bind_seg = (bb_ind_t *) calloc((unsigned long) BE.num_elts + 1, sizeof(bb_ind_t));
+    // Create the bind_seg. One row per element, plus the end of the last row and an empty page directory.
+    g_bind_seg = (seg_ptr_t *) huge_calloc((unsigned long) SEG_ENTRIES(BE.num_elts), sizeof(seg_ptr_t), "bind_seg");
     if (g_bind_seg == 0)
     {
         syslog(LOG_ERR, "FATAL ERROR: Out of memory when creating bind_seg.");
@@ -1293,22 +1624,23 @@ bool  load_beast(int read_method, bool ds_load)
     {
         if (NULL != g_bb_ds)
         {
-            free(g_bb_ds);
-            if (NULL != g_bind_seg_ds) free(g_bind_seg_ds);
+            huge_free(g_bb_ds);
+            if (NULL != g_bind_seg_ds) huge_free(g_bind_seg_ds);
 #ifdef linux
             // Seriously free the mem. Looking at you glibc.
             malloc_trim(0);
 #endif
         }
         // Create the bb_ds.
-        g_bb_ds = (valence_t *) calloc(g_num_confident_valences, sizeof(valence_t));
+        g_bb_ds = (valence_t *) huge_calloc(g_num_confident_valences, sizeof(valence_t), "bb_ds");
         if (g_bb_ds == 0)
         {
             syslog(LOG_ERR, "FATAL ERROR: Out of memory when creating bb_ds.");
             return (false);
         }
-        // Create the bind_seg_ds. +1 b/c indexing starts at 1
-        g_bind_seg_ds = (bb_ind_t *) calloc((unsigned long) BE.num_elts + 1, sizeof(bb_ind_t));
+        // Create the bind_seg_ds. One row per element, plus the end of the last row and an empty page directory.
+        g_bind_seg_ds = (seg_ptr_t *) huge_calloc((unsigned long) SEG_ENTRIES(BE.num_elts), sizeof(seg_ptr_t),
+                                                  "bind_seg_ds");
         if (g_bind_seg_ds == 0)
         {
             syslog(LOG_ERR, "FATAL ERROR: Out of memory when creating bind_seg_ds.");
@@ -1328,6 +1660,11 @@ bool  load_beast(int read_method, bool ds_load)
         case LOAD_VALENCES_FROM_BEAST_EXPORT:
             load_so_compressed();
             pull_from_beast_export();
+            // The splits go with the bind_segs, so load them before the unified adjacency replaces those.
+            if (ds_load)
+                pop_split_load(g_bind_seg, g_bind_seg_ds);
+            if (ds_load && g_unified_adjacency)
+                return load_unified();
             break;
 
         default:
@@ -1353,15 +1690,15 @@ bool big_rat_load()
     }
 
     // Create the big_rat.
-    g_big_rat = (rating_t *) calloc(BE.num_ratings, sizeof(rating_t));
+    g_big_rat = (elt_rating_t *) calloc(BE.num_ratings, sizeof(elt_rating_t));
     if (g_big_rat == 0)
     {
         syslog(LOG_ERR, "FATAL ERROR: Out of memory when creating g_big_rat.");
         return (false);
     }
 
-    // Create the big_rat_index
-    g_big_rat_index = (uint32_t *) calloc(BE.num_people + 1, sizeof(uint32_t));
+    // Create the big_rat_index. +2 b/c ids start at 1 and the last person needs an end.
+    g_big_rat_index = (uint64_t *) calloc(BE.num_people + 2, sizeof(uint64_t));
     if (g_big_rat_index == 0)
     {
         syslog(LOG_ERR, "FATAL ERROR: Out of memory when creating g_big_rat_index.");
@@ -1379,7 +1716,7 @@ bool big_rat_load()
     FILE *rat_out = fopen(file_to_open,"r");
     assert(NULL != rat_out);
 
-    size_t num_ratings_read = fread(g_big_rat, sizeof(rating_t), BE.num_ratings, rat_out);
+    size_t num_ratings_read = fread(g_big_rat, sizeof(elt_rating_t), BE.num_ratings, rat_out);
     syslog(LOG_INFO, "Number of ratings read from bin file: %lu and we expected %lu to be read.",
            num_ratings_read, (unsigned long) BE.num_ratings);
     assert(num_ratings_read == BE.num_ratings);
@@ -1392,11 +1729,11 @@ bool big_rat_load()
     rat_out = fopen(file_to_open,"r");
     assert(NULL != rat_out);
 
-    num_ratings_read = fread(g_big_rat_index, sizeof(uint32_t), BE.num_people + 1, rat_out);
+    num_ratings_read = fread(g_big_rat_index, sizeof(uint64_t), BE.num_people + 2, rat_out);
     syslog(LOG_INFO, "Number of index locations read from bin file: %lu and we expected %" PRIu64 " to be read.",
-           num_ratings_read, BE.num_people + 1);
+           num_ratings_read, BE.num_people + 2);
     fclose(rat_out);
-    assert(num_ratings_read == BE.num_people + 1);
+    assert(num_ratings_read == BE.num_people + 2);
 
     return true;
 } // end big_rat_load()
@@ -1408,7 +1745,8 @@ bool create_ds()
     // Free the beast (if it exists) b/c we can't keep him in RAM at the same time as bb_ds.
     if (g_bb)
     {
-        free(g_bb);
+        huge_free(g_bb);
+        g_bb = NULL;
 
 #ifdef linux
         // Seriously free the mem. Looking at you glibc.
@@ -1424,16 +1762,17 @@ bool create_ds()
         return (false);
     }
 
-    // Create the bind_seg.
-    g_bind_seg = (bb_ind_t *) calloc((unsigned long) BE.num_elts, sizeof(bb_ind_t));
+    // Create the bind_seg. One row per element, plus the end of the last row and an empty page directory.
+    g_bind_seg = (seg_ptr_t *) huge_calloc((unsigned long) SEG_ENTRIES(BE.num_elts), sizeof(seg_ptr_t), "bind_seg");
     if (g_bind_seg == 0)
     {
         syslog(LOG_ERR, "FATAL ERROR: Out of memory when creating bind_seg.");
         return (false);
     }
 
-    // Create the bind_seg_ds.
-    g_bind_seg_ds = (bb_ind_t *) calloc((unsigned long) BE.num_elts, sizeof(bb_ind_t));
+    // Create the bind_seg_ds. One row per element, plus the end of the last row and an empty page directory.
+    g_bind_seg_ds = (seg_ptr_t *) huge_calloc((unsigned long) SEG_ENTRIES(BE.num_elts), sizeof(seg_ptr_t),
+                                              "bind_seg_ds");
     if (g_bind_seg_ds == 0)
     {
         syslog(LOG_ERR, "FATAL ERROR: Out of memory when creating bind_seg_ds.");
@@ -1447,30 +1786,47 @@ bool create_ds()
 } // end create_DS()
 
 
-// Create leashes to various structures.
+// Create leashes to various structures. With recgen -n, a pinned worker gets the copy of the model on its own node.
 valence_t *bb_leash()
 {
-    return (g_bb);
+    const model_replica_t *local = numa_replica();
+    return (NULL != local ? local->bb : g_bb);
 }
 
-bb_ind_t  *bind_seg_leash()
+seg_ptr_t *bind_seg_leash()
 {
-    return (g_bind_seg);
+    const model_replica_t *local = numa_replica();
+    return (NULL != local ? local->bind_seg : g_bind_seg);
 }
 
 valence_t *bb_ds_leash()
 {
-    return (g_bb_ds);
+    const model_replica_t *local = numa_replica();
+    return (NULL != local ? local->bb_ds : g_bb_ds);
+}
+
+seg_ptr_t *bind_seg_ds_leash()
+{
+    const model_replica_t *local = numa_replica();
+    return (NULL != local ? local->bind_seg_ds : g_bind_seg_ds);
+}
+
+valence_t *bb_uni_leash()
+{
+    const model_replica_t *local = numa_replica();
+    return (NULL != local ? local->bb_uni : g_bb_uni);
 }
 
-bb_ind_t  *bind_seg_ds_leash()
+seg_ptr_t *bind_seg_uni_leash()
 {
-    return (g_bind_seg_ds);
+    const model_replica_t *local = numa_replica();
+    return (NULL != local ? local->bind_seg_uni : g_bind_seg_uni);
 }
 
 popularity_t *pop_leash()
 {
-    return (g_pop);
+    const model_replica_t *local = numa_replica();
+    return (NULL != local ? local->pop : g_pop);
 }
 
 int8_t *tiny_slopes_leash()
@@ -1488,12 +1844,12 @@ int8_t *tiny_offsets_leash()
     return (g_tiny_offsets);
 }
 
-rating_t *big_rat_leash()
+elt_rating_t *big_rat_leash()
 {
     return (g_big_rat);
 }
 
-uint32_t *big_rat_index_leash()
+uint64_t *big_rat_index_leash()
 {
     return (g_big_rat_index);
 }
@@ -0,0 +1,290 @@
+// SPDX-FileCopyrightText: 2022 Brian Calhoun <brian@bemorehuman.org>
+//
+// SPDX-License-Identifier: MIT
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is furnished to do
+// so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// This file is part of bemorehuman. See https://bemorehuman.org
+
+#include "recgen.h"
+#include <sys/mman.h>
+
+//
+// This file allocates the big arrays tally() reads and writes, the valences, their segment indexes and the
+// workingsets, on 2 MB pages where it can.
+//
+// tally() jumps all over hundreds of MB of valences and the workingset, so with 4 KB pages nearly every access needs
+// a page walk. By default each array gets its own 2 MB-aligned mapping with madvise(MADV_HUGEPAGE), which asks the
+// kernel for transparent huge pages. recgen -l maps from the hugetlbfs pool with MAP_HUGETLB instead, which is
+// guaranteed 2 MB pages once vm.nr_hugepages reserves enough, and falls back to transparent huge pages when it
+// doesn't. Arrays under 2 MB stay on 4 KB pages. huge_report() says what each array actually got.
+//
+
+int g_huge_pages = HUGE_PAGES_THP;  // How to back the big arrays. See recgen -l.
+
+// Each mapping starts with one of these, so huge_free() knows its length and huge_report() can find it.
+typedef struct huge_region
+{
+    struct huge_region *prev;
+    struct huge_region *next;
+    const char *what;        // what the array is, for the report
+    size_t length;           // bytes mapped, including this header
+    size_t size;             // bytes asked for
+    int wanted;              // g_huge_pages when it was mapped
+    int backing;             // HUGE_PAGES_NONE, HUGE_PAGES_THP or HUGE_PAGES_HUGETLB
+    bool reported;
+} huge_region_t;
+
+#define HUGE_HEADER_SIZE 64  // the header rounded up to a cache line, so the array stays cache-line aligned
+
+static huge_region_t *g_regions = NULL;
+static pthread_mutex_t g_regions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static size_t round_up(size_t n, size_t to)
+{
+    return (n + to - 1) / to * to;
+} // end round_up()
+
+
+// Map length bytes on a HUGE_PAGE_SIZE boundary, so each 2 MB of it can be one huge page.
+static void *map_aligned(size_t length)
+{
+    uint8_t *raw = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == raw)
+        return NULL;
+
+    uint8_t *aligned = (uint8_t *) round_up((uintptr_t) raw, HUGE_PAGE_SIZE);
+    if (aligned > raw)
+        munmap(raw, (size_t) (aligned - raw));
+    if (aligned + length < raw + length + HUGE_PAGE_SIZE)
+        munmap(aligned + length, (size_t) (raw + HUGE_PAGE_SIZE - aligned));
+    return aligned;
+} // end map_aligned()
+
+
+// Like calloc(), but backed the way g_huge_pages says. Free it with huge_free(), never free(). what names the array
+// in huge_report(). Returns NULL if there's no memory for it.
+void *huge_calloc(size_t num, size_t size, const char *what)
+{
+    if (0 != size && num > (SIZE_MAX - 2 * HUGE_PAGE_SIZE) / size)
+        return NULL;
+
+    const size_t bytes = num * size + HUGE_HEADER_SIZE;
+    const size_t small_page = (size_t) sysconf(_SC_PAGESIZE);
+    huge_region_t *r = NULL;
+    size_t length = round_up(bytes, HUGE_PAGE_SIZE);
+    int backing = HUGE_PAGES_NONE;
+
+#ifdef MAP_HUGETLB
+    if (HUGE_PAGES_HUGETLB == g_huge_pages && bytes >= HUGE_PAGE_SIZE)
+    {
+        r = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (MAP_FAILED == r)
+            r = NULL;
+        else
+            backing = HUGE_PAGES_HUGETLB;
+    }
+#endif
+
+    if (NULL == r && HUGE_PAGES_NONE != g_huge_pages && bytes >= HUGE_PAGE_SIZE)
+    {
+        r = map_aligned(length);
+        if (NULL == r)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        if (0 == madvise(r, length, MADV_HUGEPAGE))
+        {
+            backing = HUGE_PAGES_THP;
+
+            // Fault each 2 MB in now, while the kernel can still hand out whole huge pages for it.
+            for (size_t off = 0; off < length; off += HUGE_PAGE_SIZE)
+                ((volatile uint8_t *) r)[off] = 0;
+        }
+#endif
+    }
+
+    if (NULL == r)
+    {
+        length = round_up(bytes, small_page);
+        r = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == r)
+            return NULL;
+#ifdef MADV_NOHUGEPAGE
+        // Keep "no huge pages" honest even when the kernel would give them out anyway.
+        if (HUGE_PAGES_NONE == g_huge_pages)
+            madvise(r, length, MADV_NOHUGEPAGE);
+#endif
+    }
+
+    // The mapping is already zeroed, like calloc() would.
+    r->what = what;
+    r->length = length;
+    r->size = num * size;
+    r->wanted = g_huge_pages;
+    r->backing = backing;
+    r->reported = false;
+
+    pthread_mutex_lock(&g_regions_lock);
+    r->prev = NULL;
+    r->next = g_regions;
+    if (NULL != g_regions)
+        g_regions->prev = r;
+    g_regions = r;
+    pthread_mutex_unlock(&g_regions_lock);
+
+    return (uint8_t *) r + HUGE_HEADER_SIZE;
+} // end huge_calloc()
+
+
+void huge_free(void *p)
+{
+    if (NULL == p)
+        return;
+
+    huge_region_t *r = (huge_region_t *) ((uint8_t *) p - HUGE_HEADER_SIZE);
+    pthread_mutex_lock(&g_regions_lock);
+    if (NULL != r->prev)
+        r->prev->next = r->next;
+    else
+        g_regions = r->next;
+    if (NULL != r->next)
+        r->next->prev = r->prev;
+    pthread_mutex_unlock(&g_regions_lock);
+
+    munmap(r, r->length);
+} // end huge_free()
+
+
+// The size huge_calloc() was asked for, or 0 for NULL.
+size_t huge_size(const void *p)
+{
+    if (NULL == p)
+        return 0;
+    return ((const huge_region_t *) ((const uint8_t *) p - HUGE_HEADER_SIZE))->size;
+} // end huge_size()
+
+
+// Turn "none", "thp" or "hugetlb" into a HUGE_PAGES_ value. Anything else is -1.
+int parse_huge_pages(const char *name)
+{
+    if (0 == strcmp(name, "none")) return HUGE_PAGES_NONE;
+    if (0 == strcmp(name, "thp")) return HUGE_PAGES_THP;
+    if (0 == strcmp(name, "hugetlb")) return HUGE_PAGES_HUGETLB;
+    return -1;
+} // end parse_huge_pages()
+
+
+static const char *backing_name(int backing)
+{
+    switch (backing)
+    {
+        case HUGE_PAGES_HUGETLB:
+            return "2 MB hugetlbfs pages";
+        case HUGE_PAGES_THP:
+            return "transparent huge pages";
+        default:
+            return "4 KB pages";
+    }
+} // end backing_name()
+
+
+// How many bytes of transparent huge pages back the THP regions, from the AnonHugePages of each mapping in
+// /proc/self/smaps that overlaps one. Call with g_regions_lock held. Returns false if there's no smaps to read.
+static bool thp_bytes(uint64_t *bytes)
+{
+    FILE *fp = fopen("/proc/self/smaps", "r");
+    if (NULL == fp)
+        return (false);
+
+    char line[512];
+    bool overlaps = false;
+    *bytes = 0;
+    while (NULL != fgets(line, sizeof(line), fp))
+    {
+        uintptr_t start, end;
+        unsigned long long kb;
+        if (2 == sscanf(line, "%" SCNxPTR "-%" SCNxPTR " ", &start, &end))
+        {
+            overlaps = false;
+            for (const huge_region_t *r = g_regions; NULL != r && !overlaps; r = r->next)
+                overlaps = HUGE_PAGES_THP == r->backing && (uintptr_t) r < end && (uintptr_t) r + r->length > start;
+        }
+        else if (overlaps && 1 == sscanf(line, "AnonHugePages: %llu kB", &kb))
+        {
+            *bytes += kb * 1024;
+        }
+    }
+    fclose(fp);
+    return (true);
+} // end thp_bytes()
+
+
+// Log the backing of each array allocated since the last report, then a summary of all of them.
+void huge_report()
+{
+    uint64_t mapped[HUGE_PAGES_HUGETLB + 1] = { 0, 0, 0 };
+    int count[HUGE_PAGES_HUGETLB + 1] = { 0, 0, 0 };
+    int short_of_pool = 0;
+    bool any_new = false;
+
+    pthread_mutex_lock(&g_regions_lock);
+    for (huge_region_t *r = g_regions; NULL != r; r = r->next)
+    {
+        const bool fell_back = HUGE_PAGES_HUGETLB == r->wanted && HUGE_PAGES_HUGETLB != r->backing
+                               && r->size + HUGE_HEADER_SIZE >= HUGE_PAGE_SIZE;
+        mapped[r->backing] += r->length;
+        count[r->backing]++;
+        short_of_pool += fell_back;
+        if (r->reported)
+            continue;
+        any_new = true;
+        r->reported = true;
+        if (fell_back)
+            syslog(LOG_WARNING, "WARNING: %s: %.1f MB on %s because the hugetlbfs pool is too small. Raise "
+                   "vm.nr_hugepages.", r->what, (double) r->size / 1e6, backing_name(r->backing));
+        else
+            syslog(LOG_INFO, "%s: %.1f MB on %s.", r->what, (double) r->size / 1e6, backing_name(r->backing));
+    }
+
+    uint64_t thp = 0;
+    const bool have_thp = count[HUGE_PAGES_THP] > 0 && thp_bytes(&thp);
+    pthread_mutex_unlock(&g_regions_lock);
+
+    if (!any_new)
+        return;
+
+    char summary[256];
+    int len = snprintf(summary, sizeof(summary), "Huge pages: %.1f MB in %d arrays on hugetlbfs, %.1f MB in %d with "
+                       "madvise", (double) mapped[HUGE_PAGES_HUGETLB] / 1e6, count[HUGE_PAGES_HUGETLB],
+                       (double) mapped[HUGE_PAGES_THP] / 1e6, count[HUGE_PAGES_THP]);
+    if (have_thp && len > 0 && (size_t) len < sizeof(summary))
+        len += snprintf(summary + len, sizeof(summary) - (size_t) len, " (%.1f MB of it on transparent huge pages)",
+                        (double) thp / 1e6);
+    if (len > 0 && (size_t) len < sizeof(summary))
+        len += snprintf(summary + len, sizeof(summary) - (size_t) len, ", %.1f MB in %d on 4 KB pages.",
+                        (double) mapped[HUGE_PAGES_NONE] / 1e6, count[HUGE_PAGES_NONE]);
+    if (short_of_pool > 0 && len > 0 && (size_t) len < sizeof(summary))
+        snprintf(summary + len, sizeof(summary) - (size_t) len, " The hugetlbfs pool was too small for %d of them; "
+                 "raise vm.nr_hugepages.", short_of_pool);
+    printf("%s\n", summary);
+    fflush(stdout);
+    syslog(LOG_INFO, "%s", summary);
+} // end huge_report()
@@ -38,8 +38,8 @@
 //
 // Hum server
 //
-// This code listens for HTTP POST requests, then translates those to hum protocol and passes the
-// request on to the recgen server on the same machine. Hum sends a request as a hum_record with a
+// This code listens for HTTP POST requests (and GET, for /bmh/metrics), then translates those to hum protocol and
+// passes the request on to the recgen server on the same machine. Hum sends a request as a hum_record with a
 // type, content_length, and content. It then reads the response from the recgen server by reading
 // the reply hum_record's status, content_length, and content.
 //
@@ -122,6 +122,13 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+#ifdef SO_REUSEPORT
+    // recgen -w starts a hum per worker on the same port, and the kernel spreads the connections across them.
+    const int reuse = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+        perror("Error setting SO_REUSEPORT");
+#endif
+
     // Set up the server address structure
     memset(&server_address, 0, sizeof(server_address));
     server_address.sin_family = AF_INET;
@@ -173,8 +180,8 @@ int main(int argc, char *argv[])
 
         sscanf(buffer, "%s %s", method, uri);
 
-        // If the method is "POST", handle the request
-        if (strcmp(method, "POST") == 0)
+        // If the method is "POST", handle the request. A GET is a POST with no data.
+        if (strcmp(method, "POST") == 0 || strcmp(method, "GET") == 0)
         {
             int total;
             // Here is the general request message we can expect at this point:
@@ -199,7 +206,7 @@ int main(int argc, char *argv[])
 
             // Find where the POST data starts and get rid of everything
             // else prior to that. Nice.
-            const char *post_start = strstr(p, "\r\n\r\n") ;
+            const char *post_start = strstr(p ? p : buffer, "\r\n\r\n") ;
             if (post_start)
             {
                 post_start += 4;  // skip over the end of header
@@ -289,7 +296,8 @@ int main(int argc, char *argv[])
             write(sockfd, &buffer, record.content_length);
 
             // Read the response from the recgen server
-            char response[1024] = "";
+            static char response[HUM_BUFFER_SIZE];
+            response[0] = '\0';
             char stderr_resp[1024] = "";
             uint32_t res_content_length;
 
@@ -330,12 +338,22 @@ int main(int argc, char *argv[])
                     // Everything's ok and we need to send the response data to the client.
                     // Check for content-length > 0 first!
                     read(sockfd, &record.content_length, sizeof(uint32_t));
+                    if (record.content_length >= HUM_BUFFER_SIZE)
+                        record.content_length = HUM_BUFFER_SIZE - 1;
                     if (record.content_length > 0)
                     {
-                        read(sockfd, &record.content, record.content_length);
+                        // Big replies like the metrics page can take more than one read.
+                        uint32_t got = 0;
+                        while (got < record.content_length)
+                        {
+                            bytes_read = read(sockfd, record.content + got, record.content_length - got);
+                            if (bytes_read <= 0)
+                                break;
+                            got += (uint32_t) bytes_read;
+                        }
                         // Parens needed on Mac OSX, benign elsewhere
-                        (strncat)(response, (char*) record.content, record.content_length);
-                        res_content_length += record.content_length;
+                        (strncat)(response, (char*) record.content, got);
+                        res_content_length += got;
                     }
                     break;
                 }
@@ -346,19 +364,21 @@ int main(int argc, char *argv[])
                 fprintf(stderr, "Received stderr response: %s\n", stderr_resp);
 
 #ifdef USE_PROTOBUF
-            // Send the response from the recgen process back to the client
-            char response_header[] = "HTTP/1.1 200 OK\r\n"
-                                     "Content-Type: application/octet-stream\r\n"
-                                     "Content-Length: ";
+            const char *content_type = "application/octet-stream";
 #else
-            // Send the response from the recgen process back to the client
-            char response_header[] = "HTTP/1.1 200 OK\r\n"
-                                     "Content-Type: application/json\r\n"
-                                     "Content-Length: ";
+            const char *content_type = "application/json";
 #endif
+            // The metrics page is plain text whatever the protocol.
+            if (!strcmp(uri, "/bmh/metrics"))
+                content_type = "text/plain; version=0.0.4";
+
+            // Send the response from the recgen process back to the client
+            char response_header[128];
+            snprintf(response_header, sizeof(response_header),
+                     "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: ", content_type);
 
             // Coalescing...
-            char output[1536];
+            static char output[HUM_BUFFER_SIZE + 160];
             sprintf(output, "%s%d\r\n\r\n%s", response_header, res_content_length, response);
             // Get the number of digits in res_content_length.
             int numdigits = 0;
@@ -373,7 +393,7 @@ int main(int argc, char *argv[])
             // Close the connection with the recgen process' socket
             close(sockfd);
 
-        } // end if method is POST
+        } // end if method is POST or GET
 
         // Close the connection with the client
         close(client_fd);
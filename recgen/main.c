@@ -28,6 +28,7 @@
 #include <bits/signum-generic.h>
 #endif
 #include "recgen.h"
+#include <fcntl.h>
 
 // This is the bemorehuman recommendation engine.
 
@@ -39,11 +40,13 @@ const char *error_strings[] = {
     "Protobuf decoding failed for event() invocation.",
     "personid from client is incorrect.",
     "elementid from client is incorrect.",
-    "No ratings for this user."
+    "No ratings for this user.",
+    "Protobuf decoding failed for similar() invocation.",
+    "No similar-items table. Run recgen -s."
 };
 
-static rating_t *g_big_rat;
-static uint32_t *g_big_rat_index;
+static elt_rating_t *g_big_rat;
+static uint64_t *g_big_rat_index;
 static uint32_t g_event_counter = 0;
 static event_t g_events_to_persist[EVENTS_TO_PERSIST_MAX];
 static bool wait_for_valence_reload = false;
@@ -94,9 +97,15 @@ static void *json_serialize(const int scenario, const void *data, const char *st
         switch (scenario)
         {
             case SCENARIO_RECS:
+            case SCENARIO_SIMILAR:
             {
+                // Similar items can come up short after the popularity filter. An elementid of 0 ends the list.
+                int num_recs = num_recs_to_make;
+                if (SCENARIO_SIMILAR == scenario)
+                    for (num_recs = 0; num_recs < num_recs_to_make && recs_in[num_recs].elementid; num_recs++);
+
                 strcat(json, "\"recslist\":[");
-                for (int i = 0; i < num_recs_to_make; i++)
+                for (int i = 0; i < num_recs; i++)
                 {
                     strcat(json, "{\"bmhid\":");
                     itoa((int) recs_in[i].elementid, char_int);
@@ -112,7 +121,7 @@ static void *json_serialize(const int scenario, const void *data, const char *st
                     strcat(json, char_int);
                     strcat(json, "}");
 
-                    if (i < (num_recs_to_make - 1))
+                    if (i < (num_recs - 1))
                     {
                         // add comma delimiter
                         strcat(json, ",");
@@ -233,6 +242,26 @@ static void *json_deserialize(const int scenario, const size_t len, const void *
             *status = STATUS_OK;
             return rr;
         }
+        case SCENARIO_SIMILAR:
+        {
+            // create the return structure
+            recs_request_t *rr = calloc(1, sizeof(recs_request_t));
+
+            // Get root["elementid"]
+            yyjson_val *elementid = yyjson_obj_get(root, "elementid");
+            rating_item_t *ri = malloc(sizeof(rating_item_t));
+            ri->elementid = yyjson_get_uint(elementid);
+            rr->ratings_list = ri;
+
+            // Get root["popularity"]
+            yyjson_val *pop = yyjson_obj_get(root, "popularity");
+            rr->popularity = yyjson_get_int(pop);
+
+            // Free the doc
+            yyjson_doc_free(doc);
+            *status = STATUS_OK;
+            return rr;
+        }
         case SCENARIO_EVENT:
         {
             // create the return structure
@@ -299,6 +328,45 @@ static void *protobuf_serialize(const int scenario, const void *data, const char
             free(pb_response.status);
             break;
         }
+        case SCENARIO_SIMILAR:
+        {
+            // Similar items can come up short after the popularity filter. An elementid of 0 ends the list.
+            const prediction_t *recs = (prediction_t *) data;
+            int num_recs = 0;
+            if (recs)
+                while (num_recs < num_recs_to_make && recs[num_recs].elementid) num_recs++;
+
+            RecsResponse pb_response = RECS_RESPONSE__INIT; // declare the response
+            pb_response.status = malloc(sizeof(char) * STATUS_LEN);
+            pb_response.n_recslist = (size_t) num_recs;
+            RecItem **recitems = malloc(sizeof(RecItem *) * (num_recs + 1));
+            for (int i = 0; i < num_recs; i++)
+            {
+                recitems[i] = malloc(sizeof(RecItem));
+                rec_item__init(recitems[i]);
+                recitems[i]->elementid = (uint32_t) recs[i].elementid;
+
+                // Scale what we return from 32 to g_output_scale.
+                recitems[i]->rating = (int32_t) bmh_round((double) recs[i].rating / conv_to_output_scale);
+                if (0 == recitems[i]->rating) recitems[i]->rating = 1;
+                recitems[i]->popularity = pop[recs[i].elementid];
+            } // end for loop
+
+            pb_response.recslist = recitems;
+
+            strlcpy(pb_response.status, status, sizeof(pb_response.status));
+
+            *len = recs_response__get_packed_size(&pb_response);
+            buffer = malloc(*len);
+            recs_response__pack(&pb_response, buffer);
+
+            // free malloced stuff
+            for (int i = 0; i < num_recs; i++)
+                free(recitems[i]);
+            free(recitems);
+            free(pb_response.status);
+            break;
+        }
         case SCENARIO_SINGLEREC:
         {
             prediction_t *recs = (prediction_t *) data;
@@ -355,14 +423,14 @@ static void *protobuf_deserialize(const int scenario, const size_t len, const vo
             // Check for errors
             if (message_in == NULL)
             {
-                syslog(LOG_ERR, "Protobuf decoding failed for recs() invocation.");
+                BMH_LOG(LOG_LEVEL_ERR, "Protobuf decoding failed for recs() invocation.");
                 *status = PROTOBUF_DECODE_FAILED_FOR_RECS;
                 return NULL;
             }
             // Does the passed-in personid not match any people we know about?
             if (message_in->personid > BE.num_people)
             {
-                syslog(LOG_ERR, "personid from client is incorrect: ---%d---", message_in->personid);
+                BMH_LOG(LOG_LEVEL_ERR, "personid from client is incorrect: ---%d---", message_in->personid);
                 *status = PERSONID_FROM_CLIENT_INCORRECT;
                 return NULL;
             }
@@ -374,6 +442,29 @@ static void *protobuf_deserialize(const int scenario, const size_t len, const vo
             *status = STATUS_OK;
             return rr;
         }
+        case SCENARIO_SIMILAR:
+        {
+            // /bmh/similar takes a Recs message. The first element in its ratingslist is the one to find
+            // neighbors for.
+            Recs *message_in = recs__unpack(NULL, len, data);
+            if (message_in == NULL || 0 == message_in->n_ratingslist)
+            {
+                BMH_LOG(LOG_LEVEL_ERR, "Protobuf decoding failed for similar() invocation.");
+                if (message_in) recs__free_unpacked(message_in, NULL);
+                *status = PROTOBUF_DECODE_FAILED_FOR_SIMILAR;
+                return NULL;
+            }
+
+            recs_request_t *rr = calloc(1, sizeof(recs_request_t));
+            rating_item_t *ri = malloc(sizeof(rating_item_t));
+            ri->elementid = message_in->ratingslist[0]->elementid;
+            rr->ratings_list = ri;
+            rr->popularity = (popularity_t) message_in->popularity;
+
+            recs__free_unpacked(message_in, NULL);
+            *status = STATUS_OK;
+            return rr;
+        }
         case SCENARIO_SINGLEREC:
         {
             // create the return structure
@@ -383,14 +474,14 @@ static void *protobuf_deserialize(const int scenario, const size_t len, const vo
             // Check for errors.
             if (message_in == NULL)
             {
-                syslog(LOG_ERR, "Protobuf decoding failed for internal singlerec.");
+                BMH_LOG(LOG_LEVEL_ERR, "Protobuf decoding failed for internal singlerec.");
                 *status = PROTOBUF_DECODE_FAILED_FOR_SINGLEREC;
                 return NULL;
             }
             // Does the passed-in personid not match any people we know about?
             if (message_in->personid > BE.num_people)
             {
-                syslog(LOG_ERR, "personid from client is incorrect: ---%d---", message_in->personid);
+                BMH_LOG(LOG_LEVEL_ERR, "personid from client is incorrect: ---%d---", message_in->personid);
                 *status = PERSONID_FROM_CLIENT_INCORRECT;
                 return NULL;
             }
@@ -412,14 +503,14 @@ static void *protobuf_deserialize(const int scenario, const size_t len, const vo
             // Check for errors.
             if (message_in == NULL)
             {
-                syslog(LOG_ERR, "Protobuf decoding failed for event call.");
+                BMH_LOG(LOG_LEVEL_ERR, "Protobuf decoding failed for event call.");
                 *status = PROTOBUF_DECODE_FAILED_FOR_EVENT;
                 return NULL;
             }
             // Does the passed-in personid not match any people we know about?
             if (message_in->personid > BE.num_people)
             {
-                syslog(LOG_ERR, "personid from client is incorrect: ---%d---", message_in->personid);
+                BMH_LOG(LOG_LEVEL_ERR, "personid from client is incorrect: ---%d---", message_in->personid);
                 *status = PERSONID_FROM_CLIENT_INCORRECT;
                 return NULL;
             }
@@ -479,23 +570,24 @@ static void internal_singlerec(void *request)
     int status = 0;
     size_t len = 0;
     deserialized_data = protocol->deserialize(SCENARIO_SINGLEREC, post_len, post_data, &status);
+    metrics_stage(METRICS_STAGE_DESERIALIZE);
 
     // Now we should have a structure of personid, popularity, num_ratings, array of possible elt/rating pairs
     // if there was no error. Check status for errors.
     if (status)
     {
-        printf("Problem from the deserializer! Bailing on this user.\n");
+        BMH_LOG(LOG_LEVEL_WARNING, "Problem from the deserializer! Bailing on this user.");
         goto finish_up;
     }
 
     // Does the passed-in personid match a user we know about?
-    if (0 == g_big_rat_index[deserialized_data->personid])
+    if (deserialized_data->personid > BE.num_people
+        || g_big_rat_index[deserialized_data->personid] == g_big_rat_index[deserialized_data->personid + 1])
     {
         status = PERSONID_FROM_CLIENT_INCORRECT;
-        printf("Person %d not found. Bailing on this person.\n", deserialized_data->personid);
-        syslog(LOG_ERR,
-               "Error: received personid that's not in the db or has no ratings for situation internal_singlerec: %d",
-               deserialized_data->personid);
+        BMH_LOG(LOG_LEVEL_ERR,
+                "Error: received personid that's not in the db or has no ratings for situation internal_singlerec: %d",
+                deserialized_data->personid);
         goto finish_up;
     }
     // We can generate recs for this person
@@ -505,12 +597,8 @@ static void internal_singlerec(void *request)
     // 1. get the ratings for the user
     int num_rats;
 
-    // Check if we're at the max person_id first.
-    if (BE.num_people != deserialized_data->personid)
-        num_rats = (int) (g_big_rat_index[deserialized_data->personid + 1] -
-                          g_big_rat_index[deserialized_data->personid]);
-    else
-        num_rats = (int) (BE.num_ratings - g_big_rat_index[deserialized_data->personid]);
+    num_rats = (int) (g_big_rat_index[deserialized_data->personid + 1] -
+                      g_big_rat_index[deserialized_data->personid]);
 
     // Limit what we care about to MAX_RATS_PER_PERSON.
     if (num_rats > MAX_RATS_PER_PERSON) num_rats = MAX_RATS_PER_PERSON;
@@ -548,22 +636,26 @@ static void internal_singlerec(void *request)
         }
         if (i == num_rats) done = true;
     } // end while not done
+    metrics_stage(METRICS_STAGE_RATINGS_FETCH);
 
     // 2. Pass ratings to recgen core.
     const popularity_t max_obscurity = HIGHEST_POP_NUMBER;
     // 1 is most popular, 7 is most obscure. 7 includes 1-6, 3 includes 1-2, etc.
     if (!predictions(ratings, num_rats, recs, 1, target_id, max_obscurity))
-        syslog(LOG_ERR, "No predictions generated for user %d", deserialized_data->personid);
+        BMH_LOG(LOG_LEVEL_ERR, "No predictions generated for user %d", deserialized_data->personid);
 
 finish_up:
+    if (status)
+        metrics_request_failed();
+
     // Serialize the data
     serialized_data = protocol->serialize(SCENARIO_SINGLEREC, recs, error_strings[status], &len);
 #ifdef USE_FCGI
     bytes_to_fcgi = FCGX_PutStr((const char *) serialized_data, (int) len, f_req->out);
     if (bytes_to_fcgi != (int) len)
-        syslog(LOG_ERR,
-               "ERROR: in recs, bytes_to_fcgi is %d while message_length is %lu",
-               bytes_to_fcgi, len);
+        BMH_LOG(LOG_LEVEL_ERR,
+                "ERROR: in recs, bytes_to_fcgi is %d while message_length is %lu",
+                bytes_to_fcgi, len);
 #else
     h_req->out->content_length = len;
     h_req->out->type_status = HUM_RESPONSE_OK;
@@ -643,12 +735,13 @@ static void recs(void *request)
     // Deserialize the request.
     int status = 0;
     deserialized_data = protocol->deserialize(SCENARIO_RECS, post_len, post_data, &status);
+    metrics_stage(METRICS_STAGE_DESERIALIZE);
 
     // Now we should have a structure of personid, popularity, num_ratings, array of possible elt/rating pairs
     // if there was no error. Check status for errors.
     if (status)
     {
-        printf("Problem from the deserializer! Bailing on this user.\n");
+        BMH_LOG(LOG_LEVEL_WARNING, "Problem from the deserializer! Bailing on this user.");
         goto finish_up;
     }
 
@@ -658,12 +751,8 @@ static void recs(void *request)
         num_rats = deserialized_data->num_ratings;
     } else // We're in protobuf mode
     {
-        // Check if we're at the max person_id first.
-        if (BE.num_people != deserialized_data->personid)
-            num_rats = (int) (g_big_rat_index[deserialized_data->personid + 1] -
-                              g_big_rat_index[deserialized_data->personid]);
-        else
-            num_rats = (int) (BE.num_ratings - g_big_rat_index[deserialized_data->personid]);
+        num_rats = (int) (g_big_rat_index[deserialized_data->personid + 1] -
+                          g_big_rat_index[deserialized_data->personid]);
     }
 
     // Limit what we care about to MAX_RATS_PER_PERSON.
@@ -702,7 +791,7 @@ static void recs(void *request)
             }
         } else
         {
-            printf("ERROR: ratings_list is empty. Bailing on this user.\n");
+            BMH_LOG(LOG_LEVEL_WARNING, "ERROR: ratings_list is empty. Bailing on this user.");
             status = NO_RATINGS_FOR_USER;
             goto finish_up;
         }
@@ -715,16 +804,26 @@ static void recs(void *request)
             ratings[i].rating = g_big_rat[g_big_rat_index[deserialized_data->personid] + i].rating;
         }
     }
-    // 2. Pass ratings to recgen core.
+    metrics_stage(METRICS_STAGE_RATINGS_FETCH);
+
+    // 2. Pass ratings to recgen core, unless the result cache has this person's recs already.
     len = 0;
 
-    if (!predictions(ratings, num_rats, recs, RECS_BUCKET_SIZE, 0, deserialized_data->popularity))
-        syslog(LOG_ERR, "No predictions generated for user %d", deserialized_data->personid);
+    const uint64_t rats_hash = result_cache_hash(ratings, num_rats);
+    if (!result_cache_get(deserialized_data->personid, deserialized_data->popularity, rats_hash, recs))
+    {
+        if (predictions(ratings, num_rats, recs, RECS_BUCKET_SIZE, 0, deserialized_data->popularity))
+            result_cache_put(deserialized_data->personid, deserialized_data->popularity, rats_hash, recs);
+        else
+            BMH_LOG(LOG_LEVEL_ERR, "No predictions generated for user %d", deserialized_data->personid);
+    }
 
     status = STATUS_OK;
 
     // Send the response to the client.
 finish_up:
+    if (status)
+        metrics_request_failed();
 
     // Serialize the data
     serialized_data = protocol->serialize(SCENARIO_RECS, recs, error_strings[status], &len);
@@ -732,9 +831,9 @@ finish_up:
 #ifdef USE_FCGI
     bytes_to_fcgi = FCGX_PutStr((const char *) serialized_data, (int) len, f_req->out);
     if (bytes_to_fcgi != (int) len)
-        syslog(LOG_ERR,
-               "ERROR: in recs, bytes_to_fcgi is %d while message_length is %lu",
-               bytes_to_fcgi, len);
+        BMH_LOG(LOG_LEVEL_ERR,
+                "ERROR: in recs, bytes_to_fcgi is %d while message_length is %lu",
+                bytes_to_fcgi, len);
 #else
     h_req->out->content_length = len;
     h_req->out->type_status = HUM_RESPONSE_OK;
@@ -760,6 +859,144 @@ finish_up:
 } // end recs()
 
 
+//
+// Provide the elements most similar to a given element, from the similar-items table.
+// input: *void which can be *FCGX_Request or *hum_request
+//
+static void similar(void *request)
+{
+    // input: elementid, popularity
+    // output: up to num_recs_to_make similar elements, best first
+
+#ifdef USE_FCGI
+    FCGX_Request *f_req;
+    f_req = (FCGX_Request *) request;
+#else
+    const hum_request *h_req = (hum_request *) request;
+#endif
+
+    uint8_t post_data[FCGX_MAX_INPUT_STREAM_SIZE];
+    size_t post_len;
+
+#ifdef USE_FCGI
+    post_len = (size_t) FCGX_GetStr((char *) post_data,
+                                        sizeof(post_data),
+                                        f_req->in);
+#else
+    post_len = h_req->in->content_length;
+    memcpy(post_data,
+           h_req->in->content,
+           post_len);
+#endif
+
+    prediction_t *recs = NULL;
+    void *serialized_data = NULL;
+    size_t len = 0;
+
+    // Deserialize the request.
+    int status = 0;
+    recs_request_t *deserialized_data = protocol->deserialize(SCENARIO_SIMILAR, post_len, post_data, &status);
+    metrics_stage(METRICS_STAGE_DESERIALIZE);
+    if (status)
+    {
+        BMH_LOG(LOG_LEVEL_WARNING, "Problem from the deserializer! Bailing on this request.");
+        goto finish_up;
+    }
+
+    // Does the passed-in elementid not match any element we know about?
+    const exp_elt_t eltid = deserialized_data->ratings_list->elementid;
+    if (0 == eltid || eltid > BE.num_elts)
+    {
+        BMH_LOG(LOG_LEVEL_ERR, "elementid from client is incorrect: ---%u---", eltid);
+        status = ELEMENTID_FROM_CLIENT_INCORRECT;
+        goto finish_up;
+    }
+
+    // This is the list of similar elements. The extra zeroed entry ends a full list.
+    recs = (prediction_t *) calloc(num_recs_to_make + 1, sizeof(prediction_t));
+
+    // Bail roughly if we can't get any mem.
+    if (!recs)
+        exit(EXIT_NULLPREDS);
+
+    if (similar_items(eltid, (popularity_t) deserialized_data->popularity, recs, num_recs_to_make) < 0)
+        status = NO_SIMILAR_TABLE;
+    metrics_stage(METRICS_STAGE_TOP_K);
+
+finish_up:
+    if (status)
+        metrics_request_failed();
+
+    // Serialize the data
+    serialized_data = protocol->serialize(SCENARIO_SIMILAR, status ? NULL : recs, error_strings[status], &len);
+#ifdef USE_FCGI
+    bytes_to_fcgi = FCGX_PutStr((const char *) serialized_data, (int) len, f_req->out);
+    if (bytes_to_fcgi != (int) len)
+        BMH_LOG(LOG_LEVEL_ERR,
+                "ERROR: in similar, bytes_to_fcgi is %d while message_length is %lu",
+                bytes_to_fcgi, len);
+#else
+    h_req->out->content_length = len;
+    h_req->out->type_status = HUM_RESPONSE_OK;
+    strncpy((char *) h_req->out->content, (const char *) serialized_data, len);
+#endif
+
+    if (recs) free(recs);
+    if (deserialized_data)
+    {
+        free(deserialized_data->ratings_list);
+        free(deserialized_data);
+    }
+    if (serialized_data)
+        free(serialized_data);
+} // end similar()
+
+
+//
+// Append the events saved in RAM to the bmh events file and start over. A recgen -w worker calls this from its SIGTERM
+// handler on the way out, so it only uses async-signal-safe calls. Returns false if the file won't open.
+//
+static bool persist_events(void)
+{
+    // MUST append and not truncate because this file gets appended to. With recgen -w, each worker appends its
+    // lines in one write(), so they don't interleave with another worker's.
+    const int fd = open(BE.bmh_events_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return (false);
+
+    char lines[EVENTS_TO_PERSIST_MAX * 24];
+    size_t used = 0;
+    for (uint32_t i = 0; i < g_event_counter; i++)
+    {
+        char num[12];
+        itoa((int) g_events_to_persist[i].personid, num);
+        const size_t plen = strlen(num);
+        memcpy(lines + used, num, plen);
+        used += plen;
+        lines[used++] = ',';
+        itoa((int) g_events_to_persist[i].eltid, num);
+        const size_t elen = strlen(num);
+        memcpy(lines + used, num, elen);
+        used += elen;
+        lines[used++] = '\n';
+    } // end for loop across events to write out
+    if (used > 0)
+        write(fd, lines, used);
+    close(fd);
+
+    // Reset counter.
+    g_event_counter = 0;
+    return (true);
+} // end persist_events()
+
+
+// For prefork_run(), which wants a void function.
+static void persist_events_on_exit(void)
+{
+    persist_events();
+} // end persist_events_on_exit()
+
+
 //
 // Ingest an event such as a rating, listen, purchase, click, etc.
 // output: success or failure
@@ -804,12 +1041,13 @@ static void event(void *request)
     // Deserialize the request.
     int status = 0;
     event_t *deserialized_data = protocol->deserialize(SCENARIO_EVENT, post_len, post_data, &status);
+    metrics_stage(METRICS_STAGE_DESERIALIZE);
 
     // Now we should have a structure of personid, popularity, num_ratings, array of possible elt/rating pairs
     // if there was no error. Check status for errors.
     if (status)
     {
-        printf("Problem from the deserializer! Bailing on this user.\n");
+        BMH_LOG(LOG_LEVEL_WARNING, "Problem from the deserializer! Bailing on this user.");
         goto finish_up;
     }
 
@@ -818,17 +1056,16 @@ static void event(void *request)
     {
         // new
         status = PERSONID_FROM_CLIENT_INCORRECT;
-        printf("Person %d not found. Bailing on this person.\n", deserialized_data->personid);
-        syslog(LOG_ERR,
-               "Error: received personid that's not in the db or has no ratings for situation event: %d",
-               deserialized_data->personid);
+        BMH_LOG(LOG_LEVEL_ERR,
+                "Error: received personid that's not in the db or has no ratings for situation event: %d",
+                deserialized_data->personid);
         goto finish_up;
     }
 
     // Does the passed-in elementid not match any element we know about?
     if (deserialized_data->eltid > BE.num_elts)
     {
-        syslog(LOG_ERR, "elementid from client is incorrect: ---%d---", deserialized_data->eltid);
+        BMH_LOG(LOG_LEVEL_ERR, "elementid from client is incorrect: ---%d---", deserialized_data->eltid);
         status = ELEMENTID_FROM_CLIENT_INCORRECT;
         goto finish_up;
     }
@@ -838,46 +1075,31 @@ static void event(void *request)
     g_events_to_persist[g_event_counter].eltid = deserialized_data->eltid;
     g_event_counter++;
 
+    // This person's cached recs may not hold any more.
+    result_cache_forget(deserialized_data->personid);
+
     // Are we ready to persist now?
-    if (g_event_counter == EVENTS_TO_PERSIST_MAX)
+    if (g_event_counter == EVENTS_TO_PERSIST_MAX && !persist_events())
     {
-        char fname[255];
-        strlcpy(fname, BE.bmh_events_file, sizeof(fname));
-
-        // MUST be "a" and not "w" because this file gets appended to.
-        FILE *fp = fopen(fname, "a");
-
-        if (NULL == fp)
-        {
-            syslog(LOG_ERR, "ERROR: cannot open output file %s", fname);
-            exit(1);
-        }
-
-        for (int i = 0; i < (int) g_event_counter; i++)
-        {
-            char line[512];
-            sprintf(line, "%d,%d\n",
-                    g_events_to_persist[i].personid,
-                    g_events_to_persist[i].eltid);
-
-            // Put the line in the output file
-            fwrite(line, strlen(line), 1, fp);
-        } // end for loop across events to write out
-        fclose(fp);
-
-        // Reset counter.
-        g_event_counter = 0;
+        syslog(LOG_ERR, "ERROR: cannot open output file %s", BE.bmh_events_file);
+        exit(1);
     } // end if we want to persist the saved events
 
+    // Don't count persisting events as serializing.
+    metrics_mark();
+
 finish_up:
+    if (status)
+        metrics_request_failed();
+
     // Serialize the data
     serialized_data = protocol->serialize(SCENARIO_EVENT, NULL, error_strings[status], &len);
 #ifdef USE_FCGI
     bytes_to_fcgi = FCGX_PutStr((const char *) serialized_data, (int) len, f_req->out);
     if (bytes_to_fcgi != (int) len)
-        syslog(LOG_ERR,
-               "ERROR: in event, bytes_to_fcgi is %d while message_length is %lu",
-               bytes_to_fcgi, len);
+        BMH_LOG(LOG_LEVEL_ERR,
+                "ERROR: in event, bytes_to_fcgi is %d while message_length is %lu",
+                bytes_to_fcgi, len);
 #else
     h_req->out->content_length = len;
     h_req->out->type_status = HUM_RESPONSE_OK;
@@ -892,6 +1114,32 @@ finish_up:
 } // end event()
 
 
+//
+// Report the per-stage request metrics in Prometheus text format.
+// input: *void which can be *FCGX_Request or *hum_request
+//
+static void metrics(void *request)
+{
+#ifdef USE_FCGI
+    FCGX_Request *f_req = (FCGX_Request *) request;
+    char *page = malloc(HUM_BUFFER_SIZE);
+    if (NULL == page)
+    {
+        BMH_LOG(LOG_LEVEL_ERR, "ERROR: can't allocate the metrics page.");
+        return;
+    }
+    const size_t len = metrics_render(page, HUM_BUFFER_SIZE);
+    FCGX_PutStr(page, (int) len, f_req->out);
+    free(page);
+#else
+    const hum_request *h_req = (hum_request *) request;
+    h_req->out->content_length = (uint32_t) metrics_render((char *) h_req->out->content,
+                                                           sizeof(h_req->out->content));
+    h_req->out->type_status = HUM_RESPONSE_OK;
+#endif
+} // end metrics()
+
+
 #ifdef USE_FCGI
 // Execute this callback per thread, with an infinite loop inside that will receive requests
 // NOTE: clang understands the GCC pragma, but not vice-versa! So do it this way.
@@ -904,18 +1152,18 @@ static void *start_fcgi_worker(void *arg)
     FCGX_Request request;
     FCGX_InitRequest(&request, info->fcgi_fd, 0);
 
-    // Thread-specific init stuff.
+    // Thread-specific init stuff. Pin first, so the workingset comes from the worker's own NUMA node.
+    numa_pin_worker();
     create_workingset(BE.num_elts);
+    huge_report();
+    metrics_register_thread();
 
     while (1)
     {
-        FCGX_Accept_r(&request);
-
-        // Because we're sending raw protobuf-encoded data, use octet-stream.
-        if (protocol == protobuf_protocol)
-            FCGX_PutS("Content-Type: application/octet-stream\r\n\r\n", request.out);
-        else
-            FCGX_PutS("Content-Type: application/json\r\n\r\n", request.out);
+        prefork_idle();
+        if (FCGX_Accept_r(&request) < 0)
+            continue;
+        prefork_busy();
 
         const char *request_uri = FCGX_GetParam("REQUEST_URI", request.envp);
 
@@ -928,16 +1176,31 @@ static void *start_fcgi_worker(void *arg)
 
         size_t len_request_uri = strlen(request_uri);
 
+        // /metrics call. This one is plain text and doesn't wait for valences.
+        if ((12 == len_request_uri) && (!strcmp("/bmh/metrics", request_uri)))
+        {
+            FCGX_PutS("Content-Type: text/plain; version=0.0.4\r\n\r\n", request.out);
+            metrics(&request);
+            goto cleanup;
+        }
+
+        // Because we're sending raw protobuf-encoded data, use octet-stream.
+        if (protocol == protobuf_protocol)
+            FCGX_PutS("Content-Type: application/octet-stream\r\n\r\n", request.out);
+        else
+            FCGX_PutS("Content-Type: application/json\r\n\r\n", request.out);
+
         // Do we need to wait for valences to reload?
         while (wait_for_valence_reload)
         {
-            syslog(LOG_INFO, "recgen is waiting for valences to reload...");
+            BMH_LOG(LOG_LEVEL_INFO, "recgen is waiting for valences to reload...");
             sleep(1);
         }
 
         // /internal-singlerec call
         if ((23 == len_request_uri) && (!strcmp("/bmh/internal-singlerec", request_uri)))
         {
+            metrics_request_begin(SCENARIO_SINGLEREC);
             internal_singlerec(&request);
             goto cleanup;
         }
@@ -945,6 +1208,7 @@ static void *start_fcgi_worker(void *arg)
         // /recs call
         if ((9 == len_request_uri) && (!strcmp("/bmh/recs", request_uri)))
         {
+            metrics_request_begin(SCENARIO_RECS);
             recs(&request);
             goto cleanup;
         }
@@ -952,17 +1216,35 @@ static void *start_fcgi_worker(void *arg)
         // /event call
         if ((10 == len_request_uri) && (!strcmp("/bmh/event", request_uri)))
         {
+            metrics_request_begin(SCENARIO_EVENT);
             event(&request);
             goto cleanup;
         }
 
+        // /similar call
+        if ((12 == len_request_uri) && (!strcmp("/bmh/similar", request_uri)))
+        {
+            metrics_request_begin(SCENARIO_SIMILAR);
+            similar(&request);
+            goto cleanup;
+        }
+
         cleanup:
         FCGX_Finish_r(&request);
+        metrics_request_end();
 
     } // end while (1)
 } // End start_fcgi_worker callback
 #pragma GCC diagnostic pop
 
+// What each recgen -w worker process runs.
+static void serve_fcgi(int fcgi_fd)
+{
+    FCGI_info_t info;
+    info.fcgi_fd = fcgi_fd;
+    start_fcgi_worker(&info);
+} // end serve_fcgi()
+
 #else
 
 // Run this single worker with an infinite loop inside that will receive requests.
@@ -971,11 +1253,15 @@ static void *start_fcgi_worker(void *arg)
 #pragma GCC diagnostic ignored "-Wreturn-type"
 static void *start_hum_worker(int hum_fd)
 {
-    // Thread-specific init stuff.
+    // Thread-specific init stuff. Pin first, so the workingset comes from the worker's own NUMA node.
+    numa_pin_worker();
     create_workingset(BE.num_elts);
+    huge_report();
+    metrics_register_thread();
 
     while (1)
     {
+        prefork_idle();
         hum_record record_in;
         char uri[256];
 
@@ -988,19 +1274,22 @@ static void *start_hum_worker(int hum_fd)
         // open and can accept further connections.
         // This will block.
         const int cl_fd = accept(hum_fd, NULL, NULL);
+        if (cl_fd < 0)
+            continue;
+        prefork_busy();
 
         // Read field-by-field
         // Get the first byte which is the type.
         ssize_t bytes_read = read(cl_fd, &record_in.type_status, sizeof(uint8_t));
         if (bytes_read < 0)
         {
-            perror("Error reading request from hum server.");
+            BMH_LOG(LOG_LEVEL_ERR, "Error reading request from hum server: %s", strerror(errno));
             close(cl_fd);
             continue;
         }
         if (bytes_read == 0)
         {
-            perror("Error bytes_read is 0 from hum server.");
+            BMH_LOG(LOG_LEVEL_ERR, "Error bytes_read is 0 from hum server.");
             close(cl_fd);
             continue;
         }
@@ -1026,13 +1315,13 @@ static void *start_hum_worker(int hum_fd)
         bytes_read = read(cl_fd, &record_in.type_status, sizeof(uint8_t));
         if (bytes_read < 0)
         {
-            perror("Error reading POST part of request from hum server.");
+            BMH_LOG(LOG_LEVEL_ERR, "Error reading POST part of request from hum server: %s", strerror(errno));
             close(cl_fd);
             continue;
         }
         if (bytes_read == 0)
         {
-            perror("Error bytes_read for POST part is 0 from hum server.");
+            BMH_LOG(LOG_LEVEL_ERR, "Error bytes_read for POST part is 0 from hum server.");
             close(cl_fd);
             continue;
         }
@@ -1055,22 +1344,30 @@ static void *start_hum_worker(int hum_fd)
 
         const ssize_t len_request_uri = strlen(uri);
 
+        hum_request request;
+        request.in = &record_in;
+        hum_record record_out;
+        request.out = &record_out;
+
+        // /metrics call. This one doesn't wait for valences.
+        if ((12 == len_request_uri) && (!strcmp("/bmh/metrics", uri)))
+        {
+            metrics(&request);
+            goto finish;
+        }
+
         // Do we need to wait for valences to reload?
         // ReSharper disable once CppDFALoopConditionNotUpdated
         while (wait_for_valence_reload)
         {
-            syslog(LOG_INFO, "recgen is waiting for valences to reload...");
+            BMH_LOG(LOG_LEVEL_INFO, "recgen is waiting for valences to reload...");
             sleep(1);
         }
 
-        hum_request request;
-        request.in = &record_in;
-        hum_record record_out;
-        request.out = &record_out;
-
         // /internal-singlerec call
         if ((23 == len_request_uri) && (!strcmp("/bmh/internal-singlerec", uri)))
         {
+            metrics_request_begin(SCENARIO_SINGLEREC);
             internal_singlerec(&request);
             goto finish;
         }
@@ -1078,6 +1375,7 @@ static void *start_hum_worker(int hum_fd)
         // /recs call
         if ((9 == len_request_uri) && (!strcmp("/bmh/recs", uri)))
         {
+            metrics_request_begin(SCENARIO_RECS);
             recs(&request);
             goto finish;
         }
@@ -1085,10 +1383,19 @@ static void *start_hum_worker(int hum_fd)
         // /event call
         if ((10 == len_request_uri) && (!strcmp("/bmh/event", uri)))
         {
+            metrics_request_begin(SCENARIO_EVENT);
             event(&request);
             goto finish;
         }
 
+        // /similar call
+        if ((12 == len_request_uri) && (!strcmp("/bmh/similar", uri)))
+        {
+            metrics_request_begin(SCENARIO_SIMILAR);
+            similar(&request);
+            goto finish;
+        }
+
     finish:
         if (request.out->type_status == HUM_RESPONSE_OK)
         {
@@ -1107,64 +1414,47 @@ static void *start_hum_worker(int hum_fd)
                 write(cl_fd, request.out->content, request.out->content_length);
         }
         close(cl_fd);
+        metrics_request_end();
     } // end while (1)
 } // End start_hum_worker()
 #pragma GCC diagnostic pop
-#endif
 
-// Get the num_confident_valences.
-static void populate_ncv()
+// What each recgen -w worker process runs.
+static void serve_hum(int hum_fd)
 {
-    // Get the num_confident_valences from a flat file.
-    char filename[strlen(BE.working_dir) + strlen(NUM_CONF_OUTFILE) + 2];
-    strlcpy(filename, BE.working_dir, sizeof(filename));
-    strlcat(filename, "/", sizeof(filename));
-    strlcat(filename, NUM_CONF_OUTFILE, sizeof(filename));
-
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
-    {
-        printf("Can't open file %s. Exiting.\n", filename);
-        exit(1);
-    }
-
-    char *line = NULL;
-    size_t line_capacity = 0;
-    ssize_t line_length;
-    while ((line_length = getline(&line, &line_capacity, fp)) != -1)
-    {
-        // Is the file coming from linux/unix or pre Mac OSX?
-        if (line_length && (line[line_length - 1] == '\n' || line[line_length - 1] == '\r'))
-            line[--line_length] = '\0';
-        // Is the file coming from windows?
-        if (line_length && (line[line_length - 1] == '\r'))
-            line[--line_length] = '\0';
-
-        // Convert line to a size_t.
-        g_num_confident_valences = (size_t) strtol(line, NULL, 10);
-        syslog(LOG_INFO, "num_confident_valences is %lu", g_num_confident_valences);
-    }
-    free(line);
-    fclose(fp);
-} // end populate_ncv()
+    start_hum_worker(hum_fd);
+} // end serve_hum()
+#endif
 
 static void initialize_structures()
 {
+    // Hand the workers the loaded arrays again until the new ones are copied to each NUMA node.
+    numa_drop_replicas();
+
     // Get the num_confident_valences.
     populate_ncv();
 
+    // Load up the element popularities to help with preferred obscurity for recommendations. load_beast() needs them
+    // to check the popularity splits.
+    bool retval = pop_load();
+    if (true != retval)
+        exit(EXIT_FAILURE);
+
     // Begin beast stuff.
     syslog(LOG_INFO, "Begin timing for loading valences.");
     long long start = current_time_millis();
 
     // Load up Beast with valences and load the DS.
-    bool retval = load_beast(LOAD_VALENCES_FROM_BEAST_EXPORT, true);
+    retval = load_beast(g_packed_valences ? LOAD_VALENCES_FROM_PACKED : LOAD_VALENCES_FROM_BEAST_EXPORT, true);
     if (true != retval)
         exit(EXIT_MEMLOAD);
 
     long long finish = current_time_millis();
     syslog(LOG_INFO, "Time to do Beast load: %d milliseconds.", (int) (finish - start));
 
+    // If recgen -r reordered the element ids, load the permutation so we can translate at the API.
+    perm_load();
+
     // Load up big_rat and br_index ratings structure.
     syslog(LOG_INFO, "Begin timing for loading big_rat into recgen.");
     start = current_time_millis();
@@ -1176,15 +1466,22 @@ static void initialize_structures()
     finish = current_time_millis();
     syslog(LOG_INFO, "Time to do big_rat load: %d milliseconds.", (int) (finish - start));
 
-    // Load up the element popularities to help with preferred obscurity for recommendations.
-    retval = pop_load();
-    if (true != retval)
-        exit(EXIT_FAILURE);
+    // Load the similar-items table for /bmh/similar if there's one. It's fine if there isn't.
+    similar_load();
 
     // Set up big_rat.
     g_big_rat = big_rat_leash();
     g_big_rat_index = big_rat_index_leash();
 
+    // With recgen -n, copy the model to each NUMA node.
+    numa_place_model();
+
+    // Recs cached from the last model don't count any more.
+    result_cache_new_generation();
+
+    // Say which arrays got huge pages.
+    huge_report();
+
     // end initializations before spawning threads
 } // end initialize_structures()
 
@@ -1237,7 +1534,7 @@ int main(int argc, char **argv)
 
     // Use getopt to help manage the options on the command line.
     int opt;
-    while ((opt = getopt(argc, argv, "cdb:")) != -1)
+    while ((opt = getopt(argc, argv, "cdk:lnpr:sb:tuw:z")) != -1)
     {
         switch (opt)
         {
@@ -1251,6 +1548,37 @@ int main(int argc, char **argv)
                 gen_valence_cache_ds_only();
                 syslog(LOG_INFO, "*** End recgen valence cache DS generation");
                 exit(EXIT_SUCCESS);
+            case 'k': // for "keep recent recs"
+                g_result_cache_entries = strtoull(optarg, NULL, 10);
+                break;
+            case 'l': // for "large pages"
+                g_huge_pages = HUGE_PAGES_HUGETLB;
+                break;
+            case 'n': // for "NUMA"
+                g_numa_replicate = true;
+                break;
+            case 'p': // for "packed cache generation"
+                printf("*** Generating packed valence cache ***\n");
+                gen_packed_cache();
+                syslog(LOG_INFO, "*** End recgen packed valence cache generation");
+                exit(EXIT_SUCCESS);
+            case 'r': // for "reorder element ids"
+                if (0 == parse_elt_order(optarg))
+                {
+                    printf("Error: the argument for -r should be rcm or pop instead of %s. Exiting. ***\n", optarg);
+                    syslog(LOG_ERR, "The argument for -r should be rcm or pop, instead of %s. Exiting. ***\n",
+                           optarg);
+                    exit(EXIT_FAILURE);
+                }
+                printf("*** Reordering element ids ***\n");
+                gen_reordered_cache(parse_elt_order(optarg));
+                syslog(LOG_INFO, "*** End recgen element id reordering");
+                exit(EXIT_SUCCESS);
+            case 's': // for "similar-items table generation"
+                printf("*** Generating similar-items table ***\n");
+                gen_similar_cache();
+                syslog(LOG_INFO, "*** End recgen similar-items table generation");
+                exit(EXIT_SUCCESS);
             case 'b': // for "recommendation-buckets"
                 if (strtol(optarg, NULL, 10) < 2 || strtol(optarg, NULL, 10) > 32)
                 {
@@ -1261,9 +1589,30 @@ int main(int argc, char **argv)
                 }
                 g_output_scale = strtol(optarg, NULL, 10);
                 break;
+            case 't': // for "time every request in syslog"
+                g_log_request_time = true;
+                break;
+            case 'u': // for "unified adjacency"
+                g_unified_adjacency = true;
+                break;
+            case 'w': // for "worker processes"
+                if (strtol(optarg, NULL, 10) < 1 || strtol(optarg, NULL, 10) > PREFORK_MAX_WORKERS)
+                {
+                    printf("Error: the argument for -w should be between 1 and %d instead of %s. Exiting. ***\n",
+                           PREFORK_MAX_WORKERS, optarg);
+                    syslog(LOG_ERR, "The argument for -w should be between 1 and %d, instead of %s. Exiting. ***\n",
+                           PREFORK_MAX_WORKERS, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                g_prefork_workers = (uint32_t) strtol(optarg, NULL, 10);
+                break;
+            case 'z': // for "serve from the packed cache"
+                g_packed_valences = true;
+                break;
             default:
-                printf("Don't understand. Check args. Need one of c, d, or b. \n");
-                fprintf(stderr, "Usage: %s [-c] [-d] [-b buckets]\n", argv[0]);
+                printf("Don't understand. Check args. Need one of c, d, k, l, n, p, r, s, b, t, u, w, or z. \n");
+                fprintf(stderr, "Usage: %s [-c] [-d] [-k entries] [-l] [-n] [-p] [-r rcm|pop] [-s] [-b buckets] [-t] "
+                        "[-u] [-w workers] [-z]\n", argv[0]);
                 exit(EXIT_FAILURE);
         } // end switch
     } // end while
@@ -1273,6 +1622,9 @@ int main(int argc, char **argv)
     printf("*** Starting the live recommender with recs using a %d-bucket scale ***\n", g_output_scale);
     syslog(LOG_INFO, "*** Start recgen live recommender with recs using a %d-bucket scale ***", g_output_scale);
 
+    // Set up the result cache before anything forks, so the recgen -w workers share it.
+    result_cache_init(g_result_cache_entries);
+
     // Populate the beast, g_pop, and ratings structures.
     initialize_structures();
 
@@ -1325,9 +1677,16 @@ int main(int argc, char **argv)
 
     pthread_t threads[n_threads];
 
+    // With recgen -w, worker processes share the socket instead of threads in this one.
+    if (g_prefork_workers > 0)
+        prefork_run(fcgi_fd, serve_fcgi, initialize_structures, persist_events_on_exit);
+
     FCGI_info_t info;
     info.fcgi_fd = fcgi_fd;
 
+    // From here on, the workers log through the drain thread.
+    async_log_start();
+
     for (unsigned int i = 0; i < n_threads; i++)
         pthread_create(&threads[i], NULL, start_fcgi_worker, (void *) &info);
 
@@ -1354,35 +1713,41 @@ int main(int argc, char **argv)
         }
     }
 
-    // Start double-forking code to get hum to be its own independent process.
-    printf("forking process pid: %d\n", getpid());
-    const pid_t p1 = fork();
-
-    // NOTE: if pid == 0 it's the child process
-    if (p1 != 0)
+    // Start double-forking code to get hum to be its own independent process. With recgen -w there's a hum per
+    // worker, all on the same port with SO_REUSEPORT, so the kernel spreads the connections across them.
+    const uint32_t num_hums = g_prefork_workers > 0 ? g_prefork_workers : 1;
+    for (uint32_t h = 0; h < num_hums; h++)
     {
-        printf("p1 process id is %d\n", getpid());
-        int status;
-        wait(&status);
-        system("ps");
-    } else
-    {
-        const pid_t p2 = fork();
-        const int pid = getpid();
+        printf("forking process pid: %d\n", getpid());
+        fflush(stdout);
+        const pid_t p1 = fork();
 
-        if (p2 != 0)
+        // NOTE: if pid == 0 it's the child process
+        if (p1 != 0)
         {
-            printf("p2 process id is %d\n", pid);
-            exit(0);
-        }
-        printf("p3 process id is %d\n", pid);
-        printf("I'm the grandchild with pid %d.\n", getpid());
+            printf("p1 process id is %d\n", getpid());
+            int status;
+            waitpid(p1, &status, 0);
+        } else
+        {
+            const pid_t p2 = fork();
+            const int pid = getpid();
 
-        // Start the hum server.
-        char portstr[6];
-        itoa(HUM_DEFAULT_PORT, portstr);
-        execlp("hum", "hum", "-p", portstr, (char *) NULL);
+            if (p2 != 0)
+            {
+                printf("p2 process id is %d\n", pid);
+                exit(0);
+            }
+            printf("p3 process id is %d\n", pid);
+            printf("I'm the grandchild with pid %d.\n", getpid());
+
+            // Start the hum server.
+            char portstr[6];
+            itoa(HUM_DEFAULT_PORT, portstr);
+            execlp("hum", "hum", "-p", portstr, (char *) NULL);
+        }
     }
+    system("ps");
     // end double-forking stuff
 
     // Open socket that will talk to our hum server.
@@ -1407,9 +1772,9 @@ int main(int argc, char **argv)
 
     unlink(process_address.sun_path);
 
-    // Now bind the listening socket.
+    // Now bind the listening socket. Every hum connects here for every request.
     if (bind(hum_fd, (struct sockaddr *) &process_address, sizeof(struct sockaddr_un)) < 0
-        || listen(hum_fd, 5) < 0)
+        || listen(hum_fd, g_prefork_workers > 0 ? SOMAXCONN : 5) < 0)
     {
         perror("bind/listen");
         exit(EXIT_FAILURE);
@@ -1417,6 +1782,13 @@ int main(int argc, char **argv)
 
     syslog(LOG_INFO, "successfully set socket %s to allow web server to write to it.", BE.recgen_socket_location);
 
+    // With recgen -w, worker processes share the socket instead of this one serving it.
+    if (g_prefork_workers > 0)
+        prefork_run(hum_fd, serve_hum, initialize_structures, persist_events_on_exit);
+
+    // From here on, the worker logs through the drain thread.
+    async_log_start();
+
     start_hum_worker(hum_fd);
     // end else we're talking to hum server
 #endif
@@ -1442,6 +1814,9 @@ void gen_valence_cache()
     if (true != retval)
         exit(EXIT_MEMLOAD);
 
+    // Keep the element ids the way an earlier recgen -r reordered them.
+    perm_relabel_new_cache();
+
     // Export the bb stuff to binary file.
     export_beast();
 
@@ -1471,6 +1846,9 @@ void gen_valence_cache_ds_only()
     // Create the DS stuff.
     create_ds();
 
+    // Keep the element ids the way an earlier recgen -r reordered them.
+    perm_relabel_new_cache();
+
     // Export the DS stuff to binary file.
     export_ds();
 
@@ -0,0 +1,351 @@
+// SPDX-FileCopyrightText: 2022 Brian Calhoun <brian@bemorehuman.org>
+//
+// SPDX-License-Identifier: MIT
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is furnished to do
+// so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// This file is part of bemorehuman. See https://bemorehuman.org
+
+#include "recgen.h"
+#include <stdarg.h>
+#include <time.h>
+#include <sys/mman.h>
+
+//
+// This file keeps per-stage request metrics for recgen and renders them in Prometheus text format for /bmh/metrics.
+//
+// Each worker thread owns one slot and is the only writer to it, so recording a sample is a few relaxed stores with no
+// locks and no shared cache lines. The metrics page sums all the slots when it's asked for. A page can see a sample's
+// bucket before its sum or count, which is fine for monitoring.
+//
+
+// Should predictions() syslog its time for every request? Off by default because it's a syslog call per request.
+bool g_log_request_time = false;
+
+// Upper bounds of the latency buckets in nanoseconds. The last bucket is +Inf.
+static const uint64_t bucket_bounds_ns[METRICS_NUM_BUCKETS - 1] =
+{
+    1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000
+};
+
+// The same bounds in seconds, as Prometheus wants them.
+static const char *bucket_labels[METRICS_NUM_BUCKETS] =
+{
+    "1e-06", "5e-06", "1e-05", "2.5e-05", "5e-05", "0.0001", "0.00025", "0.0005",
+    "0.001", "0.0025", "0.005", "0.01", "0.025", "0.05", "0.1", "+Inf"
+};
+
+static const char *endpoint_names[NUM_SCENARIOS] = { "recs", "event", "internal-singlerec", "similar" };
+
+static const char *stage_names[METRICS_NUM_STAGES] =
+{
+    "deserialize", "ratings_fetch", "init_workingset", "tally", "composite", "top_k", "serialize_write", "request"
+};
+
+// Which stages does each endpoint go through? event doesn't make predictions, and similar is a table lookup.
+static const bool endpoint_stages[NUM_SCENARIOS][METRICS_NUM_STAGES] =
+{
+    [SCENARIO_RECS] = { true, true, true, true, true, true, true, true },
+    [SCENARIO_EVENT] = { true, false, false, false, false, false, true, true },
+    [SCENARIO_SINGLEREC] = { true, true, true, true, true, true, true, true },
+    [SCENARIO_SIMILAR] = { true, false, false, false, false, true, true, true },
+};
+
+typedef struct
+{
+    uint64_t buckets[METRICS_NUM_BUCKETS]; // not cumulative; the renderer adds them up
+    uint64_t sum_ns;
+} metrics_hist_t;
+
+typedef struct
+{
+    uint64_t requests[NUM_SCENARIOS];
+    uint64_t errors[NUM_SCENARIOS];
+    uint64_t valences[NUM_SCENARIOS];      // valences tally() visited
+    uint64_t remote_valences[NUM_SCENARIOS]; // the ones it visited from another NUMA node's memory
+    metrics_hist_t hist[NUM_SCENARIOS][METRICS_NUM_STAGES];
+} __attribute__((aligned(64))) metrics_slot_t;
+
+static metrics_slot_t g_local_slots[METRICS_MAX_THREADS];
+static metrics_slot_t *g_slots = g_local_slots;   // shared by all the workers after metrics_share()
+static bool g_shared = false;
+static uint32_t g_num_slots = 0;
+
+static __thread metrics_slot_t *t_slot = NULL;  // this thread's slot, NULL if it has none
+static __thread int t_scenario = -1;            // endpoint of the request in progress, -1 if none
+static __thread bool t_failed;
+static __thread uint64_t t_request_start;
+static __thread uint64_t t_mark;                // when the current stage started
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+} // end now_ns()
+
+
+// Only the owning thread writes a slot, so a relaxed load and store is enough. Readers never see a torn value.
+static inline void bump(uint64_t *counter, uint64_t amount)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+} // end bump()
+
+
+static void record(int stage, uint64_t ns)
+{
+    metrics_hist_t *h = &t_slot->hist[t_scenario][stage];
+    int b = 0;
+    while (b < METRICS_NUM_BUCKETS - 1 && ns > bucket_bounds_ns[b])
+        b++;
+    bump(&h->buckets[b], 1);
+    bump(&h->sum_ns, ns);
+} // end record()
+
+
+// The recgen -w master calls this before it forks, so every worker process writes its own slot of one shared set and
+// any of them can render the totals.
+void metrics_share(void)
+{
+    metrics_slot_t *shared = mmap(NULL, sizeof(g_local_slots), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                                  -1, 0);
+    if (MAP_FAILED == shared)
+    {
+        syslog(LOG_WARNING, "Can't share the metrics between workers: %s. Each one will report its own.",
+               strerror(errno));
+        return;
+    }
+    memcpy(shared, g_local_slots, sizeof(g_local_slots));
+    g_slots = shared;
+    g_shared = true;
+} // end metrics_share()
+
+
+// Call this once from each worker thread before it takes requests. A recgen -w worker process always takes the slot
+// of its worker number, so a restarted worker carries on from the counts of the one it replaced.
+void metrics_register_thread(void)
+{
+    const uint32_t slot = g_prefork_worker >= 0 ? (uint32_t) g_prefork_worker
+                                                : __atomic_fetch_add(&g_num_slots, 1, __ATOMIC_RELAXED);
+    if (slot >= METRICS_MAX_THREADS)
+    {
+        syslog(LOG_WARNING, "More than %d recgen workers. Worker %u won't show up in /bmh/metrics.",
+               METRICS_MAX_THREADS, slot);
+        return;
+    }
+    t_slot = &g_slots[slot];
+} // end metrics_register_thread()
+
+
+// Start timing a request for the passed-in endpoint (one of the SCENARIO_* values).
+void metrics_request_begin(int scenario)
+{
+    if (NULL == t_slot)
+        return;
+    t_scenario = scenario;
+    t_failed = false;
+    t_request_start = t_mark = now_ns();
+} // end metrics_request_begin()
+
+
+// Start the next stage now, without charging the time since the last one to any stage.
+void metrics_mark(void)
+{
+    if (t_scenario < 0)
+        return;
+    t_mark = now_ns();
+} // end metrics_mark()
+
+
+// Charge the time since the last stage ended to this stage.
+void metrics_stage(int stage)
+{
+    if (t_scenario < 0)
+        return;
+    const uint64_t now = now_ns();
+    record(stage, now - t_mark);
+    t_mark = now;
+} // end metrics_stage()
+
+
+void metrics_add_valences(uint64_t visited)
+{
+    if (t_scenario < 0)
+        return;
+    bump(&t_slot->valences[t_scenario], visited);
+    if (numa_running_remote())
+        bump(&t_slot->remote_valences[t_scenario], visited);
+} // end metrics_add_valences()
+
+
+// The request is going back to the client with an error status.
+void metrics_request_failed(void)
+{
+    t_failed = true;
+} // end metrics_request_failed()
+
+
+// Call this after the response is written. The time since the last stage goes to serialize & write.
+void metrics_request_end(void)
+{
+    if (t_scenario < 0)
+        return;
+    const uint64_t now = now_ns();
+    record(METRICS_STAGE_SERIALIZE_WRITE, now - t_mark);
+    record(METRICS_STAGE_REQUEST, now - t_request_start);
+    bump(&t_slot->requests[t_scenario], 1);
+    if (t_failed)
+        bump(&t_slot->errors[t_scenario], 1);
+    t_scenario = -1;
+} // end metrics_request_end()
+
+
+// Append to buf at *used. Once buf is full, *used stays at size and later calls do nothing.
+static void emit(char *buf, size_t size, size_t *used, const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+
+static void emit(char *buf, size_t size, size_t *used, const char *fmt, ...)
+{
+    if (*used >= size)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    const int n = vsnprintf(buf + *used, size - *used, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    *used += (size_t) n;
+    if (*used >= size)
+    {
+        BMH_LOG(LOG_LEVEL_WARNING, "/bmh/metrics output doesn't fit in %zu bytes and was cut short.", size);
+        *used = size;
+    }
+} // end emit()
+
+
+static void emit_counter(char *buf, size_t size, size_t *used, const char *name, const char *help,
+                         const uint64_t values[NUM_SCENARIOS])
+{
+    emit(buf, size, used, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int e = 0; e < NUM_SCENARIOS; e++)
+        emit(buf, size, used, "%s{endpoint=\"%s\"} %" PRIu64 "\n", name, endpoint_names[e], values[e]);
+} // end emit_counter()
+
+
+static void emit_histogram(char *buf, size_t size, size_t *used, const char *name, const char *labels,
+                           const metrics_hist_t *h)
+{
+    uint64_t cumulative = 0;
+    for (int b = 0; b < METRICS_NUM_BUCKETS; b++)
+    {
+        cumulative += h->buckets[b];
+        emit(buf, size, used, "%s_bucket{%s,le=\"%s\"} %" PRIu64 "\n", name, labels, bucket_labels[b], cumulative);
+    }
+    emit(buf, size, used, "%s_sum{%s} %.9f\n", name, labels, (double) h->sum_ns / 1e9);
+    emit(buf, size, used, "%s_count{%s} %" PRIu64 "\n", name, labels, cumulative);
+} // end emit_histogram()
+
+
+static void emit_value(char *buf, size_t size, size_t *used, const char *name, const char *type, const char *help,
+                       uint64_t value)
+{
+    emit(buf, size, used, "# HELP %s %s\n# TYPE %s %s\n%s %" PRIu64 "\n", name, help, name, type, name, value);
+} // end emit_value()
+
+
+// Write the metrics page into buf and return its length.
+size_t metrics_render(char *buf, size_t size)
+{
+    // Sum up all the slots.
+    metrics_slot_t total;
+    memset(&total, 0, sizeof(total));
+
+    const uint32_t num_slots = g_shared ? METRICS_MAX_THREADS : __atomic_load_n(&g_num_slots, __ATOMIC_RELAXED);
+    for (uint32_t s = 0; s < num_slots && s < METRICS_MAX_THREADS; s++)
+    {
+        for (int e = 0; e < NUM_SCENARIOS; e++)
+        {
+            total.requests[e] += __atomic_load_n(&g_slots[s].requests[e], __ATOMIC_RELAXED);
+            total.errors[e] += __atomic_load_n(&g_slots[s].errors[e], __ATOMIC_RELAXED);
+            total.valences[e] += __atomic_load_n(&g_slots[s].valences[e], __ATOMIC_RELAXED);
+            total.remote_valences[e] += __atomic_load_n(&g_slots[s].remote_valences[e], __ATOMIC_RELAXED);
+            for (int st = 0; st < METRICS_NUM_STAGES; st++)
+            {
+                for (int b = 0; b < METRICS_NUM_BUCKETS; b++)
+                    total.hist[e][st].buckets[b] += __atomic_load_n(&g_slots[s].hist[e][st].buckets[b],
+                                                                    __ATOMIC_RELAXED);
+                total.hist[e][st].sum_ns += __atomic_load_n(&g_slots[s].hist[e][st].sum_ns, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    size_t used = 0;
+    buf[0] = '\0';
+
+    emit_counter(buf, size, &used, "bmh_requests_total", "Requests recgen has answered.", total.requests);
+    emit_counter(buf, size, &used, "bmh_request_errors_total", "Requests answered with an error status.",
+                 total.errors);
+    emit_counter(buf, size, &used, "bmh_valences_visited_total", "Valences tally() walked.", total.valences);
+    emit_counter(buf, size, &used, "bmh_valences_remote_total",
+                 "Valences tally() walked while running on a different NUMA node from the copy of the model it read.",
+                 total.remote_valences);
+
+    char labels[96];
+    emit(buf, size, &used, "# HELP bmh_request_duration_seconds Time from reading a request to writing its reply.\n"
+                           "# TYPE bmh_request_duration_seconds histogram\n");
+    for (int e = 0; e < NUM_SCENARIOS; e++)
+    {
+        snprintf(labels, sizeof(labels), "endpoint=\"%s\"", endpoint_names[e]);
+        emit_histogram(buf, size, &used, "bmh_request_duration_seconds", labels, &total.hist[e][METRICS_STAGE_REQUEST]);
+    }
+
+    emit(buf, size, &used, "# HELP bmh_stage_duration_seconds Time spent in each stage of a request.\n"
+                           "# TYPE bmh_stage_duration_seconds histogram\n");
+    for (int e = 0; e < NUM_SCENARIOS; e++)
+    {
+        for (int st = 0; st < METRICS_STAGE_REQUEST; st++)
+        {
+            if (!endpoint_stages[e][st])
+                continue;
+            snprintf(labels, sizeof(labels), "endpoint=\"%s\",stage=\"%s\"", endpoint_names[e], stage_names[st]);
+            emit_histogram(buf, size, &used, "bmh_stage_duration_seconds", labels, &total.hist[e][st]);
+        }
+    }
+
+    result_cache_stats_t rc;
+    if (result_cache_stats(&rc))
+    {
+        emit_value(buf, size, &used, "bmh_result_cache_hits_total", "counter",
+                   "Recs requests answered from the result cache.", rc.hits);
+        emit_value(buf, size, &used, "bmh_result_cache_misses_total", "counter",
+                   "Recs requests the result cache had no answer for.", rc.misses);
+        emit_value(buf, size, &used, "bmh_result_cache_evictions_total", "counter",
+                   "Result cache entries replaced to make room.", rc.evictions);
+        emit_value(buf, size, &used, "bmh_result_cache_invalidations_total", "counter",
+                   "Result cache entries dropped because an event came in for the person.", rc.invalidations);
+        emit_value(buf, size, &used, "bmh_result_cache_entries", "gauge", "Result cache entries in use.", rc.used);
+        emit_value(buf, size, &used, "bmh_result_cache_capacity", "gauge", "Result cache entries it can hold.",
+                   rc.capacity);
+        emit_value(buf, size, &used, "bmh_result_cache_bytes", "gauge", "Memory the result cache takes.", rc.bytes);
+    }
+
+    return used < size ? used : size - 1;
+} // end metrics_render()
@@ -0,0 +1,381 @@
+// SPDX-FileCopyrightText: 2022 Brian Calhoun <brian@bemorehuman.org>
+//
+// SPDX-License-Identifier: MIT
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is furnished to do
+// so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// This file is part of bemorehuman. See https://bemorehuman.org
+
+#define _GNU_SOURCE  // for cpu_set_t, sched_setaffinity() and sched_getcpu(); it has to come before any #include
+#include "recgen.h"
+#include <sched.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+//
+// This file keeps recgen's model close to the workers that read it on machines with more than one NUMA node.
+//
+// tally() reads hundreds of MB of valences per second, and on a multi-socket server they live on whichever node the
+// loading thread ran on, so every worker on another node pays remote-memory latency for every valence. With recgen -n,
+// numa_place_model() copies the read-only model (bb, bb_ds, their segment indexes, the unified or packed layouts, the
+// popularity splits and pop) to every other node, numa_pin_worker() pins each worker to a node round-robin, and the
+// leashes return the copy on the worker's own node. That costs one more copy of the model per node.
+//
+// Either way, /bmh/metrics counts the valences tally() walked while its worker ran on a different node from the copy
+// it read, so you can see what the copies buy.
+//
+
+bool g_numa_replicate = false;   // Copy the model to each NUMA node and pin the workers. See recgen -n.
+
+#define NUMA_MAX_COPIES 16       // arrays in a model_replica_t that get copied
+
+static int g_num_nodes = 0;                         // nodes with CPUs, at most NUMA_MAX_NODES
+static int g_node_id[NUMA_MAX_NODES];               // the kernel's number for each of them
+static cpu_set_t g_node_cpus[NUMA_MAX_NODES];
+static int16_t g_cpu_node[CPU_SETSIZE];             // node number of each CPU, -1 if unknown
+static pthread_once_t g_discover_once = PTHREAD_ONCE_INIT;
+
+static model_replica_t g_replicas[NUMA_MAX_NODES];  // indexed like g_node_id
+static int g_home = 0;                              // the g_replicas entry that points at the loaded model
+static bool g_replicated = false;                   // true while the copies are good to read
+static void *g_copies[NUMA_MAX_NODES][NUMA_MAX_COPIES];
+static int g_num_copies[NUMA_MAX_NODES];
+static char g_labels[NUMA_MAX_NODES][NUMA_MAX_COPIES][48];
+static uint32_t g_next_worker = 0;
+
+static __thread const model_replica_t *t_replica = NULL;  // this worker's copy, NULL if it isn't pinned
+
+
+// Read a sysfs list like "0-3,8-11" into set. Returns false if there's no such file.
+static bool read_list(const char *path, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    FILE *fp = fopen(path, "r");
+    if (NULL == fp)
+        return (false);
+
+    char line[4096];
+    const bool got = NULL != fgets(line, sizeof(line), fp);
+    fclose(fp);
+    if (!got)
+        return (false);
+
+    for (const char *s = line; '\0' != *s && '\n' != *s;)
+    {
+        char *end;
+        long lo = strtol(s, &end, 10);
+        if (end == s)
+            break;
+        long hi = lo;
+        if ('-' == *end)
+            hi = strtol(end + 1, &end, 10);
+        for (long i = lo; i <= hi && i < CPU_SETSIZE; i++)
+            CPU_SET((int) i, set);
+        s = ',' == *end ? end + 1 : end;
+    }
+    return (true);
+} // end read_list()
+
+
+static void discover(void)
+{
+    for (int c = 0; c < CPU_SETSIZE; c++)
+        g_cpu_node[c] = -1;
+
+    cpu_set_t online;
+    if (read_list("/sys/devices/system/node/online", &online))
+    {
+        for (int n = 0; n < CPU_SETSIZE; n++)
+        {
+            if (!CPU_ISSET(n, &online))
+                continue;
+
+            char path[PATH_SIZE];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+            cpu_set_t cpus;
+            if (!read_list(path, &cpus) || 0 == CPU_COUNT(&cpus))
+                continue;  // memory-only nodes can't run a worker
+            if (NUMA_MAX_NODES == g_num_nodes)
+            {
+                syslog(LOG_WARNING, "More than %d NUMA nodes. recgen -n only uses the first %d.", NUMA_MAX_NODES,
+                       NUMA_MAX_NODES);
+                break;
+            }
+
+            g_node_id[g_num_nodes] = n;
+            g_node_cpus[g_num_nodes] = cpus;
+            for (int c = 0; c < CPU_SETSIZE; c++)
+                if (CPU_ISSET(c, &cpus))
+                    g_cpu_node[c] = (int16_t) n;
+            g_num_nodes++;
+        }
+    }
+
+    // No NUMA information means one node with every CPU we may run on.
+    if (0 == g_num_nodes)
+    {
+        g_node_id[0] = 0;
+        CPU_ZERO(&g_node_cpus[0]);
+        sched_getaffinity(0, sizeof(cpu_set_t), &g_node_cpus[0]);
+        g_num_nodes = 1;
+    }
+} // end discover()
+
+
+// How many NUMA nodes with CPUs this machine has. 1 if it doesn't say.
+int numa_num_nodes()
+{
+    pthread_once(&g_discover_once, discover);
+    return g_num_nodes;
+} // end numa_num_nodes()
+
+
+// Where in g_node_id node is, or -1.
+static int node_index(int node)
+{
+    for (int i = 0; i < numa_num_nodes(); i++)
+        if (g_node_id[i] == node)
+            return i;
+    return -1;
+} // end node_index()
+
+
+// The node of the CPU this thread is running on right now, or -1.
+static int current_node(void)
+{
+    const int cpu = sched_getcpu();
+    return cpu >= 0 && cpu < CPU_SETSIZE ? g_cpu_node[cpu] : -1;
+} // end current_node()
+
+
+// The NUMA node holding the page at addr, or -1 if the kernel won't say.
+int numa_node_of(const void *addr)
+{
+#ifdef __linux__
+    int node = -1;
+    if (NULL != addr && 0 == syscall(SYS_get_mempolicy, &node, NULL, 0, addr, MPOL_F_NODE | MPOL_F_ADDR))
+        return node;
+#else
+    (void) addr;
+#endif
+    return -1;
+} // end numa_node_of()
+
+
+// Keep this thread on the CPUs of node. Returns false if there's no such node or the kernel says no.
+bool numa_pin_to_node(int node)
+{
+    const int i = node_index(node);
+    return i >= 0 && 0 == sched_setaffinity(0, sizeof(cpu_set_t), &g_node_cpus[i]);
+} // end numa_pin_to_node()
+
+
+// Take every page this thread touches from now on from node only.
+static void bind_memory(int node)
+{
+#ifdef __linux__
+    unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    mask[(size_t) node / (8 * sizeof(unsigned long))] |= 1UL << ((size_t) node % (8 * sizeof(unsigned long)));
+    if (0 != syscall(SYS_set_mempolicy, MPOL_BIND, mask, (unsigned long) CPU_SETSIZE))
+        syslog(LOG_WARNING, "Can't bind the copy of the model for NUMA node %d to it: %s", node, strerror(errno));
+#else
+    (void) node;
+#endif
+} // end bind_memory()
+
+
+// Copy size bytes of src into a new array for g_replicas[i]. If there's no memory for it, that node keeps reading
+// src.
+static void *copy_array(int i, const void *src, size_t size, const char *what)
+{
+    if (NULL == src || 0 == size)
+        return (void *) src;
+
+    char *label = g_labels[i][g_num_copies[i]];
+    snprintf(label, sizeof(g_labels[i][0]), "%s on NUMA node %d", what, g_node_id[i]);
+    void *copy = huge_calloc(1, size, label);
+    if (NULL == copy)
+    {
+        syslog(LOG_WARNING, "WARNING: Out of memory for the %s. Workers there will read it remotely.", label);
+        return (void *) src;
+    }
+    memcpy(copy, src, size);
+    g_copies[i][g_num_copies[i]++] = copy;
+    return copy;
+} // end copy_array()
+
+
+// Runs on a thread of its own for each node that needs a copy, so the copy's pages come from that node.
+static void *copy_model(void *arg)
+{
+    const int i = (int) (intptr_t) arg;
+    const int node = g_node_id[i];
+    if (!numa_pin_to_node(node))
+        syslog(LOG_WARNING, "Can't run on NUMA node %d to copy the model there: %s", node, strerror(errno));
+    bind_memory(node);
+
+    const model_replica_t *home = &g_replicas[g_home];
+    model_replica_t *r = &g_replicas[i];
+    r->node = node;
+    r->bb = copy_array(i, home->bb, huge_size(home->bb), "bb");
+    r->bind_seg = copy_array(i, home->bind_seg, huge_size(home->bind_seg), "bind_seg");
+    r->bb_ds = copy_array(i, home->bb_ds, huge_size(home->bb_ds), "bb_ds");
+    r->bind_seg_ds = copy_array(i, home->bind_seg_ds, huge_size(home->bind_seg_ds), "bind_seg_ds");
+    r->bb_uni = copy_array(i, home->bb_uni, huge_size(home->bb_uni), "bb_uni");
+    r->bind_seg_uni = copy_array(i, home->bind_seg_uni, huge_size(home->bind_seg_uni), "bind_seg_uni");
+    r->packed = NULL;
+    if (NULL != home->packed)
+    {
+        const packed_adjacency_t *pk = home->packed;
+        r->packed_copy.val_seg = copy_array(i, pk->val_seg, huge_size(pk->val_seg), "packed val_seg");
+        r->packed_copy.key_seg = copy_array(i, pk->key_seg, huge_size(pk->key_seg), "packed key_seg");
+        r->packed_copy.soindex = copy_array(i, pk->soindex, huge_size(pk->soindex), "packed soindex");
+        r->packed_copy.keys = copy_array(i, pk->keys, huge_size(pk->keys), "packed keys");
+        r->packed_copy.key_bytes = pk->key_bytes;
+        r->packed = &r->packed_copy;
+    }
+    r->pop = copy_array(i, home->pop, (BE.num_elts + 1) * sizeof(popularity_t), "pop");
+    r->split = copy_array(i, home->split, huge_size(home->split), "bb_pop");
+    r->split_ds = copy_array(i, home->split_ds, huge_size(home->split_ds), "bb_pop_ds");
+
+    return NULL;
+} // end copy_model()
+
+
+// Stop handing out the copies and free them. initialize_structures() calls this before it reloads the model, so the
+// loaders see the loaded arrays through the leashes.
+void numa_drop_replicas()
+{
+    g_replicated = false;
+    for (int i = 0; i < NUMA_MAX_NODES; i++)
+    {
+        for (int c = 0; c < g_num_copies[i]; c++)
+            huge_free(g_copies[i][c]);
+        g_num_copies[i] = 0;
+    }
+} // end numa_drop_replicas()
+
+
+// Find the node the model was loaded on and, with recgen -n, copy it to every other node. Call it once the whole
+// model is loaded, before the workers start or after a reload.
+void numa_place_model()
+{
+    numa_drop_replicas();
+
+    model_replica_t loaded;
+    memset(&loaded, 0, sizeof(loaded));
+    loaded.bb = bb_leash();
+    loaded.bind_seg = bind_seg_leash();
+    loaded.bb_ds = bb_ds_leash();
+    loaded.bind_seg_ds = bind_seg_ds_leash();
+    loaded.bb_uni = bb_uni_leash();
+    loaded.bind_seg_uni = bind_seg_uni_leash();
+    loaded.packed = packed_leash();
+    loaded.pop = pop_leash();
+    loaded.split = pop_split_leash();
+    loaded.split_ds = pop_split_ds_leash();
+
+    const void *first = NULL != loaded.bb ? (const void *) loaded.bb
+                      : NULL != loaded.bb_uni ? (const void *) loaded.bb_uni
+                      : NULL != loaded.packed ? (const void *) loaded.packed->keys : NULL;
+    int node = numa_node_of(first);
+    if (node_index(node) < 0)
+        node = current_node();
+    g_home = node_index(node) < 0 ? 0 : node_index(node);
+    loaded.node = g_node_id[g_home];
+    g_replicas[g_home] = loaded;
+
+    if (numa_num_nodes() < 2)
+    {
+        if (g_numa_replicate)
+            syslog(LOG_INFO, "There's only one NUMA node, so recgen -n has nothing to do.");
+        return;
+    }
+    if (!g_numa_replicate)
+    {
+        syslog(LOG_INFO, "The model is on NUMA node %d of %d. Workers on the other nodes read it remotely; recgen -n "
+               "would copy it to each node.", g_node_id[g_home], numa_num_nodes());
+        return;
+    }
+
+    const long long start = current_time_millis();
+    pthread_t threads[NUMA_MAX_NODES];
+    for (int i = 0; i < numa_num_nodes(); i++)
+    {
+        if (i != g_home && 0 != pthread_create(&threads[i], NULL, copy_model, (void *) (intptr_t) i))
+        {
+            syslog(LOG_ERR, "Can't start a thread to copy the model to NUMA node %d. Exiting.", g_node_id[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < numa_num_nodes(); i++)
+        if (i != g_home)
+            pthread_join(threads[i], NULL);
+
+    g_replicated = true;
+    const long long took = current_time_millis() - start;
+    printf("Copied the model from NUMA node %d to %d other node(s) in %lld milliseconds.\n", g_node_id[g_home],
+           numa_num_nodes() - 1, took);
+    syslog(LOG_INFO, "Copied the model from NUMA node %d to %d other node(s) in %lld milliseconds.", g_node_id[g_home],
+           numa_num_nodes() - 1, took);
+} // end numa_place_model()
+
+
+// Call this from each worker before it allocates its workingset. With recgen -n, it pins the worker to the next node
+// round-robin (by worker number for recgen -w), starting with the node the model was loaded on, and points the
+// worker's leashes at that node's copy.
+void numa_pin_worker()
+{
+    if (!g_replicated)
+        return;
+
+    const uint32_t worker = g_prefork_worker >= 0 ? (uint32_t) g_prefork_worker
+                                                  : __atomic_fetch_add(&g_next_worker, 1, __ATOMIC_RELAXED);
+    const int i = (int) ((g_home + worker) % (uint32_t) numa_num_nodes());
+    if (!numa_pin_to_node(g_node_id[i]))
+    {
+        BMH_LOG(LOG_LEVEL_WARNING, "Can't pin worker %u to NUMA node %d: %s", worker, g_node_id[i], strerror(errno));
+        return;
+    }
+    t_replica = &g_replicas[i];
+    BMH_LOG(LOG_LEVEL_INFO, "Worker %u is on NUMA node %d.", worker, g_node_id[i]);
+} // end numa_pin_worker()
+
+
+// The copy of the model for this worker's node, or NULL to use the loaded one.
+const model_replica_t *numa_replica()
+{
+    return g_replicated ? t_replica : NULL;
+} // end numa_replica()
+
+
+// Is this thread running on a different node from the copy of the model it reads?
+bool numa_running_remote()
+{
+    if (g_num_nodes < 2)
+        return (false);
+
+    const int node = current_node();
+    const model_replica_t *r = numa_replica();
+    return node >= 0 && node != (NULL != r ? r->node : g_replicas[g_home].node);
+} // end numa_running_remote()
@@ -0,0 +1,430 @@
+// SPDX-FileCopyrightText: 2022 Brian Calhoun <brian@bemorehuman.org>
+//
+// SPDX-License-Identifier: MIT
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is furnished to do
+// so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// This file is part of bemorehuman. See https://bemorehuman.org
+
+#include "recgen.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PACKED_HAVE_SSSE3
+#endif
+
+//
+// This file builds and serves the packed valence cache.
+//
+// recgen -p reads the 4 valence cache files, lays each element's bb_ds and bb segments side by side the way the
+// unified adjacency does, and stores the sorted eltids of each run as stream-vbyte deltas next to a plain soindex
+// array. recgen -z serves from it with tally_packed(), which decodes PACKED_BLOCK eltids at a time onto the stack.
+// The decoder uses SSSE3 when the CPU has it, and plain C otherwise.
+//
+
+bool g_packed_valences = false;  // Serve from the packed cache instead of the bb and bb_ds. See recgen -z.
+
+static packed_adjacency_t g_packed;           // all NULL if we're not serving from the packed cache
+static bool g_packed_loaded = false;
+
+static uint8_t g_group_length[256];           // bytes of data after each control byte
+static uint8_t g_group_shuffle[256][16];      // pshufb masks that spread a group's data into 4 uint32's
+
+typedef const uint8_t *(*packed_decoder_t)(const uint8_t *, uint32_t *, uint32_t, uint32_t *);
+static packed_decoder_t g_decoder = NULL;
+
+
+// Decode num_groups groups into out, adding each delta to *prev as we go. Returns where the next group starts.
+static const uint8_t *decode_scalar(const uint8_t *in, uint32_t *out, uint32_t num_groups, uint32_t *prev)
+{
+    uint32_t p = *prev;
+
+    for (uint32_t g = 0; g < num_groups; g++)
+    {
+        const uint8_t control = *in++;
+        for (int k = 0; k < PACKED_GROUP; k++)
+        {
+            const int code = (control >> (2 * k)) & 3;
+            uint32_t delta = in[0];
+            if (code >= 1) delta |= (uint32_t) in[1] << 8;
+            if (code >= 2) delta |= (uint32_t) in[2] << 16;
+            if (code >= 3) delta |= (uint32_t) in[3] << 24;
+            in += code + 1;
+            p += delta;
+            *out++ = p;
+        }
+    }
+    *prev = p;
+    return in;
+} // end decode_scalar()
+
+
+#ifdef PACKED_HAVE_SSSE3
+// Same as decode_scalar(), but one pshufb spreads each group into 4 lanes and two shifted adds do the prefix sum.
+__attribute__((target("ssse3")))
+static const uint8_t *decode_ssse3(const uint8_t *in, uint32_t *out, uint32_t num_groups, uint32_t *prev)
+{
+    __m128i p = _mm_set1_epi32((int) *prev);
+
+    for (uint32_t g = 0; g < num_groups; g++)
+    {
+        const uint8_t control = *in++;
+        const __m128i data = _mm_loadu_si128((const __m128i *) in);
+        __m128i v = _mm_shuffle_epi8(data, _mm_loadu_si128((const __m128i *) g_group_shuffle[control]));
+        in += g_group_length[control];
+
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+        v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi32(v, p);
+        _mm_storeu_si128((__m128i *) out, v);
+        out += PACKED_GROUP;
+        p = _mm_shuffle_epi32(v, 0xff);
+    }
+    *prev = (uint32_t) _mm_cvtsi128_si32(p);
+    return in;
+} // end decode_ssse3()
+#endif
+
+
+// Fill in the group tables and pick a decoder. Safe to call more than once.
+static void init_decoder()
+{
+    if (NULL != g_decoder)
+        return;
+
+    for (int control = 0; control < 256; control++)
+    {
+        int pos = 0;
+        for (int k = 0; k < PACKED_GROUP; k++)
+        {
+            const int len = ((control >> (2 * k)) & 3) + 1;
+            for (int b = 0; b < 4; b++)
+                g_group_shuffle[control][4 * k + b] = (uint8_t) (b < len ? pos + b : 0x80);
+            pos += len;
+        }
+        g_group_length[control] = (uint8_t) pos;
+    }
+
+    g_decoder = decode_scalar;
+#ifdef PACKED_HAVE_SSSE3
+    if (__builtin_cpu_supports("ssse3"))
+        g_decoder = decode_ssse3;
+#endif
+    syslog(LOG_INFO, "Packed valences decode with %s.", decode_scalar == g_decoder ? "plain C" : "SSSE3");
+} // end init_decoder()
+
+
+const uint8_t *packed_decode(const uint8_t *in, uint32_t *out, uint32_t num_groups, uint32_t *prev)
+{
+    return g_decoder(in, out, num_groups, prev);
+} // end packed_decode()
+
+
+// One valence with its whole 32-bit eltid, while we sort and encode a run.
+typedef struct
+{
+    exp_elt_t eltid;
+    uint8_t soindex;
+} packed_item_t;
+
+
+static int itemcmp(const void *p1, const void *p2)
+{
+    const exp_elt_t a = ((const packed_item_t *) p1)->eltid;
+    const exp_elt_t b = ((const packed_item_t *) p2)->eltid;
+    return (a > b) - (a < b);
+} // end itemcmp()
+
+
+// Encode one run of n valences, sorted by eltid, into keys and soindex. Returns where the next run's keys start.
+static uint8_t *encode_run(uint8_t *keys, uint8_t *soindex, const packed_item_t *run, uint64_t n)
+{
+    exp_elt_t prev = 0;
+
+    for (uint64_t i = 0; i < n; i += PACKED_GROUP)
+    {
+        uint8_t *control = keys++;
+        *control = 0;
+        for (uint64_t k = 0; k < PACKED_GROUP; k++)
+        {
+            uint32_t delta = 0;
+            if (i + k < n)
+            {
+                delta = run[i + k].eltid - prev;
+                prev = run[i + k].eltid;
+                soindex[i + k] = run[i + k].soindex;
+            }
+            const int code = delta < (1U << 8) ? 0 : delta < (1U << 16) ? 1 : delta < (1U << 24) ? 2 : 3;
+            *control |= (uint8_t) (code << (2 * k));
+            for (int b = 0; b <= code; b++)
+                *keys++ = (uint8_t) (delta >> (8 * b));
+        }
+    }
+    return keys;
+} // end encode_run()
+
+
+// Gather element e's segment into run with whole eltids, sorted. Returns how many there are.
+static uint64_t gather_run(packed_item_t *run, const valence_t *src, const seg_ptr_t *idx, uint64_t e)
+{
+    bool sorted = true;
+    uint64_t n = 0;
+    seg_walk_t walk;
+    uint64_t start, stop;
+    exp_elt_t base;
+
+    seg_walk_start(&walk, idx, SEG_ROWS(BE.num_elts), e, GET_SEG(idx[e + 1]));
+    while (seg_walk_next(&walk, &start, &stop, &base))
+    {
+        for (uint64_t v = start; v < stop; v++, n++)
+        {
+            run[n].eltid = base | GET_ELT(src[v].eltid);
+            run[n].soindex = src[v].soindex;
+            if (n > 0 && run[n - 1].eltid > run[n].eltid) sorted = false;
+        }
+    }
+    if (!sorted)
+        qsort(run, n, sizeof(packed_item_t), itemcmp);
+    return n;
+} // end gather_run()
+
+
+// Build the packed adjacency from the bb and bb_ds. Returns false if we run out of memory.
+bool pack_adjacency(packed_adjacency_t *pk, const valence_t *bb, const seg_ptr_t *bind_seg, const valence_t *bb_ds,
+                    const seg_ptr_t *bind_seg_ds)
+{
+    const uint64_t num_valences = GET_SEG(bind_seg[SEG_ROWS(BE.num_elts) - 1]);
+    const uint64_t num_runs = 2 * (BE.num_elts + 1);
+
+    init_decoder();
+    memset(pk, 0, sizeof(*pk));
+
+    // The longest a run can be is 17 bytes for each group of 4, so start with that and give the rest back at the end.
+    uint64_t longest = 0;
+    for (uint64_t e = 0; e <= BE.num_elts; e++)
+    {
+        const uint64_t x_count = GET_SEG(bind_seg[e + 1]) - GET_SEG(bind_seg[e]);
+        const uint64_t y_count = GET_SEG(bind_seg_ds[e + 1]) - GET_SEG(bind_seg_ds[e]);
+        if (x_count > longest) longest = x_count;
+        if (y_count > longest) longest = y_count;
+    }
+    const uint64_t max_key_bytes = (2 * num_valences + PACKED_GROUP * num_runs) / PACKED_GROUP * 17;
+
+    pk->val_seg = huge_calloc(PACKED_SEG_ENTRIES(BE.num_elts), sizeof(seg_ptr_t), "packed val_seg");
+    pk->key_seg = huge_calloc(PACKED_SEG_ENTRIES(BE.num_elts), sizeof(seg_ptr_t), "packed key_seg");
+    pk->soindex = huge_calloc(2 * num_valences + 1, sizeof(uint8_t), "packed soindex");
+    pk->keys = huge_calloc(max_key_bytes + PACKED_PAD, sizeof(uint8_t), "packed keys");
+    packed_item_t *run = calloc(longest + 1, sizeof(packed_item_t));
+    if (NULL == pk->val_seg || NULL == pk->key_seg || NULL == pk->soindex || NULL == pk->keys || NULL == run)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when packing the valences.");
+        free(run);
+        return (false);
+    }
+
+    uint64_t offset = 0;
+    uint8_t *keys = pk->keys;
+    for (uint64_t e = 0; e <= BE.num_elts; e++)
+    {
+        // The y side first, then the x side, same as the unified adjacency.
+        for (int side = 0; side < 2; side++)
+        {
+            const uint64_t n = side ? gather_run(run, bb, bind_seg, e) : gather_run(run, bb_ds, bind_seg_ds, e);
+
+            SET_SEG(pk->val_seg[2 * e + side], offset);
+            SET_SEG(pk->key_seg[2 * e + side], (uint64_t) (keys - pk->keys));
+            keys = encode_run(keys, &pk->soindex[offset], run, n);
+            offset += n;
+        }
+    }
+    SET_SEG(pk->val_seg[2 * BE.num_elts + 2], offset);
+    pk->key_bytes = (uint64_t) (keys - pk->keys);
+    SET_SEG(pk->key_seg[2 * BE.num_elts + 2], pk->key_bytes);
+    free(run);
+
+    // Give back what we didn't use, keeping the zero padding.
+    uint8_t *shrunk = huge_calloc(pk->key_bytes + PACKED_PAD, sizeof(uint8_t), "packed keys");
+    if (NULL != shrunk)
+    {
+        memcpy(shrunk, pk->keys, pk->key_bytes);
+        huge_free(pk->keys);
+        pk->keys = shrunk;
+    }
+    memset(&pk->keys[pk->key_bytes], 0, PACKED_PAD);
+
+    return (true);
+} // end pack_adjacency()
+
+
+static void packed_filename(char *filename, size_t size)
+{
+    strlcpy(filename, BE.valence_cache_dir, size);
+    strlcat(filename, "/", size);
+    strlcat(filename, VALENCES_PACKED, size);
+} // end packed_filename()
+
+
+//
+// This generates the packed valence cache from the valence caches, so run it after recgen -c and recgen -d.
+// To use, invoke the recgen executable with "-p", then serve from it with "-z".
+//
+void gen_packed_cache()
+{
+    printf("Begin timing for generating packed valence cache.\n");
+    const long long start = current_time_millis();
+
+    populate_ncv();
+
+    // We need both the bb and the bb_ds, same as the unified adjacency.
+    if (true != load_beast(LOAD_VALENCES_FROM_BEAST_EXPORT, true))
+        exit(EXIT_MEMLOAD);
+
+    packed_adjacency_t pk;
+    if (!pack_adjacency(&pk, bb_leash(), bind_seg_leash(), bb_ds_leash(), bind_seg_ds_leash()))
+        exit(EXIT_MEMLOAD);
+
+    char filename[strlen(BE.valence_cache_dir) + strlen(VALENCES_PACKED) + 2];
+    packed_filename(filename, sizeof(filename));
+
+    FILE *fp = fopen(filename, "w");
+    if (NULL == fp)
+    {
+        syslog(LOG_ERR, "ERROR: cannot open output file %s", filename);
+        exit(-1);
+    }
+
+    packed_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACKED_MAGIC, sizeof(header.magic));
+    header.version = PACKED_VERSION;
+    header.num_elts = BE.num_elts;
+    header.num_valences = g_num_confident_valences;
+    header.key_bytes = pk.key_bytes;
+
+    const size_t num_entries = PACKED_SEG_ENTRIES(BE.num_elts);
+    if (fwrite(&header, sizeof(header), 1, fp) != 1
+        || fwrite(pk.val_seg, sizeof(seg_ptr_t), num_entries, fp) != num_entries
+        || fwrite(pk.key_seg, sizeof(seg_ptr_t), num_entries, fp) != num_entries
+        || fwrite(pk.soindex, sizeof(uint8_t), 2 * g_num_confident_valences, fp) != 2 * g_num_confident_valences
+        || fwrite(pk.keys, sizeof(uint8_t), pk.key_bytes, fp) != pk.key_bytes)
+    {
+        syslog(LOG_ERR, "ERROR: cannot write to %s", filename);
+        exit(-1);
+    }
+    fclose(fp);
+
+    const uint64_t packed_bytes = 2 * g_num_confident_valences + pk.key_bytes;
+    const uint64_t unpacked_bytes = 2 * g_num_confident_valences * sizeof(valence_t);
+    const long long finish = current_time_millis();
+    printf("Packed %zu valences each way into %" PRIu64 " bytes instead of %" PRIu64 " (%.1f%% smaller) in %s.\n",
+           g_num_confident_valences, packed_bytes, unpacked_bytes,
+           unpacked_bytes ? 100.0 * (1.0 - (double) packed_bytes / (double) unpacked_bytes) : 0.0, filename);
+    printf("Time to generate packed valence cache: %d milliseconds.\n", (int) (finish - start));
+} // end gen_packed_cache()
+
+
+static void free_packed(packed_adjacency_t *pk)
+{
+    huge_free(pk->val_seg);
+    huge_free(pk->key_seg);
+    huge_free(pk->soindex);
+    huge_free(pk->keys);
+    memset(pk, 0, sizeof(*pk));
+} // end free_packed()
+
+
+// Load the packed valence cache that recgen -p wrote. Returns false if it's missing, old, or from other valences.
+bool packed_load()
+{
+    if (g_packed_loaded)
+    {
+        free_packed(&g_packed);
+        g_packed_loaded = false;
+    }
+    init_decoder();
+
+    char filename[strlen(BE.valence_cache_dir) + strlen(VALENCES_PACKED) + 2];
+    packed_filename(filename, sizeof(filename));
+
+    FILE *fp = fopen(filename, "r");
+    if (NULL == fp)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: No packed valence cache at %s. Run recgen -p first.", filename);
+        return (false);
+    }
+
+    packed_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1
+        || memcmp(header.magic, PACKED_MAGIC, sizeof(header.magic)) != 0
+        || header.version != PACKED_VERSION)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: %s isn't a packed valence cache this recgen can read. Run recgen -p again.",
+               filename);
+        fclose(fp);
+        return (false);
+    }
+    if (header.num_elts != BE.num_elts || header.num_valences != g_num_confident_valences)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: %s was built from different valences. Run recgen -p again.", filename);
+        fclose(fp);
+        return (false);
+    }
+
+    const size_t num_entries = PACKED_SEG_ENTRIES(BE.num_elts);
+    packed_adjacency_t *pk = &g_packed;
+    pk->key_bytes = header.key_bytes;
+    pk->val_seg = huge_calloc(num_entries, sizeof(seg_ptr_t), "packed val_seg");
+    pk->key_seg = huge_calloc(num_entries, sizeof(seg_ptr_t), "packed key_seg");
+    pk->soindex = huge_calloc(2 * g_num_confident_valences + 1, sizeof(uint8_t), "packed soindex");
+    pk->keys = huge_calloc(pk->key_bytes + PACKED_PAD, sizeof(uint8_t), "packed keys");
+    if (NULL == pk->val_seg || NULL == pk->key_seg || NULL == pk->soindex || NULL == pk->keys)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when loading the packed valence cache.");
+        free_packed(pk);
+        fclose(fp);
+        return (false);
+    }
+
+    if (fread(pk->val_seg, sizeof(seg_ptr_t), num_entries, fp) != num_entries
+        || fread(pk->key_seg, sizeof(seg_ptr_t), num_entries, fp) != num_entries
+        || fread(pk->soindex, sizeof(uint8_t), 2 * g_num_confident_valences, fp) != 2 * g_num_confident_valences
+        || fread(pk->keys, sizeof(uint8_t), pk->key_bytes, fp) != pk->key_bytes)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: %s is short. Run recgen -p again.", filename);
+        free_packed(pk);
+        fclose(fp);
+        return (false);
+    }
+    fclose(fp);
+
+    g_packed_loaded = true;
+    syslog(LOG_INFO, "Successfully loaded the packed valence cache: %" PRIu64 " bytes instead of %zu.",
+           2 * g_num_confident_valences + pk->key_bytes, 2 * g_num_confident_valences * sizeof(valence_t));
+    return (true);
+} // end packed_load()
+
+
+const packed_adjacency_t *packed_leash()
+{
+    const model_replica_t *local = numa_replica();
+    if (NULL != local)
+        return local->packed;
+    return g_packed_loaded ? &g_packed : NULL;
+} // end packed_leash()
@@ -0,0 +1,347 @@
+// SPDX-FileCopyrightText: 2022 Brian Calhoun <brian@bemorehuman.org>
+//
+// SPDX-License-Identifier: MIT
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is furnished to do
+// so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// This file is part of bemorehuman. See https://bemorehuman.org
+
+#include "recgen.h"
+
+//
+// This file partitions each row of the valence cache by popularity bucket.
+//
+// A request with a target popularity only returns elements in buckets 1..target_pop, but tally() used to accumulate
+// every valence of a rated element and let top_recs() throw the rest away. recgen -c and recgen -d sort each row of
+// the bb and bb_ds by the popularity bucket of its elements, most popular first, and write where each bucket ends to
+// bb_pop.bin and bb_pop_ds.bin. tally() then stops each row at the end of the target bucket.
+//
+
+static pop_split_t *g_pop_split = NULL;      // one per row of the bind_seg, or NULL if we walk whole rows
+static pop_split_t *g_pop_split_ds = NULL;   // one per row of the bind_seg_ds
+
+
+// 64-bit FNV-1a of the catalog's popularities, so a split for an older pop.out doesn't get used.
+static uint64_t pop_hash(const popularity_t *pop)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (uint64_t e = 0; e <= BE.num_elts; e++)
+    {
+        hash ^= pop[e];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+} // end pop_hash()
+
+
+// Which bucket a row sorts an element into. Anything past HIGHEST_POP_NUMBER goes after every bucket, since top_recs()
+// never returns it, and anything under LOWEST_POP_NUMBER goes with it since top_recs() always does.
+static unsigned pop_bucket(popularity_t p)
+{
+    if (p < LOWEST_POP_NUMBER) return LOWEST_POP_NUMBER;
+    if (p > HIGHEST_POP_NUMBER) return HIGHEST_POP_NUMBER + 1;
+    return p;
+} // end pop_bucket()
+
+
+// The catalog's popularities, indexed by the valence cache's element ids instead. The caller frees it.
+popularity_t *pop_internal(const popularity_t *pop)
+{
+    popularity_t *out = calloc(BE.num_elts + 1, sizeof(popularity_t));
+    if (NULL == out)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when partitioning the valences by popularity.");
+        exit(EXIT_MEMLOAD);
+    }
+    for (uint64_t e = 0; e <= BE.num_elts; e++)
+        out[e] = pop[elt_external((exp_elt_t) e)];
+    return out;
+} // end pop_internal()
+
+
+// Sort each row of an adjacency (bb or bb_ds) by its elements' popularity bucket, keeping the eltids ascending within
+// a bucket, and return where each bucket ends, allocated with huge_calloc() as what. pop is indexed by the adjacency's
+// own element ids. The pages move with the valences, so *bind_seg gets a new page directory, and moves if that needs
+// more room.
+pop_split_t *partition_by_pop(valence_t *bb, seg_ptr_t **bind_seg, const popularity_t *pop, const char *what)
+{
+    const uint64_t rows = SEG_ROWS(BE.num_elts);
+
+    // The long rows get their splits after the short ones.
+    uint64_t num_long = 0;
+    for (uint64_t r = 0; r + 1 < rows; r++)
+        if (GET_SEG((*bind_seg)[r + 1]) - GET_SEG((*bind_seg)[r]) > POP_SPLIT_SHORT_ROW)
+            num_long++;
+    pop_split_t *split = huge_calloc((size_t) (rows + 2 * num_long), sizeof(pop_split_t), what);
+    if (NULL == split)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when partitioning the valences by popularity.");
+        exit(EXIT_MEMLOAD);
+    }
+    pop_split_t *long_split = &split[rows];
+    num_long = 0;
+
+    uint8_t *page = seg_page_array(GET_SEG((*bind_seg)[rows - 1]), "bind_seg");
+    exp_elt_t *id = NULL;
+    valence_t *tmp = NULL;
+    uint64_t tmp_size = 0;
+
+    for (uint64_t r = 0; r + 1 < rows; r++)
+    {
+        const uint64_t start = GET_SEG((*bind_seg)[r]);
+        const uint64_t count = GET_SEG((*bind_seg)[r + 1]) - start;
+        uint64_t next[HIGHEST_POP_NUMBER + 2] = { 0 };
+
+        if (count > tmp_size)
+        {
+            free(tmp);
+            free(id);
+            tmp_size = count;
+            tmp = malloc(tmp_size * sizeof(valence_t));
+            id = malloc(tmp_size * sizeof(exp_elt_t));
+            if (NULL == tmp || NULL == id)
+            {
+                syslog(LOG_ERR, "FATAL ERROR: Out of memory when partitioning the valences by popularity.");
+                exit(EXIT_MEMLOAD);
+            }
+        }
+
+        // The whole ids, with their pages from the directory.
+        seg_walk_t walk;
+        uint64_t run_start, run_stop;
+        exp_elt_t base;
+        seg_walk_start(&walk, *bind_seg, rows, r, start + count);
+        while (seg_walk_next(&walk, &run_start, &run_stop, &base))
+            for (uint64_t v = run_start; v < run_stop; v++)
+                id[v - start] = base | GET_ELT(bb[v].eltid);
+
+        // Count each bucket, then turn the counts into where each bucket starts.
+        for (uint64_t i = 0; i < count; i++)
+            next[pop_bucket(pop[id[i]])]++;
+        if (count > POP_SPLIT_SHORT_ROW)
+        {
+            split[r].end[0] = POP_SPLIT_LONG;
+            split[r].end[1] = (uint16_t) num_long;
+            split[r].end[2] = (uint16_t) (num_long >> 16);
+        }
+        uint64_t sum = 0;
+        for (unsigned b = LOWEST_POP_NUMBER; b <= HIGHEST_POP_NUMBER + 1; b++)
+        {
+            const uint64_t c = next[b];
+            next[b] = sum;
+            sum += c;
+            if (b >= HIGHEST_POP_NUMBER)
+                continue;
+            if (count <= POP_SPLIT_SHORT_ROW)
+                split[r].end[b - 1] = (uint16_t) sum;
+            else
+            {
+                long_split[2 * num_long].end[b - 1] = (uint16_t) sum;
+                long_split[2 * num_long + 1].end[b - 1] = (uint16_t) (sum >> 16);
+            }
+        }
+        if (count > POP_SPLIT_SHORT_ROW)
+            num_long++;
+
+        // A stable counting sort, so the row stays in eltid order within each bucket.
+        for (uint64_t i = 0; i < count; i++)
+        {
+            const uint64_t to = next[pop_bucket(pop[id[i]])]++;
+            tmp[to] = bb[start + i];
+            if (NULL != page)
+                page[start + to] = (uint8_t) (id[i] >> ELT_PAGE_BITS);
+        }
+        if (count > 0)
+            memcpy(&bb[start], tmp, count * sizeof(valence_t));
+    }
+    free(tmp);
+    free(id);
+    seg_add_pages(bind_seg, rows, page, "bind_seg");
+    free(page);
+    return split;
+} // end partition_by_pop()
+
+
+// POP_SPLIT_END() for a row longer than POP_SPLIT_SHORT_ROW.
+uint64_t pop_split_long_end(const pop_split_t *split, uint64_t r, int b)
+{
+    const uint64_t k = (uint64_t) split[r].end[1] | ((uint64_t) split[r].end[2] << 16);
+    const pop_split_t *long_split = &split[SEG_ROWS(BE.num_elts) + 2 * k];
+    return (uint64_t) long_split[0].end[b - 1] | ((uint64_t) long_split[1].end[b - 1] << 16);
+} // end pop_split_long_end()
+
+
+// How many long splits come after the rows.
+static uint64_t count_long(const pop_split_t *split)
+{
+    uint64_t num_long = 0;
+    for (uint64_t r = 0; r + 1 < SEG_ROWS(BE.num_elts); r++)
+        if (POP_SPLIT_LONG == split[r].end[0])
+            num_long++;
+    return num_long;
+} // end count_long()
+
+
+static void cache_filename(char *filename, size_t size, const char *name)
+{
+    strlcpy(filename, BE.valence_cache_dir, size);
+    strlcat(filename, "/", size);
+    strlcat(filename, name, size);
+} // end cache_filename()
+
+
+// export_beast() and export_ds() call this before they write the bb or bb_ds. Partition its rows by popularity and
+// write the splits to name in the valence cache dir.
+void pop_split_export(valence_t *bb, seg_ptr_t **bind_seg, const char *name)
+{
+    if (NULL == pop_leash() && true != pop_load())
+        exit(EXIT_FAILURE);
+
+    popularity_t *pop = pop_internal(pop_leash());
+    pop_split_t *split = partition_by_pop(bb, bind_seg, pop, name);
+    free(pop);
+
+    char filename[strlen(BE.valence_cache_dir) + strlen(name) + 2];
+    cache_filename(filename, sizeof(filename), name);
+    FILE *fp = fopen(filename, "w");
+    if (NULL == fp)
+    {
+        syslog(LOG_ERR, "ERROR: cannot open output file %s", filename);
+        exit(-1);
+    }
+
+    pop_split_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, POP_SPLIT_MAGIC, sizeof(header.magic));
+    header.version = POP_SPLIT_VERSION;
+    header.buckets = HIGHEST_POP_NUMBER - 1;
+    header.num_elts = BE.num_elts;
+    header.num_valences = GET_SEG((*bind_seg)[SEG_ROWS(BE.num_elts) - 1]);
+    header.pop_hash = pop_hash(pop_leash());
+    header.num_long = count_long(split);
+
+    const uint64_t entries = SEG_ROWS(BE.num_elts) + 2 * header.num_long;
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 || fwrite(split, sizeof(pop_split_t), entries, fp) != entries)
+    {
+        syslog(LOG_ERR, "ERROR: cannot write to %s", filename);
+        exit(-1);
+    }
+    fclose(fp);
+    huge_free(split);
+} // end pop_split_export()
+
+
+// Read the splits for one adjacency, or return NULL if there aren't any we can trust. Then tally() walks whole rows,
+// which gives the same recs, just slower.
+static pop_split_t *read_split(const char *name, const seg_ptr_t *bind_seg)
+{
+    char filename[strlen(BE.valence_cache_dir) + strlen(name) + 2];
+    cache_filename(filename, sizeof(filename), name);
+    FILE *fp = fopen(filename, "r");
+    if (NULL == fp)
+    {
+        syslog(LOG_INFO, "No popularity splits at %s, so tally() walks whole rows.", filename);
+        return NULL;
+    }
+
+    const uint64_t rows = SEG_ROWS(BE.num_elts);
+    uint64_t entries = 0;
+    pop_split_header_t header;
+    pop_split_t *split = NULL;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1
+              && memcmp(header.magic, POP_SPLIT_MAGIC, sizeof(header.magic)) == 0
+              && header.version == POP_SPLIT_VERSION
+              && header.buckets == HIGHEST_POP_NUMBER - 1
+              && header.num_elts == BE.num_elts
+              && header.num_valences == GET_SEG(bind_seg[rows - 1])
+              && header.pop_hash == pop_hash(pop_leash())
+              && header.num_long <= rows;
+    if (ok)
+    {
+        entries = rows + 2 * header.num_long;
+        split = huge_calloc((size_t) entries, sizeof(pop_split_t), name);
+        if (NULL == split)
+        {
+            syslog(LOG_ERR, "FATAL ERROR: Out of memory when loading the popularity splits.");
+            exit(EXIT_MEMLOAD);
+        }
+        ok = fread(split, sizeof(pop_split_t), entries, fp) == entries;
+    }
+    fclose(fp);
+
+    // Every bucket has to end inside its row, or tally() would walk into the next one.
+    uint64_t num_long = 0;
+    for (uint64_t r = 0; ok && r + 1 < rows; r++)
+    {
+        const uint64_t count = GET_SEG(bind_seg[r + 1]) - GET_SEG(bind_seg[r]);
+        if (POP_SPLIT_LONG == split[r].end[0])
+        {
+            ok = count > POP_SPLIT_SHORT_ROW && num_long < header.num_long
+                 && ((uint64_t) split[r].end[1] | ((uint64_t) split[r].end[2] << 16)) == num_long;
+            num_long++;
+        }
+        else
+            ok = count <= POP_SPLIT_SHORT_ROW;
+        for (unsigned b = 1; ok && b < HIGHEST_POP_NUMBER; b++)
+            ok = POP_SPLIT_END(split, r, b) <= count && (1 == b || POP_SPLIT_END(split, r, b - 1)
+                                                                   <= POP_SPLIT_END(split, r, b));
+    }
+    ok = ok && num_long == header.num_long;
+    if (!ok)
+    {
+        syslog(LOG_WARNING, "WARNING: %s doesn't match this valence cache or pop.out, so tally() walks whole rows. "
+               "Run recgen -c and -d again.", filename);
+        huge_free(split);
+        return NULL;
+    }
+    return split;
+} // end read_split()
+
+
+// load_beast() calls this once the bb and bb_ds are in. Needs pop_load() first. Returns true if both have splits.
+bool pop_split_load(const seg_ptr_t *bind_seg, const seg_ptr_t *bind_seg_ds)
+{
+    huge_free(g_pop_split);
+    huge_free(g_pop_split_ds);
+    g_pop_split = g_pop_split_ds = NULL;
+    if (NULL == pop_leash())
+        return (false);
+
+    g_pop_split = read_split(POP_SPLIT_BB, bind_seg);
+    g_pop_split_ds = read_split(POP_SPLIT_BB_DS, bind_seg_ds);
+    if (NULL == g_pop_split || NULL == g_pop_split_ds)
+        return (false);
+
+    syslog(LOG_INFO, "Successfully loaded the popularity splits.");
+    return (true);
+} // end pop_split_load()
+
+
+const pop_split_t *pop_split_leash()
+{
+    const model_replica_t *local = numa_replica();
+    return NULL != local ? local->split : g_pop_split;
+}
+
+const pop_split_t *pop_split_ds_leash()
+{
+    const model_replica_t *local = numa_replica();
+    return NULL != local ? local->split_ds : g_pop_split_ds;
+}
@@ -44,11 +44,16 @@ static int pcry[256][32];    // Pre-calculated rating of y = mx + b
 
 void create_workingset(size_t num_recs)
 {
-    g_workingset = malloc(num_recs * sizeof(prediction_t));
+    g_workingset = huge_calloc(num_recs, sizeof(prediction_t), "workingset");
+    if (NULL == g_workingset)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when creating the workingset.");
+        exit(EXIT_MEMLOAD);
+    }
     // NOTE: We don't free this ever because it sticks around forever.
 }
 
-static void init_workingset(size_t num_recs)
+void init_workingset(size_t num_recs)
 {
     // Populate the workingset with empty predictions.
     for (size_t i = 0; i < num_recs; i++)
@@ -65,11 +70,13 @@ static void init_workingset(size_t num_recs)
 // Compare any two predictions, for use as a callback function by qsort()
 //
 // Returns -1 if the first rating (recommendation value) is more than the second
-//          0 if the ratings are equal
 //          1 if the first rating is less than the second rating
 // NOTE: this behavior is flipped (normally sort is ascending) so we get the highest
 // rating values at beginning of sorted structure
 //
+// Equal ratings go by rating count and then by element id, lowest first. top_recs() compares the catalog's element
+// ids, so the order doesn't depend on where recgen -r moved the elements.
+//
 static int predcmp(const void *p1, const void *p2)
 {
     const prediction_t x = *(const prediction_t *) p1;
@@ -92,10 +99,14 @@ static int predcmp(const void *p1, const void *p2)
             {
                 return (-1);
             }
-            else
+            else if (x.rating_count < y.rating_count)
             {
                 return (1);
             }
+            else
+            {
+                return (x.elementid < y.elementid ? -1 : 1);
+            }
         }
     }
 } // end predcmp()
@@ -103,12 +114,12 @@ static int predcmp(const void *p1, const void *p2)
 
 // Pre-calculate all possible ratings so we don't have to do this when generating each individual rec. 256 possible
 // slope-offset pairs and 32 possible ratings values for a total of 8192 possible combinations.
-static void create_pcrs(const int8_t *tiny_slopes,
-                        const double *tiny_slopes_inv,
-                        const int8_t *tiny_offsets)
+void create_pcrs(const int8_t *tiny_slopes,
+                 const double *tiny_slopes_inv,
+                 const int8_t *tiny_offsets)
 {
     int counter = 0;
-    syslog(LOG_INFO, "....Inside create_pcrs....");
+    BMH_LOG(LOG_LEVEL_INFO, "....Inside create_pcrs....");
     for (uint8_t i = 0; counter < 256; i++, counter++)   // slope - offset combination
     {
         for (int j = 1; j < 33; j++)   // user-rating
@@ -132,14 +143,28 @@ static void create_pcrs(const int8_t *tiny_slopes,
     pcr_created = true;
 } // end create_pcrs()
 
-// Tally gets called once for each live user and calculates possible recommendation values for the other elements
-static void tally(const valence_t *bb,
-                  const bb_ind_t *bind_seg,
-                  const valence_t *bb_ds,
-                  const bb_ind_t *bind_seg_ds,
-                  int rat_length,
-                  rating_t ur[])
+// What does a valence predict for its other element, given a rating (1-32) of this one? For a bb valence this element
+// is x and we solve for y. For a bb_ds valence this element is y and we solve for x. Call create_pcrs() first.
+int predicted_rating(uint8_t soindex, int rating, bool solve_for_y)
+{
+    return solve_for_y ? pcry[soindex][rating - 1] : pcrx[soindex][rating - 1];
+} // end predicted_rating()
+
+// Tally gets called once for each live user and calculates possible recommendation values for the other elements.
+// With the popularity splits, it only walks the valences of elements in buckets 1..target_pop. Returns how many
+// valences it walked.
+uint64_t tally(const valence_t *bb,
+           const seg_ptr_t *bind_seg,
+           const valence_t *bb_ds,
+           const seg_ptr_t *bind_seg_ds,
+           const pop_split_t *split,
+           const pop_split_t *split_ds,
+           popularity_t target_pop,
+           int rat_length,
+           rating_t ur[])
 {
+    uint64_t visited = 0;
+    const uint64_t rows = SEG_ROWS(BE.num_elts);
     for (int i=0; i < rat_length; i++)
     {
         int rating;
@@ -148,6 +173,9 @@ static void tally(const valence_t *bb,
         const uint32_t user_rated = ur[i].elementid;
         const uint8_t user_rating = ur[i].rating;
 
+        // We have no valences for an element past the ones we know about.
+        if (user_rated > BE.num_elts) continue;
+
         // There are two similar but different sections of code below. They are separate for increased clarity. Merging would save a little
         // redundancy but add complexity in human understanding. Because this piece is the core of the recommender, let's err
         // on the side of human understanding.
@@ -155,57 +183,157 @@ static void tally(const valence_t *bb,
         // First we need to find the (x,uR) valences where x goes from 1 to (uR - 1).
         // Iterate over, e.g., (1..232,233) given 233 as userRated passed in to Tally()
 
-        const bb_ind_t  y_start = bind_seg_ds[user_rated];
-        exp_elt_t user_rated_next = user_rated;
-        while (UINT64_MAX == bind_seg_ds[++user_rated_next].offset)
-            if (user_rated_next == (BE.num_elts - 1)) break;
-
-        // Do we have valences with a user_rated in the y position?
-        if (y_start.offset != UINT64_MAX)
+        // The page directory splits the row into runs of x's on the same page. With one page that's the whole row.
+        seg_walk_t walk;
+        uint64_t y_start, y_end;
+        exp_elt_t base;
+        seg_walk_start(&walk, bind_seg_ds, rows, user_rated, SEG_END(bind_seg_ds, split_ds, user_rated, target_pop));
+        while (seg_walk_next(&walk, &y_start, &y_end, &base))
         {
-            const valence_t *const start_ptr = &bb_ds[y_start.offset];
-            const valence_t *const end_ptr = start_ptr + y_start.count;
-            for (bb_ptr = start_ptr; bb_ptr < end_ptr; bb_ptr++)
+            // Do we have valences with a user_rated in the y position?
+            if (y_start != y_end)
             {
-                // Get the prediction_to_make value from the val_key.
-                prediction_to_make = GET_ELT(bb_ptr->eltid);
-
-                // We are solving for x, so we want x = (y - b) / m
-                rating = pcrx[bb_ptr->soindex][user_rating - 1];
-                g_workingset[prediction_to_make - 1].rating_accum += rating;
-                g_workingset[prediction_to_make - 1].rating_count++;
-            } // end for loop
-        } // end if y_start not 0
+                const valence_t *const start_ptr = &bb_ds[y_start];
+                const valence_t *const end_ptr = &bb_ds[y_end];
+                visited += y_end - y_start;
+                for (bb_ptr = start_ptr; bb_ptr < end_ptr; bb_ptr++)
+                {
+                    // Get the prediction_to_make value from the val_key.
+                    prediction_to_make = base | GET_ELT(bb_ptr->eltid);
+
+                    // We are solving for x, so we want x = (y - b) / m
+                    rating = pcrx[bb_ptr->soindex][user_rating - 1];
+                    g_workingset[prediction_to_make - 1].rating_accum += rating;
+                    g_workingset[prediction_to_make - 1].rating_count++;
+                } // end for loop
+            } // end if y segment not empty
+        } // end for loop across runs of x
 
         // Here we need to do the (uR, y) valences where y goes from uR+1 to NUM_ELTS.
         // Get the starting point of the fixed x value in the Beast.
-        const bb_ind_t  x_start = bind_seg[user_rated];
-        user_rated_next = user_rated;
-        while (UINT64_MAX == bind_seg[++user_rated_next].offset)
-            if (user_rated_next == (BE.num_elts - 1)) break;
-
-        // Do we have valences with a user_rated in the x position?
-        if (x_start.offset != UINT64_MAX)
+        uint64_t x_start, x_end;
+        seg_walk_start(&walk, bind_seg, rows, user_rated, SEG_END(bind_seg, split, user_rated, target_pop));
+        while (seg_walk_next(&walk, &x_start, &x_end, &base))
         {
-            const valence_t *const start_ptr = &bb[x_start.offset];
-            const valence_t *const end_ptr = start_ptr + x_start.count;
-            for (bb_ptr = start_ptr; bb_ptr < end_ptr; bb_ptr++)
+            // Do we have valences with a user_rated in the x position?
+            if (x_start != x_end)
             {
-                // Get the prediction_to_make value from the val_key.
-                prediction_to_make = GET_ELT(bb_ptr->eltid);
-
-                // We are solving for y, so we want y = mx + b. Scaling is correct.
-                rating = pcry[bb_ptr->soindex][user_rating - 1];
-                g_workingset[prediction_to_make - 1].rating_accum += rating;
-                g_workingset[prediction_to_make - 1].rating_count++;
-            } // end for loop across x,y pairs for fixed x = userRated
-        } // end if x_start not 0
+                const valence_t *const start_ptr = &bb[x_start];
+                const valence_t *const end_ptr = &bb[x_end];
+                visited += x_end - x_start;
+                for (bb_ptr = start_ptr; bb_ptr < end_ptr; bb_ptr++)
+                {
+                    // Get the prediction_to_make value from the val_key.
+                    prediction_to_make = base | GET_ELT(bb_ptr->eltid);
+
+                    // We are solving for y, so we want y = mx + b. Scaling is correct.
+                    rating = pcry[bb_ptr->soindex][user_rating - 1];
+                    g_workingset[prediction_to_make - 1].rating_accum += rating;
+                    g_workingset[prediction_to_make - 1].rating_count++;
+                } // end for loop across x,y pairs for fixed x = userRated
+            } // end if x segment not empty
+        } // end for loop across runs of y
     } // end for loop across user's ratings
+    return visited;
 } // end Tally()
 
 
+// Same as tally() but over the unified adjacency, where each rated element's y side and x side are one contiguous run
+// of the bb_uni. The unified rows are copies of the bb_ds and bb rows, so they use those rows' splits. Returns how many
+// valences it walked.
+uint64_t tally_unified(const valence_t *bb_uni, const seg_ptr_t *bind_seg_uni, const pop_split_t *split,
+                       const pop_split_t *split_ds, popularity_t target_pop, int rat_length, rating_t ur[])
+{
+    uint64_t visited = 0;
+    const uint64_t rows = UNI_SEG_ROWS(BE.num_elts);
+    for (int i = 0; i < rat_length; i++)
+    {
+        const uint32_t user_rated = ur[i].elementid;
+        const uint8_t user_rating = ur[i].rating;
+
+        // We have no valences for an element past the ones we know about.
+        if (user_rated > BE.num_elts) continue;
+
+        // First the row with user_rated in the y position, so we solve for x. Then straight on into the row with
+        // it in the x position, so we solve for y.
+        for (uint64_t side = 0; side < 2; side++)
+        {
+            const pop_split_t *const side_split = side ? split : split_ds;
+            const uint64_t r = 2 * (uint64_t) user_rated + side;
+            const uint64_t end = (NULL == side_split || target_pop >= HIGHEST_POP_NUMBER) ? GET_SEG(bind_seg_uni[r + 1])
+                                 : GET_SEG(bind_seg_uni[r]) + POP_SPLIT_END(side_split, user_rated, target_pop);
+            const int (*const pcr)[32] = side ? pcry : pcrx;
+            seg_walk_t walk;
+            uint64_t start, stop;
+            exp_elt_t base;
+            seg_walk_start(&walk, bind_seg_uni, rows, r, end);
+            while (seg_walk_next(&walk, &start, &stop, &base))
+            {
+                const valence_t *bb_ptr = &bb_uni[start];
+                const valence_t *const end_ptr = &bb_uni[stop];
+                visited += stop - start;
+                for (; bb_ptr < end_ptr; bb_ptr++)
+                {
+                    const exp_elt_t prediction_to_make = base | GET_ELT(bb_ptr->eltid);
+                    g_workingset[prediction_to_make - 1].rating_accum += pcr[bb_ptr->soindex][user_rating - 1];
+                    g_workingset[prediction_to_make - 1].rating_count++;
+                }
+            }
+        }
+    } // end for loop across user's ratings
+    return visited;
+} // end tally_unified()
+
+
+// Same as tally_unified() but over the packed adjacency. Each run's eltids get decoded PACKED_BLOCK at a time into
+// a buffer on the stack, so the whole request reads about half the bytes. The runs are in eltid order for the deltas
+// rather than by popularity, so this walks all of them whatever the target popularity. Returns how many valences it
+// walked.
+uint64_t tally_packed(const packed_adjacency_t *pk, int rat_length, rating_t ur[])
+{
+    uint64_t visited = 0;
+    uint32_t ids[PACKED_BLOCK];
+
+    for (int i = 0; i < rat_length; i++)
+    {
+        const uint32_t user_rated = ur[i].elementid;
+        const uint8_t user_rating = ur[i].rating;
+
+        // We have no valences for an element past the ones we know about.
+        if (user_rated > BE.num_elts) continue;
+
+        // Side 0 has user_rated in the y position, so we solve for x. Side 1 has it in the x position.
+        for (int side = 0; side < 2; side++)
+        {
+            const uint64_t run = 2 * (uint64_t) user_rated + (uint64_t) side;
+            const uint64_t first = GET_SEG(pk->val_seg[run]);
+            uint64_t left = GET_SEG(pk->val_seg[run + 1]) - first;
+            const uint8_t *keys = &pk->keys[GET_SEG(pk->key_seg[run])];
+            const uint8_t *soindex = &pk->soindex[first];
+            int (*const pcr)[32] = side ? pcry : pcrx;
+            uint32_t prev = 0;
+
+            visited += left;
+            while (left > 0)
+            {
+                const uint32_t n = left < PACKED_BLOCK ? (uint32_t) left : PACKED_BLOCK;
+                keys = packed_decode(keys, ids, (n + PACKED_GROUP - 1) / PACKED_GROUP, &prev);
+                for (uint32_t j = 0; j < n; j++)
+                {
+                    g_workingset[ids[j] - 1].rating_accum += pcr[soindex[j]][user_rating - 1];
+                    g_workingset[ids[j] - 1].rating_count++;
+                }
+                soindex += n;
+                left -= n;
+            }
+        }
+    } // end for loop across user's ratings
+    return visited;
+} // end tally_packed()
+
+
 // Composite the prediction values.
-static void composite(uint64_t num_recs)
+void composite(uint64_t num_recs)
 {
     for (int i = 0; i < (int) num_recs; i++)
     {
@@ -246,27 +374,114 @@ static void find_single(uint64_t num_recs, int eltid)
 }  // end find_single()
 
 
+// heap holds the best n predictions found so far as a binary heap in predcmp() order with the worst at the root.
+// Move heap[i] up toward the root until its parent is worse.
+static void heap_up(prediction_t heap[], int i)
+{
+    while (i > 0 && predcmp(&heap[i], &heap[(i - 1) / 2]) > 0)
+    {
+        const prediction_t tmp = heap[i];
+        heap[i] = heap[(i - 1) / 2];
+        heap[(i - 1) / 2] = tmp;
+        i = (i - 1) / 2;
+    }
+} // end heap_up()
+
+
+// Move heap[i] down until both its children are better.
+static void heap_down(prediction_t heap[], int n, int i)
+{
+    for (;;)
+    {
+        int worst = i;
+        const int left = 2 * i + 1;
+        if (left < n && predcmp(&heap[left], &heap[worst]) > 0)
+            worst = left;
+        if (left + 1 < n && predcmp(&heap[left + 1], &heap[worst]) > 0)
+            worst = left + 1;
+        if (worst == i)
+            return;
+
+        const prediction_t tmp = heap[i];
+        heap[i] = heap[worst];
+        heap[worst] = tmp;
+        i = worst;
+    }
+} // end heap_down()
+
+
+// Copy the best num_recs predictions in the target popularity bucket (or more popular) to recs, best first. Only
+// num_recs of them are ever kept, in a heap in recs, so most of the workingset costs one comparison with the worst of
+// those instead of a place in a sort of the whole thing.
+void top_recs(prediction_t recs[], int num_recs, popularity_t target_pop, const popularity_t *pop)
+{
+    int found = 0;
+
+    // clean up target_pop
+    if (target_pop < LOWEST_POP_NUMBER || target_pop > HIGHEST_POP_NUMBER)
+        target_pop = LOWEST_POP_NUMBER;
+
+    for (uint64_t w = 0; w < BE.num_elts; w++)
+    {
+        // The recs and pop use the catalog's element ids, which aren't the valence cache's if recgen -r reordered
+        // them. Ties go by element id, so comparing catalog ids keeps the reorder out of the recs.
+        prediction_t candidate = g_workingset[w];
+        candidate.elementid = elt_external(candidate.elementid);
+
+        // check to see if the rec to make is in target popularity bucket.
+        if (pop[candidate.elementid] > target_pop)
+            continue;
+
+        if (found < num_recs)
+        {
+            recs[found] = candidate;
+            heap_up(recs, found++);
+        }
+        else if (predcmp(&candidate, &recs[0]) < 0)
+        {
+            recs[0] = candidate;
+            heap_down(recs, found, 0);
+        }
+    }
+
+    qsort(recs, (size_t) found, sizeof(prediction_t), predcmp);
+} // end top_recs()
+
+
 // Param eltid is for the situations when we want to know about a rec for a specific product id.
 // Use param target_pop for the situation when we want to get recs from a target popularity bucket (or more popular).
+// ur and eltid are in the catalog's element ids, and so are the recs. If recgen -r reordered the element ids, ur gets
+// translated in place.
 bool predictions(rating_t ur[], int rat_length, prediction_t recs[], int num_recs, int eltid, popularity_t target_pop)
 {
-    const long long start = current_time_micros();
+    const long long start = g_log_request_time ? current_time_micros() : 0;
 
     // Get a handle to the combined beast & bind leashes.
     valence_t *bb = bb_leash();
     
     // Get a handle to the bind index.
-    const bb_ind_t  *bind_seg = bind_seg_leash();
+    const seg_ptr_t *bind_seg = bind_seg_leash();
     
     // Get a handle to the combined beast & bind leashes, DS version.
     valence_t *bb_ds = bb_ds_leash();
     
     // Get a handle to the bind index, DS version.
-    const bb_ind_t  *bind_seg_ds = bind_seg_ds_leash();
+    const seg_ptr_t *bind_seg_ds = bind_seg_ds_leash();
+
+    // If we're using the unified adjacency, the four above are NULL and these aren't.
+    const valence_t *bb_uni = bb_uni_leash();
+    const seg_ptr_t *bind_seg_uni = bind_seg_uni_leash();
+
+    // If we're using the packed cache, all six above are NULL and this isn't.
+    const packed_adjacency_t *packed = packed_leash();
     
     // Get a handle to the Popularity index.
     const popularity_t *pop = pop_leash();
 
+    // Where each popularity bucket ends in the rows of the bind_seg and bind_seg_ds, if we have that.
+    const pop_split_t *split = pop_split_leash();
+    const pop_split_t *split_ds = pop_split_ds_leash();
+
     const int8_t *tiny_slopes = tiny_slopes_leash();
     const double *tiny_slopes_inv = tiny_slopes_inv_leash();
     const int8_t *tiny_offsets = tiny_offsets_leash();
@@ -280,79 +495,70 @@ bool predictions(rating_t ur[], int rat_length, prediction_t recs[], int num_rec
     // Check for valid ratings passed in.
     if ((NULL == ur) || (0 == rat_length))
     {
-        syslog(LOG_ERR, "ERROR: cannot make Predictions for empty UserRating list");
+        BMH_LOG(LOG_LEVEL_ERR, "ERROR: cannot make Predictions for empty UserRating list");
         return (false);
     }
     init_workingset(BE.num_elts);
+    metrics_stage(METRICS_STAGE_INIT_WORKINGSET);
 
     const int userid = ur[0].userid;
     int i;
 
-    tally(bb, bind_seg, bb_ds, bind_seg_ds, rat_length, ur);
+    // clean up target_pop the way top_recs() does. Asking about one element ignores it, so then tally() walks it all.
+    if (target_pop < LOWEST_POP_NUMBER || target_pop > HIGHEST_POP_NUMBER)
+        target_pop = LOWEST_POP_NUMBER;
+    const popularity_t tally_pop = 0 == eltid ? target_pop : HIGHEST_POP_NUMBER;
+
+    // The valence cache may use its own element ids. See reorder.c.
+    for (i = 0; i < rat_length; i++)
+        ur[i].elementid = elt_internal(ur[i].elementid);
+    if (0 != eltid)
+        eltid = (int) elt_internal((exp_elt_t) eltid);
+
+    if (NULL != packed)
+        metrics_add_valences(tally_packed(packed, rat_length, ur));
+    else if (NULL != bb_uni)
+        metrics_add_valences(tally_unified(bb_uni, bind_seg_uni, split, split_ds, tally_pop, rat_length, ur));
+    else
+        metrics_add_valences(tally(bb, bind_seg, bb_ds, bind_seg_ds, split, split_ds, tally_pop, rat_length, ur));
+    metrics_stage(METRICS_STAGE_TALLY);
 
     // Now set rating = accum / count.
     composite(BE.num_elts);
+    metrics_stage(METRICS_STAGE_COMPOSITE);
 
     // Are we recommending top numRecs items?
     if (0 == eltid)
     {
-
-#if defined(__NetBSD__) || defined(__FreeBSD__)
-        // On NetBSD and FreeBSD, qsort is very slow in this situation. Mergesort is much faster.
-        mergesort(g_workingset, BE.num_elts, sizeof(prediction_t), predcmp);
-#else
-        qsort(g_workingset, BE.num_elts, sizeof(prediction_t), predcmp);
-#endif
-        
-        // Copy workingset to recs. Note that numRecs is small. The bit below
-        // should work b/c we've just sorted WorkingSet by pred value
-        int ws_walker = 0;
-
-        i = 0;
-
-        // clean up target_pop
-        if (target_pop < LOWEST_POP_NUMBER || target_pop > HIGHEST_POP_NUMBER)
-            target_pop = LOWEST_POP_NUMBER;
-
-        while (i < num_recs)
-        {
-            const exp_elt_t curr_elt = g_workingset[ws_walker].elementid;
-
-            // check to see if the rec to make is in target popularity bucket.
-            if (pop[curr_elt] <= target_pop)
-            {
-                recs[i].elementid = curr_elt;
-                recs[i].rating = g_workingset[ws_walker].rating;
-                recs[i].rating_accum = g_workingset[ws_walker].rating_accum;
-                recs[i].rating_count = g_workingset[ws_walker].rating_count;
-                i++;
-            }
-            ws_walker++;
-        } // end while walking numRecs to check for targetPop
+        top_recs(recs, num_recs, target_pop, pop);
     } // end if we're recommending numRecs items
     else
     {
         find_single(BE.num_elts, eltid);
-        recs[0].elementid = g_workingset[0].elementid;
+        recs[0].elementid = elt_external(g_workingset[0].elementid);
         recs[0].rating = g_workingset[0].rating;
         recs[0].rating_accum = g_workingset[0].rating_accum;
         recs[0].rating_count = g_workingset[0].rating_count;
     } // end else we're trying to find a single rec
+    metrics_stage(METRICS_STAGE_TOP_K);
 
     // Clean up the elt recommendations for this user.
     for (i = 0; i < num_recs; i++)
     {
         if ((int) (recs[i].rating) == -10)
         {
-            syslog(LOG_WARNING, "WARNING: found a -1 for a prediction for element %d, user %d.",
-                   recs[i].elementid, userid);
+            BMH_LOG(LOG_LEVEL_WARNING, "WARNING: found a -1 for a prediction for element %d, user %d.",
+                    recs[i].elementid, userid);
         }
 
         recs[i].rating = (int16_t) bmh_round(recs[i].rating / 10.0);
     } // end for loop
 
-    const long long finish = current_time_micros();
-    syslog(LOG_INFO, "Time to perform Prediction: %d microseconds.", (int) (finish - start));
+    if (g_log_request_time)
+    {
+        const long long finish = current_time_micros();
+        BMH_LOG(LOG_LEVEL_INFO, "Time to perform Prediction: %d microseconds.", (int) (finish - start));
+    }
 
     return (true);
 }// end Predictions()
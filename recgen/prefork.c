@@ -0,0 +1,239 @@
+// SPDX-FileCopyrightText: 2022 Brian Calhoun <brian@bemorehuman.org>
+//
+// SPDX-License-Identifier: MIT
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is furnished to do
+// so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// This file is part of bemorehuman. See https://bemorehuman.org
+
+#include "recgen.h"
+#include <signal.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+//
+// This file runs recgen as a master process with a pool of prefork worker processes, for recgen -w.
+//
+// A worker thread shares the events buffer, the reload flag and the rest of main.c's globals with every other thread
+// in its process, so recgen scales with processes instead. The master loads the model and opens the listening socket,
+// then forks the workers. Each worker inherits the socket and a copy-on-write view of the model. Nothing writes to the
+// model, so its pages stay shared. Each worker has its own workingset and its own events buffer.
+//
+// The master restarts any worker that dies. On SIGUSR1 it loads the model again and forks a new set of workers from
+// it. The old workers finish the request they're on, persist their events and exit, so no request waits for a reload.
+//
+
+uint32_t g_prefork_workers = 0;   // How many worker processes to fork. 0 serves from this process. See recgen -w.
+int32_t g_prefork_worker = -1;    // Which worker this process is, or -1 for the master or without recgen -w.
+
+static pid_t g_pids[PREFORK_MAX_WORKERS];
+static long long g_started[PREFORK_MAX_WORKERS];   // when each worker was forked, in milliseconds
+static volatile sig_atomic_t g_reload_requested = 0;
+static volatile sig_atomic_t g_stop_requested = 0;
+static volatile sig_atomic_t g_busy = 0;           // in a worker: a request is in progress
+static void (*g_persist)(void) = NULL;             // in a worker: saves what would be lost when it exits
+
+
+static void master_signal(int signo)
+{
+    if (SIGUSR1 == signo)
+        g_reload_requested = 1;
+    else
+        g_stop_requested = 1;
+} // end master_signal()
+
+
+// A worker told to stop between requests goes now. One in the middle of a request goes when it's done.
+static void worker_signal(int signo)
+{
+    (void) signo;
+    g_stop_requested = 1;
+    if (!g_busy)
+    {
+        if (NULL != g_persist)
+            g_persist();
+        _exit(EXIT_SUCCESS);
+    }
+} // end worker_signal()
+
+
+// Install handler for signo without SA_RESTART, so it interrupts waitpid().
+static void on_signal(int signo, void (*handler)(int))
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(signo, &sa, NULL);
+} // end on_signal()
+
+
+static void spawn(uint32_t worker, int listen_fd, void (*serve)(int))
+{
+    // Anything still buffered would be written again by the worker.
+    fflush(NULL);
+
+    const pid_t master = getpid();
+    const pid_t pid = fork();
+    if (pid < 0)
+    {
+        syslog(LOG_ERR, "Can't fork recgen worker %u: %s", worker, strerror(errno));
+        g_pids[worker] = 0;
+        return;
+    }
+    if (pid > 0)
+    {
+        g_pids[worker] = pid;
+        g_started[worker] = current_time_millis();
+        return;
+    }
+
+    // In the worker. killall -USR1 recgen reaches the workers too, but it's the master that reloads.
+    g_prefork_worker = (int32_t) worker;
+    g_stop_requested = 0;
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGINT, SIG_DFL);
+    on_signal(SIGTERM, worker_signal);
+#ifdef __linux__
+    // Go when the master does.
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != master)
+        _exit(EXIT_FAILURE);
+#else
+    (void) master;
+#endif
+
+    // Start the log drain thread with SIGTERM blocked, so worker_signal() always runs on the thread that serves.
+    sigset_t term, old;
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    sigprocmask(SIG_BLOCK, &term, &old);
+    async_log_start();
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    serve(listen_fd);
+    _exit(EXIT_SUCCESS);
+} // end spawn()
+
+
+// Fork g_prefork_workers workers that each call serve(listen_fd), then look after them until SIGTERM or SIGINT.
+// reload() loads the model again for SIGUSR1. persist() runs in a worker, maybe from a signal handler, before it
+// exits, so it must be async-signal-safe. Never returns.
+void prefork_run(int listen_fd, void (*serve)(int), void (*reload)(void), void (*persist)(void))
+{
+    g_persist = persist;
+    on_signal(SIGUSR1, master_signal);
+    on_signal(SIGTERM, master_signal);
+    on_signal(SIGINT, master_signal);
+
+    // So /bmh/metrics from any worker adds up all of them.
+    metrics_share();
+
+    for (uint32_t w = 0; w < g_prefork_workers; w++)
+        spawn(w, listen_fd, serve);
+    printf("recgen master %d is serving with %u worker processes.\n", getpid(), g_prefork_workers);
+    syslog(LOG_INFO, "recgen master %d is serving with %u worker processes.", getpid(), g_prefork_workers);
+    fflush(stdout);
+
+    while (!g_stop_requested)
+    {
+        int status;
+        const pid_t pid = waitpid(-1, &status, 0);
+
+        for (uint32_t w = 0; pid > 0 && w < g_prefork_workers; w++)
+        {
+            if (g_pids[w] != pid)
+                continue;  // an old worker from before a reload, most likely
+
+            if (WIFSIGNALED(status))
+                syslog(LOG_ERR, "recgen worker %u (pid %d) died from signal %d. Restarting it.", w, pid,
+                       WTERMSIG(status));
+            else
+                syslog(LOG_ERR, "recgen worker %u (pid %d) exited with status %d. Restarting it.", w, pid,
+                       WEXITSTATUS(status));
+
+            // Don't spin on a worker that dies as soon as it starts.
+            if (current_time_millis() - g_started[w] < PREFORK_MIN_UPTIME_MS)
+                sleep(1);
+            g_pids[w] = 0;
+        }
+
+        if (g_reload_requested)
+        {
+            g_reload_requested = 0;
+            syslog(LOG_INFO, "recgen master received SIGUSR1. Reloading and forking new workers.");
+            reload();
+
+            pid_t old[PREFORK_MAX_WORKERS];
+            memcpy(old, g_pids, sizeof(old));
+            for (uint32_t w = 0; w < g_prefork_workers; w++)
+                spawn(w, listen_fd, serve);
+            for (uint32_t w = 0; w < g_prefork_workers; w++)
+                if (old[w] > 0)
+                    kill(old[w], SIGTERM);
+            syslog(LOG_INFO, "recgen master forked %u workers with the reloaded model.", g_prefork_workers);
+        }
+
+        // Fill any empty slots, whether the worker died or fork() failed.
+        for (uint32_t w = 0; w < g_prefork_workers && !g_stop_requested; w++)
+            if (0 == g_pids[w])
+                spawn(w, listen_fd, serve);
+        if (pid < 0 && ECHILD == errno)
+            sleep(1);
+    }
+
+    syslog(LOG_INFO, "recgen master is stopping its workers.");
+    for (uint32_t w = 0; w < g_prefork_workers; w++)
+        if (g_pids[w] > 0)
+            kill(g_pids[w], SIGTERM);
+    while (waitpid(-1, NULL, 0) > 0 || EINTR == errno)
+        ;
+    exit(EXIT_SUCCESS);
+} // end prefork_run()
+
+
+// A worker calls prefork_busy() once it has a request and prefork_idle() before it waits for the next one, so a
+// SIGTERM never cuts a request short.
+void prefork_busy()
+{
+    g_busy = 1;
+} // end prefork_busy()
+
+
+void prefork_idle()
+{
+    if (g_prefork_worker < 0)
+        return;
+
+    // Block SIGTERM while deciding, so worker_signal() can't persist at the same time.
+    sigset_t term, old;
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    sigprocmask(SIG_BLOCK, &term, &old);
+    g_busy = 0;
+    if (g_stop_requested)
+    {
+        if (NULL != g_persist)
+            g_persist();
+        _exit(EXIT_SUCCESS);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+} // end prefork_idle()
@@ -59,9 +59,43 @@
 #define VALENCES_BB_DS "bb_ds.bin"
 #define VALENCES_BB_SEG_DS "bb_seg_ds.bin"
 
+// The two segment files start with a seg_header_t so a cache in an older layout is caught at load time.
+#define VALENCES_SEG_MAGIC "BMHSEG"
+#define VALENCES_SEG_VERSION 4
+
 #define RATINGS_BR "big_rat.bin"
 #define RATINGS_BR_INDEX "big_rat_index.bin"
 
+// This is the optional similar-items table recgen -s builds from the 4 files above.
+#define SIMILAR_BIN "similar.bin"
+#define SIMILAR_MAGIC "BMHSIML"
+#define SIMILAR_VERSION 2
+#define SIMILAR_K 8                     // neighbors kept per element in each popularity bucket
+#define SIMILAR_ROW (SIMILAR_K * HIGHEST_POP_NUMBER)
+
+// This is the optional packed valence cache recgen -p builds from the 4 files above and recgen -z serves from.
+#define VALENCES_PACKED "bb_packed.bin"
+#define PACKED_MAGIC "BMHPACK"
+#define PACKED_VERSION 1
+#define PACKED_GROUP 4                  // eltid deltas per control byte
+#define PACKED_BLOCK 64                 // eltids tally_packed() decodes onto the stack at a time; a multiple of 4
+#define PACKED_PAD 16                   // zero bytes after the keys so a 16-byte load at the last group stays inside
+
+// This is the optional element id permutation recgen -r writes when it relabels the 4 files above.
+#define ELT_PERM_BIN "elt_perm.bin"
+#define ELT_PERM_MAGIC "BMHPERM"
+#define ELT_PERM_VERSION 1
+
+// These are the per-row popularity splits recgen -c and recgen -d write next to the bb and bb_ds.
+#define POP_SPLIT_BB "bb_pop.bin"
+#define POP_SPLIT_BB_DS "bb_pop_ds.bin"
+#define POP_SPLIT_MAGIC "BMHPOPS"
+#define POP_SPLIT_VERSION 2
+
+// These are the orderings recgen -r can give the element ids.
+#define ELT_ORDER_RCM 1                 // reverse Cuthill-McKee: neighbors get nearby ids
+#define ELT_ORDER_POP 2                 // popularity, then community: hot elements and their neighbors first
+
 #define POP_OUTFILE "pop.out"
 #define SO_COMP_OUTFILE "so_compressed.out"
 #define NUM_CONF_OUTFILE "num_confident_valences.out"
@@ -69,6 +103,7 @@
 // These are the ways we can read the valences
 #define LOAD_VALENCES_FROM_VALGEN 1
 #define LOAD_VALENCES_FROM_BEAST_EXPORT 2
+#define LOAD_VALENCES_FROM_PACKED 3
 
 #define RECGEN_LOG_MASK LOG_INFO
 #define MIN_VALENCES_FOR_PREDICTIONS 1
@@ -90,7 +125,7 @@
 #define MAX_STACK 128              // stack size for max 2^(128/2) array elements when sorting
 #define EVENTS_TO_PERSIST_MAX 100   // how many incoming events to store in RAM before persisting to disk?
 
-#define HUM_BUFFER_SIZE 8192
+#define HUM_BUFFER_SIZE 65536       // big enough for the /bmh/metrics page
 #define HUM_DEFAULT_PORT 8888
 
 #define LOG_HUM_STRING "hum"
@@ -99,35 +134,75 @@
 #define LOWEST_POP_NUMBER 1
 #define HIGHEST_POP_NUMBER 7
 
-// This expects a valence_xy_t for both args.
-#define ASSIGN(a,b) do { \
-    a.x[0] = b.x[0]; \
-    a.x[1] = b.x[1]; \
-    a.x[2] = b.x[2]; \
-    a.eltid[0] = b.eltid[0]; \
-    a.eltid[1] = b.eltid[1]; \
-    a.eltid[2] = b.eltid[2]; \
-    a.soindex = b.soindex; \
-} while (0)
-
-// These 2 defines tackle assignment and unassignment of an element id to Element_id_t.
-#define COMPACT(a, b) do { \
-    a[2] = (b) & 0xff; \
-    a[1] = (b >> 8) & 0xff; \
-    a[0] = (b >> 16) & 0xff; \
-} while (0)
+// These are the ways huge_calloc() can back the big arrays. See huge_mem.c.
+#define HUGE_PAGES_NONE 0               // 4 KB pages only
+#define HUGE_PAGES_THP 1                // madvise(MADV_HUGEPAGE) for transparent huge pages, the default
+#define HUGE_PAGES_HUGETLB 2            // MAP_HUGETLB from the hugetlbfs pool, with recgen -l
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+#define PREFORK_MAX_WORKERS METRICS_MAX_THREADS  // recgen -w forks at most this many worker processes
+#define PREFORK_MIN_UPTIME_MS 1000      // a worker that dies sooner than this after its fork waits 1 s to restart
+
+#define RCACHE_WAYS 8                   // result cache entries per set; a person's entries all go in one set
+#define RCACHE_SHARDS 64                // result cache locks; set s takes lock s % RCACHE_SHARDS
+
+#define NUMA_MAX_NODES 8                // recgen -n keeps a copy of the model on each of up to this many nodes
+
+// These are for the kernel benchmark in bench.c.
+#define BENCH_DEFAULT_ELTS 50000        // elements in a synthetic model
+#define BENCH_DEFAULT_DENSITY 200       // average valences per element in the x position of a synthetic model
+#define BENCH_DEFAULT_USERS 2000        // requests to time
+#define BENCH_WARMUP_USERS 20           // requests to run before timing
+#define BENCH_PCR_REPS 1000             // create_pcrs() calls to time
+#define BENCH_NUM_RATING_BUCKETS 5      // latency is reported by user rating count: 1-10, 11-50, 51-200, 201-1000, more
+#define BENCH_CACHE_LINE 64             // bytes per cache line when counting the workingset lines tally() writes
+
+// These are for the per-stage request metrics in metrics.c.
+#define METRICS_MAX_THREADS 64          // workers beyond this many aren't counted
+#define METRICS_NUM_BUCKETS 16          // latency histogram buckets, including +Inf
+
+// These are for the request-path logger in async_log.c.
+#define LOG_RING_SIZE 256               // messages each thread can have waiting; must be a power of 2
+#define LOG_MSG_SIZE 248                // longest message, including the terminating NUL
+#define LOG_MAX_THREADS 64              // threads beyond this many have their messages dropped
+#define LOG_SITE_RATE 10                // messages per second each BMH_LOG() call site may log
+#define LOG_DRAIN_INTERVAL_MS 10        // how long the drain thread sleeps when there's nothing to log
+
+// Log levels for BMH_LOG(). They're the syslog priorities, so MAX_LOG_LEVEL=LOG_LEVEL_INFO keeps LOG_INFO and more
+// urgent messages and compiles the rest away.
+#define LOG_LEVEL_ERR LOG_ERR
+#define LOG_LEVEL_WARNING LOG_WARNING
+#define LOG_LEVEL_INFO LOG_INFO
+#define LOG_LEVEL_DEBUG LOG_DEBUG
+
+#ifndef MAX_LOG_LEVEL
+#define MAX_LOG_LEVEL LOG_LEVEL_INFO
+#endif
 
-#define EXPAND(a,b) do { \
-	b = ((unsigned) a[0] << (unsigned) 16); \
-	b += ((unsigned) a[1] << (unsigned) 8); \
-	b += (a[2]); \
+// Log without blocking. level is one of the LOG_LEVEL_* values and the rest is a printf format and its args.
+#define BMH_LOG(level, ...) do { \
+    if ((level) <= MAX_LOG_LEVEL) \
+    { \
+        static log_site_t bmh_log_site_; \
+        async_log_write(&bmh_log_site_, (level), __VA_ARGS__); \
+    } \
 } while (0)
 
-// Use this before SETHIBITS.
+// Element ids are 32 bits but a valence only has room for the low 24. The rest of the id, its page, comes from the
+// page directory at the end of the segment index (see seg_pages.c), which only lists the rows that reach past page 0.
+// A catalog under 2^24 elements has one page and an empty directory.
+#define ELT_PAGE_BITS 24
+#define ELT_PAGE_MASK ((1U << ELT_PAGE_BITS) - 1)
+#define ELT_PAGES(num_elts) (((uint64_t) (num_elts) >> ELT_PAGE_BITS) + 1)
+#define SEG_ROWS(num_elts) ((uint64_t) (num_elts) + 2)
+#define SEG_ENTRIES(num_elts) (SEG_ROWS(num_elts) + 2)
+#define MAX_ELTS (UINT32_MAX - 1)       // ids are 1..num_elts and num_elts + 1 has to fit in an exp_elt_t
+
+// Use this before SETHIBITS. It keeps the low 24 bits; the page is in the row of the segment index.
 #define SETELT(a, b) do { \
     a[2] = (b) & 0xff; \
-    a[1] = (b >> 8) & 0xff; \
-    a[0] = (b >> 16) & 0x0f; \
+    a[1] = ((b) >> 8) & 0xff; \
+    a[0] = ((b) >> 16) & 0xff; \
 } while (0)
 
 // Use this before SETLOBITS.
@@ -140,19 +215,125 @@ a += ((unsigned) b); \
 } while (0)
 
 #define GET_ELT(a) (((uint32_t)a[0] << 16) | ((uint32_t)a[1] << 8) | a[2])
+
+// These 2 defines read and write the 40-bit offset in a seg_ptr_t.
+#define GET_SEG(a) ((uint64_t)(a).b[0] | ((uint64_t)(a).b[1] << 8) | ((uint64_t)(a).b[2] << 16) \
+                    | ((uint64_t)(a).b[3] << 24) | ((uint64_t)(a).b[4] << 32))
+
+#define SET_SEG(a, v) do { \
+    (a).b[0] = (uint8_t) (v); \
+    (a).b[1] = (uint8_t) ((v) >> 8); \
+    (a).b[2] = (uint8_t) ((v) >> 16); \
+    (a).b[3] = (uint8_t) ((v) >> 24); \
+    (a).b[4] = (uint8_t) ((v) >> 32); \
+} while (0)
+
+#define SEG_MAX_OFFSET ((1ULL << 40) - 1)
+
 #define GET_LOW_4_BITS(byte) ((byte) & 0x0F)
 #define GET_HIGH_4_BITS(byte) ((byte) >> 4)
 
 //
 // Typedefs
 //
-typedef uint8_t element_id_t[3]; // 24 bits for y (in the x,y pair -- x is in the bind_seg)
+typedef uint8_t element_id_t[3]; // low 24 bits for y (in the x,y pair -- x and y's page are in the bind_seg)
 typedef uint32_t exp_elt_t; // convenient way to deal with element id's
+// The bind_seg and bind_seg_ds are CSR row pointer arrays into the bb and bb_ds, with one row per element. Row e's
+// valences are [GET_SEG(bind_seg[e]), GET_SEG(bind_seg[e + 1])) and an empty row is just two equal offsets. The
+// SEG_ROWS(BE.num_elts) row pointers are followed by the page directory, which is 2 entries when it's empty, so an
+// index has SEG_ENTRIES(BE.num_elts) entries or a few more. Offsets are packed into 40 bits, which is 5 bytes a row
+// instead of 16.
 typedef struct
 {
-    uint64_t offset; // type of each elt in the bb, -1 (UINT64_MAX) value means no value
-    uint64_t count; // how many elements are there?
-} bb_ind_t;
+    uint8_t b[5];
+} seg_ptr_t;
+
+typedef struct
+{
+    char magic[8];           // VALENCES_SEG_MAGIC
+    uint32_t version;        // VALENCES_SEG_VERSION
+    uint32_t elt_pages;      // ELT_PAGES(num_elts)
+    uint64_t num_elts;       // BE.num_elts
+    uint64_t num_valences;   // the offset in the last row pointer
+    uint64_t num_entries;    // the file has this many seg_ptr_t's after this header, row pointers then directory
+} seg_header_t;
+
+// Each row of the bb and bb_ds is sorted by its elements' popularity bucket, most popular first, and by eltid within a
+// bucket. end[b - 1] is how many of row r's valences are in buckets 1..b, so a request that only wants buckets up to
+// target_pop walks just the front of each row. That fits in 16 bits for a row of up to POP_SPLIT_SHORT_ROW valences.
+// A longer row has end[0] == POP_SPLIT_LONG and the index k of its long split in end[1] (low half) and end[2] (high
+// half). Long split k is the two pop_split_t's after the rows at 2k and 2k + 1, with the low and high halves of its
+// 32-bit ends. The file is a pop_split_header_t, then SEG_ROWS(num_elts) of these, then the long splits.
+#define POP_SPLIT_LONG 0xFFFF
+#define POP_SPLIT_SHORT_ROW (POP_SPLIT_LONG - 1)
+
+typedef struct
+{
+    uint16_t end[HIGHEST_POP_NUMBER - 1];
+} pop_split_t;
+
+typedef struct
+{
+    char magic[8];           // POP_SPLIT_MAGIC
+    uint32_t version;        // POP_SPLIT_VERSION
+    uint32_t buckets;        // HIGHEST_POP_NUMBER - 1 ends per row
+    uint64_t num_elts;       // BE.num_elts
+    uint64_t num_valences;   // the offset in the last seg_ptr_t of the index the splits are for
+    uint64_t pop_hash;       // 64-bit FNV-1a of the pop.out the rows were sorted with
+    uint64_t num_long;       // rows longer than POP_SPLIT_SHORT_ROW, each with a long split at the end of the file
+} pop_split_header_t;
+
+// How many of row r's valences are in buckets 1..b.
+#define POP_SPLIT_END(split, r, b) (POP_SPLIT_LONG != (split)[r].end[0] ? (uint64_t) (split)[r].end[(b) - 1] \
+    : pop_split_long_end((split), (r), (b)))
+
+// Where row r of a segment index ends for a request that only wants popularity buckets 1..target_pop. Without splits,
+// or when every bucket is wanted, that's the whole row.
+#define SEG_END(idx, split, r, target_pop) ((NULL == (split) || (target_pop) >= HIGHEST_POP_NUMBER) \
+    ? GET_SEG((idx)[(r) + 1]) : GET_SEG((idx)[r]) + POP_SPLIT_END(split, r, target_pop))
+
+// seg_walk_next() hands back a row a run at a time, where every valence in a run is on the same page.
+typedef struct
+{
+    uint64_t next;           // where the next run starts
+    uint64_t end;            // where the walk stops
+    const seg_ptr_t *run;    // the row's next entry in the page directory, or NULL if the whole row is page 0
+    const seg_ptr_t *last_run;
+} seg_walk_t;
+
+// The unified adjacency (recgen -u) puts both of an element's segments next to each other in one bb_uni, so a rated
+// element costs one sequential scan instead of one in bb_ds and another in bb. Element e has rows 2e, its bb_ds row
+// (e is y), and 2e + 1, its bb row (e is x). bind_seg_uni has UNI_SEG_ROWS row pointers and then its own page
+// directory, so bb_uni and bind_seg_uni take the same memory as bb, bb_ds and their two bind_segs.
+#define UNI_SEG_ROWS(num_elts) (2 * ((uint64_t) (num_elts) + 1) + 1)
+#define UNI_SEG_ENTRIES(num_elts) (UNI_SEG_ROWS(num_elts) + 2)
+
+// The packed adjacency is the unified adjacency with the eltids compressed. Each run of valences (the y side or the
+// x side of an element) is sorted by eltid and stored as deltas in stream-vbyte groups: one control byte with a 2-bit
+// byte length for each of the next 4 deltas, then the 1-4 bytes of each delta, little-endian. The first delta of a
+// run is from 0, and a short last group is padded with zero deltas. The soindexes aren't compressed and sit in their
+// own array in the same order. So a valence takes about 2-3 bytes instead of the 4 of a valence_t. The deltas carry
+// whole 32-bit ids, so there are no pages here: element e's y side is run 2e and its x side is run 2e + 1.
+#define PACKED_SEG_ENTRIES(num_elts) (2 * (uint64_t) (num_elts) + 3)
+
+typedef struct
+{
+    seg_ptr_t *val_seg;      // PACKED_SEG_ENTRIES offsets into soindex
+    seg_ptr_t *key_seg;      // PACKED_SEG_ENTRIES byte offsets into keys where each run's groups start
+    uint8_t *soindex;        // 2 * g_num_confident_valences slope-offset indexes
+    uint8_t *keys;           // key_bytes bytes of groups, then PACKED_PAD zero bytes
+    uint64_t key_bytes;
+} packed_adjacency_t;
+
+typedef struct
+{
+    char magic[8];           // PACKED_MAGIC
+    uint32_t version;        // PACKED_VERSION
+    uint32_t padding;
+    uint64_t num_elts;       // BE.num_elts
+    uint64_t num_valences;   // g_num_confident_valences; there are twice this many soindexes
+    uint64_t key_bytes;      // size of the keys
+} packed_header_t;
 
 typedef struct // slope/offset compression helper type
 {
@@ -167,10 +348,10 @@ typedef struct
     uint8_t soindex; // slope-offset index. hi fewbits are index to the slope, lower 4 bits are the index to the offset
 } valence_t;
 
-typedef struct
+typedef struct __attribute__((packed))
 {
-    element_id_t x; // half of the x,y pair. (x)
-    element_id_t eltid; // other half of the x,y pair. (y)
+    exp_elt_t x; // half of the x,y pair. (x)
+    exp_elt_t eltid; // other half of the x,y pair. (y)
     uint8_t soindex;
     // slope-offset index. hi four bits are index to the slope, lower 4 bits are the index to the offset
 } valence_xy_t;
@@ -183,6 +364,71 @@ typedef struct
 
 typedef uint8_t popularity_t; // range is 1-7 where 1 is very popular and 7 is obscure
 
+typedef struct
+{
+    uint64_t capacity;       // entries the result cache can hold
+    uint64_t used;           // entries that aren't empty
+    uint64_t bytes;          // shared memory it takes
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;  // entries event() forgot
+} result_cache_stats_t;
+
+// With recgen -n there's one of these per NUMA node, and the leashes hand each worker the one for its node. The one
+// for the node recgen loaded the model on points at the loaded arrays; the others point at copies on their own node.
+typedef struct
+{
+    int node;
+    valence_t *bb;
+    seg_ptr_t *bind_seg;
+    valence_t *bb_ds;
+    seg_ptr_t *bind_seg_ds;
+    valence_t *bb_uni;
+    seg_ptr_t *bind_seg_uni;
+    const packed_adjacency_t *packed;   // NULL unless serving from the packed cache, else points at packed_copy
+    packed_adjacency_t packed_copy;
+    popularity_t *pop;
+    const pop_split_t *split;
+    const pop_split_t *split_ds;
+} model_replica_t;
+
+// The similar-items table is this header, then SIMILAR_ROW neighbor_t's for each element from 0 to num_elts, best
+// first. A row holds the best SIMILAR_K neighbors from each popularity bucket, so any target popularity still finds
+// SIMILAR_K of them if there are that many. Element 0 has no neighbors. Unused slots have eltid 0 and come last.
+typedef struct
+{
+    char magic[8];           // SIMILAR_MAGIC
+    uint32_t version;        // SIMILAR_VERSION
+    uint32_t k;              // SIMILAR_K, per popularity bucket
+    uint64_t num_elts;       // BE.num_elts when the table was built
+    uint64_t num_valences;   // g_num_confident_valences when the table was built
+} similar_header_t;
+
+// The element id permutation is this header, then to_internal[id] for each catalog id from 0 to num_elts. The valence
+// cache files, the similar-items table and the packed cache use the internal ids, and recgen translates at the API.
+typedef struct
+{
+    char magic[8];           // ELT_PERM_MAGIC
+    uint32_t version;        // ELT_PERM_VERSION
+    uint32_t ordering;       // ELT_ORDER_RCM or ELT_ORDER_POP
+    uint64_t num_elts;       // BE.num_elts when the ids were reordered
+} elt_perm_header_t;
+
+typedef struct
+{
+    uint32_t eltid;
+    int16_t lift;            // how much loving rather than hating the element raises eltid's predicted rating
+    int16_t rating;          // eltid's predicted rating from someone who loves the element
+} neighbor_t;
+
+typedef struct // rate limit state for one BMH_LOG() call site
+{
+    uint32_t window;     // the second that count is for
+    uint32_t count;      // messages this site tried to log during that second
+    uint32_t suppressed; // messages held back since the last one that got through
+} log_site_t;
+
 typedef struct
 {
     int fcgi_fd;
@@ -211,7 +457,21 @@ enum
 };
 
 // These are the different requests we can make to the server.
-enum { SCENARIO_RECS, SCENARIO_EVENT, SCENARIO_SINGLEREC };
+enum { SCENARIO_RECS, SCENARIO_EVENT, SCENARIO_SINGLEREC, SCENARIO_SIMILAR, NUM_SCENARIOS };
+
+// These are the stages of a request that metrics.c times. METRICS_STAGE_REQUEST is the whole request.
+enum
+{
+    METRICS_STAGE_DESERIALIZE,
+    METRICS_STAGE_RATINGS_FETCH,
+    METRICS_STAGE_INIT_WORKINGSET,
+    METRICS_STAGE_TALLY,
+    METRICS_STAGE_COMPOSITE,
+    METRICS_STAGE_TOP_K,
+    METRICS_STAGE_SERIALIZE_WRITE,
+    METRICS_STAGE_REQUEST,
+    METRICS_NUM_STAGES
+};
 
 // These are the different communciation protocols we can use to talk to the server.
 enum { PROTOCOL_PROTOBUF, PROTOCOL_JSON };
@@ -232,7 +492,9 @@ enum
     PROTOBUF_DECODE_FAILED_FOR_EVENT,
     PERSONID_FROM_CLIENT_INCORRECT,
     ELEMENTID_FROM_CLIENT_INCORRECT,
-    NO_RATINGS_FOR_USER
+    NO_RATINGS_FOR_USER,
+    PROTOBUF_DECODE_FAILED_FOR_SIMILAR,
+    NO_SIMILAR_TABLE
 };
 
 extern const char *error_strings[];
@@ -240,12 +502,22 @@ extern const char *error_strings[];
 
 extern size_t g_num_confident_valences;
 extern uint8_t g_output_scale;
+extern bool g_log_request_time;
+extern bool g_unified_adjacency;
+extern bool g_packed_valences;
+extern int g_huge_pages;
+extern bool g_numa_replicate;
+extern uint32_t g_prefork_workers;
+extern uint64_t g_result_cache_entries;
+extern int32_t g_prefork_worker;
 
 //
 // Prototypes of things used outside the function's own source file
 //
 
 // in big_mem.c
+extern void populate_ncv(void);
+
 extern bool pop_load(void);
 
 extern bool load_beast(int, bool);
@@ -260,11 +532,22 @@ extern void export_ds(void);
 
 extern valence_t *bb_leash(void);
 
-extern bb_ind_t *bind_seg_leash(void);
+extern seg_ptr_t *bind_seg_leash(void);
 
 extern valence_t *bb_ds_leash(void);
 
-extern bb_ind_t *bind_seg_ds_leash(void);
+extern seg_ptr_t *bind_seg_ds_leash(void);
+
+extern void unify_adjacency(valence_t *, seg_ptr_t **, const valence_t *, const seg_ptr_t *, const valence_t *,
+                            const seg_ptr_t *);
+
+extern void relabel_adjacency(valence_t *, seg_ptr_t **, const valence_t *, const seg_ptr_t *, const exp_elt_t *);
+
+extern void relabel_beast(const exp_elt_t *);
+
+extern valence_t *bb_uni_leash(void);
+
+extern seg_ptr_t *bind_seg_uni_leash(void);
 
 extern popularity_t *pop_leash(void);
 
@@ -274,15 +557,169 @@ extern double *tiny_slopes_inv_leash(void);
 
 extern int8_t *tiny_offsets_leash(void);
 
-extern rating_t *big_rat_leash(void);
+extern elt_rating_t *big_rat_leash(void);
 
-extern uint32_t *big_rat_index_leash(void);
+extern uint64_t *big_rat_index_leash(void);
 
 // in predictions.c
 extern void create_workingset(size_t);
 
+extern void init_workingset(size_t);
+
+extern void create_pcrs(const int8_t *, const double *, const int8_t *);
+
+extern uint64_t tally(const valence_t *, const seg_ptr_t *, const valence_t *, const seg_ptr_t *, const pop_split_t *,
+                      const pop_split_t *, popularity_t, int, rating_t []);
+
+extern uint64_t tally_unified(const valence_t *, const seg_ptr_t *, const pop_split_t *, const pop_split_t *,
+                              popularity_t, int, rating_t []);
+
+extern uint64_t tally_packed(const packed_adjacency_t *, int, rating_t []);
+
+extern void composite(uint64_t);
+
+extern void top_recs(prediction_t [], int, popularity_t, const popularity_t *);
+
 extern bool predictions(rating_t [], int, prediction_t [], int, int, popularity_t);
 
+extern int predicted_rating(uint8_t, int, bool);
+
+// in packed.c
+extern bool pack_adjacency(packed_adjacency_t *, const valence_t *, const seg_ptr_t *, const valence_t *,
+                           const seg_ptr_t *);
+
+extern void gen_packed_cache(void);
+
+extern bool packed_load(void);
+
+extern const packed_adjacency_t *packed_leash(void);
+
+extern const uint8_t *packed_decode(const uint8_t *, uint32_t *, uint32_t, uint32_t *);
+
+// in similar.c
+extern void gen_similar_cache(void);
+
+extern bool similar_load(void);
+
+extern int similar_items(exp_elt_t, popularity_t, prediction_t [], int);
+
+// in reorder.c
+extern int parse_elt_order(const char *);
+
+extern exp_elt_t *order_elements(int, const valence_t *, const seg_ptr_t *, const valence_t *, const seg_ptr_t *);
+
+extern void gen_reordered_cache(int);
+
+extern void perm_relabel_new_cache(void);
+
+extern bool perm_load(void);
+
+extern void perm_install(exp_elt_t *);
+
+extern exp_elt_t elt_internal(exp_elt_t);
+
+extern exp_elt_t elt_external(exp_elt_t);
+
+// in huge_mem.c
+extern void *huge_calloc(size_t, size_t, const char *);
+
+extern void huge_free(void *);
+
+extern size_t huge_size(const void *);
+
+extern int parse_huge_pages(const char *);
+
+extern void huge_report(void);
+
+// in numa.c
+extern int numa_num_nodes(void);
+
+extern int numa_node_of(const void *);
+
+extern bool numa_pin_to_node(int);
+
+extern void numa_place_model(void);
+
+extern void numa_drop_replicas(void);
+
+extern void numa_pin_worker(void);
+
+extern const model_replica_t *numa_replica(void);
+
+extern bool numa_running_remote(void);
+
+// in prefork.c
+extern void prefork_run(int, void (*)(int), void (*)(void), void (*)(void));
+
+extern void prefork_busy(void);
+
+extern void prefork_idle(void);
+
+// in result_cache.c
+extern void result_cache_init(uint64_t);
+
+extern void result_cache_new_generation(void);
+
+extern uint64_t result_cache_hash(const rating_t *, int);
+
+extern bool result_cache_get(uint32_t, int32_t, uint64_t, prediction_t *);
+
+extern void result_cache_put(uint32_t, int32_t, uint64_t, const prediction_t *);
+
+extern void result_cache_forget(uint32_t);
+
+extern bool result_cache_stats(result_cache_stats_t *);
+
+// in seg_pages.c
+extern uint8_t *seg_page_array(uint64_t, const char *);
+
+extern void seg_add_pages(seg_ptr_t **, uint64_t, const uint8_t *, const char *);
+
+extern uint64_t seg_index_entries(const seg_ptr_t *, uint64_t);
+
+extern void seg_walk_start(seg_walk_t *, const seg_ptr_t *, uint64_t, uint64_t, uint64_t);
+
+extern bool seg_walk_next(seg_walk_t *, uint64_t *, uint64_t *, exp_elt_t *);
+
+// in pop_split.c
+extern popularity_t *pop_internal(const popularity_t *);
+
+extern pop_split_t *partition_by_pop(valence_t *, seg_ptr_t **, const popularity_t *, const char *);
+
+extern uint64_t pop_split_long_end(const pop_split_t *, uint64_t, int);
+
+extern void pop_split_export(valence_t *, seg_ptr_t **, const char *);
+
+extern bool pop_split_load(const seg_ptr_t *, const seg_ptr_t *);
+
+extern const pop_split_t *pop_split_leash(void);
+
+extern const pop_split_t *pop_split_ds_leash(void);
+
+// in async_log.c
+extern void async_log_start(void);
+
+extern void async_log_write(log_site_t *, int, const char *, ...) __attribute__((format(printf, 3, 4)));
+
+// in metrics.c
+extern void metrics_share(void);
+
+extern void metrics_register_thread(void);
+
+extern void metrics_request_begin(int);
+
+extern void metrics_mark(void);
+
+extern void metrics_stage(int);
+
+extern void metrics_add_valences(uint64_t);
+
+extern void metrics_request_failed(void);
+
+extern void metrics_request_end(void);
+
+extern size_t metrics_render(char *, size_t);
+
 // in main.c
 extern void gen_valence_cache(void);
 
@@ -0,0 +1,429 @@
+// SPDX-FileCopyrightText: 2022 Brian Calhoun <brian@bemorehuman.org>
+//
+// SPDX-License-Identifier: MIT
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is furnished to do
+// so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// This file is part of bemorehuman. See https://bemorehuman.org
+
+#include "recgen.h"
+
+//
+// This file reorders the element ids so tally() has some locality when it updates the workingset.
+//
+// The catalog's element ids come from normalize.sh in no useful order, so the elements whose predictions one rated
+// element updates are spread across the whole workingset. recgen -r relabels the valence cache so that elements
+// sharing valences get nearby ids, and writes the permutation to elt_perm.bin. recgen loads the permutation and
+// translates ids where ratings come in and recs go out, so clients only ever see the catalog's ids.
+//
+
+static exp_elt_t *g_to_internal = NULL;   // catalog id -> internal id, or NULL if the ids weren't reordered
+static exp_elt_t *g_to_external = NULL;   // internal id -> catalog id
+
+
+// Translate a catalog element id to the id the valence cache uses. Ids outside the catalog stay as they are, so the
+// checks downstream still catch them.
+exp_elt_t elt_internal(exp_elt_t eltid)
+{
+    return (NULL == g_to_internal || eltid > BE.num_elts) ? eltid : g_to_internal[eltid];
+} // end elt_internal()
+
+
+// Translate an id the valence cache uses back to the catalog's element id.
+exp_elt_t elt_external(exp_elt_t eltid)
+{
+    return (NULL == g_to_external || eltid > BE.num_elts) ? eltid : g_to_external[eltid];
+} // end elt_external()
+
+
+// Start translating ids with to_internal, which has BE.num_elts + 1 entries, or stop translating if it's NULL.
+// The permutation is ours to free after this.
+void perm_install(exp_elt_t *to_internal)
+{
+    free(g_to_internal);
+    free(g_to_external);
+    g_to_internal = g_to_external = NULL;
+    if (NULL == to_internal)
+        return;
+
+    g_to_external = calloc(BE.num_elts + 1, sizeof(exp_elt_t));
+    if (NULL == g_to_external)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when creating the element id translation.");
+        exit(EXIT_MEMLOAD);
+    }
+    for (uint64_t e = 0; e <= BE.num_elts; e++)
+        g_to_external[to_internal[e]] = (exp_elt_t) e;
+    g_to_internal = to_internal;
+} // end perm_install()
+
+
+// Turn "rcm" or "pop" into ELT_ORDER_RCM or ELT_ORDER_POP. Anything else is 0.
+int parse_elt_order(const char *name)
+{
+    if (0 == strcmp(name, "rcm"))
+        return ELT_ORDER_RCM;
+    if (0 == strcmp(name, "pop"))
+        return ELT_ORDER_POP;
+    return 0;
+} // end parse_elt_order()
+
+
+static int keycmp(const void *p1, const void *p2)
+{
+    const uint64_t a = *(const uint64_t *) p1;
+    const uint64_t b = *(const uint64_t *) p2;
+    return (a > b) - (a < b);
+} // end keycmp()
+
+
+// How many valences does element e have, counting both sides?
+static uint64_t degree(const seg_ptr_t *bind_seg, const seg_ptr_t *bind_seg_ds, uint64_t e)
+{
+    return GET_SEG(bind_seg[e + 1]) - GET_SEG(bind_seg[e]) + GET_SEG(bind_seg_ds[e + 1]) - GET_SEG(bind_seg_ds[e]);
+} // end degree()
+
+
+// The sort key for element e: its degree, ascending for RCM and descending for popularity, then its id.
+static uint64_t order_key(int ordering, uint64_t deg, uint64_t e)
+{
+    if (deg > UINT32_MAX)
+        deg = UINT32_MAX;
+    if (ELT_ORDER_POP == ordering)
+        deg = UINT32_MAX - deg;
+    return (deg << 32) | e;
+} // end order_key()
+
+
+// Work out new ids for the elements from the adjacency in bb and bb_ds. Both orderings walk breadth first over the
+// elements that share valences. RCM starts each connected piece from its least connected element, takes neighbors
+// least connected first, and reverses the whole order at the end, which keeps each element's neighbors close to it.
+// Popularity starts from the most connected element and takes neighbors most connected first, so the hot elements
+// and the ones they share valences with get the low ids. Returns to_internal[old id] = new id, BE.num_elts + 1 of them.
+exp_elt_t *order_elements(int ordering, const valence_t *bb, const seg_ptr_t *bind_seg, const valence_t *bb_ds,
+                          const seg_ptr_t *bind_seg_ds)
+{
+    const uint64_t n = BE.num_elts;
+    uint64_t *seeds = calloc(n + 1, sizeof(uint64_t));
+    exp_elt_t *order = calloc(n + 1, sizeof(exp_elt_t));
+    uint8_t *placed = calloc(n + 1, sizeof(uint8_t));
+    exp_elt_t *to_internal = calloc(n + 1, sizeof(exp_elt_t));
+    if (NULL == seeds || NULL == order || NULL == placed || NULL == to_internal)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when ordering the elements.");
+        exit(EXIT_MEMLOAD);
+    }
+
+    uint64_t max_degree = 0;
+    for (uint64_t e = 1; e <= n; e++)
+    {
+        const uint64_t deg = degree(bind_seg, bind_seg_ds, e);
+        if (deg > max_degree)
+            max_degree = deg;
+        seeds[e - 1] = order_key(ordering, deg, e);
+    }
+    qsort(seeds, n, sizeof(uint64_t), keycmp);
+
+    uint64_t *neighbors = calloc(max_degree + 1, sizeof(uint64_t));
+    if (NULL == neighbors)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when ordering the elements.");
+        exit(EXIT_MEMLOAD);
+    }
+
+    uint64_t head = 0, tail = 0;
+    for (uint64_t s = 0; s < n; s++)
+    {
+        const exp_elt_t seed = (exp_elt_t) (seeds[s] & UINT32_MAX);
+        if (placed[seed])
+            continue;
+        placed[seed] = 1;
+        order[tail++] = seed;
+
+        while (head < tail)
+        {
+            const exp_elt_t e = order[head++];
+            uint64_t num_neighbors = 0;
+            for (int side = 0; side < 2; side++)
+            {
+                const valence_t *src = side ? bb_ds : bb;
+                const seg_ptr_t *idx = side ? bind_seg_ds : bind_seg;
+                seg_walk_t walk;
+                uint64_t start, stop;
+                exp_elt_t base;
+                seg_walk_start(&walk, idx, SEG_ROWS(n), e, GET_SEG(idx[e + 1]));
+                while (seg_walk_next(&walk, &start, &stop, &base))
+                {
+                    for (uint64_t v = start; v < stop; v++)
+                    {
+                        const exp_elt_t y = base | GET_ELT(src[v].eltid);
+                        if (placed[y])
+                            continue;
+                        placed[y] = 1;
+                        neighbors[num_neighbors++] = order_key(ordering, degree(bind_seg, bind_seg_ds, y), y);
+                    }
+                }
+            }
+            qsort(neighbors, num_neighbors, sizeof(uint64_t), keycmp);
+            for (uint64_t i = 0; i < num_neighbors; i++)
+                order[tail++] = (exp_elt_t) (neighbors[i] & UINT32_MAX);
+        }
+    }
+
+    for (uint64_t i = 0; i < n; i++)
+        to_internal[order[i]] = (exp_elt_t) (ELT_ORDER_RCM == ordering ? n - i : i + 1);
+
+    free(neighbors);
+    free(placed);
+    free(order);
+    free(seeds);
+    return to_internal;
+} // end order_elements()
+
+
+// The mean distance between the ids of a valence's two elements. Smaller means tally()'s writes land closer together.
+static double mean_span(const valence_t *bb, const seg_ptr_t *bind_seg)
+{
+    double total = 0;
+    uint64_t num = 0;
+
+    for (uint64_t e = 1; e <= BE.num_elts; e++)
+    {
+        seg_walk_t walk;
+        uint64_t start, stop;
+        exp_elt_t base;
+        seg_walk_start(&walk, bind_seg, SEG_ROWS(BE.num_elts), e, GET_SEG(bind_seg[e + 1]));
+        while (seg_walk_next(&walk, &start, &stop, &base))
+            for (uint64_t v = start; v < stop; v++, num++)
+            {
+                const uint64_t y = base | GET_ELT(bb[v].eltid);
+                total += (double) (y > e ? y - e : e - y);
+            }
+    }
+    return num ? total / (double) num : 0.0;
+} // end mean_span()
+
+
+static void cache_filename(char *filename, size_t size, const char *name)
+{
+    strlcpy(filename, BE.valence_cache_dir, size);
+    strlcat(filename, "/", size);
+    strlcat(filename, name, size);
+} // end cache_filename()
+
+
+// Read the permutation recgen -r wrote, or return NULL if there isn't one. num_elts gets the catalog size it's for.
+static exp_elt_t *read_perm(const char *filename, uint64_t *num_elts)
+{
+    FILE *fp = fopen(filename, "r");
+    if (NULL == fp)
+        return NULL;
+
+    elt_perm_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1
+        || memcmp(header.magic, ELT_PERM_MAGIC, sizeof(header.magic)) != 0
+        || header.version != ELT_PERM_VERSION
+        || header.num_elts > MAX_ELTS)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: %s isn't an element permutation this recgen can read. Run recgen -r again.",
+               filename);
+        exit(-1);
+    }
+
+    exp_elt_t *perm = calloc(header.num_elts + 1, sizeof(exp_elt_t));
+    uint8_t *seen = calloc(header.num_elts + 1, sizeof(uint8_t));
+    if (NULL == perm || NULL == seen)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when loading the element permutation.");
+        exit(EXIT_MEMLOAD);
+    }
+
+    // Every id has to go to a different id in the catalog, or translating would lose elements.
+    bool ok = fread(perm, sizeof(exp_elt_t), header.num_elts + 1, fp) == header.num_elts + 1 && 0 == perm[0];
+    for (uint64_t e = 1; ok && e <= header.num_elts; e++)
+    {
+        ok = perm[e] >= 1 && perm[e] <= header.num_elts && !seen[perm[e]];
+        if (ok)
+            seen[perm[e]] = 1;
+    }
+    free(seen);
+    fclose(fp);
+    if (!ok)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: %s is short or isn't a permutation. Run recgen -c, -d and -r again.", filename);
+        exit(-1);
+    }
+
+    *num_elts = header.num_elts;
+    return perm;
+} // end read_perm()
+
+
+static void write_perm(const char *filename, const exp_elt_t *to_internal, int ordering)
+{
+    FILE *fp = fopen(filename, "w");
+    if (NULL == fp)
+    {
+        syslog(LOG_ERR, "ERROR: cannot open output file %s", filename);
+        exit(-1);
+    }
+
+    elt_perm_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ELT_PERM_MAGIC, sizeof(header.magic));
+    header.version = ELT_PERM_VERSION;
+    header.ordering = (uint32_t) ordering;
+    header.num_elts = BE.num_elts;
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1
+        || fwrite(to_internal, sizeof(exp_elt_t), BE.num_elts + 1, fp) != BE.num_elts + 1)
+    {
+        syslog(LOG_ERR, "ERROR: cannot write to %s", filename);
+        exit(-1);
+    }
+    fclose(fp);
+} // end write_perm()
+
+
+// Load the permutation if recgen -r reordered the element ids. Returns false if the ids are the catalog's own.
+bool perm_load()
+{
+    perm_install(NULL);
+
+    char filename[strlen(BE.valence_cache_dir) + strlen(ELT_PERM_BIN) + 2];
+    cache_filename(filename, sizeof(filename), ELT_PERM_BIN);
+
+    uint64_t num_elts = 0;
+    exp_elt_t *to_internal = read_perm(filename, &num_elts);
+    if (NULL == to_internal)
+    {
+        syslog(LOG_INFO, "No element permutation at %s, so element ids are used as they are.", filename);
+        return (false);
+    }
+    if (num_elts != BE.num_elts)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: %s is for %" PRIu64 " elements instead of %" PRIu64 ". Run recgen -c, -d and -r "
+               "again.", filename, num_elts, BE.num_elts);
+        exit(-1);
+    }
+
+    perm_install(to_internal);
+    syslog(LOG_INFO, "Successfully loaded the element permutation.");
+    return (true);
+} // end perm_load()
+
+
+// recgen -c and recgen -d call this before they write their half of the cache. If recgen -r reordered this catalog
+// before, relabel the new bb or bb_ds the same way so all 4 files keep agreeing with elt_perm.bin, and install the
+// permutation. A permutation for a catalog of another size is stale, so it goes.
+void perm_relabel_new_cache()
+{
+    char filename[strlen(BE.valence_cache_dir) + strlen(ELT_PERM_BIN) + 2];
+    cache_filename(filename, sizeof(filename), ELT_PERM_BIN);
+
+    uint64_t num_elts = 0;
+    exp_elt_t *to_internal = read_perm(filename, &num_elts);
+    if (NULL == to_internal)
+        return;
+
+    if (num_elts != BE.num_elts)
+    {
+        printf("Removing %s, which is for %" PRIu64 " elements. Run recgen -r again to reorder.\n", filename,
+               num_elts);
+        unlink(filename);
+        free(to_internal);
+        return;
+    }
+
+    relabel_beast(to_internal);
+    printf("Reordered the element ids with %s.\n", filename);
+
+    // Export sorts the rows by popularity, which it looks up through the permutation.
+    perm_install(to_internal);
+} // end perm_relabel_new_cache()
+
+
+// Remove a file recgen built from the valence cache in the old ids.
+static void remove_derived(const char *name, char flag)
+{
+    char filename[strlen(BE.valence_cache_dir) + strlen(name) + 2];
+    cache_filename(filename, sizeof(filename), name);
+    if (0 == unlink(filename))
+        printf("Removed %s, which used the old ids. Run recgen -%c again to rebuild it.\n", filename, flag);
+} // end remove_derived()
+
+
+//
+// This reorders the element ids in the valence caches, so run it after recgen -c and recgen -d. It rewrites the 4
+// files in the new ids and writes the permutation to elt_perm.bin. The similar-items table and the packed cache are
+// in the old ids, so it removes them.
+// To use, invoke the recgen executable with "-r rcm" or "-r pop".
+//
+void gen_reordered_cache(int ordering)
+{
+    printf("Begin timing for reordering element ids.\n");
+    const long long start = current_time_millis();
+
+    populate_ncv();
+
+    // We need both the bb and the bb_ds to see all of an element's neighbors.
+    if (true != load_beast(LOAD_VALENCES_FROM_BEAST_EXPORT, true))
+        exit(EXIT_MEMLOAD);
+
+    // If the cache was reordered before, it's in those ids now and the new permutation has to go through both.
+    char filename[strlen(BE.valence_cache_dir) + strlen(ELT_PERM_BIN) + 2];
+    cache_filename(filename, sizeof(filename), ELT_PERM_BIN);
+    uint64_t num_elts = 0;
+    exp_elt_t *earlier = read_perm(filename, &num_elts);
+    if (NULL != earlier && num_elts != BE.num_elts)
+    {
+        free(earlier);
+        earlier = NULL;
+    }
+
+    const double span_before = mean_span(bb_leash(), bind_seg_leash());
+    exp_elt_t *to_internal = order_elements(ordering, bb_leash(), bind_seg_leash(), bb_ds_leash(),
+                                            bind_seg_ds_leash());
+    relabel_beast(to_internal);
+    const double span_after = mean_span(bb_leash(), bind_seg_leash());
+
+    if (NULL != earlier)
+    {
+        for (uint64_t e = 0; e <= BE.num_elts; e++)
+            earlier[e] = to_internal[earlier[e]];
+        free(to_internal);
+        to_internal = earlier;
+    }
+
+    // Export sorts the rows by popularity, which is looked up through the permutation, so install it first.
+    perm_install(to_internal);
+    export_beast();
+    export_ds();
+    write_perm(filename, to_internal, ordering);
+
+    remove_derived(SIMILAR_BIN, 's');
+    remove_derived(VALENCES_PACKED, 'p');
+
+    const long long finish = current_time_millis();
+    printf("Reordered %" PRIu64 " element ids with %s. The mean id distance across a valence went from %.1f to %.1f.\n",
+           BE.num_elts, ELT_ORDER_RCM == ordering ? "reverse Cuthill-McKee" : "popularity then community",
+           span_before, span_after);
+    printf("Time to reorder element ids: %d milliseconds.\n", (int) (finish - start));
+} // end gen_reordered_cache()
@@ -0,0 +1,293 @@
+// SPDX-FileCopyrightText: 2022 Brian Calhoun <brian@bemorehuman.org>
+//
+// SPDX-License-Identifier: MIT
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is furnished to do
+// so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// This file is part of bemorehuman. See https://bemorehuman.org
+
+#include "recgen.h"
+#include <sys/mman.h>
+
+//
+// This file keeps the recs recgen made recently, so a person asking again gets the same answer without another tally
+// and sort. It's off unless recgen -k gives it a size.
+//
+// An entry is keyed by personid, target popularity, a hash of the ratings the recs came from and the model
+// generation, which goes up each time initialize_structures() loads the model. Entries from an older generation
+// never match, so a reload empties the cache as far as anyone can tell. event() forgets a person's entries.
+//
+// The cache is set-associative: a person's entries all live in one set of RCACHE_WAYS, picked by personid, so
+// forgetting a person touches one set. There's a power of 2 of sets, and a person's set is the top bits of personid
+// times 2^64 / golden ratio, which spreads runs of consecutive personids evenly over all the sets. Each set evicts with
+// CLOCK. Sets are spread across RCACHE_SHARDS locks. The whole thing is one shared mapping with process-shared locks,
+// so with recgen -w every worker sees the same cache and an event on one worker is forgotten on all of them. A worker
+// from before a reload keeps its own generation, so it can't file old-model recs under the new one.
+//
+
+uint64_t g_result_cache_entries = 0;   // How many recs lists to keep. 0 turns the cache off. See recgen -k.
+
+typedef struct
+{
+    uint64_t ratings_hash;       // 64-bit FNV-1a of the ratings the recs came from
+    uint32_t personid;
+    uint32_t generation;         // 0 if the entry is empty
+    int32_t popularity;
+    uint8_t referenced;          // CLOCK bit, set on each hit
+    uint8_t padding[3];
+    prediction_t recs[RECS_BUCKET_SIZE];
+} rcache_entry_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    uint64_t used;               // entries of this shard's sets that aren't empty, though some may be stale
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+} __attribute__((aligned(64))) rcache_shard_t;
+
+typedef struct
+{
+    rcache_shard_t shards[RCACHE_SHARDS];
+    uint64_t num_sets;
+    int set_bits;                // num_sets is 1 << set_bits
+    size_t bytes;
+} rcache_t;
+
+static rcache_t *g_cache = NULL;             // the header, then num_sets CLOCK hands, then the entries
+static uint8_t *g_hands = NULL;
+static rcache_entry_t *g_entries = NULL;
+static uint32_t g_generation = 1;            // this process's model generation
+
+
+// Map the cache shared, so the recgen -w workers forked later all use it. Call it before initialize_structures().
+void result_cache_init(uint64_t entries)
+{
+    if (0 == entries)
+        return;
+
+    int set_bits = 1;
+    while (((uint64_t) RCACHE_WAYS << set_bits) < entries)
+        set_bits++;
+    const uint64_t num_sets = 1ULL << set_bits;
+    const size_t hands_bytes = (num_sets + 63) / 64 * 64;
+    const size_t bytes = sizeof(rcache_t) + hands_bytes + num_sets * RCACHE_WAYS * sizeof(rcache_entry_t);
+    uint8_t *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == mem)
+    {
+        printf("FATAL ERROR: Out of memory for a result cache of %" PRIu64 " entries.\n", entries);
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory for a result cache of %" PRIu64 " entries.", entries);
+        exit(EXIT_MEMLOAD);
+    }
+
+    // The mapping is zeroed, so every entry starts empty.
+    g_cache = (rcache_t *) mem;
+    g_hands = mem + sizeof(rcache_t);
+    g_entries = (rcache_entry_t *) (mem + sizeof(rcache_t) + hands_bytes);
+    g_cache->num_sets = num_sets;
+    g_cache->set_bits = set_bits;
+    g_cache->bytes = bytes;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef PTHREAD_MUTEX_ROBUST
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+    for (int s = 0; s < RCACHE_SHARDS; s++)
+        pthread_mutex_init(&g_cache->shards[s].lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    printf("Result cache: %" PRIu64 " entries in %.1f MB.\n", num_sets * RCACHE_WAYS, (double) bytes / 1e6);
+    syslog(LOG_INFO, "Result cache: %" PRIu64 " entries in %.1f MB.", num_sets * RCACHE_WAYS, (double) bytes / 1e6);
+} // end result_cache_init()
+
+
+// initialize_structures() calls this each time it loads the model, so recs from the old one stop matching.
+void result_cache_new_generation()
+{
+    g_generation++;
+    if (0 == g_generation)
+        g_generation = 1;
+} // end result_cache_new_generation()
+
+
+// The hash of a request's ratings that goes in its key. Take it before predictions(), which may change the ratings.
+uint64_t result_cache_hash(const rating_t *ratings, int num_rats)
+{
+    if (NULL == g_cache)
+        return 0;
+
+    uint64_t h = FNV_OFFSET_BASIS;
+    for (int i = 0; i < num_rats; i++)
+    {
+        const uint32_t parts[2] = { ratings[i].elementid, ratings[i].rating };
+        const uint8_t *p = (const uint8_t *) parts;
+        for (size_t b = 0; b < sizeof(parts); b++)
+            h = (h ^ p[b]) * FNV_PRIME;
+    }
+    return h;
+} // end result_cache_hash()
+
+
+static uint64_t set_of(uint32_t personid)
+{
+    return ((uint64_t) personid * 0x9e3779b97f4a7c15ULL) >> (64 - g_cache->set_bits);
+} // end set_of()
+
+
+// Lock the shard of set. If a worker died holding it, it may have left an entry half written, so empty the shard.
+static rcache_shard_t *lock_set(uint64_t set)
+{
+    rcache_shard_t *shard = &g_cache->shards[set % RCACHE_SHARDS];
+    const int rc = pthread_mutex_lock(&shard->lock);
+#ifdef PTHREAD_MUTEX_ROBUST
+    if (EOWNERDEAD == rc)
+    {
+        for (uint64_t s = set % RCACHE_SHARDS; s < g_cache->num_sets; s += RCACHE_SHARDS)
+            for (int w = 0; w < RCACHE_WAYS; w++)
+                g_entries[s * RCACHE_WAYS + (uint64_t) w].generation = 0;
+        shard->used = 0;
+        pthread_mutex_consistent(&shard->lock);
+        syslog(LOG_WARNING, "A recgen worker died holding a result cache lock. Emptied that part of the cache.");
+    }
+#else
+    (void) rc;
+#endif
+    return shard;
+} // end lock_set()
+
+
+// If the cache has recs for this request from the current model, copy them to recs and return true.
+bool result_cache_get(uint32_t personid, int32_t popularity, uint64_t hash, prediction_t *recs)
+{
+    if (NULL == g_cache)
+        return (false);
+
+    const uint64_t set = set_of(personid);
+    rcache_entry_t *ways = &g_entries[set * RCACHE_WAYS];
+    rcache_shard_t *shard = lock_set(set);
+    for (int w = 0; w < RCACHE_WAYS; w++)
+    {
+        rcache_entry_t *e = &ways[w];
+        if (e->generation == g_generation && e->personid == personid && e->popularity == popularity
+            && e->ratings_hash == hash)
+        {
+            memcpy(recs, e->recs, sizeof(e->recs));
+            e->referenced = 1;
+            shard->hits++;
+            pthread_mutex_unlock(&shard->lock);
+            return (true);
+        }
+    }
+    shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+    return (false);
+} // end result_cache_get()
+
+
+// Keep the recs predictions() just made for this request.
+void result_cache_put(uint32_t personid, int32_t popularity, uint64_t hash, const prediction_t *recs)
+{
+    if (NULL == g_cache)
+        return;
+
+    const uint64_t set = set_of(personid);
+    rcache_entry_t *ways = &g_entries[set * RCACHE_WAYS];
+    rcache_shard_t *shard = lock_set(set);
+
+    // Reuse this request's old entry or an empty one, else sweep the CLOCK hand past recently hit entries.
+    rcache_entry_t *victim = NULL;
+    for (int w = 0; w < RCACHE_WAYS && NULL == victim; w++)
+        if (ways[w].personid == personid && ways[w].popularity == popularity && ways[w].ratings_hash == hash)
+            victim = &ways[w];
+    for (int w = 0; w < RCACHE_WAYS && NULL == victim; w++)
+        if (0 == ways[w].generation)
+            victim = &ways[w];
+    while (NULL == victim)
+    {
+        rcache_entry_t *e = &ways[g_hands[set]];
+        g_hands[set] = (uint8_t) ((g_hands[set] + 1) % RCACHE_WAYS);
+        if (e->referenced && e->generation == g_generation)
+            e->referenced = 0;
+        else
+        {
+            victim = e;
+            shard->evictions++;
+        }
+    }
+
+    if (0 == victim->generation)
+        shard->used++;
+    victim->personid = personid;
+    victim->popularity = popularity;
+    victim->ratings_hash = hash;
+    victim->generation = g_generation;
+    victim->referenced = 0;
+    memcpy(victim->recs, recs, sizeof(victim->recs));
+    pthread_mutex_unlock(&shard->lock);
+} // end result_cache_put()
+
+
+// event() calls this, since a new event for personid may change their recs.
+void result_cache_forget(uint32_t personid)
+{
+    if (NULL == g_cache)
+        return;
+
+    const uint64_t set = set_of(personid);
+    rcache_entry_t *ways = &g_entries[set * RCACHE_WAYS];
+    rcache_shard_t *shard = lock_set(set);
+    for (int w = 0; w < RCACHE_WAYS; w++)
+    {
+        if (0 != ways[w].generation && ways[w].personid == personid)
+        {
+            ways[w].generation = 0;
+            shard->used--;
+            shard->invalidations++;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+} // end result_cache_forget()
+
+
+// Add up the shards for /bmh/metrics. Returns false if the cache is off.
+bool result_cache_stats(result_cache_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (NULL == g_cache)
+        return (false);
+
+    stats->capacity = g_cache->num_sets * RCACHE_WAYS;
+    stats->bytes = g_cache->bytes;
+    for (int s = 0; s < RCACHE_SHARDS; s++)
+    {
+        rcache_shard_t *shard = lock_set((uint64_t) s);
+        stats->used += shard->used;
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->invalidations += shard->invalidations;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return (true);
+} // end result_cache_stats()
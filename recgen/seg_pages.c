@@ -0,0 +1,197 @@
+// SPDX-FileCopyrightText: 2022 Brian Calhoun <brian@bemorehuman.org>
+//
+// SPDX-License-Identifier: MIT
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is furnished to do
+// so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// This file is part of bemorehuman. See https://bemorehuman.org
+#include "recgen.h"
+
+//
+// This file keeps the pages of the element ids in a segment index.
+//
+// A valence only stores the low 24 bits of its eltid. The top 8, the page, are the same for long stretches of a row,
+// since rows are sorted, so each index ends with a page directory that stores them as runs:
+//
+//   dir[0]                  S, how many rows have a valence past page 0
+//   dir[1 .. S]             those rows, ascending
+//   dir[S + 1 .. 2S + 1]    where each of those rows' runs start in the run list, and where the last one ends
+//   dir[2S + 2 ..]          the runs, each (page << 32) | count for count valences in a row on the same page
+//
+// where dir is the entry after the row pointers. A row that isn't listed is all page 0, so a catalog under 2^24
+// elements has the 2-entry directory { 0, 0 } and costs nothing extra. A bigger catalog only pays for the rows that
+// reach past page 0, and only a run per page they touch, instead of a row pointer per element per page.
+//
+
+
+// A zeroed page per valence for a builder to fill in and hand to seg_add_pages(), or NULL when the catalog has only
+// one page and there's nothing to keep.
+uint8_t *seg_page_array(uint64_t num_valences, const char *what)
+{
+    if (ELT_PAGES(BE.num_elts) < 2)
+        return NULL;
+
+    uint8_t *page = calloc(num_valences > 0 ? num_valences : 1, sizeof(uint8_t));
+    if (NULL == page)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory for the pages of %s.", what);
+        exit(EXIT_MEMLOAD);
+    }
+    return page;
+} // end seg_page_array()
+
+
+// How many entries the index takes, row pointers and directory, given how many row pointers it has.
+uint64_t seg_index_entries(const seg_ptr_t *idx, uint64_t rows)
+{
+    const seg_ptr_t *dir = &idx[rows];
+    const uint64_t paged = GET_SEG(dir[0]);
+    return rows + 2 * paged + 2 + GET_SEG(dir[2 * paged + 1]);
+} // end seg_index_entries()
+
+
+// Replace the page directory of *idx, which has rows row pointers and was allocated with huge_calloc(). page[v] is
+// the page of valence v, or page is NULL if every valence is on page 0. If the new directory doesn't fit where the
+// old one was, *idx moves.
+void seg_add_pages(seg_ptr_t **idx, uint64_t rows, const uint8_t *page, const char *what)
+{
+    uint64_t paged = 0, runs = 0;
+    for (uint64_t r = 0; NULL != page && r + 1 < rows; r++)
+    {
+        const uint64_t start = GET_SEG((*idx)[r]), end = GET_SEG((*idx)[r + 1]);
+        uint64_t row_runs = 0;
+        bool past_zero = false;
+        for (uint64_t v = start; v < end; v++)
+        {
+            if (v == start || page[v] != page[v - 1])
+                row_runs++;
+            past_zero |= 0 != page[v];
+        }
+        if (past_zero)
+        {
+            paged++;
+            runs += row_runs;
+        }
+    }
+
+    const uint64_t entries = rows + 2 * paged + 2 + runs;
+    seg_ptr_t *out = *idx;
+    if (entries * sizeof(seg_ptr_t) > huge_size(out))
+    {
+        out = huge_calloc((size_t) entries, sizeof(seg_ptr_t), what);
+        if (NULL == out)
+        {
+            syslog(LOG_ERR, "FATAL ERROR: Out of memory for the page directory of %s.", what);
+            exit(EXIT_MEMLOAD);
+        }
+        memcpy(out, *idx, (size_t) rows * sizeof(seg_ptr_t));
+        huge_free(*idx);
+        *idx = out;
+    }
+
+    seg_ptr_t *dir = &out[rows];
+    seg_ptr_t *run = &dir[2 * paged + 2];
+    uint64_t n = 0, offset = 0;
+    SET_SEG(dir[0], paged);
+    for (uint64_t r = 0; 0 != paged && r + 1 < rows; r++)
+    {
+        const uint64_t start = GET_SEG(out[r]), end = GET_SEG(out[r + 1]);
+        bool past_zero = false;
+        for (uint64_t v = start; v < end && !past_zero; v++)
+            past_zero = 0 != page[v];
+        if (!past_zero)
+            continue;
+
+        n++;
+        SET_SEG(dir[n], r);
+        SET_SEG(dir[paged + n], offset);
+        for (uint64_t v = start; v < end; )
+        {
+            uint64_t stop = v + 1;
+            while (stop < end && page[stop] == page[v])
+                stop++;
+            const uint64_t entry = ((uint64_t) page[v] << 32) | (stop - v);
+            SET_SEG(run[offset], entry);
+            offset++;
+            v = stop;
+        }
+    }
+    SET_SEG(dir[paged + n + 1], offset);
+} // end seg_add_pages()
+
+
+// Walk row r of idx, which has rows row pointers, from its start up to end, which is at most where the row ends.
+void seg_walk_start(seg_walk_t *w, const seg_ptr_t *idx, uint64_t rows, uint64_t r, uint64_t end)
+{
+    w->next = GET_SEG(idx[r]);
+    w->end = end;
+    w->run = w->last_run = NULL;
+
+    const seg_ptr_t *dir = &idx[rows];
+    const uint64_t paged = GET_SEG(dir[0]);
+    if (0 == paged)
+        return;
+
+    // Binary search the rows that have pages.
+    uint64_t lo = 0, hi = paged;
+    while (lo < hi)
+    {
+        const uint64_t mid = lo + (hi - lo) / 2;
+        if (GET_SEG(dir[1 + mid]) < r)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < paged && GET_SEG(dir[1 + lo]) == r)
+    {
+        const seg_ptr_t *run = &dir[2 * paged + 2];
+        w->run = &run[GET_SEG(dir[paged + 1 + lo])];
+        w->last_run = &run[GET_SEG(dir[paged + 2 + lo])];
+    }
+} // end seg_walk_start()
+
+
+// The next run of the walk: valences [*start, *stop) are all on the page whose ids start at *base. Returns false
+// once the walk is done.
+bool seg_walk_next(seg_walk_t *w, uint64_t *start, uint64_t *stop, exp_elt_t *base)
+{
+    if (w->next >= w->end)
+        return false;
+
+    *start = w->next;
+    if (NULL == w->run)
+    {
+        *stop = w->end;
+        *base = 0;
+    }
+    else
+    {
+        if (w->run >= w->last_run)
+            return false;
+        const uint64_t run = GET_SEG(*w->run);
+        w->run++;
+        *stop = w->next + (run & UINT32_MAX);
+        if (*stop > w->end)
+            *stop = w->end;
+        *base = (exp_elt_t) ((run >> 32) << ELT_PAGE_BITS);
+    }
+    w->next = *stop;
+    return true;
+} // end seg_walk_next()
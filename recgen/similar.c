@@ -0,0 +1,305 @@
+// SPDX-FileCopyrightText: 2022 Brian Calhoun <brian@bemorehuman.org>
+//
+// SPDX-License-Identifier: MIT
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is furnished to do
+// so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// This file is part of bemorehuman. See https://bemorehuman.org
+
+#include "recgen.h"
+
+//
+// This file builds and serves the similar-items table behind /bmh/similar.
+//
+// Everything we know about how element X relates to the others is already in X's bb segment (X as x) and bb_ds
+// segment (X as y). recgen -s walks both for each element, ranks the other elements by how strongly X's rating moves
+// their predicted rating, and writes the best SIMILAR_K of them from each popularity bucket to similar.bin. Serving a
+// request is then one row lookup plus the popularity filter, instead of a whole-catalog tally and sort.
+//
+
+static neighbor_t *g_similar = NULL;       // (num_elts + 1) * SIMILAR_ROW neighbors, or NULL if there's no table
+
+// A neighbor while recgen -s ranks them. Steep valences all clamp to the same lift and rating, so it keeps the lift
+// before clamping to tell them apart.
+typedef struct
+{
+    neighbor_t n;
+    int32_t slope;           // the lift if ratings weren't bounded
+} candidate_t;
+
+
+// Is a a better neighbor than b? Stronger lift first, then higher predicted rating, then the steeper valence, then
+// lower catalog id so the table comes out the same every time, whether or not recgen -r reordered the ids.
+static bool better_neighbor(const candidate_t *a, const candidate_t *b)
+{
+    if (a->n.lift != b->n.lift) return a->n.lift > b->n.lift;
+    if (a->n.rating != b->n.rating) return a->n.rating > b->n.rating;
+    if (a->slope != b->slope) return a->slope > b->slope;
+    return elt_external(a->n.eltid) < elt_external(b->n.eltid);
+} // end better_neighbor()
+
+
+// Offer a neighbor to a row kept sorted best first. Slots with eltid 0 are empty and sort last.
+static void offer_neighbor(candidate_t row[SIMILAR_K], const candidate_t *candidate)
+{
+    const candidate_t *last = &row[SIMILAR_K - 1];
+    if (last->n.eltid && !better_neighbor(candidate, last))
+        return;
+
+    int i = SIMILAR_K - 1;
+    while (i > 0 && (0 == row[i - 1].n.eltid || better_neighbor(candidate, &row[i - 1])))
+    {
+        row[i] = row[i - 1];
+        i--;
+    }
+    row[i] = *candidate;
+} // end offer_neighbor()
+
+
+// Offer every valence in element e's segment of bb to the row for its other element's popularity bucket.
+static void offer_segment(candidate_t rows[HIGHEST_POP_NUMBER][SIMILAR_K], const popularity_t *pop,
+                          const valence_t *bb, const seg_ptr_t *bind_seg, exp_elt_t e, bool solve_for_y)
+{
+    const int8_t *tiny_slopes = tiny_slopes_leash();
+    const double *tiny_slopes_inv = tiny_slopes_inv_leash();
+    seg_walk_t walk;
+    uint64_t start, stop;
+    exp_elt_t base;
+    seg_walk_start(&walk, bind_seg, SEG_ROWS(BE.num_elts), e, GET_SEG(bind_seg[e + 1]));
+    while (seg_walk_next(&walk, &start, &stop, &base))
+    {
+        for (const valence_t *v = &bb[start]; v < &bb[stop]; v++)
+        {
+            const int loved = predicted_rating(v->soindex, 32, solve_for_y);
+            candidate_t candidate;
+            candidate.n.eltid = base | GET_ELT(v->eltid);
+            candidate.n.lift = (int16_t) (loved - predicted_rating(v->soindex, 1, solve_for_y));
+            candidate.n.rating = (int16_t) loved;
+
+            // Same scaling as create_pcrs(), over the 31 steps from hating to loving.
+            const int slope_index = GET_HIGH_4_BITS(v->soindex);
+            candidate.slope = solve_for_y ? 31 * tiny_slopes[slope_index]
+                    : (int32_t) bmh_round(31 * FLOAT_TO_SHORT_MULT_SQ * tiny_slopes_inv[slope_index]);
+
+            popularity_t p = pop[candidate.n.eltid];
+            p = (p < LOWEST_POP_NUMBER) ? LOWEST_POP_NUMBER : (p > HIGHEST_POP_NUMBER) ? HIGHEST_POP_NUMBER : p;
+            offer_neighbor(rows[p - LOWEST_POP_NUMBER], &candidate);
+        }
+    }
+} // end offer_segment()
+
+
+// Merge the popularity buckets' rows into one row of SIMILAR_ROW, best first, and return how many neighbors it has.
+static int merge_buckets(neighbor_t row[SIMILAR_ROW], candidate_t rows[HIGHEST_POP_NUMBER][SIMILAR_K])
+{
+    int next[HIGHEST_POP_NUMBER] = {0};
+    int count = 0;
+    memset(row, 0, SIMILAR_ROW * sizeof(neighbor_t));
+    for (;;)
+    {
+        int best = -1;
+        for (int b = 0; b < HIGHEST_POP_NUMBER; b++)
+            if (next[b] < SIMILAR_K && rows[b][next[b]].n.eltid
+                && (best < 0 || better_neighbor(&rows[b][next[b]], &rows[best][next[best]])))
+                best = b;
+        if (best < 0)
+            return count;
+        row[count++] = rows[best][next[best]++].n;
+    }
+} // end merge_buckets()
+
+
+//
+// This generates the similar-items table from the valence caches, so run it after recgen -c and recgen -d.
+// To use, invoke the recgen executable with "-s".
+//
+void gen_similar_cache()
+{
+    printf("Begin timing for generating similar-items table.\n");
+    const long long start = current_time_millis();
+
+    populate_ncv();
+
+    // We need both the bb and the bb_ds to see all of an element's valences.
+    if (true != load_beast(LOAD_VALENCES_FROM_BEAST_EXPORT, true))
+        exit(EXIT_MEMLOAD);
+
+    const valence_t *bb = bb_leash();
+    const seg_ptr_t *bind_seg = bind_seg_leash();
+    const valence_t *bb_ds = bb_ds_leash();
+    const seg_ptr_t *bind_seg_ds = bind_seg_ds_leash();
+    create_pcrs(tiny_slopes_leash(), tiny_slopes_inv_leash(), tiny_offsets_leash());
+
+    // The rows are per popularity bucket, and ties go to the lower catalog id. Both need the permutation.
+    perm_load();
+    if (true != pop_load())
+        exit(EXIT_FAILURE);
+    popularity_t *pop = pop_internal(pop_leash());
+
+    char filename[strlen(BE.valence_cache_dir) + strlen(SIMILAR_BIN) + 2];
+    strlcpy(filename, BE.valence_cache_dir, sizeof(filename));
+    strlcat(filename, "/", sizeof(filename));
+    strlcat(filename, SIMILAR_BIN, sizeof(filename));
+
+    FILE *fp = fopen(filename, "w");
+    if (NULL == fp)
+    {
+        syslog(LOG_ERR, "ERROR: cannot open output file %s", filename);
+        exit(-1);
+    }
+
+    similar_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SIMILAR_MAGIC, sizeof(header.magic));
+    header.version = SIMILAR_VERSION;
+    header.k = SIMILAR_K;
+    header.num_elts = BE.num_elts;
+    header.num_valences = g_num_confident_valences;
+    fwrite(&header, sizeof(header), 1, fp);
+
+    candidate_t rows[HIGHEST_POP_NUMBER][SIMILAR_K];
+    neighbor_t row[SIMILAR_ROW];
+    uint64_t num_neighbors = 0;
+
+    // Element 0 doesn't exist, so its row stays empty.
+    memset(row, 0, sizeof(row));
+    fwrite(row, sizeof(neighbor_t), SIMILAR_ROW, fp);
+
+    for (exp_elt_t x = 1; x <= BE.num_elts; x++)
+    {
+        memset(rows, 0, sizeof(rows));
+
+        // x in the x position: y = mx + b.
+        offer_segment(rows, pop, bb, bind_seg, x, true);
+
+        // x in the y position: x = (y - b) / m.
+        offer_segment(rows, pop, bb_ds, bind_seg_ds, x, false);
+
+        num_neighbors += merge_buckets(row, rows);
+
+        if (fwrite(row, sizeof(neighbor_t), SIMILAR_ROW, fp) != SIMILAR_ROW)
+        {
+            syslog(LOG_ERR, "ERROR: cannot write to %s", filename);
+            exit(-1);
+        }
+    }
+    fclose(fp);
+    free(pop);
+
+    const long long finish = current_time_millis();
+    printf("Wrote %" PRIu64 " neighbors for %" PRIu64 " elements to %s.\n", num_neighbors, BE.num_elts, filename);
+    printf("Time to generate similar-items table: %d milliseconds.\n", (int) (finish - start));
+} // end gen_similar_cache()
+
+
+// Load the similar-items table if there is one that matches the loaded valences. Without it, /bmh/similar answers
+// with NO_SIMILAR_TABLE.
+bool similar_load()
+{
+    if (NULL != g_similar)
+    {
+        free(g_similar);
+        g_similar = NULL;
+    }
+
+    char filename[strlen(BE.valence_cache_dir) + strlen(SIMILAR_BIN) + 2];
+    strlcpy(filename, BE.valence_cache_dir, sizeof(filename));
+    strlcat(filename, "/", sizeof(filename));
+    strlcat(filename, SIMILAR_BIN, sizeof(filename));
+
+    FILE *fp = fopen(filename, "r");
+    if (NULL == fp)
+    {
+        syslog(LOG_INFO, "No similar-items table at %s. Run recgen -s to serve /bmh/similar.", filename);
+        return (false);
+    }
+
+    similar_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1
+        || memcmp(header.magic, SIMILAR_MAGIC, sizeof(header.magic)) != 0
+        || header.version != SIMILAR_VERSION
+        || header.k != SIMILAR_K)
+    {
+        syslog(LOG_ERR, "%s isn't a similar-items table this recgen can read. Ignoring it.", filename);
+        fclose(fp);
+        return (false);
+    }
+
+    // A table from older valences would point at the wrong neighbors.
+    if (header.num_elts != BE.num_elts || header.num_valences != g_num_confident_valences)
+    {
+        syslog(LOG_WARNING, "%s was built from different valences. Ignoring it. Run recgen -s again.", filename);
+        fclose(fp);
+        return (false);
+    }
+
+    const size_t num_entries = (size_t) (BE.num_elts + 1) * SIMILAR_ROW;
+    g_similar = malloc(num_entries * sizeof(neighbor_t));
+    if (NULL == g_similar)
+    {
+        syslog(LOG_ERR, "FATAL ERROR: Out of memory when loading the similar-items table.");
+        fclose(fp);
+        return (false);
+    }
+
+    const size_t num_read = fread(g_similar, sizeof(neighbor_t), num_entries, fp);
+    fclose(fp);
+    if (num_read != num_entries)
+    {
+        syslog(LOG_ERR, "%s is short: read %zu of %zu neighbors. Ignoring it.", filename, num_read, num_entries);
+        free(g_similar);
+        g_similar = NULL;
+        return (false);
+    }
+
+    syslog(LOG_INFO, "Successfully loaded up the similar-items table.");
+    return (true);
+} // end similar_load()
+
+
+// Put up to num_recs neighbors of eltid in the target popularity bucket (or more popular) in recs, best first.
+// Returns how many it found, or -1 if there's no table.
+int similar_items(exp_elt_t eltid, popularity_t target_pop, prediction_t recs[], int num_recs)
+{
+    if (NULL == g_similar)
+        return -1;
+
+    const popularity_t *pop = pop_leash();
+
+    // clean up target_pop
+    if (target_pop < LOWEST_POP_NUMBER || target_pop > HIGHEST_POP_NUMBER)
+        target_pop = LOWEST_POP_NUMBER;
+
+    // The table uses the valence cache's element ids, which aren't the catalog's if recgen -r reordered them.
+    const neighbor_t *row = &g_similar[(size_t) elt_internal(eltid) * SIMILAR_ROW];
+    int found = 0;
+    for (int i = 0; i < SIMILAR_ROW && row[i].eltid && found < num_recs; i++)
+    {
+        const exp_elt_t neighbor = elt_external(row[i].eltid);
+        if (pop[neighbor] > target_pop)
+            continue;
+        recs[found].elementid = neighbor;
+        recs[found].rating = (int) bmh_round(row[i].rating / 10.0);
+        recs[found].rating_accum = 0;
+        recs[found].rating_count = 0;
+        found++;
+    }
+    return found;
+} // end similar_items()
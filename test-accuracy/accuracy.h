@@ -44,6 +44,7 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 
 #ifdef USE_PROTOBUF
 #include "../recgen/recgen.pb-c.h"
@@ -111,6 +112,45 @@ typedef struct
     struct sockaddr_in server_addr;
 } http_client;
 
+// Benchmark mode. Each connection is a thread that issues requests over a fresh socket. In closed-loop mode a thread
+// sends its next request as soon as the last one returns. In open-loop mode requests are scheduled at a fixed rate and
+// latency is measured from the scheduled time, so a slow server can't hide its queueing delay by slowing us down.
+#define BENCH_DEFAULT_CONNECTIONS 4
+#define BENCH_MAX_CONNECTIONS 256
+#define BENCH_DEFAULT_SECONDS 10
+#define BENCH_MIX_RECS 70            // default percentage of /recs calls
+#define BENCH_MIX_EVENT 10           // default percentage of /event calls
+#define BENCH_MIX_SINGLEREC 20       // default percentage of /internal-singlerec calls
+#define BENCH_MAX_RATINGS_SENT 200   // same cap on ratings per /recs call as the accuracy test
+
+// Latency histogram in the style of HdrHistogram: values below BENCH_HIST_SUB are exact, above that each power of 2
+// is split into BENCH_HIST_SUB / 2 buckets, so any recorded value is within 1/128 (under 1%) of the truth.
+#define BENCH_HIST_SUB_BITS 8
+#define BENCH_HIST_SUB (1u << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_MAX_BITS 40       // about 12 days in micros
+#define BENCH_HIST_BUCKETS ((BENCH_HIST_MAX_BITS - BENCH_HIST_SUB_BITS + 2) * (BENCH_HIST_SUB / 2))
+
+typedef struct
+{
+    uint64_t counts[BENCH_HIST_BUCKETS];
+    uint64_t total;     // number of recorded values
+    uint64_t sum;       // sum of recorded values, for the mean
+    uint64_t max;       // largest recorded value
+} bench_hist_t;
+
+typedef struct
+{
+    int connections;               // concurrent connections (threads)
+    int seconds;                   // how long to run
+    double qps;                    // target requests per second across all connections, 0 means closed loop
+    int mix[3];                    // percentage of requests for each scenario, indexed by SCENARIO_*
+    int protocol;                  // PROTOCOL_JSON or PROTOCOL_PROTOBUF
+    protocol_interface *proto;     // how to serialize requests
+    int ratings_scale;             // scale of ratings we send
+    const elt_rating_t *big_rat;   // the valgen-outputted user ratings, grouped by person, still in 32-bucket scale
+    const uint64_t *big_rat_index; // person p is [index[p], index[p + 1])
+} bench_config_t;
+
 //
 // Prototypes of things used outside the function's own source file
 //
@@ -121,8 +161,13 @@ extern void TestAccuracy(void);
 
 extern unsigned int random_uint(unsigned int);
 
+// in bench.c
+extern void Benchmark(const bench_config_t *);
+
 // in helpers.c
 extern unsigned long contact_bemorehuman_server(int, int, const char *, size_t, char **);
+extern int open_bemorehuman_connection(void);
+extern unsigned long exchange_with_bemorehuman_server(int, int, int, const char *, size_t, char **);
 extern void cleanup_http_client(void);
 
 // globals
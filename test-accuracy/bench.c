@@ -0,0 +1,398 @@
+// SPDX-FileCopyrightText: 2022 Brian Calhoun <brian@bemorehuman.org>
+//
+// SPDX-License-Identifier: MIT
+//
+// MIT License
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy of
+// this software and associated documentation files (the "Software"), to deal in
+// the Software without restriction, including without limitation the rights to
+// use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+// of the Software, and to permit persons to whom the Software is furnished to do
+// so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+// FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+// COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+// IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+// CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+//
+// This file is part of bemorehuman. See https://bemorehuman.org
+// This is test-accuracy's load generator. See Benchmark() below.
+
+#include "accuracy.h"
+
+static const char *scenario_names[] = { "/recs", "/event", "/internal-singlerec" };
+
+typedef struct
+{
+    int id;                   // which connection are we?
+    const bench_config_t *cfg;
+    uint64_t rng;             // per-thread random state so threads don't fight over a shared generator
+    long long start;          // when the run started (micros)
+    long long stop;           // when the run should stop (micros)
+    bench_hist_t *hist;       // one latency histogram per scenario
+    uint64_t errors[3];       // failed requests per scenario
+} bench_thread_t;
+
+static uint32_t *g_people = NULL;   // people with at least one rating
+static size_t g_num_people = 0;
+
+
+// Monotonic clock in micros so wall clock adjustments don't show up as latency.
+static long long mono_micros(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+} // end mono_micros()
+
+
+// splitmix64, plenty random for picking requests
+static uint64_t bench_rand(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+} // end bench_rand()
+
+
+//
+// Histogram helpers
+//
+
+static uint32_t hist_index(uint64_t value)
+{
+    if (value < BENCH_HIST_SUB)
+        return (uint32_t) value;
+
+    if (value >= (1ULL << BENCH_HIST_MAX_BITS))
+        value = (1ULL << BENCH_HIST_MAX_BITS) - 1;
+
+    const uint32_t msb = 63 - (uint32_t) __builtin_clzll(value);
+    const uint32_t e = msb - BENCH_HIST_SUB_BITS + 1;
+    return e * (BENCH_HIST_SUB / 2) + (uint32_t) (value >> e);
+} // end hist_index()
+
+
+// The largest value that lands in bucket idx.
+static uint64_t hist_value(uint32_t idx)
+{
+    if (idx < BENCH_HIST_SUB)
+        return idx;
+
+    const uint32_t e = idx / (BENCH_HIST_SUB / 2) - 1;
+    const uint64_t sub = idx - e * (BENCH_HIST_SUB / 2);
+    return ((sub + 1) << e) - 1;
+} // end hist_value()
+
+
+static void hist_record(bench_hist_t *h, uint64_t value)
+{
+    h->counts[hist_index(value)]++;
+    h->total++;
+    h->sum += value;
+    if (value > h->max)
+        h->max = value;
+} // end hist_record()
+
+
+static void hist_merge(bench_hist_t *to, const bench_hist_t *from)
+{
+    for (uint32_t i = 0; i < BENCH_HIST_BUCKETS; i++)
+        to->counts[i] += from->counts[i];
+    to->total += from->total;
+    to->sum += from->sum;
+    if (from->max > to->max)
+        to->max = from->max;
+} // end hist_merge()
+
+
+// Value at the given percentile (0-100).
+static uint64_t hist_percentile(const bench_hist_t *h, double percentile)
+{
+    if (0 == h->total)
+        return 0;
+
+    uint64_t wanted = (uint64_t) ceil((percentile / 100.0) * (double) h->total);
+    if (wanted < 1)
+        wanted = 1;
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < BENCH_HIST_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= wanted)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+} // end hist_percentile()
+
+
+static void hist_print(const char *name, const bench_hist_t *h, uint64_t errors, double elapsed_secs)
+{
+    printf("%-20s %10" PRIu64 " %8" PRIu64 " %10.1f %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9.0f\n",
+           name, h->total, errors, (double) h->total / elapsed_secs,
+           hist_percentile(h, 50.0), hist_percentile(h, 99.0), hist_percentile(h, 99.9), h->max,
+           h->total ? (double) h->sum / (double) h->total : 0.0);
+} // end hist_print()
+
+
+//
+// Requests
+//
+
+// Ratings in the bin file are always 32-based so convert to the scale we're testing with.
+static int32_t natural_rating(const bench_config_t *cfg, uint8_t rating)
+{
+    if (32 == cfg->ratings_scale)
+        return rating;
+
+    int32_t r = (int32_t) bmh_round((double) rating * (double) cfg->ratings_scale / 32.0);
+    return r < 1 ? 1 : r;
+} // end natural_rating()
+
+
+// Build, send and time one request. Returns true if the server answered.
+static bool bench_request(bench_thread_t *t, int scenario)
+{
+    const bench_config_t *cfg = t->cfg;
+    const uint32_t personid = g_people[bench_rand(&t->rng) % g_num_people];
+    const uint64_t first = cfg->big_rat_index[personid];
+    const uint64_t numrows = cfg->big_rat_index[personid + 1] - first;
+
+    char *body = NULL, *raw_response = NULL;
+    size_t body_length = 0;
+    recs_request_t rr;
+    rating_item_t *ri = NULL;
+    rating_item_t one_ri;
+    event_t er;
+
+    rr.personid = personid;
+    rr.popularity = HIGHEST_POP_NUMBER;
+    rr.num_ratings = 0;
+    rr.ratings_list = NULL;
+
+    switch (scenario)
+    {
+        case SCENARIO_RECS:
+        {
+            const uint64_t num_to_send = numrows < BENCH_MAX_RATINGS_SENT ? numrows : BENCH_MAX_RATINGS_SENT;
+            ri = malloc(num_to_send * sizeof(rating_item_t));
+            if (NULL == ri)
+            {
+                printf("FATAL ERROR: Out of memory when building a recs request.\n");
+                exit(-1);
+            }
+            for (uint64_t i = 0; i < num_to_send; i++)
+            {
+                ri[i].elementid = cfg->big_rat[first + i].elementid;
+                ri[i].rating = natural_rating(cfg, cfg->big_rat[first + i].rating);
+            }
+            rr.ratings_list = ri;
+            rr.num_ratings = (int) num_to_send;
+            cfg->proto->serialize(SCENARIO_RECS, &rr, &body, &body_length);
+            break;
+        }
+        case SCENARIO_EVENT:
+            er.personid = personid;
+            er.eltid = (uint32_t) (bench_rand(&t->rng) % BE.num_elts) + 1;
+            cfg->proto->serialize(SCENARIO_EVENT, &er, &body, &body_length);
+            break;
+        case SCENARIO_SINGLEREC:
+            one_ri.elementid = cfg->big_rat[first + bench_rand(&t->rng) % numrows].elementid;
+            one_ri.rating = 0;
+            rr.ratings_list = &one_ri;
+            rr.num_ratings = 1;
+            cfg->proto->serialize(SCENARIO_SINGLEREC, &rr, &body, &body_length);
+            break;
+        default:
+            return false;
+    }
+
+    bool ok = false;
+    const int sock = open_bemorehuman_connection();
+    if (sock >= 0)
+    {
+        const unsigned long len = exchange_with_bemorehuman_server(sock, cfg->protocol, scenario, body, body_length,
+                                                                   &raw_response);
+        close(sock);
+
+        // A request counts as done when the server answered with a body. We don't parse it, that's client time.
+        ok = (len != 0 && len != (unsigned long) -1);
+        if (len != (unsigned long) -1)
+            free(raw_response);
+    }
+
+    free(body);
+    free(ri);
+    return ok;
+} // end bench_request()
+
+
+static int pick_scenario(bench_thread_t *t)
+{
+    const int roll = (int) (bench_rand(&t->rng) % 100);
+
+    if (roll < t->cfg->mix[SCENARIO_RECS])
+        return SCENARIO_RECS;
+    if (roll < t->cfg->mix[SCENARIO_RECS] + t->cfg->mix[SCENARIO_EVENT])
+        return SCENARIO_EVENT;
+    return SCENARIO_SINGLEREC;
+} // end pick_scenario()
+
+
+static void *bench_worker(void *arg)
+{
+    bench_thread_t *t = (bench_thread_t *) arg;
+    const bench_config_t *cfg = t->cfg;
+
+    // In open-loop mode each connection gets an equal share of the rate, offset so they don't all fire together.
+    const double interval = cfg->qps > 0 ? (1000000.0 * cfg->connections) / cfg->qps : 0.0;
+    double scheduled = (double) t->start + interval * t->id / cfg->connections;
+
+    while (1)
+    {
+        long long begin = mono_micros();
+
+        if (interval > 0)
+        {
+            if ((long long) scheduled >= t->stop)
+                break;
+
+            // Wait for our turn. If we're behind we go right away and the lateness counts against the latency.
+            if ((long long) scheduled > begin)
+            {
+                const long long wait = (long long) scheduled - begin;
+                struct timespec ts = { wait / 1000000, (wait % 1000000) * 1000 };
+                nanosleep(&ts, NULL);
+            }
+            begin = (long long) scheduled;
+            scheduled += interval;
+        }
+        else if (begin >= t->stop)
+            break;
+
+        const int scenario = pick_scenario(t);
+        const bool ok = bench_request(t, scenario);
+        const long long finish = mono_micros();
+
+        if (ok)
+            hist_record(&t->hist[scenario], (uint64_t) (finish - begin));
+        else
+            t->errors[scenario]++;
+    }
+
+    return NULL;
+} // end bench_worker()
+
+
+// Hammer the server with a mix of /recs, /event and /internal-singlerec calls and report latency percentiles & QPS.
+void Benchmark(const bench_config_t *cfg)
+{
+    size_t i;
+
+    // Only people with ratings make sensible requests.
+    g_people = malloc((BE.num_people + 1) * sizeof(uint32_t));
+    if (NULL == g_people)
+    {
+        printf("FATAL ERROR: Out of memory when creating the benchmark people list.\n");
+        exit(-1);
+    }
+    for (i = 1; i <= BE.num_people; i++)
+        if (cfg->big_rat_index[i + 1] > cfg->big_rat_index[i])
+            g_people[g_num_people++] = (uint32_t) i;
+
+    if (0 == g_num_people || 0 == BE.num_elts)
+    {
+        printf("ERROR: no ratings to build benchmark requests from. Exiting.\n");
+        exit(-1);
+    }
+
+    if (cfg->qps > 0)
+        printf("*** Open-loop benchmark: %d connections, %.1f requests/sec target, %d seconds ***\n",
+               cfg->connections, cfg->qps, cfg->seconds);
+    else
+        printf("*** Closed-loop benchmark: %d connections, %d seconds ***\n", cfg->connections, cfg->seconds);
+    printf("*** Mix: %d%% /recs, %d%% /event, %d%% /internal-singlerec ***\n",
+           cfg->mix[SCENARIO_RECS], cfg->mix[SCENARIO_EVENT], cfg->mix[SCENARIO_SINGLEREC]);
+    if (cfg->mix[SCENARIO_EVENT] > 0)
+        printf("*** NOTE: /event calls send random events to the server. ***\n");
+
+    bench_thread_t threads[cfg->connections];
+    pthread_t tids[cfg->connections];
+    uint64_t seed = (uint64_t) current_time_micros();
+
+    const long long start = mono_micros();
+    for (int c = 0; c < cfg->connections; c++)
+    {
+        threads[c].id = c;
+        threads[c].cfg = cfg;
+        threads[c].rng = seed + (uint64_t) c * 0x632be59bd9b4e019ULL;
+        threads[c].start = start;
+        threads[c].stop = start + (long long) cfg->seconds * 1000000;
+        threads[c].hist = calloc(3, sizeof(bench_hist_t));
+        memset(threads[c].errors, 0, sizeof(threads[c].errors));
+        if (NULL == threads[c].hist)
+        {
+            printf("FATAL ERROR: Out of memory when creating benchmark histograms.\n");
+            exit(-1);
+        }
+        if (pthread_create(&tids[c], NULL, bench_worker, &threads[c]) != 0)
+        {
+            printf("FATAL ERROR: Can't create benchmark thread %d.\n", c);
+            exit(-1);
+        }
+    }
+
+    for (int c = 0; c < cfg->connections; c++)
+        pthread_join(tids[c], NULL);
+    const double elapsed_secs = (double) (mono_micros() - start) / 1000000.0;
+
+    // Merge the per-thread histograms.
+    bench_hist_t *merged = calloc(4, sizeof(bench_hist_t)); // one per scenario plus the total
+    uint64_t errors[4] = { 0, 0, 0, 0 };
+    if (NULL == merged)
+    {
+        printf("FATAL ERROR: Out of memory when merging benchmark histograms.\n");
+        exit(-1);
+    }
+    for (int c = 0; c < cfg->connections; c++)
+    {
+        for (int s = 0; s < 3; s++)
+        {
+            hist_merge(&merged[s], &threads[c].hist[s]);
+            hist_merge(&merged[3], &threads[c].hist[s]);
+            errors[s] += threads[c].errors[s];
+            errors[3] += threads[c].errors[s];
+        }
+        free(threads[c].hist);
+    }
+
+    printf("\nLatencies are in micros%s.\n", cfg->qps > 0 ? ", measured from each request's scheduled start" : "");
+    printf("%-20s %10s %8s %10s %9s %9s %9s %9s %9s\n",
+           "endpoint", "requests", "errors", "qps", "p50", "p99", "p999", "max", "mean");
+    for (int s = 0; s < 3; s++)
+        if (merged[s].total > 0 || errors[s] > 0)
+            hist_print(scenario_names[s], &merged[s], errors[s], elapsed_secs);
+    hist_print("all", &merged[3], errors[3], elapsed_secs);
+
+    printf("\nAchieved %.1f requests/sec over %.2f seconds", (double) merged[3].total / elapsed_secs, elapsed_secs);
+    if (cfg->qps > 0)
+        printf(" (target %.1f)", cfg->qps);
+    printf(".\n");
+
+    free(merged);
+    free(g_people);
+    g_people = NULL;
+    g_num_people = 0;
+} // end Benchmark()
+
+
+// end bench.c
@@ -124,31 +124,70 @@ int extract_content_length(const char *response)
 } // end extract_content_length()
 
 
-// This routine calls the bemorehuman server and returns the response.
-//
-// inputs: int protocol, int scenario, const char *req_body, const size_t req_body_len
-// outputs: char **raw_response;
-// return: unsigned long number of bytes read in response
-unsigned long contact_bemorehuman_server(int protocol, int scenario, const char *req_body,
-                                         const size_t req_body_len, char **raw_response)
+// Work out which server we're testing against.
+static void bemorehuman_server_location(char server_loc[32], int *port)
 {
-    int port;
-
     // default is dev
-    char server_loc[32] = DEV_SERVER;
-    port = DEV_SERVER_PORT;
+    strcpy(server_loc, DEV_SERVER);
+    *port = DEV_SERVER_PORT;
 
     // 3 options for server machine: localhost, stage, prod
     if (TEST_LOC_STAGE == g_server_location)
     {
         strcpy(server_loc, STAGE_SERVER);
-        port = STAGE_SERVER_PORT;
+        *port = STAGE_SERVER_PORT;
     }
     if (TEST_LOC_PROD == g_server_location)
     {
         strcpy(server_loc, PROD_SERVER);
-        port = PROD_SERVER_PORT;
+        *port = PROD_SERVER_PORT;
     }
+} // end bemorehuman_server_location()
+
+
+// This routine opens a fresh connection to the bemorehuman server. Unlike contact_bemorehuman_server() it doesn't
+// touch the shared client, so any number of threads can use it at once.
+//
+// return: connected socket, or -1 if we couldn't connect
+int open_bemorehuman_connection(void)
+{
+    char server_loc[32];
+    int port;
+    struct sockaddr_in server_addr;
+
+    bemorehuman_server_location(server_loc, &port);
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_loc, &server_addr.sin_addr) <= 0)
+        return -1;
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+
+    if (connect(sock, (struct sockaddr *) &server_addr, sizeof(server_addr)) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    return sock;
+} // end open_bemorehuman_connection()
+
+
+// This routine sends one request over a connected socket and reads the response.
+//
+// inputs: int sock, int protocol, int scenario, const char *req_body, const size_t req_body_len
+// outputs: char **raw_response;
+// return: unsigned long number of bytes read in response
+unsigned long exchange_with_bemorehuman_server(int sock, int protocol, int scenario, const char *req_body,
+                                               const size_t req_body_len, char **raw_response)
+{
+    char server_loc[32];
+    int port;
+
+    bemorehuman_server_location(server_loc, &port);
 
     if (NULL == req_body)
     {
@@ -175,21 +214,6 @@ unsigned long contact_bemorehuman_server(int protocol, int scenario, const char
             break;
     }
 
-    // Initialize http client if we haven't yet
-    if (!client_initialized) setup_http_client(server_loc, port);
-    if (client == NULL)
-    {
-        syslog(LOG_CRIT, "http client is null. Exiting.");
-        exit(1);
-    }
-
-    // Connect to server
-    if (connect(client->socket, (struct sockaddr *) &client->server_addr, sizeof(client->server_addr)) < 0)
-    {
-        perror("Connection Failed");
-        return -1;
-    }
-
     // Prepare HTTP POST request with specific path
     char request[MAX_BUFFER_SIZE];
     snprintf(request, sizeof(request),
@@ -201,7 +225,7 @@ unsigned long contact_bemorehuman_server(int protocol, int scenario, const char
              "%s", path, server_loc, protocol_string, req_body_len, req_body);
 
     // Send HTTP request
-    send(client->socket, request, strlen(request), 0);
+    send(sock, request, strlen(request), 0);
     // printf("HTTP request sent:\n%s\n", request);
 
     // Receive server response
@@ -211,7 +235,7 @@ unsigned long contact_bemorehuman_server(int protocol, int scenario, const char
     char *header_end = NULL;
 
     // Read response
-    while ((bytes_read = read(client->socket, buffer + total_bytes_read, sizeof(buffer) - total_bytes_read - 1)) > 0)
+    while ((bytes_read = read(sock, buffer + total_bytes_read, sizeof(buffer) - total_bytes_read - 1)) > 0)
     {
         total_bytes_read += bytes_read;
         buffer[total_bytes_read] = '\0';
@@ -260,7 +284,7 @@ unsigned long contact_bemorehuman_server(int protocol, int scenario, const char
 
     while (body_bytes_read < content_length_response)
     {
-        bytes_read = read(client->socket, response_body + body_bytes_read, content_length_response - body_bytes_read);
+        bytes_read = read(sock, response_body + body_bytes_read, content_length_response - body_bytes_read);
         if (bytes_read <= 0) break;
         body_bytes_read += bytes_read;
     }
@@ -271,6 +295,41 @@ unsigned long contact_bemorehuman_server(int protocol, int scenario, const char
 
     *raw_response = response_body;
 
+    return (body_bytes_read);
+} // end exchange_with_bemorehuman_server()
+
+
+// This routine calls the bemorehuman server and returns the response.
+//
+// inputs: int protocol, int scenario, const char *req_body, const size_t req_body_len
+// outputs: char **raw_response;
+// return: unsigned long number of bytes read in response
+unsigned long contact_bemorehuman_server(int protocol, int scenario, const char *req_body,
+                                         const size_t req_body_len, char **raw_response)
+{
+    char server_loc[32];
+    int port;
+
+    bemorehuman_server_location(server_loc, &port);
+
+    // Initialize http client if we haven't yet
+    if (!client_initialized) setup_http_client(server_loc, port);
+    if (client == NULL)
+    {
+        syslog(LOG_CRIT, "http client is null. Exiting.");
+        exit(1);
+    }
+
+    // Connect to server
+    if (connect(client->socket, (struct sockaddr *) &client->server_addr, sizeof(client->server_addr)) < 0)
+    {
+        perror("Connection Failed");
+        return -1;
+    }
+
+    unsigned long len = exchange_with_bemorehuman_server(client->socket, protocol, scenario, req_body, req_body_len,
+                                                         raw_response);
+
     // Close the connection (important for keeping the server happy).
     close(client->socket);
 
@@ -278,7 +337,7 @@ unsigned long contact_bemorehuman_server(int protocol, int scenario, const char
     client->socket = socket(AF_INET, SOCK_STREAM, 0);
 
     //cleanup
-    return (body_bytes_read);
+    return len;
 } // end contact_bemorehuman_server()
 
 
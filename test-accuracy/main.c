@@ -27,11 +27,15 @@
 
 int g_server_location = TEST_LOC_DEV;
 static int g_ratings_scale = 5;
-static rating_t *g_big_rat = NULL; // this is the valgen-outputted user ratings
-static uint32_t *g_big_rat_index = NULL; // this is a person index into g_big_rat
+static elt_rating_t *g_big_rat = NULL; // this is the valgen-outputted user ratings, grouped by person
+static uint64_t *g_big_rat_index = NULL; // this is a person index into g_big_rat: person p is [index[p], index[p + 1])
 static bool g_group_test = false;
 static size_t g_num_testing_people = 0;
 static bool g_test_event_call = false;
+static bool g_benchmark = false;
+static bench_config_t g_bench = { BENCH_DEFAULT_CONNECTIONS, BENCH_DEFAULT_SECONDS, 0.0,
+                                  { BENCH_MIX_RECS, BENCH_MIX_EVENT, BENCH_MIX_SINGLEREC },
+                                  PROTOCOL_JSON, NULL, 5, NULL, NULL };
 
 //
 //
@@ -444,6 +448,60 @@ static int needle_compare(const void *a, const void *b)
 
 
 
+// Load the big_rat and its person index that valgen wrote. Ratings stay in the 32-bucket scale.
+static void load_big_rat(void)
+{
+    // Create the big_rat.
+    g_big_rat = (elt_rating_t *) calloc(BE.num_ratings, sizeof(elt_rating_t));
+
+    if (g_big_rat == 0)
+    {
+        printf("FATAL ERROR: Out of memory when creating g_big_rat.\n");
+        exit(-1);
+    }
+    // Create the big_rat_index. +2 b/c ids start at 1 and the last person needs an end.
+    g_big_rat_index = (uint64_t *) calloc(BE.num_people + 2, sizeof(uint64_t));
+    if (g_big_rat_index == 0)
+    {
+        printf("FATAL ERROR: Out of memory when creating g_big_rat_index.\n");
+        exit(-1);
+    }
+
+    // Begin fread-ing the 2 memory structures.
+
+    // Read the big_rat
+    char file_to_open[strlen(BE.working_dir) + strlen(RATINGS_BR_INDEX) + 2];
+
+    strlcpy(file_to_open, BE.working_dir, sizeof(file_to_open));
+    strlcat(file_to_open, "/", sizeof(file_to_open));
+    strlcat(file_to_open, RATINGS_BR, sizeof(file_to_open));
+    FILE *rat_out = fopen(file_to_open, "r");
+    size_t num_ratings_read, num_indices_read;
+    assert(NULL != rat_out);
+
+    num_ratings_read = fread(g_big_rat, sizeof(elt_rating_t), BE.num_ratings, rat_out);
+    printf("Number of ratings read from bin file: %lu and we expected %" PRIu64 " to be read.\n",
+           num_ratings_read, BE.num_ratings);
+    fclose(rat_out);
+    assert(num_ratings_read == BE.num_ratings);
+    // end loading big_rat
+
+    // Read the big_rat_index
+    strlcpy(file_to_open, BE.working_dir, sizeof(file_to_open));
+    strlcat(file_to_open, "/", sizeof(file_to_open));
+    strlcat(file_to_open, RATINGS_BR_INDEX, sizeof(file_to_open));
+    rat_out = fopen(file_to_open, "r");
+    assert(NULL != rat_out);
+
+    num_indices_read = fread(g_big_rat_index, sizeof(uint64_t), BE.num_people + 2, rat_out);
+    printf("Number of index locations read from bin file: %lu and we expected %" PRIu64 " to be read.\n",
+           num_indices_read, BE.num_people + 2);
+    fclose(rat_out);
+    assert(num_indices_read == BE.num_people + 2);
+    // end loading big_rat_index
+} // end load_big_rat()
+
+
 // Test bemorehuman
 void TestAccuracy(void)
 {
@@ -481,41 +539,10 @@ void TestAccuracy(void)
     unsigned int random;
     double random_avg = 0.0;
     // Begin loading ratings.
-    // Create the big_rat.
-    g_big_rat = (rating_t *) calloc(BE.num_ratings, sizeof(rating_t));
-
-    if (g_big_rat == 0)
-    {
-        printf("FATAL ERROR: Out of memory when creating g_big_rat.\n");
-        exit(-1);
-    }
-    // Create the big_rat_index
-    g_big_rat_index = (uint32_t *) calloc(BE.num_people + 1, sizeof(uint32_t));
-    if (g_big_rat_index == 0)
-    {
-        printf("FATAL ERROR: Out of memory when creating g_big_rat_index.\n");
-        exit(-1);
-    }
-
-    // Begin fread-ing the 2 memory structures.
+    load_big_rat();
 
-    // Read the big_rat
     char file_to_open[strlen(BE.working_dir) + strlen(RATINGS_BR_INDEX) + 2];
 
-    strlcpy(file_to_open, BE.working_dir, sizeof(file_to_open));
-    strlcat(file_to_open, "/", sizeof(file_to_open));
-    strlcat(file_to_open, RATINGS_BR, sizeof(file_to_open));
-    FILE *rat_out = fopen(file_to_open, "r");
-    size_t num_ratings_read, num_indices_read;
-    assert(NULL != rat_out);
-
-    num_ratings_read = fread(g_big_rat, sizeof(rating_t), BE.num_ratings, rat_out);
-    printf("Number of ratings read from bin file: %lu and we expected %" PRIu64 " to be read.\n",
-           num_ratings_read, BE.num_ratings);
-    fclose(rat_out);
-    assert(num_ratings_read == BE.num_ratings);
-    // end loading big_rat
-
     double floaty = 32.0 / (double) g_ratings_scale;
     int num1 = 0, num2 = 0, num3 = 0, num4 = 0, num5 = 0, num6 = 0, num7 = 0,
             num8 = 0, num9 = 0, num10 = 0;
@@ -562,7 +589,7 @@ void TestAccuracy(void)
             // Write content to the temporary file
             // Make sure to use fwrite and not fprintff with %s
             char buf[64];
-            sprintf(buf, "%d\t%d\t%d\n", g_big_rat[i].userid, g_big_rat[i].elementid, g_big_rat[i].rating);
+            sprintf(buf, "%d\t%d\n", g_big_rat[i].elementid, g_big_rat[i].rating);
             size_t len = strlen(buf);
             fwrite(buf, len, 1, file);
             */
@@ -574,20 +601,6 @@ void TestAccuracy(void)
         */
     } // end if we're not in 32-scale
 
-    // Read the big_rat_index
-    strlcpy(file_to_open, BE.working_dir, sizeof(file_to_open));
-    strlcat(file_to_open, "/", sizeof(file_to_open));
-    strlcat(file_to_open, RATINGS_BR_INDEX, sizeof(file_to_open));
-    rat_out = fopen(file_to_open, "r");
-    assert(NULL != rat_out);
-
-    num_indices_read = fread(g_big_rat_index, sizeof(uint32_t), BE.num_people + 1, rat_out);
-    printf("Number of index locations read from bin file: %lu and we expected %" PRIu64 " to be read.\n",
-           num_indices_read, BE.num_people + 1);
-    fclose(rat_out);
-    assert(num_indices_read == BE.num_people + 1);
-    // end loading big_rat_index
-
     // begin loading of elements.out which is file of the form: elementid,elementname  (on each line)
 
     // plan is to malloc the size of the band name when filling array
@@ -667,10 +680,7 @@ void TestAccuracy(void)
                floor(100 * (double) userCounter / (double) g_num_testing_people));
 
         num_held_back = 0;
-        numrows = 0;
-        for (i = 0; i < num_ratings_read; i++)
-            if (g_big_rat[i].userid == userid)
-                numrows++;
+        numrows = g_big_rat_index[userid + 1] - g_big_rat_index[userid];
 
         // Begin preparing recs request.
         size_t len;
@@ -997,10 +1007,31 @@ int main(int argc, char **argv)
 #endif
     // Use getopt to help manage the options on the command line.
     int opt;
-    while ((opt = getopt(argc, argv, "egn:pr:s")) != -1)
+    while ((opt = getopt(argc, argv, "bc:d:egm:n:pq:r:s")) != -1)
     {
         switch (opt)
         {
+            case 'b': // for "benchmark"
+                g_benchmark = true;
+                printf("*** Running the load generator instead of the accuracy test ***\n");
+                break;
+            case 'c': // for "connections"
+                if (strtol(optarg, NULL, 10) < 1 || strtol(optarg, NULL, 10) > BENCH_MAX_CONNECTIONS)
+                {
+                    printf("Error: the argument for -c should be > 0 and < %d instead of %s. Exiting. ***\n",
+                           BENCH_MAX_CONNECTIONS + 1, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                g_bench.connections = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'd': // for "duration"
+                if (strtol(optarg, NULL, 10) < 1)
+                {
+                    printf("Error: the argument for -d should be > 0 instead of %s. Exiting. ***\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                g_bench.seconds = (int) strtol(optarg, NULL, 10);
+                break;
             case 'e': // for "testing /event call"
                 g_test_event_call = true;
                 printf("*** Testing the /event call. NOTE: This will send random ratings to the server. ***\n");
@@ -1010,6 +1041,21 @@ int main(int argc, char **argv)
                 printf("*** Testing specific hard-coded group... ***\n");
                 break;
 
+            case 'm': // for "mix"
+            {
+                int recs, event, singlerec;
+                if (sscanf(optarg, "%d,%d,%d", &recs, &event, &singlerec) != 3 || recs < 0 || event < 0
+                    || singlerec < 0 || recs + event + singlerec != 100)
+                {
+                    printf("Error: the argument for -m should be recs,event,singlerec percentages adding up to 100 "
+                           "instead of %s. Exiting. ***\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                g_bench.mix[SCENARIO_RECS] = recs;
+                g_bench.mix[SCENARIO_EVENT] = event;
+                g_bench.mix[SCENARIO_SINGLEREC] = singlerec;
+                break;
+            }
             case 'n': // for "number of users"
                 if (strtol(optarg, NULL, 10) < 1)
                 {
@@ -1023,6 +1069,14 @@ int main(int argc, char **argv)
                 g_server_location = TEST_LOC_PROD;
                 printf("*** Testing against prod... ***\n");
                 break;
+            case 'q': // for "queries per second"
+                if (strtod(optarg, NULL) <= 0)
+                {
+                    printf("Error: the argument for -q should be > 0 instead of %s. Exiting. ***\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                g_bench.qps = strtod(optarg, NULL);
+                break;
             case 'r': // for "rating-buckets"
                 if (strtol(optarg, NULL, 10) < 2 || strtol(optarg, NULL, 10) > 32)
                 {
@@ -1038,14 +1092,30 @@ int main(int argc, char **argv)
                 break;
 
             default:
-                printf("Don't understand. Check args. Need one or more of e, g, j, n, p, r, or s. \n");
-                fprintf(stderr, "Usage: %s [-e | -g | -n num_testing_people | -p | -r ratings_buckets | -s]\n",
-                        argv[0]);
+                printf("Don't understand. Check args. Need one or more of b, c, d, e, g, m, n, p, q, r, or s. \n");
+                fprintf(stderr, "Usage: %s [-e | -g | -n num_testing_people | -p | -r ratings_buckets | -s]\n"
+                        "       %s -b [-c connections] [-d seconds] [-q target_qps] [-m recs,event,singlerec]"
+                        " [-p | -r ratings_buckets | -s]\n",
+                        argv[0], argv[0]);
                 exit(EXIT_FAILURE);
         } // end switch
     } // end while
 
-    TestAccuracy();
+    if (g_benchmark)
+    {
+        load_big_rat();
+
+#ifdef USE_PROTOBUF
+        g_bench.protocol = PROTOCOL_PROTOBUF;
+#endif
+        g_bench.proto = protocol;
+        g_bench.ratings_scale = g_ratings_scale;
+        g_bench.big_rat = g_big_rat;
+        g_bench.big_rat_index = g_big_rat_index;
+        Benchmark(&g_bench);
+    }
+    else
+        TestAccuracy();
 
     exit(EXIT_SUCCESS);
 } // end main ()
@@ -33,20 +33,22 @@
 // Globals
 //
 
-// g_big_rat must store the entire representation of the ratings
+// g_big_rat must store the entire representation of the ratings, but only until the row & column index are built
 static uint64_t g_curr = 0;                    // static counter of ratings added
-static Rating *g_big_rat, *g_big_rat_ds;  // static structure to hold ratings, ds is for different sorting
+static Rating *g_big_rat;                 // static structure to hold ratings in file order while loading
+static elt_rating_t *g_rows;              // ratings by person (compressed sparse row), sorted by eltid within person
+static uint64_t *g_row_index;             // person p's ratings are g_rows[g_row_index[p]..g_row_index[p + 1])
+static user_rating_t *g_cols;             // ratings by element (compressed sparse column), sorted by userid within elt
+static uint64_t *g_col_index;             // element e's ratings are g_cols[g_col_index[e]..g_col_index[e + 1])
 static popularity_t *g_pop;               // static structure to hold popularity structure for each element
 
 //
 // Forward declarations
 //
 void add(Rating);
-int ratingcmp(const void *, const void*);
-int ratingcmpDS(const void*, const void*);
 
 //
-// Create the big chunk of memory. And another one, sorted differently to decrease mem reqs.
+// Create the big chunk of memory to load into. The row & column index are created once we've loaded.
 //
 int big_rat_init(void)
 {
@@ -62,7 +64,6 @@ int big_rat_init(void)
     start = current_time_micros();
 
     g_big_rat = (Rating *) malloc(size);
-    g_big_rat_ds = (Rating *) malloc(size);
     g_pop = (popularity_t *) malloc(sizeof(popularity_t) * (BE.num_elts + 1));  // the + 1 is so we can address this the same way as eltid
 
     // Record the end time.
@@ -70,14 +71,14 @@ int big_rat_init(void)
 
     // Print out the difference
     syslog(LOG_INFO, "Time to allocate: %d microseconds", (int) (finish - start));
-    syslog(LOG_INFO, "Number of bytes allocated for each of the two structures: %lu", size);
+    syslog(LOG_INFO, "Number of bytes allocated for the load structure: %lu", size);
 
-    if (0 == g_big_rat || 0 == g_big_rat_ds || 0 == g_pop)
+    if (0 == g_big_rat || 0 == g_pop)
     {
-        syslog(LOG_ERR, "ERROR: Out of memory when creating g_big_rat or g_big_rat_ds or g_pop.");
+        syslog(LOG_ERR, "ERROR: Out of memory when creating g_big_rat or g_pop.");
         return (1);
     }
-    syslog(LOG_INFO, "Created the g_big_rat and g_big_rat_ds with %lu elements each.", (unsigned long) BE.num_ratings);
+    syslog(LOG_INFO, "Created the g_big_rat with %lu elements.", (unsigned long) BE.num_ratings);
     syslog(LOG_INFO, "Created the g_pop with %lu elements.", (unsigned long) BE.num_elts);
 
     // Init the g_pop by setting the eltid and ensuring rcount is 0.
@@ -92,7 +93,7 @@ int big_rat_init(void)
 
 
 //
-// Put a Rating into the big_rat and big_rat_ds.
+// Put a Rating into the big_rat.
 //
 void add(Rating r)
 {
@@ -105,11 +106,6 @@ void add(Rating r)
     g_big_rat[g_curr].userId = r.userId;
     g_big_rat[g_curr].eltid = r.eltid;
     g_big_rat[g_curr].rating = r.rating;
-        
-    // Set up additonal Ratings structure, to be sorted differently.
-    g_big_rat_ds[g_curr].userId = r.userId;
-    g_big_rat_ds[g_curr].eltid = r.eltid;
-    g_big_rat_ds[g_curr].rating = r.rating;
 
     // Update the g_pop.
     g_pop[r.eltid].rcount += 1;
@@ -122,71 +118,6 @@ void add(Rating r)
 } // end add()
 
 
-//
-// A function to compare any two Ratings for use as a callback function by qsort alternative below.
-// We're sorting by userid, then eltid
-//
-// Returns -1 if the first uid is less than the second || same user but first elt is less than second
-//          0 if the two uids are the same AND element ids are equal
-//          1 if the first uid is greater than the second || same user but first elt is greater than second
-//
-int ratingcmp(const void* p1, const void* p2)
-{
-    Rating x = *(const Rating *) p1, y = *(const Rating *) p2;
-
-    // this test is to see if p1 < p2
-    if ((x.userId < y.userId) || ((x.userId == y.userId) && (x.eltid < y.eltid)))
-    {
-        return (-1);
-    }
-    else
-    {
-        // this test is to see if p1 > p2
-        if ((x.userId > y.userId) || ((x.userId == y.userId) && (x.eltid > y.eltid)))
-        {
-            return (1);
-        }
-        else
-        {
-            // they're the same (x.user = y.user AND x.element = y.element)
-            return (0);
-        }
-    }
-} // end ratingcmp()
-
-
-//
-// A function to compare any two Ratings for use as a callback function by qsort alternative below.
-// We're sorting by eltid, then userid (opposite of how ratingcmp sorts)
-// Returns -1 if the first eltid is less than the second || same elts but first user is less than second
-//          0 if the two eltids are the same AND userids are equal
-//          1 if the first eltid is greater than the second || same elts but first user is greater than second
-//
-int ratingcmpDS(const void* p1, const void* p2)
-{
-    Rating x = *(const Rating *) p1, y = *(const Rating *) p2;
-
-    // this test is to see if p1 < p2
-    if ((x.eltid < y.eltid) || ((x.eltid == y.eltid) && (x.userId < y.userId)))
-    {
-        return (-1);
-    }
-    else
-    {
-        // this test is to see if p1 > p2
-        if ((x.eltid > y.eltid) || ((x.eltid == y.eltid) && (x.userId > y.userId)))
-        {
-            return (1);
-        }
-        else
-        {
-            // they're the same (x.user = y.user AND x.element = y.element)
-            return (0);
-        }
-    }
-} // end ratingcmpDS()
-
-
 //
 // A function to compare any two popularities for use as a callback function by qsort().
 // We're sorting by the popularity's rcount, high to low
@@ -255,74 +186,314 @@ static int pop_elt_cmp(const void* p1, const void* p2)
 } // end pop_elt_cmp()
 
 
-static bool ds = false;
-typedef Rating type;      // array type
-#define MAX 64            // stack size for max 2^(64/2) array elements
+// Begin row & column index implementation.
+//
+// Both indexes are keyed on dense integers (userid is 1..num_people, eltid is 1..num_elts), so rather than sorting
+// Ratings we count them. Each build is a stable counting sort on a single key, spread across the threads: every
+// thread histograms its own contiguous chunk of the input, a prefix sum over (key, thread) gives every thread its own
+// write positions (and gives us the index for free), and then every thread scatters its chunk.
+//
+// 1. rows:    count the loaded ratings by userid and scatter (eltid, rating) into g_rows, in load order
+// 2. columns: walk the rows person by person, count by eltid and scatter (userid, rating) into g_cols. Because people
+//             are visited in order and the scatter is stable, each column comes out sorted by userid.
+// 3. rows:    walk the columns element by element and scatter (eltid, rating) back into g_rows. Each row comes out
+//             sorted by eltid the same way, so nothing is sorted by comparison.
+//
+// Peak memory is the 9-byte load structure plus the 5-byte rows. The load structure is freed before the columns are
+// built, so we finish with 10 bytes per rating instead of the two 12-byte copies we used to keep.
 
-static void quicksort_iterative(type array[], uint64_t len)
+typedef struct
 {
-    uint64_t left = 0, stack[MAX], pos = 0;
-    uint64_t seed = (unsigned) rand(); // NOLINT because we know rand() is pseudorandom and that's ok.
-    for ( ; ; )                                          // outer loop
+    uint64_t lo, hi;     // this thread's chunk: ratings [lo, hi) for the rows, people [lo, hi) for the columns
+    uint64_t *hist;      // this thread's histogram (and then write positions), num_keys long
+    uint64_t num_keys;   // largest key + 1
+} index_part_t;
+
+// Rows: count the loaded ratings by person.
+static void *count_rows(void *args)
+{
+    index_part_t *part = (index_part_t *) args;
+
+    memset(part->hist, 0, part->num_keys * sizeof(uint64_t));
+    for (uint64_t i = part->lo; i < part->hi; i++)
+        part->hist[g_big_rat[i].userId]++;
+
+    return (void *) NULL;
+} // end count_rows()
+
+// Rows: put the loaded ratings in their row.
+static void *scatter_rows(void *args)
+{
+    index_part_t *part = (index_part_t *) args;
+
+    for (uint64_t i = part->lo; i < part->hi; i++)
     {
-        for (; left+1 < len; len++)                      // sort left to len-1
+        elt_rating_t *entry = &g_rows[part->hist[g_big_rat[i].userId]++];
+        entry->elementid = g_big_rat[i].eltid;
+        entry->rating = g_big_rat[i].rating;
+    }
+
+    return (void *) NULL;
+} // end scatter_rows()
+
+// Rows again: count each element's ratings by person.
+static void *count_rows_by_col(void *args)
+{
+    index_part_t *part = (index_part_t *) args;
+
+    memset(part->hist, 0, part->num_keys * sizeof(uint64_t));
+    for (uint64_t i = g_col_index[part->lo]; i < g_col_index[part->hi]; i++)
+        part->hist[g_cols[i].userid]++;
+
+    return (void *) NULL;
+} // end count_rows_by_col()
+
+// Rows again: put each element's ratings back in their person's row. Elements come in order, so each row ends up
+// sorted by eltid.
+static void *scatter_rows_by_col(void *args)
+{
+    index_part_t *part = (index_part_t *) args;
+
+    for (uint64_t e = part->lo; e < part->hi; e++)
+    {
+        for (uint64_t i = g_col_index[e]; i < g_col_index[e + 1]; i++)
         {
-            if (pos == MAX) len = stack[pos = 0];        // stack overflow, reset
-            type pivot = array[left+seed%(len-left)];    // pick random pivot
-            seed = seed*69069+1;                         // next pseudorandom number
-            stack[pos++] = len;                          // sort right part later
-            for (uint64_t right = left-1; ; )            // inner loop: partitioning
-            {
-                if (ds)
-                {
-                    while (ratingcmpDS(&(array[++right]), &pivot) < 0); // look for greater element
-                    while (ratingcmpDS(&pivot, &(array[--len])) < 0);   // look for smaller element
-                }
-                else
-                {
-                    while (ratingcmp(&(array[++right]), &pivot) < 0);   // look for greater element
-                    while (ratingcmp(&pivot, &(array[--len])) < 0);     // look for smaller element
-                }
-                if (right >= len) break;                 // partition point found?
-                type temp = array[right];
-                array[right] = array[len];               // the only swap
-                array[len] = temp;
-            } // end for loop
-        } // end for loop
-        if (pos == 0) break;                             // stack empty?
-        left = len;                                      // left to right is sorted
-        len = stack[--pos];                              // get next range to sort
-    } // end outermost for loop
-} // end quicksort_iterative()
+            elt_rating_t *entry = &g_rows[part->hist[g_cols[i].userid]++];
+            entry->elementid = (uint32_t) e;
+            entry->rating = g_cols[i].rating;
+        }
+    }
+
+    return (void *) NULL;
+} // end scatter_rows_by_col()
+
+// Columns: count each person's ratings by element.
+static void *count_cols(void *args)
+{
+    index_part_t *part = (index_part_t *) args;
+
+    memset(part->hist, 0, part->num_keys * sizeof(uint64_t));
+    for (uint64_t i = g_row_index[part->lo]; i < g_row_index[part->hi]; i++)
+        part->hist[g_rows[i].elementid]++;
+
+    return (void *) NULL;
+} // end count_cols()
+
+// Columns: put each person's ratings in their column.
+static void *scatter_cols(void *args)
+{
+    index_part_t *part = (index_part_t *) args;
+
+    for (uint64_t p = part->lo; p < part->hi; p++)
+    {
+        for (uint64_t i = g_row_index[p]; i < g_row_index[p + 1]; i++)
+        {
+            user_rating_t *entry = &g_cols[part->hist[g_rows[i].elementid]++];
+            entry->userid = (uint32_t) p;
+            entry->rating = g_rows[i].rating;
+        }
+    }
+
+    return (void *) NULL;
+} // end scatter_cols()
+
+//
+// How many threads for a counting pass? Capped so the histograms (one per thread, num_keys each) never need more
+// memory than the ratings themselves. For small catalogs that means NTHREADS; for huge key counts we use fewer.
+//
+static int index_threads(uint64_t num_keys)
+{
+    uint64_t nthreads = BE.num_ratings / num_keys;
+    if (nthreads > NTHREADS) nthreads = NTHREADS;
+    if (nthreads < 1) nthreads = 1;
+    return (int) nthreads;
+} // end index_threads()
 
+static void run_parts(void *(*fn)(void *), index_part_t *parts, int nthreads)
+{
+    pthread_t thread_id[NTHREADS];
+    int t;
+
+    for (t = 0; t < nthreads; t++)
+        pthread_create(&thread_id[t], NULL, fn, &parts[t]);
+    for (t = 0; t < nthreads; t++)
+        pthread_join(thread_id[t], NULL);
+} // end run_parts()
+
+//
+// Turn per-thread counts into per-thread write positions and fill in the index (num_keys + 1 entries).
+// Key-major then thread-minor keeps the scatter stable.
+//
+static void prefix_parts(index_part_t *parts, int nthreads, uint64_t *index)
+{
+    uint64_t running = 0;
+    for (uint64_t k = 0; k < parts[0].num_keys; k++)
+    {
+        index[k] = running;
+        for (int t = 0; t < nthreads; t++)
+        {
+            uint64_t count = parts[t].hist[k];
+            parts[t].hist[k] = running;
+            running += count;
+        }
+    }
+    index[parts[0].num_keys] = running;
+} // end prefix_parts()
+
+static uint64_t *alloc_hist(int nthreads, uint64_t num_keys)
+{
+    uint64_t *hist = malloc((size_t) nthreads * num_keys * sizeof(uint64_t));
+    if (NULL == hist)
+    {
+        syslog(LOG_CRIT, "Out of RAM. Can't allocate histograms for the big_rat index. Exiting.");
+        exit(-1);
+    }
+    return hist;
+} // end alloc_hist()
+
+static void build_rows(void)
+{
+    uint64_t num_keys = BE.num_people + 1;   // +1 b/c ids start at 1
+    int t, nthreads = index_threads(num_keys);
+    index_part_t parts[NTHREADS];
+    uint64_t *hist = alloc_hist(nthreads, num_keys);
+    uint64_t chunk = BE.num_ratings / (uint64_t) nthreads;
+
+    g_rows = (elt_rating_t *) malloc(BE.num_ratings * sizeof(elt_rating_t));
+    g_row_index = (uint64_t *) malloc((num_keys + 1) * sizeof(uint64_t));
+    if (NULL == g_rows || NULL == g_row_index)
+    {
+        syslog(LOG_CRIT, "Out of RAM. Can't allocate the big_rat rows. Exiting.");
+        exit(-1);
+    }
+
+    for (t = 0; t < nthreads; t++)
+    {
+        parts[t].lo = (uint64_t) t * chunk;
+        parts[t].hi = (t == nthreads - 1) ? BE.num_ratings : parts[t].lo + chunk;  // last thread gets the remainder
+        parts[t].hist = &hist[(uint64_t) t * num_keys];
+        parts[t].num_keys = num_keys;
+    }
+    run_parts(count_rows, parts, nthreads);
+    prefix_parts(parts, nthreads, g_row_index);
+    run_parts(scatter_rows, parts, nthreads);
+    free(hist);
+} // end build_rows()
+
+static void build_cols(void)
+{
+    uint64_t num_keys = BE.num_elts + 1;     // +1 b/c ids start at 1
+    uint64_t num_people = BE.num_people + 1;
+    int t, nthreads = index_threads(num_keys);
+    index_part_t parts[NTHREADS];
+    uint64_t *hist = alloc_hist(nthreads, num_keys);
+
+    g_cols = (user_rating_t *) malloc(BE.num_ratings * sizeof(user_rating_t));
+    g_col_index = (uint64_t *) malloc((num_keys + 1) * sizeof(uint64_t));
+    if (NULL == g_cols || NULL == g_col_index)
+    {
+        syslog(LOG_CRIT, "Out of RAM. Can't allocate the big_rat columns. Exiting.");
+        exit(-1);
+    }
+
+    // Split the people so each thread gets about the same number of ratings.
+    uint64_t p = 0;
+    for (t = 0; t < nthreads; t++)
+    {
+        uint64_t target = (BE.num_ratings / (uint64_t) nthreads) * (uint64_t) (t + 1);
+        parts[t].lo = p;
+        if (t == nthreads - 1)
+            p = num_people;
+        else
+            while (p < num_people && g_row_index[p] < target) p++;
+        parts[t].hi = p;
+        parts[t].hist = &hist[(uint64_t) t * num_keys];
+        parts[t].num_keys = num_keys;
+    }
+    run_parts(count_cols, parts, nthreads);
+    prefix_parts(parts, nthreads, g_col_index);
+    run_parts(scatter_cols, parts, nthreads);
+    free(hist);
+} // end build_cols()
+
+// The rows came out in load order, so rebuild them from the columns, element by element. Each row is then sorted by
+// eltid, with one more counting pass instead of sorting each row.
+static void sort_rows(void)
+{
+    uint64_t num_keys = BE.num_people + 1;   // +1 b/c ids start at 1
+    uint64_t num_elts = BE.num_elts + 1;
+    int t, nthreads = index_threads(num_keys);
+    index_part_t parts[NTHREADS];
+    uint64_t *hist = alloc_hist(nthreads, num_keys);
+
+    // Split the elements so each thread gets about the same number of ratings.
+    uint64_t e = 0;
+    for (t = 0; t < nthreads; t++)
+    {
+        uint64_t target = (BE.num_ratings / (uint64_t) nthreads) * (uint64_t) (t + 1);
+        parts[t].lo = e;
+        if (t == nthreads - 1)
+            e = num_elts;
+        else
+            while (e < num_elts && g_col_index[e] < target) e++;
+        parts[t].hi = e;
+        parts[t].hist = &hist[(uint64_t) t * num_keys];
+        parts[t].num_keys = num_keys;
+    }
+    run_parts(count_rows_by_col, parts, nthreads);
+    prefix_parts(parts, nthreads, g_row_index);
+    run_parts(scatter_rows_by_col, parts, nthreads);
+    free(hist);
+} // end sort_rows()
+
+// End row & column index implementation.
 
 // Pull ratings from flat file.
-void big_rat_pull_from_flat_file(void)
+//
+// Check one rating, convert it to 32 buckets and put it in the big_rat.
+//
+static void ingest(Rating r, uint64_t ratings_count)
 {
-    // Plan is:
-    // 1) read the ratings from the flat file
-    // 2) once we have userid, and rating, call add() for each rating
-    // 3) sort the big guy
+    // Convert to 32-buckets if not already there
+    if (g_ratings_scale != 32)
+    {
+        double floaty, floaty2;
+        floaty = 32.0 / (double) g_ratings_scale;
+        floaty2 = (double) r.rating * floaty;
+        r.rating = (uint8_t) bmh_round(floaty2);
+        if (r.rating > 32) r.rating = 32;
+    }
 
-    long long start, finish;
+    // Check to make sure the elements and people ids are normalized.
+    if (r.eltid > BE.num_elts || r.userId > BE.num_people)
+    {
+        syslog(LOG_ERR, "Either eltid %d is more than num_elts %" PRIu64 " or userid %d is more than num_people %" PRIu64 ". Userids and element ids must be in sequence. ratings_count is %" PRIu64 ". Exiting.",
+               r.eltid, BE.num_elts, r.userId, BE.num_people, ratings_count);
+        exit(-1);
+    }
 
-    syslog(LOG_INFO, "Begin timing for loading of big_rat...");
+    add(r);
 
-    // Record the start time:
-    start = current_time_millis();
+    // Spit something out every 1 M to generally track progress.
+    if (0 == (ratings_count % 1000000))
+        printf("ratings_count is: %" PRIu64" \n", ratings_count);
+} // end ingest()
 
+
+//
+// Read the text ratings file, one "personid,eltid,rating" per line.
+//
+// returns the number of ratings read
+//
+static uint64_t read_text_ratings(const char *filename)
+{
     Rating r;
     r.rating = 0;
     r.eltid = 0;
     r.userId = 0;
 
-    // Begin reading from flat file.
-
     FILE *fp;
-    u_int64_t i;
     u_int64_t ratings_count = 0;
-    char filename[strlen(BE.ratings_file) + 1];
-    strlcpy(filename, BE.ratings_file, sizeof(filename));
     fp = fopen(filename, "r");
     if (!fp)
     {
@@ -336,7 +507,6 @@ void big_rat_pull_from_flat_file(void)
 
     // Allow for tab and comma-delimited ratings input file.
     const char delimiter[3] = "\t,";
-    unsigned long people_bound = BE.num_people + 1;
 
     while ((line_length = getline(&line, &line_capacity, fp)) != -1)
     {
@@ -366,16 +536,6 @@ void big_rat_pull_from_flat_file(void)
                     break;
                 case 2:   // rating
                     r.rating = (uint8_t) strtol(token, NULL, 10);
-
-                    // Convert to 32-buckets if not already there
-                    if (g_ratings_scale != 32)
-                    {
-                        double floaty, floaty2;
-                        floaty = 32.0 / (double) g_ratings_scale;
-                        floaty2 = (double) r.rating * floaty;
-                        r.rating = (uint8_t) bmh_round(floaty2);
-                        if (r.rating > 32) r.rating = 32;
-                    }
                     break;
                 default:
                     syslog(LOG_ERR, "ERROR: hit the default case situation when parsing tokens in ratings input file. Why?");
@@ -386,25 +546,130 @@ void big_rat_pull_from_flat_file(void)
             token_number++;
         } // end while() parsing tokens
 
-        // Check to make sure the elements and people ids are normalized.
-        if (r.eltid > BE.num_elts || r.userId > people_bound)
+        ingest(r, ratings_count);
+        ratings_count++;
+    } // end while we still have lines to process in this file
+
+    free(line);
+    fclose(fp);
+
+    return ratings_count;
+} // end read_text_ratings()
+
+
+//
+// Read the binary ratings file. See RATINGS_BIN in bmh-config.h for the format.
+//
+// returns the number of ratings read
+//
+static uint64_t read_binary_ratings(const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        syslog(LOG_CRIT, "Can't open ratings file %s. Exiting.", filename);
+        exit(-11);
+    }
+
+    // The records are small, so the whole file is smaller than the big_rat load buffer. Read it all at once.
+    fseek(fp, 0, SEEK_END);
+    long file_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    uint8_t *data = (uint8_t *) malloc(file_size > 0 ? (size_t) file_size : 1);
+    if (NULL == data || file_size < (long) sizeof(ratings_bin_header_t)
+        || fread(data, (size_t) file_size, 1, fp) != 1)
+    {
+        syslog(LOG_CRIT, "Can't read binary ratings file %s. Exiting.", filename);
+        exit(-11);
+    }
+    fclose(fp);
+
+    ratings_bin_header_t header;
+    memcpy(&header, data, sizeof(header));
+    if (strncmp(header.magic, RATINGS_BIN_MAGIC, sizeof(header.magic)) != 0 || header.version != RATINGS_BIN_VERSION)
+    {
+        syslog(LOG_CRIT, "%s is not a binary ratings file we understand. Exiting.", filename);
+        exit(-11);
+    }
+
+    const uint8_t *p = data + sizeof(header);
+    const uint8_t *end = data + file_size;
+    uint64_t ratings_count = 0;
+    int64_t personid = 0, eltid = 0;
+
+    while (p < end)
+    {
+        uint64_t dperson, delt;
+
+        p = get_varint(p, end, &dperson);
+        if (p)
+            p = get_varint(p, end, &delt);
+        if (NULL == p || p >= end)
         {
-            syslog(LOG_ERR, "Either eltid %d is more than num_elts %" PRIu64 " or userid %d is more than num_people %" PRIu64 ". Userids and element ids must be in sequence. ratings_count is %" PRIu64 ". Exiting.",
-                   r.eltid, BE.num_elts, r.userId, BE.num_people, ratings_count);
+            syslog(LOG_CRIT, "Binary ratings file %s is truncated after %" PRIu64 " ratings. Exiting.", filename,
+                   ratings_count);
             exit(-1);
         }
 
-        add(r);
+        // The eltid delta starts over from 0 with each new person.
+        int64_t dp = zigzag_decode(dperson);
+        if (dp != 0)
+            eltid = 0;
+        personid += dp;
+        eltid += zigzag_decode(delt);
+
+        Rating r;
+        r.userId = (uint32_t) personid;
+        r.eltid = (uint32_t) eltid;
+        r.rating = *p++;
 
-        // Spit something out every 1 M to generally track progress.
-        if (0 == (ratings_count % 1000000))
-            printf("ratings_count is: %" PRIu64" \n", ratings_count);
+        ingest(r, ratings_count);
         ratings_count++;
-    } // end while we still have lines to process in this file
+    }
+
+    free(data);
+
+    if (ratings_count != header.num_ratings)
+        syslog(LOG_ERR, "Binary ratings file %s header says %" PRIu64 " ratings but we read %" PRIu64, filename,
+               header.num_ratings, ratings_count);
+
+    return ratings_count;
+} // end read_binary_ratings()
+
+
+void big_rat_pull_from_flat_file(void)
+{
+    // Plan is:
+    // 1) read the ratings from the flat file (text or binary)
+    // 2) once we have userid, and rating, call add() for each rating
+    // 3) build the row & column index from the big guy
+
+    long long start, finish;
+    u_int64_t i;
+
+    syslog(LOG_INFO, "Begin timing for loading of big_rat...");
+
+    // Record the start time:
+    start = current_time_millis();
+
+    // Begin reading from flat file.
+    char filename[PATH_SIZE + 32];
+    u_int64_t ratings_count;
+    FILE *fp;
+
+    if (BE.binary_ratings)
+    {
+        snprintf(filename, sizeof(filename), "%s/%s", BE.working_dir, RATINGS_BIN);
+        ratings_count = read_binary_ratings(filename);
+    }
+    else
+    {
+        strlcpy(filename, BE.ratings_file, sizeof(filename));
+        ratings_count = read_text_ratings(filename);
+    }
 
     printf("final ratings_count: %" PRIu64 "\n", ratings_count);
-    free(line);
-    fclose(fp);
 
     // end read from flat file
 
@@ -417,64 +682,50 @@ void big_rat_pull_from_flat_file(void)
     // Print the number of big_rat elts.
     syslog(LOG_INFO, "Number of big_rat elements is %" PRIu64, g_curr);
 
-    // 4) sort the big guy
-    // Now sort on uid.
-    syslog(LOG_INFO, "Beginning sort of big_rat and big_rat_ds...");
+    // 4) build the row & column index
+    syslog(LOG_INFO, "Beginning build of big_rat rows & columns...");
 
-    // DO NOT USE QSORT. It's broken for large data sizes that we sometimes use.
+    // DO NOT USE QSORT. It's broken for large data sizes that we sometimes use. The keys are dense ints so count instead.
     start = current_time_millis();
-    quicksort_iterative(g_big_rat, (BE.num_ratings));
-    ds = true;
-    quicksort_iterative(g_big_rat_ds, (BE.num_ratings));
+    build_rows();
+
+    // The rows have everything now so we're done with the load structure.
+    free(g_big_rat);
+    g_big_rat = NULL;
+
+    build_cols();
+    sort_rows();
 
     finish = current_time_millis();
 
     // Print out the difference
-    syslog(LOG_INFO, "Time to sort both the big_rat structures: %d milliseconds", (int) (finish - start));
+    syslog(LOG_INFO, "Time to build the big_rat rows & columns: %d milliseconds", (int) (finish - start));
 
-    // At this point, g_big_rat is sorted by userId then eltid, and is not redundant.
-    // At this point, g_big_rat_ds is sorted by eltid then userId and is not redundant.
-    // The non-redundancy part just so happens to be that way based on data
+    // At this point, the ratings of each person are sorted by eltid and the ratings of each elt are sorted by userid.
 
     // todo: ensure non-redundancy
 
     // sanity check
-    for (i = 0; i < 10; i++)
+    for (i = 0; i < 10 && i < BE.num_ratings; i++)
     {
-        syslog(LOG_INFO, "big_rat [%" PRIu64"].userId: %d, rating: %d, elt: %d", i, g_big_rat[i].userId, g_big_rat[i].rating, g_big_rat[i].eltid);
-        syslog(LOG_INFO, "big_rat_ds [%" PRIu64 "].userId: %d, rating: %d, elt: %d", i, g_big_rat_ds[i].userId, g_big_rat_ds[i].rating, g_big_rat_ds[i].eltid);
+        syslog(LOG_INFO, "big_rat rows [%" PRIu64"] rating: %d, elt: %d", i, g_rows[i].rating, g_rows[i].elementid);
+        syslog(LOG_INFO, "big_rat cols [%" PRIu64 "] userId: %d, rating: %d", i, g_cols[i].userid, g_cols[i].rating);
     }
 
-    br = g_big_rat;
-    brds = g_big_rat_ds;
-
-    // Make an array index of the users with values of BR indexes so we don't have to be so dumb in buildElements()
-
-    // Iterate over BR once to populate the br_index
-    int curr_user = 0;
-    i = 0;
-
-    // Allocate br_index.
-    br_index = malloc((BE.num_people + 1) * sizeof(uint32_t));
-    if (br_index == NULL)
-    {
-        syslog(LOG_CRIT, "Out of RAM. Can't allocate br_index. Exiting.");
-        exit(-1);
-    }
-
-    // Need to speed-optimize the br_index, so make it an array. We just sorted g_big_rat by personid so we can walk it.
-    // It can be an array of uint32_t. The position in the array is the walker_user. Just watch the one-off index.
-    while (i < BE.num_ratings)
-    {
-        uint32_t walker_user;
-        walker_user = g_big_rat[i].userId;
-        if (walker_user != (uint32_t) curr_user)
-        {
-            (br_index)[walker_user] = (uint32_t) i;
-            curr_user = (int) walker_user;
-        }
-        i++;
-    }
+    // Record what we just ingested so the other binaries don't have to rescan the ratings file to learn it.
+    uint64_t num_people = 0, num_elts = 0;
+    for (i = 1; i <= BE.num_people; i++)
+        if (g_row_index[i + 1] > g_row_index[i])
+            num_people++;
+    for (i = 1; i <= BE.num_elts; i++)
+        if (g_col_index[i + 1] > g_col_index[i])
+            num_elts++;
+    write_dataset_manifest(filename, num_people, num_elts, ratings_count);
+
+    br = g_rows;
+    br_index = g_row_index;
+    brds = g_cols;
+    brds_index = g_col_index;
 
     // Now shape up the g_pop.
 
@@ -532,7 +783,7 @@ void big_rat_pull_from_flat_file(void)
 } // end big_rat_pull_from_flat_file()
 
 
-// This dumps the big_rat and br_rat_index (2 structures total) to the filesystem for quick loading later.
+// This dumps the big_rat rows and their index (2 structures total) to the filesystem for quick loading later.
 void export_br(void)
 {
     // Now write the loaded big_rat to a file for quick-fast in a hurry loading later.
@@ -552,7 +803,7 @@ void export_br(void)
 
     assert(NULL != rat_out);
     size_t num_ratings_written;
-    num_ratings_written = fwrite(g_big_rat, sizeof(Rating), BE.num_ratings, rat_out);
+    num_ratings_written = fwrite(g_rows, sizeof(elt_rating_t), BE.num_ratings, rat_out);
     syslog(LOG_INFO, "Number of ratings written to bin file: %lu and we expected %" PRIu64 " to be written.",
            num_ratings_written, BE.num_ratings);
     fclose(rat_out);
@@ -564,9 +815,10 @@ void export_br(void)
     rat_out = fopen(filename,"w");
     assert(NULL != rat_out);
 
-    num_ratings_written = fwrite(br_index, sizeof(uint32_t), BE.num_people + 1, rat_out);
+    // The index has one more entry than there are people (+1 b/c ids start at 1) so the last row has an end.
+    num_ratings_written = fwrite(g_row_index, sizeof(uint64_t), BE.num_people + 2, rat_out);
     syslog(LOG_INFO, "Number of br_index entries written to bin file: %lu and we expected %" PRIu64 " to be written.",
-           num_ratings_written, BE.num_people + 1);
+           num_ratings_written, BE.num_people + 2);
     fclose(rat_out);
 } // end export_br()
 
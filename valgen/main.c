@@ -97,8 +97,10 @@ static void test_spearman(void)
 //
 static uint32_t elts_per_thread;
 
-Rating *br, *brds;       // brds is the Differently Sorted BR
-uint32_t *br_index;      // index into big_rat
+elt_rating_t *br;        // ratings by person, each person's sorted by elt
+user_rating_t *brds;     // brds is the Differently Sorted BR: ratings by elt, each elt's sorted by person
+uint64_t *br_index;      // row index into br
+uint64_t *brds_index;    // column index into brds
 
 
 // Each thread computes a portion of the g_elements and subsequent valences.
@@ -163,7 +165,7 @@ int main(int argc, char **argv)
                 }
                 g_ratings_scale = (uint8_t) atoi(optarg);
                 printf("*** Starting valgen with ratings using a %d-bucket scale ***\n", g_ratings_scale);
-                goto forreal;
+                break;
             default:
                 printf("Don't understand. Check args. \n");
                 fprintf(stderr, "Usage: %s [-r ratingsbuckets]\n", argv[0]);
@@ -171,8 +173,6 @@ int main(int argc, char **argv)
         } // end switch
     } // end while
 
-    forreal:
-
     if (BE.num_elts == 0)
     {
         syslog(LOG_CRIT, "*** Exiting valgen because num_elts is a null pointer or 0.");
@@ -190,10 +190,10 @@ int main(int argc, char **argv)
     // Record the start time.
     start = current_time_millis();
 
-    // This call loads up big_rat and big_rat_ds with ratings.
+    // This call loads up the big_rat rows (br) and columns (brds) with ratings.
     big_rat_pull_from_flat_file();
 
-    // This will dump the big_rat and big_rat_index in binary form for later reading by recgen.
+    // This will dump the big_rat rows and their index in binary form for later reading by recgen.
     export_br();
 
     if (NULL == br || NULL == brds)
@@ -203,11 +203,11 @@ int main(int argc, char **argv)
     }
     // Record the end time.
     finish = current_time_millis();
-    syslog(LOG_INFO, "Time to do big_rat and big_rat_ds load: %d milliseconds", (int) (finish - start));
+    syslog(LOG_INFO, "Time to do big_rat rows & columns load: %d milliseconds", (int) (finish - start));
     // End big_rat stuff: initialise the big_rat.
 
-    // NOTE: The rats in big_rat are sorted by userid then elt which is the required sorting for valgen.
-    // The rats in big_rat_ds are sorted by elt then userid.
+    // NOTE: The rats in br are grouped by userid and sorted by elt within each user, which is what valgen requires.
+    // The rats in brds are grouped by elt and sorted by userid within each elt.
     // Ignore redundant because it won't matter too much.
     // Call buildVals which is entry into valence generation (Assume no intersection bits.)
 
@@ -215,20 +215,11 @@ int main(int argc, char **argv)
     // from: allocate all mem for pairs & vals --> build all pairs --> build all valences --> print out valences
     // to: foreach x (allocate enough mem for (x,y) --> build (x,y) elts --> build (x.y) valences --> print out valences)
 
-    // Allocate g_elements.
-    // The +1 below is so we can address the index by the y value and basically ignore the 0th position.
+    // Allocate g_pairs.
     // NOTE: For multithreading, each thread needs its own g_pairs.
     int i, j;
     for (i = 0; i < NTHREADS; i++)
-    {
-        g_pairs[i] = (pair_t *) calloc((size_t) BE.num_elts + 1, sizeof(pair_t));
-
-        if (g_pairs[i] == 0)
-        {
-            syslog(LOG_ERR, "ERROR: Out of memory when creating g_pairs[%d].", i);
-            exit(1);
-        }
-    } // end for loop across number of threads
+        pairs_alloc((uint32_t) i);
 
     // Check if output dir exists and if it doesn't, create it.
     if (!check_make_dir(BE.working_dir))
@@ -264,7 +255,7 @@ int main(int argc, char **argv)
     for (i = 0; i < NTHREADS; i++)
     {
         // Free the pairs structure we allocated.
-        if (g_pairs[i]) free(g_pairs[i]);
+        pairs_free((uint32_t) i);
 
         // Build the string for the big cat command.
         sprintf(vname, "%s%d ", "valences.out", i);
@@ -26,7 +26,13 @@
 #include "valgen.h"
 
 // Forward declarations
+static void moments(int, const uint8_t *, const uint8_t *, moments_t *);
 static void linefit(uint8_t, const uint8_t *, const uint8_t *, double *, double *, int *);
+static int compare_eltid(const void *, const void *);
+static pair_t *pairs_find(pair_acc_t *, uint32_t);
+static bool elt_can_pair(uint32_t);
+static void rank_buckets(int, const uint8_t *, uint8_t [MAX_BUCKETS + 1]);
+static double spearman_xy(int, const uint8_t *, const uint8_t *);
 
 // BeastConf is a lookup table to determine the 95% confidence of relevance of a particular valence. Values in
 //    the table are gleaned from a 1950's textbook
@@ -42,20 +48,106 @@ static double g_BeastConf[MAX_RATN_FOR_VALGEN + 1] =
                     0.325, 0.321, 0.317, 0.313, 0.309, 0.305, 0.301, 0.298, 0.294, 0.291, 0.288, 0.285};
 
 //
-// Create the big-ass chunk of memory to store valences
+// Each thread accumulates the (x,y) pairs for one x at a time in its own pair_acc_t.
 //
-// The Pairs and Valences structures need to have the same number of nodes so the structures
-// should be treated similarly. Note that there is no Valence structure. We just write them out to file.
+// Only the y-values actually co-rated with x get a pair_t. slot[y] says where y's pair_t lives, and touched lists the
+// y-values in the order we first saw them, so resetting and scanning only visits those y-values instead of all
+// num_elts of them.
 //
 
-pair_t *g_pairs[NTHREADS];
+pair_acc_t g_pairs[NTHREADS];
+
+#define PAIRS_INITIAL_CAPACITY 1024
+
+// Allocate this thread's pair accumulator.
+void pairs_alloc(uint32_t thread)
+{
+    pair_acc_t *acc = &g_pairs[thread];
+
+    // The +1 below is so we can address the slots by the y value and basically ignore the 0th position.
+    acc->slot = (uint32_t *) calloc((size_t) BE.num_elts + 1, sizeof(uint32_t));
+
+    acc->capacity = (BE.num_elts < PAIRS_INITIAL_CAPACITY) ? (uint32_t) BE.num_elts + 1 : PAIRS_INITIAL_CAPACITY;
+    acc->touched = (uint32_t *) malloc(acc->capacity * sizeof(uint32_t));
+    acc->pairs = (pair_t *) malloc(acc->capacity * sizeof(pair_t));
+    acc->num_touched = 0;
+
+    if (NULL == acc->slot || NULL == acc->touched || NULL == acc->pairs)
+    {
+        syslog(LOG_ERR, "ERROR: Out of memory when creating g_pairs[%d].", thread);
+        exit(1);
+    }
+} // end pairs_alloc()
+
+
+// Free this thread's pair accumulator.
+void pairs_free(uint32_t thread)
+{
+    free(g_pairs[thread].slot);
+    free(g_pairs[thread].touched);
+    free(g_pairs[thread].pairs);
+    memset(&g_pairs[thread], 0, sizeof(pair_acc_t));
+} // end pairs_free()
+
+
+// Find y's pair_t in this accumulator, making a fresh one if this is the first time we've seen y for this x.
+static pair_t *pairs_find(pair_acc_t *acc, uint32_t y)
+{
+    uint32_t slot = acc->slot[y];
+
+    if (slot)
+        return &acc->pairs[slot - 1];
+
+    // Make room if we need to.
+    if (acc->num_touched == acc->capacity)
+    {
+        acc->capacity *= 2;
+        acc->touched = (uint32_t *) realloc(acc->touched, acc->capacity * sizeof(uint32_t));
+        acc->pairs = (pair_t *) realloc(acc->pairs, acc->capacity * sizeof(pair_t));
+
+        if (NULL == acc->touched || NULL == acc->pairs)
+        {
+            syslog(LOG_ERR, "ERROR: Out of memory when growing pairs to %u.", acc->capacity);
+            exit(1);
+        }
+    }
+
+    pair_t *pair = &acc->pairs[acc->num_touched];
+    pair->num_rat = 0;
+    acc->touched[acc->num_touched] = y;
+    acc->num_touched++;
+    acc->slot[y] = acc->num_touched;
+
+    return pair;
+} // end pairs_find()
+
+
+// Can element e ever reach the co-rating threshold? It can't be co-rated more often than it was rated.
+static bool elt_can_pair(uint32_t e)
+{
+    return (brds_index[e + 1] - brds_index[e]) > RATINGS_THRESH;
+} // end elt_can_pair()
+
+
+// qsort() helper for element ids.
+static int compare_eltid(const void *a, const void *b)
+{
+    uint32_t ea = *(const uint32_t *) a;
+    uint32_t eb = *(const uint32_t *) b;
+
+    return (ea > eb) - (ea < eb);
+} // end compare_eltid()
 
-static int g_brds_walker[NTHREADS] = {0};
 
 void buildValsInit(uint32_t thread)
 {
-    // Zero-out this thread's g_pairs structure based on which thread is active right now.
-    memset(g_pairs[thread], 0, sizeof(pair_t) * (BE.num_elts + 1));
+    pair_acc_t *acc = &g_pairs[thread];
+
+    // Zero-out only the slots this thread's previous x touched.
+    for (uint32_t i = 0; i < acc->num_touched; i++)
+        acc->slot[acc->touched[i]] = 0;
+
+    acc->num_touched = 0;
 } // end buildValsInit()
 
 
@@ -63,80 +155,94 @@ void buildValsInit(uint32_t thread)
 // For example: (3,7), (3,18), (3,22)...
 //
 // Plan:
-// 1. walk the brds (sorted by elt then userid) for the passed-in x
-// 2. find all the x, y for each user (in the BR, which is sorted by userid then elt)
+// 1. walk the brds column for the passed-in x (everyone who rated x, by userid)
+// 2. find all the x, y for each user (in the BR row for that user, which is sorted by elt)
 // 3. process as was done previously
 void build_pairs(uint32_t thread, uint32_t x)
 {
-    uint32_t el1, el2;
-    uint32_t br_limit = BE.num_ratings - 1;
-    
-    // Catch-up if needed.
-    while (brds[g_brds_walker[thread]].eltid < x)
-           g_brds_walker[thread]++;
+    pair_acc_t *acc = &g_pairs[thread];
+    uint32_t el2;
+
+    // Nothing with x can reach the threshold, so don't bother.
+    if (!elt_can_pair(x))
+        return;
 
-    // 1. Walk the BRDS (sorted by elt then userid) for the passed-in x.
-    while (x == brds[g_brds_walker[thread]].eltid)
+    // 1. Walk the BRDS column for the passed-in x.
+    for (uint64_t col = brds_index[x]; col < brds_index[x + 1]; col++)
     {
-        unsigned short ra1;
-        uint32_t user1, user2;
-        user1 = brds[g_brds_walker[thread]].userId;
-        ra1 = brds[g_brds_walker[thread]].rating;
-
-        // 2. Find all the x, y for each user (in the BR, which is sorted by userid then elt).
-        // Find the x,y for all user1 in the BR.
-        uint32_t current2ndRow;
-        current2ndRow = br_index[user1];
-
-        // Ok, now we're at the first entry in BR that matches userid from brds.
-        // Grab all the ratings for this user, to build up the (x,y) combinations.
-        // First we need to bump the counter to make sure elt y id is > elt x id for the (x,y) pair.
-        while (br[current2ndRow].eltid <= x && current2ndRow < br_limit)
+        uint32_t user1 = brds[col].userid;
+        uint8_t ra1 = brds[col].rating;
+
+        // 2. Find all the x, y for this user in the BR.
+        // We only want y > x for the (x,y) pair, and the row is sorted by elt, so binary search for the first y > x.
+        uint64_t lo = br_index[user1], hi = br_index[user1 + 1];
+        while (lo < hi)
         {
-            current2ndRow++;
+            uint64_t mid = lo + (hi - lo) / 2;
+            if (br[mid].elementid <= x)
+                lo = mid + 1;
+            else
+                hi = mid;
         }
-        user2 = br[current2ndRow].userId;
 
-        while (user1 == user2)
+        // Grab the rest of the ratings for this user, to build up the (x,y) combinations.
+        for (uint64_t row = lo; row < br_index[user1 + 1]; row++)
         {
-            // Search for the x,y stuff.
-            unsigned short ra2;
-            ra2 = br[current2ndRow].rating;
+            // Find the correct place in the g_pairs structure. it's el2 :)
+            el2 = br[row].elementid;
+            if (!elt_can_pair(el2))
+                continue;
 
-            el1 = (uint32_t) x;
-            el2 = (uint32_t) br[current2ndRow].eltid;
+            pair_t *pair = pairs_find(acc, el2);
+            int8_t num_rat = pair->num_rat;
 
-            // Make sure we don't process the (x,x).
-            if (el1 != el2)
+            // We are only storing a maximum of (MAX_RATN_FOR_VALGEN) per valence.
+            if (num_rat < MAX_RATN_FOR_VALGEN)
             {
-                // Find the correct place in the g_pairs structure. it's el2 :)
-                int8_t num_rat = g_pairs[thread][el2].num_rat;
+                pair->rat1[num_rat] = ra1;
+                pair->rat2[num_rat] = br[row].rating;
+
+                // Bump the ratings counter.
+                pair->num_rat++;
+            } // end if num_rat < MAX_RATN_FOR_VALGEN
+        } // end for loop across the rest of this user's row
+    } // end for loop across the x column
+}// end build_pairs()
 
-                // We are only storing a maximum of (MAX_RATN_FOR_VALGEN) per valence.
-                if (num_rat < MAX_RATN_FOR_VALGEN)
-                {
-                    g_pairs[thread][el2].rat1[num_rat] = (uint8_t) ra1;
-                    g_pairs[thread][el2].rat2[num_rat] = (uint8_t) ra2;
 
-                    // Bump the ratings counter.
-                    g_pairs[thread][el2].num_rat++;
-                } // end if num_rat < MAX_RATN_FOR_VALGEN
-            } // end check we're not doing x,x
+//
+// This routine sums the moments of a (x, y) pair of rating arrays. Ratings are small integers, so everything here
+// is exact integer math and the loop is a straight run of widening multiply-adds that the compiler vectorises.
+//
+// IN
+// n is length of arrays
+// x is x array
+// y is y array
+//
+// OUT
+// m is the moment sums
+//
+static void moments(int n, const uint8_t *x, const uint8_t *y, moments_t *m)
+{
+    uint32_t sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
 
-            current2ndRow++;
-            if (current2ndRow < BE.num_ratings)
-            {
-                user2 = br[current2ndRow].userId;
-            }
-            else
-            {
-                user2 = 0;
-            }
-        } // end while user1 == user2
+    for (int i = 0; i < n; i++)
+    {
+        uint32_t xi = x[i];
+        uint32_t yi = y[i];
+        sx += xi;
+        sy += yi;
+        sxx += xi * xi;
+        syy += yi * yi;
+        sxy += xi * yi;
+    }
 
-        g_brds_walker[thread]++;
-    } // end while we're looking at the same x element id
-}// end build_pairs()
+    m->sx = sx;
+    m->sy = sy;
+    m->sxx = sxx;
+    m->syy = syy;
+    m->sxy = sxy;
+} // end moments()
 
 
 //
@@ -154,34 +260,19 @@ void build_pairs(uint32_t thread, uint32_t x)
 //
 static void linefit(uint8_t n, const uint8_t *x, const uint8_t *y, double *a, double *b, int *fail_code)
 {
-    // Calculate the averages of arrays x and y.
-    double xa = 0, ya = 0;
-    int i;
-    for (i = 0; i < n; i++)
-    {
-        xa += x[i];
-        ya += y[i];
-    }
-    xa /= n;
-    ya /= n;
+    moments_t m;
+    moments(n, x, y, &m);
 
-    // Calculate auxiliary sums.
-    double xx = 0, xy = 0;
-    for (i = 0; i < n; i++)
-    {
-        double tmpx, tmpy;
-        tmpx = x[i] - xa;
-        tmpy = y[i] - ya;
-        xx += tmpx * tmpx;
-        xy += tmpx * tmpy;
-    }
+    // Calculate auxiliary sums, scaled by n so they stay integers.
+    int64_t xx = (int64_t) n * m.sxx - (int64_t) m.sx * m.sx;
+    int64_t xy = (int64_t) n * m.sxy - (int64_t) m.sx * m.sy;
 
     // Calculate regression line parameters.
     // Make sure slope is not infinite.
-    if (fabs(xx) != 0)
+    if (xx != 0)
     {
-        *b = xy / xx;
-        *a = ya - *b * xa;
+        *b = (double) xy / (double) xx;
+        *a = ((double) m.sy - *b * (double) m.sx) / n;
     }
     else
     {
@@ -192,103 +283,116 @@ static void linefit(uint8_t n, const uint8_t *x, const uint8_t *y, double *a, do
 
 
 //
-// This routine finds the spearman correlation coefficient for a (rat1, rat2) pair.
+// This routine fills in the rank of each rating bucket. Tied ratings share the average of the ranks they span, so the
+// rank of bucket v is start[v] + (num[v] + 1) / 2. We keep twice that value so it's always an integer.
 //
 // IN
 // array_len is length of array
-// input_array is an [array_len,2] array of char implemented as a single-dimension array.
+// input is the ratings
 //
 // OUT
-// returns the spearman value
+// rank2 is twice the rank of each bucket, indexed by rating. Index 0 is for out-of-range ratings and is always 0.
 //
-double spearman(int array_len, const uint8_t *input_array)
+static void rank_buckets(int array_len, const uint8_t *input, uint8_t rank2[MAX_BUCKETS + 1])
 {
-    int col, i;
-    uint8_t rating;
-    double rank[MAX_RATN_FOR_VALGEN * 2];
-
-    // Walk the input to find num[x] instances of a rating. After walking, we can populate rank.
-    for (col = 0; col < 2; col++)
-    {
-        uint8_t num[MAX_BUCKETS] = {0}; // Initialize all counts to zero
-        uint8_t start[MAX_BUCKETS] = {0}; // Initialize all counts to zero
-        double avg[MAX_BUCKETS] = {0.0}; // Initialize all counts to zero
+    uint8_t num[MAX_BUCKETS + 1] = {0};
 
-        // Walk each column of input data
-        for (i = 0; i < array_len; i++)
-        {
-            rating = input_array[(i) * 2 + (col)];
-            if (rating >= 1 && rating <= MAX_BUCKETS)
-                num[rating - 1]++;
-        }
+    for (int i = 0; i < array_len; i++)
+        if (input[i] >= 1 && input[i] <= MAX_BUCKETS)
+            num[input[i]]++;
 
-        // Figure out where each rating would sit in a sorted list and compute averages if we need to.
-        for (i = 0; i < MAX_BUCKETS; i++)
-        {
-            start[i] = (i == 0) ? 0 : start[i - 1] + num[i - 1];
-            if (num[i] != 0)
-            {
-                double sum = start[i] + 1;
-                for (int j = 2; j <= num[i]; j++)
-                    sum += start[i] + j;
-                avg[i] = sum / num[i];
-            }
-        }
+    uint8_t start = 0;
+    rank2[0] = 0;
+    for (int v = 1; v <= MAX_BUCKETS; v++)
+    {
+        rank2[v] = (uint8_t) (2 * start + num[v] + 1);
+        start = (uint8_t) (start + num[v]);
+    }
+} // end rank_buckets()
 
-        // Walk input input_array again, assigning RANK values.
-        for (i = 0; i < array_len; i++)
-        {
-            rating = input_array[(i) * 2 + (col)];
-            if (rating >= 1 && rating <= MAX_BUCKETS)
-                RANK(i, col) = avg[rating - 1];
-        }
-    } // end column rankings for loop
 
-    double xrho, xnum = 0, xdem1 = 0, xdem2 = 0, xnconst;
+//
+// This routine finds the spearman correlation coefficient for a (rat1, rat2) pair held in two arrays.
+//
+// Everything is kept as twice the rank so the sums are exact integers. That scales the numerator and both
+// denominator terms by 4, which cancels out in rho.
+//
+// IN
+// array_len is length of arrays
+// x is x array
+// y is y array
+//
+// OUT
+// returns the spearman value
+//
+static double spearman_xy(int array_len, const uint8_t *x, const uint8_t *y)
+{
+    uint8_t rank2x[MAX_BUCKETS + 1], rank2y[MAX_BUCKETS + 1];
+    uint8_t rx[MAX_RATN_FOR_VALGEN], ry[MAX_RATN_FOR_VALGEN];
+    int i;
 
-    xnconst = (double) array_len * (((double) array_len + 1.0) / 2.0) * (((double) array_len + 1.0) / 2.0);
+    rank_buckets(array_len, x, rank2x);
+    rank_buckets(array_len, y, rank2y);
 
-    // Work on numerator.
+    // Look up the rank of each rating.
     for (i = 0; i < array_len; i++)
     {
-        xnum += (RANK(i, 0) * RANK(i, 1));
+        rx[i] = rank2x[(x[i] <= MAX_BUCKETS) ? x[i] : 0];
+        ry[i] = rank2y[(y[i] <= MAX_BUCKETS) ? y[i] : 0];
     }
-    xnum -= xnconst;
 
-    // Work on denominator.
-    for (i = 0; i < array_len; i++)
-    {
-        xdem1 += (RANK(i, 0) * RANK(i, 0));
-    }
-    xdem1 -= xnconst;
-    xdem1 = sqrt(xdem1);
+    moments_t m;
+    moments(array_len, rx, ry, &m);
 
-    for (i = 0; i < array_len; i++)
-    {
-        xdem2 += (RANK(i, 1) * RANK(i, 1));
-    }
-    xdem2 -= xnconst;
-    xdem2 = sqrt(xdem2);
+    // This is 4 * n * ((n + 1) / 2)^2.
+    int64_t xnconst = (int64_t) array_len * (array_len + 1) * (array_len + 1);
 
-    xrho = xnum / (xdem1 * xdem2);
+    int64_t xnum = (int64_t) m.sxy - xnconst;
+    int64_t xdem1 = (int64_t) m.sxx - xnconst;
+    int64_t xdem2 = (int64_t) m.syy - xnconst;
 
-    // This code does not like constant y as it may result in taking a square root of a neg. Or something.
-    if (isnan(xrho))
+    // Constant x or y means there's no spread to correlate against, so compute spearman's rho like I did previously.
+    if (xdem1 <= 0 || xdem2 <= 0)
     {
-        // if we're in a NaN situation, compute spearman's rho like I did previously.
-        double sum = 0;
+        int64_t sum = 0;
         for (i = 0; i < array_len; i++)
         {
-            double diff;
-            diff = RANK(i, 0) - RANK(i, 1);
-            sum += (diff * diff);
+            int32_t diff = (int32_t) rx[i] - (int32_t) ry[i];
+            sum += diff * diff;
         }
 
-        // Insert sum into spear calc.
-        xrho = 1.0 - ((6.0 * sum) / (double) ((array_len * array_len * array_len) - array_len));
+        // Insert sum into spear calc. The sum is of doubled ranks, so divide by 4.
+        return 1.0 - ((6.0 * ((double) sum / 4.0)) / (double) ((array_len * array_len * array_len) - array_len));
     }
 
-    return xrho;
+    return (double) xnum / (sqrt((double) xdem1) * sqrt((double) xdem2));
+} // end spearman_xy()
+
+
+//
+// This routine finds the spearman correlation coefficient for a (rat1, rat2) pair.
+//
+// IN
+// array_len is length of array
+// input_array is an [array_len,2] array of char implemented as a single-dimension array.
+//
+// OUT
+// returns the spearman value
+//
+double spearman(int array_len, const uint8_t *input_array)
+{
+    uint8_t x[MAX_RATN_FOR_VALGEN], y[MAX_RATN_FOR_VALGEN];
+
+    if (array_len > MAX_RATN_FOR_VALGEN)
+        array_len = MAX_RATN_FOR_VALGEN;
+
+    for (int i = 0; i < array_len; i++)
+    {
+        x[i] = input_array[i * 2];
+        y[i] = input_array[i * 2 + 1];
+    }
+
+    return spearman_xy(array_len, x, y);
 } // end spearman()
 
 
@@ -300,7 +404,6 @@ void buildValences(uint32_t thread, uint32_t x)
     uint8_t rat1[MAX_RATN_FOR_VALGEN];
     uint8_t rat2[MAX_RATN_FOR_VALGEN];
 
-    uint32_t elts_walker;
     int i;
     double a, b;
 
@@ -324,21 +427,20 @@ void buildValences(uint32_t thread, uint32_t x)
     el1 = x;
 
     // The idea at this point is that we shouldn't be doing _any_ hunting or rb_finding in here!
-    // Find the first x,y in g_pairs by using walker b/c it may not be the 0th position.
-    // elts_walker is y.
-    for (elts_walker = 1; elts_walker < BE.num_elts; elts_walker++)
-    {
-        // Have we found the next y-value that has at least 1 rating?
-        if (g_pairs[thread][elts_walker].num_rat > RATINGS_THRESH) break;
-    }
+    // Walk the y-values that were co-rated with x, in y order so the output is the same as a walk across all of them.
+    pair_acc_t *acc = &g_pairs[thread];
+    qsort(acc->touched, acc->num_touched, sizeof(uint32_t), compare_eltid);
 
-    // Keep going as long as the y-value is less than the max possible.
-    while (elts_walker < BE.num_elts)
+    for (uint32_t t = 0; t < acc->num_touched; t++)
     {
         uint32_t el2;
         int8_t num_rat;
-        el2 = elts_walker;
-        num_rat = g_pairs[thread][elts_walker].num_rat;
+        el2 = acc->touched[t];
+        const pair_t *pair = &acc->pairs[acc->slot[el2] - 1];
+        num_rat = pair->num_rat;
+
+        // Have we found the next y-value that has enough ratings?
+        if (num_rat <= RATINGS_THRESH) continue;
 
         // syslog(LOG_INFO, "GH0 el1 %lu, el2 %lu, num_rat %d, thresh %d, index %lu", el1, el2, num_rat, RATINGS_THRESH, index);
 
@@ -346,22 +448,14 @@ void buildValences(uint32_t thread, uint32_t x)
         {
             syslog(LOG_ERR, "In a bad place because num_rat (%d) is bigger than the max (%d).", num_rat, MAX_RATN_FOR_VALGEN);
             syslog(LOG_ERR, "Skipping (%d,%d) and continuing on...", el1, el2);
-
-            // Set up for next pass thru.
-            elts_walker++;
-            for (; elts_walker < BE.num_elts; elts_walker++)
-            {
-                // Have we found the next y-value that has at least 1 rating?
-                if (g_pairs[thread][elts_walker].num_rat > RATINGS_THRESH) break;
-            }
             continue;
         } // end if
 
         for (i = num_rat - 1; i >= 0; i--)
         {
             // Use a single byte for the rating.
-            rat1[i] = g_pairs[thread][elts_walker].rat1[i];
-            rat2[i] = g_pairs[thread][elts_walker].rat2[i];
+            rat1[i] = pair->rat1[i];
+            rat2[i] = pair->rat2[i];
         } // end for loop
 
         int fail_code = 0;
@@ -416,14 +510,8 @@ void buildValences(uint32_t thread, uint32_t x)
         } // end if we had an infinite slope
 
         double spear, abs_spear;
-        uint8_t bx[num_rat * 2];
-
-        for (i = 0; i < num_rat; i++)
-            BX(i, 0) = rat1[i];
-        for (i = 0; i < num_rat; i++)
-            BX(i, 1) = rat2[i];
 
-        spear = spearman(num_rat, bx);
+        spear = spearman_xy(num_rat, rat1, rat2);
         abs_spear = fabs(spear);
 
         // begin CSV-appending
@@ -454,15 +542,7 @@ void buildValences(uint32_t thread, uint32_t x)
             fwrite(out_buffer, strlen(out_buffer), 1, fp2);
         }
         // end CSV-appending
-
-        // Set up for next pass thru.
-        elts_walker++;
-        for (; elts_walker < BE.num_elts; elts_walker++)
-        {
-            // Have we found the next y-value that has at least 1 rating?
-            if (g_pairs[thread][elts_walker].num_rat > RATINGS_THRESH) break;
-        }
-    } // end while there are more pairs to process, using index
+    } // end for loop across the touched y-values
 
     if (fclose(fp2) != 0)
     {
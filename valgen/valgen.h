@@ -53,10 +53,6 @@
 #define BYTES_RATN_FOR_VALGEN 48
 #define MAX_RATN_FOR_VALGEN 48
 
-// spear-specific
-#define RANK(I,J) rank[(I)*2 + (J)]
-#define BX(I,J) bx[(I)*2 + (J)]
-
 // linefit-specifc
 #define INFINITE_SLOPE 1
 
@@ -72,11 +68,11 @@
 
 // Typedefs
 
-typedef struct {
+// This is only used while loading. It's packed so the load buffer is 9 bytes per rating instead of 12.
+typedef struct __attribute__((packed)) {
     uint32_t userId;
     uint32_t eltid;
     uint8_t rating;
-    uint8_t pad[3];
 } Rating;
 
 typedef struct {
@@ -85,6 +81,24 @@ typedef struct {
     int8_t num_rat;
 } pair_t;
 
+// One thread's sparse set of (x,y) pairs for the current x.
+typedef struct {
+    uint32_t *slot;        // indexed by y, 0 means y hasn't been seen for this x, else the index + 1 into pairs
+    uint32_t *touched;     // the y-values seen for this x
+    pair_t *pairs;         // the pair for each y-value, in the order they were first seen
+    uint32_t num_touched;  // how many y-values have been seen for this x
+    uint32_t capacity;     // how many touched and pairs entries are allocated
+} pair_acc_t;
+
+// Integer moment sums of a (x, y) pair of rating arrays, shared by linefit and spearman.
+typedef struct {
+    uint32_t sx;
+    uint32_t sy;
+    uint32_t sxx;
+    uint32_t syy;
+    uint32_t sxy;
+} moments_t;
+
 typedef struct {
     uint32_t eltid;   // id of element
     uint32_t rcount;  // number of ratings for this element
@@ -104,15 +118,18 @@ extern uint8_t g_ratings_scale;
 extern int big_rat_init(void);
 extern void big_rat_pull_from_flat_file(void);
 extern void export_br(void);
-extern Rating *br, *brds;
+extern elt_rating_t *br;
+extern user_rating_t *brds;
 
 // in precursors.c
-extern pair_t *g_pairs[NTHREADS];
+extern pair_acc_t g_pairs[NTHREADS];
+extern void pairs_alloc(uint32_t);
+extern void pairs_free(uint32_t);
 extern void build_pairs(uint32_t, uint32_t);
 extern void buildValsInit(uint32_t);
 extern void buildValences(uint32_t, uint32_t);
 extern double spearman(int , const uint8_t *);
 
 // in main.c
-extern uint32_t *br_index;
+extern uint64_t *br_index, *brds_index;
 #endif // VALGEN_H